@@ -0,0 +1,481 @@
+/// Drives the attguard request path through liblatte and reports throughput
+// and latency percentiles for each kind of request.
+//
+// By default attguard runs inside this process with a metadata service that
+// answers at once (or after --metadata-delay-us), so the numbers cover the
+// IPC, session and manager cost only. With --daemon the clients talk to an
+// attguard already running, e.g. one started by tools/bench.sh against
+// tools/metadata_stub.go.
+//
+// Clients are --procs processes of --threads threads each. Every thread
+// issues --ops requests picked from --mix with a fixed seed, so two runs
+// issue the same sequence of requests.
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cstdio>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <array>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <algorithm>
+
+#include "libport.h"
+#include "config.h"
+#include "log.h"
+#include "manager.h"
+#include "metadata.h"
+#include "server.h"
+#include "utils.h"
+
+namespace {
+
+enum Op {
+  CREATE = 0,
+  CHECK = 1,
+  DELETE = 2,
+  NOP = 3,
+};
+
+const char *op_names[NOP] = {"create", "check", "delete"};
+
+struct Options {
+  std::string daemon;
+  std::string config;
+  int procs = 1;
+  int threads = 4;
+  uint64_t ops = 10000;
+  std::array<uint32_t, NOP> mix = {{1, 8, 1}};
+  uint32_t nports = 10;
+  uint32_t metadata_delay_us = 0;
+  size_t io_threads = 0;
+  int pool = 0;
+  bool pipelined = false;
+  bool shm_ring = false;
+  uint32_t seed = 1987;
+};
+
+/// What one process measured, also the format sent back to the parent.
+struct Result {
+  uint64_t start_ns = 0;
+  uint64_t end_ns = 0;
+  std::array<uint64_t, NOP> errors = {{0, 0, 0}};
+  std::array<uint64_t, NOP> refused = {{0, 0, 0}};
+  std::array<std::vector<uint32_t>, NOP> latencies_us;
+
+  void merge(const Result &other) {
+    start_ns = start_ns == 0 ? other.start_ns : std::min(start_ns, other.start_ns);
+    end_ns = std::max(end_ns, other.end_ns);
+    for (int i = 0; i < NOP; ++i) {
+      errors[i] += other.errors[i];
+      refused[i] += other.refused[i];
+      latencies_us[i].insert(latencies_us[i].end(),
+          other.latencies_us[i].begin(), other.latencies_us[i].end());
+    }
+  }
+};
+
+/// Answers every call the benchmark issues with success, after an optional
+// delay standing in for the service round trip.
+class NullMetadataClient: public latte::MetadataServiceClient {
+  public:
+    NullMetadataClient(uint32_t delay_us): delay_us_(delay_us) {}
+
+    pplx::task<bool> create_instance_async(const std::string &,
+        const std::string &, const std::string &, const std::string &,
+        uint32_t, uint32_t, const std::string &,
+        const std::unordered_map<std::string, std::string> &) override {
+      return answer();
+    }
+
+    pplx::task<bool> delete_instance_async(const std::string &,
+        const std::string &) override {
+      return answer();
+    }
+
+    pplx::task<bool> can_access_async(const std::string &,
+        const std::string &, uint32_t, const std::string &,
+        const std::string &) override {
+      return answer();
+    }
+
+  private:
+    pplx::task<bool> answer() {
+      if (delay_us_ == 0) {
+        return pplx::task_from_result(true);
+      }
+      auto delay = std::chrono::microseconds(delay_us_);
+      return pplx::create_task([delay]() {
+          std::this_thread::sleep_for(delay);
+          return true;
+      });
+    }
+
+    uint32_t delay_us_;
+};
+
+inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool write_all(int fd, const void *buf, size_t n) {
+  auto p = static_cast<const char*>(buf);
+  while (n > 0) {
+    ssize_t w = ::write(fd, p, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+bool read_all(int fd, void *buf, size_t n) {
+  auto p = static_cast<char*>(buf);
+  while (n > 0) {
+    ssize_t r = ::read(fd, p, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool send_result(int fd, const Result &r) {
+  if (!write_all(fd, &r.start_ns, sizeof(r.start_ns)) ||
+      !write_all(fd, &r.end_ns, sizeof(r.end_ns))) {
+    return false;
+  }
+  for (int i = 0; i < NOP; ++i) {
+    uint64_t n = r.latencies_us[i].size();
+    if (!write_all(fd, &r.errors[i], sizeof(uint64_t)) ||
+        !write_all(fd, &r.refused[i], sizeof(uint64_t)) ||
+        !write_all(fd, &n, sizeof(n)) ||
+        !write_all(fd, r.latencies_us[i].data(), n * sizeof(uint32_t))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool recv_result(int fd, Result *r) {
+  if (!read_all(fd, &r->start_ns, sizeof(r->start_ns)) ||
+      !read_all(fd, &r->end_ns, sizeof(r->end_ns))) {
+    return false;
+  }
+  for (int i = 0; i < NOP; ++i) {
+    uint64_t n;
+    if (!read_all(fd, &r->errors[i], sizeof(uint64_t)) ||
+        !read_all(fd, &r->refused[i], sizeof(uint64_t)) ||
+        !read_all(fd, &n, sizeof(n))) {
+      return false;
+    }
+    r->latencies_us[i].resize(n);
+    if (!read_all(fd, r->latencies_us[i].data(), n * sizeof(uint32_t))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// One client thread. Principals it created are kept so that checks and
+// deletions target live ones; with none alive a create is issued instead.
+void run_client(const Options &opts, int proc, int thread, Result *result) {
+  struct Live {
+    uint64_t uuid;
+    uint32_t port_lo;
+  };
+  std::mt19937 rng(opts.seed + proc * 1000 + thread);
+  std::discrete_distribution<int> pick(opts.mix.begin(), opts.mix.end());
+  std::vector<Live> live;
+  std::stringstream ss;
+  ss << "10." << proc % 256 << "." << thread % 256 << ".1";
+  auto ip = ss.str();
+  uint64_t next_uuid = (uint64_t(proc) << 40) | (uint64_t(thread) << 24);
+  uint32_t slots = (65535 - 1024) / opts.nports;
+
+  for (uint64_t i = 0; i < opts.ops; ++i) {
+    auto op = static_cast<Op>(pick(rng));
+    if (op != CREATE && live.empty()) {
+      op = CREATE;
+    }
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    if (op == CREATE) {
+      uint64_t uuid = next_uuid++;
+      uint32_t lo = 1024 + (uuid % slots) * opts.nports;
+      r = liblatte_create_principal_with_allocated_ports(uuid, "bench-image",
+          "*", ip.c_str(), lo, lo + opts.nports);
+      if (r > 0) {
+        live.push_back(Live{uuid, lo});
+      }
+    } else {
+      std::uniform_int_distribution<size_t> which(0, live.size() - 1);
+      auto target = which(rng);
+      if (op == CHECK) {
+        r = liblatte_check_access(ip.c_str(), live[target].port_lo,
+            "bench-object");
+      } else {
+        r = liblatte_delete_principal_without_allocated_ports(live[target].uuid);
+        live[target] = live.back();
+        live.pop_back();
+      }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    result->latencies_us[op].push_back(static_cast<uint32_t>(elapsed));
+    if (r < 0) {
+      result->errors[op]++;
+    } else if (r == 0) {
+      result->refused[op]++;
+    }
+  }
+}
+
+void wait_for_socket(const std::string &path) {
+  for (int i = 0; i < 500 && ::access(path.c_str(), F_OK) != 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+/// Body of a forked client process, reports to fd and never returns.
+void run_process(const Options &opts, const std::string &daemon, int proc,
+    int fd) {
+  wait_for_socket(daemon);
+  if (liblatte_init("", 1, daemon.c_str()) != 0) {
+    ::_exit(1);
+  }
+  if (opts.pool > 0) {
+    liblatte_set_connection_pool(opts.pool, 5000);
+  }
+  if (opts.pipelined) {
+    liblatte_set_pipelined(1);
+  }
+  if (opts.shm_ring) {
+    liblatte_set_shm_ring(1);
+  }
+  std::vector<Result> results(opts.threads);
+  std::vector<std::thread> threads;
+  uint64_t start = now_ns();
+  for (int t = 0; t < opts.threads; ++t) {
+    threads.emplace_back(run_client, std::cref(opts), proc, t, &results[t]);
+  }
+  for (auto &t: threads) {
+    t.join();
+  }
+  Result total;
+  for (auto &r: results) {
+    total.merge(r);
+  }
+  total.start_ns = start;
+  total.end_ns = now_ns();
+  ::_exit(send_result(fd, total) ? 0 : 1);
+}
+
+inline uint32_t percentile(const std::vector<uint32_t> &sorted, double q) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(q * (sorted.size() - 1));
+  return sorted[rank];
+}
+
+void report(Result &total) {
+  double seconds = (total.end_ns - total.start_ns) / 1e9;
+  uint64_t all = 0;
+  printf("%-8s %10s %12s %8s %8s %8s %8s %8s %8s\n", "op", "count", "ops/s",
+      "p50us", "p99us", "p999us", "maxus", "refused", "errors");
+  for (int i = 0; i < NOP; ++i) {
+    auto &lat = total.latencies_us[i];
+    std::sort(lat.begin(), lat.end());
+    all += lat.size();
+    printf("%-8s %10zu %12.1f %8u %8u %8u %8u %8" PRIu64 " %8" PRIu64 "\n", op_names[i],
+        lat.size(), seconds > 0 ? lat.size() / seconds : 0.0,
+        percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999),
+        lat.empty() ? 0 : lat.back(), total.refused[i], total.errors[i]);
+  }
+  printf("total %" PRIu64 " requests in %.3fs, %.1f ops/s\n", all, seconds,
+      seconds > 0 ? all / seconds : 0.0);
+}
+
+/// "create=1,check=8,delete=1", omitted kinds get weight 0
+bool parse_mix(const char *arg, std::array<uint32_t, NOP> *mix) {
+  std::array<uint32_t, NOP> parsed = {{0, 0, 0}};
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    auto eq = item.find('=');
+    if (eq == std::string::npos) {
+      return false;
+    }
+    auto name = item.substr(0, eq);
+    auto found = std::find_if(op_names, op_names + NOP,
+        [&name](const char *n) { return name == n; });
+    if (found == op_names + NOP) {
+      return false;
+    }
+    parsed[found - op_names] = atoi(item.c_str() + eq + 1);
+  }
+  if (parsed[CREATE] == 0) {
+    return false;
+  }
+  *mix = parsed;
+  return true;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+      "usage: %s [options]\n"
+      "  --daemon PATH          use a running attguard instead of an in-process one\n"
+      "  --config PATH          attguard config for the in-process server\n"
+      "  --procs N              client processes (1)\n"
+      "  --threads N            client threads per process (4)\n"
+      "  --ops N                requests per thread (10000)\n"
+      "  --mix create=1,check=8,delete=1\n"
+      "  --nports N             ports per principal (10)\n"
+      "  --metadata-delay-us N  in-process metadata service latency (0)\n"
+      "  --io-threads N         in-process attguard io threads (one per core)\n"
+      "  --pool N               daemon connections per process\n"
+      "  --pipelined            pipeline requests on the connections\n"
+      "  --shm-ring             send checks through shared memory\n"
+      "  --seed N               request sequence seed\n", prog);
+}
+
+bool parse_options(int argc, char **argv, Options *opts) {
+  static struct option long_options[] = {
+    {"daemon", required_argument, 0, 'd'},
+    {"config", required_argument, 0, 'c'},
+    {"procs", required_argument, 0, 'P'},
+    {"threads", required_argument, 0, 't'},
+    {"ops", required_argument, 0, 'n'},
+    {"mix", required_argument, 0, 'm'},
+    {"nports", required_argument, 0, 'p'},
+    {"metadata-delay-us", required_argument, 0, 'D'},
+    {"io-threads", required_argument, 0, 'i'},
+    {"pool", required_argument, 0, 'C'},
+    {"pipelined", no_argument, 0, 'L'},
+    {"shm-ring", no_argument, 0, 'R'},
+    {"seed", required_argument, 0, 's'},
+    {0, 0, 0, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (c) {
+      case 'd': opts->daemon = optarg; break;
+      case 'c': opts->config = optarg; break;
+      case 'P': opts->procs = atoi(optarg); break;
+      case 't': opts->threads = atoi(optarg); break;
+      case 'n': opts->ops = strtoull(optarg, nullptr, 10); break;
+      case 'm':
+        if (!parse_mix(optarg, &opts->mix)) {
+          fprintf(stderr, "bad mix %s, create must have a weight\n", optarg);
+          return false;
+        }
+        break;
+      case 'p': opts->nports = atoi(optarg); break;
+      case 'D': opts->metadata_delay_us = atoi(optarg); break;
+      case 'i': opts->io_threads = atoi(optarg); break;
+      case 'C': opts->pool = atoi(optarg); break;
+      case 'L': opts->pipelined = true; break;
+      case 'R': opts->shm_ring = true; break;
+      case 's': opts->seed = atoi(optarg); break;
+      default: return false;
+    }
+  }
+  return opts->procs > 0 && opts->threads > 0 && opts->nports > 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  if (!parse_options(argc, argv, &opts)) {
+    usage(argv[0]);
+    return 1;
+  }
+  latte::setloglevel(LOG_WARNING);
+
+  bool inproc = opts.daemon.size() == 0;
+  auto daemon = inproc ? "/tmp/attguard-bench." + std::to_string(::getpid()) :
+    opts.daemon;
+  if (inproc) {
+    ::unlink(daemon.c_str());
+  }
+
+  /// clients fork before any thread exists, they wait for the socket
+  std::vector<pid_t> children;
+  std::vector<int> fds;
+  for (int proc = 0; proc < opts.procs; ++proc) {
+    int p[2];
+    if (::pipe(p) != 0) {
+      ::perror("pipe");
+      return 1;
+    }
+    pid_t pid = ::fork();
+    if (pid < 0) {
+      ::perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      ::close(p[0]);
+      run_process(opts, daemon, proc, p[1]);
+    }
+    ::close(p[1]);
+    children.push_back(pid);
+    fds.push_back(p[0]);
+  }
+
+  std::unique_ptr<latte::Server> server;
+  std::thread serving;
+  if (inproc) {
+    if (opts.config.size() > 0) {
+      latte::config::load_config(opts.config.c_str());
+    }
+    latte::init_manager(new NullMetadataClient(opts.metadata_delay_us));
+    server = latte::utils::make_unique<latte::Server>(daemon, opts.io_threads);
+    serving = std::thread([&server]() { server->start(); });
+  }
+
+  Result total;
+  int failed = 0;
+  for (size_t i = 0; i < children.size(); ++i) {
+    Result r;
+    if (recv_result(fds[i], &r)) {
+      total.merge(r);
+    } else {
+      failed++;
+    }
+    ::close(fds[i]);
+    ::waitpid(children[i], nullptr, 0);
+  }
+
+  if (inproc) {
+    server->stop();
+    serving.join();
+    ::unlink(daemon.c_str());
+  }
+  if (failed > 0) {
+    fprintf(stderr, "%d client processes failed\n", failed);
+    return 1;
+  }
+  report(total);
+  return 0;
+}
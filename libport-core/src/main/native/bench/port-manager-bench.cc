@@ -0,0 +1,292 @@
+/// Microbenchmarks of PortManager, the allocator of port ranges for
+// principals. Each case runs with every allocation policy and at several
+// occupancy levels of the port space, and one CSV line is printed per run:
+//
+//   benchmark,policy,occupancy,free_segments,iterations,ns_per_op
+//
+// An occupancy level is reached by filling the space with random sized
+// ranges and releasing random ones, so the free space is scattered over many
+// segments the way long running hosts leave it. Iteration counts grow until
+// a run lasts --min-time-ms, and random inputs are drawn before the timer
+// starts so only the allocator is measured.
+
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "port_manager.h"
+
+using latte::PortManager;
+
+namespace {
+
+constexpr uint32_t PORT_LOW = 1024;
+constexpr uint32_t PORT_HIGH = 65536;
+constexpr uint32_t MAX_RANGE = 64;
+constexpr size_t NINPUT = 4096;
+
+struct Options {
+  uint64_t min_time_ms = 200;
+  std::string filter;
+  uint32_t seed = 1987;
+};
+
+/// Handed to a benchmark body, which prepares its state, calls start() and
+// then runs iterations operations.
+class State {
+  public:
+    State(uint64_t iterations, uint32_t seed): iterations(iterations),
+      rng(seed) {}
+
+    inline void start() {
+      started_ = std::chrono::steady_clock::now();
+    }
+
+    inline std::chrono::nanoseconds elapsed() const {
+      return std::chrono::steady_clock::now() - started_;
+    }
+
+    const uint64_t iterations;
+    std::mt19937 rng;
+    /// free segments once set up, reported along the timing
+    uint32_t free_segments = 0;
+
+  private:
+    std::chrono::steady_clock::time_point started_;
+};
+
+typedef std::function<void(State&, PortManager&, std::vector<uint32_t>&)> Body;
+
+struct Case {
+  const char *name;
+  Body body;
+};
+
+const char *policy_name(PortManager::Policy p) {
+  switch (p) {
+    case PortManager::BEST_FIT: return "best_fit";
+    case PortManager::WORST_FIT: return "worst_fit";
+    case PortManager::FIRST_FIT: return "first_fit";
+  }
+  return "unknown";
+}
+
+/// Fill the space with ranges of 1 to 2 * MAX_RANGE ports, then release
+// random ones until occupancy percent of it is in use. The lower ports of
+// the ranges still allocated are left in live.
+void fragment(PortManager &pm, uint32_t occupancy, std::mt19937 &rng,
+    std::vector<uint32_t> *live) {
+  std::uniform_int_distribution<uint32_t> size(1, 2 * MAX_RANGE);
+  std::vector<PortManager::PortPair> all;
+  uint64_t used = 0;
+  try {
+    while (true) {
+      auto r = pm.allocate(size(rng));
+      all.push_back(r);
+      used += r.second - r.first;
+    }
+  } catch (std::runtime_error &) {
+    /// the space is full
+  }
+  std::shuffle(all.begin(), all.end(), rng);
+  uint64_t target = uint64_t(pm.high() - pm.low()) * occupancy / 100;
+  live->clear();
+  for (auto &r: all) {
+    if (used > target) {
+      pm.deallocate(r.first);
+      used -= r.second - r.first;
+    } else {
+      live->push_back(r.first);
+    }
+  }
+}
+
+uint32_t count_free_segments(const PortManager &pm) {
+  return pm.report_fragment(PORT_HIGH);
+}
+
+/// Release a random live range and allocate one of random size.
+void churn(State &state, PortManager &pm, std::vector<uint32_t> &live) {
+  std::uniform_int_distribution<uint32_t> size(1, MAX_RANGE);
+  std::vector<uint32_t> sizes(NINPUT);
+  std::vector<size_t> victims(NINPUT);
+  for (size_t i = 0; i < NINPUT; ++i) {
+    sizes[i] = size(state.rng);
+    victims[i] = state.rng();
+  }
+  state.start();
+  for (uint64_t i = 0; i < state.iterations && !live.empty(); ++i) {
+    auto victim = victims[i % NINPUT] % live.size();
+    pm.deallocate(live[victim]);
+    try {
+      live[victim] = pm.allocate(sizes[i % NINPUT]).first;
+    } catch (std::runtime_error &) {
+      /// space exhausted at high occupancy, drop the slot
+      live[victim] = live.back();
+      live.pop_back();
+    }
+  }
+}
+
+/// Allocate an exact free range and release it again.
+void exact_range(State &state, PortManager &pm, std::vector<uint32_t> &) {
+  std::uniform_int_distribution<uint32_t> port(pm.low(), pm.high() - MAX_RANGE);
+  std::vector<PortManager::PortPair> ranges;
+  for (size_t tries = 0; ranges.size() < NINPUT && tries < 64 * NINPUT; ++tries) {
+    uint32_t lo = port(state.rng);
+    uint32_t hi = lo + 1 + state.rng() % MAX_RANGE;
+    if (!pm.is_allocated(lo, hi)) {
+      ranges.push_back(std::make_pair(lo, hi));
+    }
+  }
+  if (ranges.empty()) {
+    state.start();
+    return;
+  }
+  state.start();
+  for (uint64_t i = 0; i < state.iterations; ++i) {
+    auto &r = ranges[i % ranges.size()];
+    pm.allocate(r.first, r.second);
+    pm.deallocate(r.first);
+  }
+}
+
+void probe_port(State &state, PortManager &pm, std::vector<uint32_t> &) {
+  std::uniform_int_distribution<uint32_t> port(pm.low(), pm.high() - 1);
+  std::vector<uint32_t> ports(NINPUT);
+  for (auto &p: ports) {
+    p = port(state.rng);
+  }
+  uint64_t hits = 0;
+  state.start();
+  for (uint64_t i = 0; i < state.iterations; ++i) {
+    hits += pm.is_allocated(ports[i % NINPUT]);
+  }
+  /// keep the probes from being optimized away
+  if (hits == UINT64_MAX) {
+    printf("#\n");
+  }
+}
+
+void probe_range(State &state, PortManager &pm, std::vector<uint32_t> &) {
+  std::uniform_int_distribution<uint32_t> port(pm.low(), pm.high() - MAX_RANGE);
+  std::vector<uint32_t> ports(NINPUT);
+  for (auto &p: ports) {
+    p = port(state.rng);
+  }
+  uint64_t hits = 0;
+  state.start();
+  for (uint64_t i = 0; i < state.iterations; ++i) {
+    auto lo = ports[i % NINPUT];
+    hits += pm.is_allocated(lo, lo + MAX_RANGE);
+  }
+  if (hits == UINT64_MAX) {
+    printf("#\n");
+  }
+}
+
+void report_fragment(State &state, PortManager &pm, std::vector<uint32_t> &) {
+  uint64_t total = 0;
+  state.start();
+  for (uint64_t i = 0; i < state.iterations; ++i) {
+    total += pm.report_fragment(MAX_RANGE);
+  }
+  if (total == UINT64_MAX) {
+    printf("#\n");
+  }
+}
+
+const Case cases[] = {
+  {"churn", churn},
+  {"exact_range", exact_range},
+  {"is_allocated_port", probe_port},
+  {"is_allocated_range", probe_range},
+  {"report_fragment", report_fragment},
+};
+
+const PortManager::Policy policies[] = {
+  PortManager::BEST_FIT, PortManager::WORST_FIT, PortManager::FIRST_FIT,
+};
+
+const uint32_t occupancies[] = {10, 50, 90};
+
+/// Runs one case with growing iteration counts until it lasts long enough,
+// each attempt on a freshly fragmented allocator.
+void run(const Options &opts, const Case &c, PortManager::Policy policy,
+    uint32_t occupancy) {
+  auto min_time = std::chrono::milliseconds(opts.min_time_ms);
+  uint64_t iterations = 1;
+  while (true) {
+    PortManager pm(PORT_LOW, PORT_HIGH, policy);
+    std::vector<uint32_t> live;
+    State state(iterations, opts.seed);
+    fragment(pm, occupancy, state.rng, &live);
+    state.free_segments = count_free_segments(pm);
+    c.body(state, pm, live);
+    auto elapsed = state.elapsed();
+    if (elapsed >= min_time || iterations >= (uint64_t(1) << 32)) {
+      printf("%s,%s,%u,%u,%lu,%.2f\n", c.name, policy_name(policy),
+          occupancy, state.free_segments, (unsigned long) iterations,
+          double(elapsed.count()) / iterations);
+      fflush(stdout);
+      return;
+    }
+    /// aim past min_time, at most 10x per round
+    double scale = elapsed.count() > 0 ?
+      1.4 * min_time.count() * 1e6 / elapsed.count() : 10;
+    iterations = std::max<uint64_t>(iterations + 1,
+        iterations * std::min(scale, 10.0));
+  }
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+      "usage: %s [options]\n"
+      "  --min-time-ms N   minimum duration of a run (200)\n"
+      "  --filter NAME     only run benchmarks whose name contains NAME\n"
+      "  --seed N          seed of the random inputs\n", prog);
+}
+
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+    {"min-time-ms", required_argument, 0, 't'},
+    {"filter", required_argument, 0, 'f'},
+    {"seed", required_argument, 0, 's'},
+    {0, 0, 0, 0}
+  };
+  Options opts;
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (c) {
+      case 't': opts.min_time_ms = strtoull(optarg, nullptr, 10); break;
+      case 'f': opts.filter = optarg; break;
+      case 's': opts.seed = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  printf("benchmark,policy,occupancy,free_segments,iterations,ns_per_op\n");
+  for (auto &c: cases) {
+    if (std::string(c.name).find(opts.filter) == std::string::npos) {
+      continue;
+    }
+    for (auto policy: policies) {
+      for (auto occupancy: occupancies) {
+        run(opts, c, policy, occupancy);
+      }
+    }
+  }
+  return 0;
+}
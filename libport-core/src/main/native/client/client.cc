@@ -13,18 +13,28 @@
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "comm.h"
+#include "shm_ring.h"
 #include <string>
 #include <sstream>
 #include <sys/socket.h>
 #include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <random>
+#include <thread>
 
 
 
 
 namespace latte {
 
-/// do we have thread safety problem?
+/// A single client is not thread safe unless pipelined, share connections
+// between threads through AttGuardClientPool.
 
 /// The guard is unix only, in order to take advantage of unix domain socket
 // and authentication mechanism
@@ -36,11 +46,16 @@ class AttGuardClient {
     AttGuardClient(std::string myid, std::string myip): AttGuardClient(std::move(myid), std::move(myip), DEFAULT_DAEMON_PATH) { }
 
     AttGuardClient(std::string myid, std::string myip, std::string daemon_path):
-        myid_(std::move(myid)), myip_(std::move(myip)), daemon_path_(std::move(daemon_path)), sock_(0) {
+        myid_(std::move(myid)), myip_(std::move(myip)), daemon_path_(std::move(daemon_path)), sock_(0),
+        pipelined_(false), receiving_(false), broken_(false), peer_v2_(false),
+        ring_wanted_(false), ring_outstanding_(0), ring_receiving_(false) {
       redial();
     }
 
     void redial() {
+      ring_.reset();
+      ring_outstanding_ = 0;
+      ring_arrived_.clear();
       if (sock_) {
         close(sock_);
       }
@@ -48,14 +63,43 @@ class AttGuardClient {
       if (sock_ < 0) {
         throw std::runtime_error("can not connect to the attestation guard, abort");
       }
+      broken_ = false;
+      /// the guard may have been replaced by another version
+      peer_v2_ = false;
+      if (ring_wanted_) {
+        open_ring();
+      }
     }
 
+    /// the stream is out of sync after a failed send or receive
+    bool broken() const { return broken_; }
+
     ~AttGuardClient() {
       close(sock_);
     }
 
     const std::string &myip() const { return myip_; }
 
+    /// In pipelined mode concurrent callers share the socket: commands are
+    // sent as soon as they are ready and responses are matched by id, in
+    // whatever order the daemon finishes them. Needs a daemon that echoes
+    // the command id, so it is off by default. Switch it before sharing
+    // the client between threads.
+    void set_pipelined(bool pipelined) { pipelined_ = pipelined; }
+
+    /// CHECK_* calls go through a shared memory ring set up by the guard,
+    // the socket stays for everything else and for responses too large for
+    // a slot. Also switch it before sharing the client between threads.
+    // False if the guard does not offer a ring, calls stay on the socket.
+    bool set_shm_ring(bool enable) {
+      ring_wanted_ = enable;
+      if (!enable) {
+        ring_.reset();
+        return true;
+      }
+      return ring_ || open_ring();
+    }
+
     //// TODO: optimize the parameters involving constant ref. We don't want to 
     //make extra copy if things can be moved.
 
@@ -70,6 +114,24 @@ class AttGuardClient {
     int create_instance(uint64_t pid, const std::string &image,
         const std::vector<std::string> &raw_configs, const std::string &ip,
         uint32_t lport, uint32_t rport, const std::string &storage) {
+      return quick_post<proto::Command::CREATE_PRINCIPAL>(
+          make_principal(pid, image, raw_configs, ip, lport, rport, storage));
+    }
+
+    /// Create a burst of principals in one round trip, results as in
+    // check_accesses.
+    std::vector<int> create_principals(const std::vector<proto::Principal> &principals) {
+      proto::PrincipalList statement;
+      for (auto &p: principals) {
+        *statement.add_principals() = p;
+      }
+      return quick_post_batch<proto::Command::CREATE_PRINCIPALS>(statement,
+          principals.size());
+    }
+
+    proto::Principal make_principal(uint64_t pid, const std::string &image,
+        const std::vector<std::string> &raw_configs, const std::string &ip,
+        uint32_t lport, uint32_t rport, const std::string &storage) {
       proto::Principal p;
       p.set_id(pid);
       auto auth = p.mutable_auth();
@@ -90,7 +152,7 @@ class AttGuardClient {
         std::string val(s.begin() + split + 1, s.end());
         confmap[std::move(key)] = std::move(val);
       }
-      return quick_post<proto::Command::CREATE_PRINCIPAL>(p);
+      return p;
     }
 
     int delete_principal(uint64_t uuid) {
@@ -126,7 +188,7 @@ class AttGuardClient {
     std::unique_ptr<proto::Principal> get_local_principal(uint64_t uuid) {
       proto::Principal lookup;
       lookup.set_id(uuid);
-      return quick_get_principal<proto::Command::GET_PRINCIPAL>(lookup);
+      return quick_get_principal<proto::Command::GET_LOCAL_PRINCIPAL>(lookup);
     }
 
     std::unique_ptr<proto::MetadataConfig> get_metadata_config() {
@@ -267,6 +329,38 @@ class AttGuardClient {
       return quick_post<proto::Command::CHECK_ACCESS>(statement);
     }
 
+    /// Batched checks, one IPC round trip for all the entries. Each result
+    // is 1 (granted), 0 (denied) or -1 (failed).
+    std::vector<int> check_properties(const std::string &ip, uint32_t port,
+        const std::vector<std::string> &properties) {
+      proto::CheckProperty statement;
+      for (auto &property: properties) {
+        statement.add_properties(property);
+      }
+      statement.set_batch(true);
+      auto p = statement.mutable_principal();
+      auto auth = p->mutable_auth();
+      auth->set_ip(ip);
+      auth->set_port_lo(port);
+      return quick_post_batch<proto::Command::CHECK_PROPERTY>(statement,
+          properties.size());
+    }
+
+    std::vector<int> check_accesses(const std::string &ip, uint32_t port,
+        const std::vector<std::string> &objects) {
+      proto::CheckAccess statement;
+      for (auto &object: objects) {
+        statement.add_objects(object);
+      }
+      statement.set_batch(true);
+      auto p = statement.mutable_principal();
+      auto auth = p->mutable_auth();
+      auth->set_ip(ip);
+      auth->set_port_lo(port);
+      return quick_post_batch<proto::Command::CHECK_ACCESS>(statement,
+          objects.size());
+    }
+
     std::unique_ptr<proto::Attestation> check_attestation(
         const std::string &ip, uint32_t port) {
       proto::CheckAttestation statement;
@@ -339,6 +433,29 @@ class AttGuardClient {
       return status_int<type>(post(prepare<type>(statement, myid_.c_str())));
     }
 
+    template<proto::Command::Type type>
+    inline std::vector<int> quick_post_batch(
+        const typename proto::statement_traits<type>::msg_type &statement,
+        size_t n) {
+      auto resp = post(prepare<type>(statement, myid_.c_str()));
+      std::vector<int> results(n, -1);
+      auto list = resp.extract_status_list();
+      if (!list || (size_t)list->results_size() != n) {
+        auto status = resp.status();
+        log("%s, batch response = (%d, %s)", proto::statement_traits<type>::name,
+            status.first, status.second.c_str());
+        return results;
+      }
+      for (size_t i = 0; i < n; ++i) {
+        auto &status = list->results(i);
+        LATTE_DEBUG("%s, response[%zu] = (%d, %s)",
+            proto::statement_traits<type>::name, i, (int)status.success(),
+            status.info().c_str());
+        results[i] = status.error() ? -1 : (int)status.success();
+      }
+      return results;
+    }
+
     template<proto::Command::Type type>
     inline std::unique_ptr<proto::Principal> quick_get_principal(
         const typename proto::statement_traits<type>::msg_type &statement) {
@@ -349,45 +466,546 @@ class AttGuardClient {
 
     template<proto::Command::Type type>
     int status_int(const proto::ResponseWrapper &r) {
-      auto status = r.status();
-      if (loglevel() == LOG_DEBUG) {
-        log("%s, response = (%d, %s)", proto::statement_traits<type>::name,
-            status.first, status.second.c_str());
+      if (LATTE_LOG_ENABLED(LOG_DEBUG)) {
+        auto status = r.status();
+        log_at(LOG_DEBUG, "%s, response = (%d, %s)",
+            proto::statement_traits<type>::name, status.first,
+            status.second.c_str());
         return status.first;
-      } else {
-        return r.status_int();
       }
+      return r.status_int();
     }
 
 
+    /// Commands go out in the v1 format until the guard answered with
+    // PROTO_MAGIC_V2, so an older guard still understands the first ones.
+    int send(const proto::Command &cmd) {
+      if (peer_v2_) {
+        return proto_send_msg(sock_, cmd);
+      }
+      proto::Command legacy(cmd);
+      proto::downgrade(&legacy);
+      return proto_send_msg(sock_, legacy);
+    }
+
+    inline void learn_magic(uint32_t magic) {
+      if (magic == PROTO_MAGIC_V2 && !peer_v2_) {
+        peer_v2_ = true;
+      }
+    }
+
     proto::ResponseWrapper post(const proto::Command& cmd) {
-      int ret = proto_send_msg(sock_, cmd);
+      if (ring_ && on_ring(cmd.type()) &&
+          cmd.ByteSizeLong() <= ShmRing::MAX_PAYLOAD) {
+        return post_ring(cmd);
+      }
+      if (pipelined_) {
+        return post_pipelined(cmd);
+      }
+      int ret = send(cmd);
       if (ret != 0) {
+        broken_ = true;
         std::stringstream err;
         err << "send failure, code " << ret;
         return proto::make_status_response(false, err.str());
       }
+      return recv_response();
+    }
+
+    proto::ResponseWrapper recv_response() {
       auto result = proto::Response::default_instance().New();
-      ret = proto_recv_msg(sock_, result);
+      uint32_t magic;
+      int ret = proto_recv_msg(sock_, result, &magic);
       if (ret != 0) {
+        delete result;
+        broken_ = true;
         std::stringstream err;
         err << "recv failure " << ret;
         return proto::make_status_response(false, err.str());
       }
+      learn_magic(magic);
       return proto::ResponseWrapper(result);
     }
 
+    proto::ResponseWrapper post_pipelined(const proto::Command& cmd) {
+      int ret;
+      {
+        std::lock_guard<std::mutex> guard(send_lock_);
+        ret = send(cmd);
+      }
+      if (ret != 0) {
+        broken_ = true;
+        std::stringstream err;
+        err << "send failure, code " << ret;
+        return proto::make_status_response(false, err.str());
+      }
+      return wait_response(cmd.id());
+    }
+
+    /// Whichever waiter finds the socket idle reads the next response and
+    // parks it for its owner if it is not its own.
+    proto::ResponseWrapper wait_response(int64_t id) {
+      std::unique_lock<std::mutex> guard(recv_lock_);
+      while (true) {
+        auto found = arrived_.find(id);
+        if (found != arrived_.end()) {
+          auto result = std::move(found->second);
+          arrived_.erase(found);
+          return proto::ResponseWrapper(std::move(result));
+        }
+        /// the stream is out of sync, nothing more can be read from it
+        if (broken_) {
+          return proto::make_status_response(false, "recv failure");
+        }
+        if (receiving_) {
+          arrival_.wait(guard);
+          continue;
+        }
+        receiving_ = true;
+        guard.unlock();
+        auto result = std::make_shared<proto::Response>();
+        uint32_t magic;
+        int ret = proto_recv_msg(sock_, result.get(), &magic);
+        guard.lock();
+        receiving_ = false;
+        arrival_.notify_all();
+        if (ret != 0) {
+          broken_ = true;
+          std::stringstream err;
+          err << "recv failure " << ret;
+          return proto::make_status_response(false, err.str());
+        }
+        learn_magic(magic);
+        if (result->id() == id) {
+          return proto::ResponseWrapper(std::move(result));
+        }
+        arrived_[result->id()] = std::move(result);
+      }
+    }
+
+    /// the small and frequent calls, the ones worth a ring
+    static bool on_ring(proto::Command::Type type) {
+      switch (type) {
+        case proto::Command::CHECK_PROPERTY:
+        case proto::Command::CHECK_ACCESS:
+        case proto::Command::CHECK_WORKER_ACCESS:
+        case proto::Command::CHECK_IMAGE_PROPERTY:
+        case proto::Command::CHECK_ATTESTATION:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    /// Asks for the ring on a connection nothing else uses yet. The guard
+    // attaches the fds of the channel to its answer.
+    bool open_ring() {
+      proto::Empty placeholder;
+      int ret = send(prepare<proto::Command::OPEN_RING>(placeholder,
+            myid_.c_str()));
+      uint8_t header[COMM_HEADER_SZ];
+      int fds[ShmChannel::NFD];
+      size_t nfd = ShmChannel::NFD;
+      if (ret == 0) {
+        ret = utils::recv_with_fds(sock_, header, sizeof(header), fds, &nfd);
+      } else {
+        nfd = 0;
+      }
+      std::unique_ptr<proto::Response> result(new proto::Response);
+      if (ret == 0) {
+        uint32_t size, magic;
+        decode_frame_header(header, &size, &magic);
+        utils::Buffer payload(size + 1);
+        ret = utils::reliable_recv(sock_, payload.buf(), size);
+        if (ret == 0 && !result->ParseFromArray(payload.buf(), size)) {
+          ret = utils::PARSE_ERROR;
+        }
+        learn_magic(magic);
+      }
+      bool offered = ret == 0 && nfd == ShmChannel::NFD &&
+        proto::ResponseWrapper(std::move(result)).status_int() == 1;
+      if (offered) {
+        ring_ = ShmChannel::attach(fds[0], fds[1], fds[2]);
+      } else {
+        for (size_t i = 0; i < nfd; ++i) {
+          close(fds[i]);
+        }
+      }
+      if (ret != 0) {
+        broken_ = true;
+        log_err("asking for a shared memory ring failed, code %d", ret);
+      } else if (!ring_) {
+        log("the attestation guard offers no shared memory ring");
+      }
+      return (bool)ring_;
+    }
+
+    /// Outstanding commands are bounded by the slots of a ring, so the guard
+    // always has a slot for the response.
+    proto::ResponseWrapper post_ring(const proto::Command &cmd) {
+      {
+        std::unique_lock<std::mutex> guard(ring_lock_);
+        ring_space_.wait(guard, [this]() {
+            return ring_outstanding_ < ShmRing::NSLOT || broken_;
+        });
+        if (broken_) {
+          return proto::make_status_response(false, "ring failure");
+        }
+        ++ring_outstanding_;
+        auto &commands = ring_->commands();
+        cmd.SerializeWithCachedSizesToArray(commands.next());
+        if (commands.publish(cmd.GetCachedSize())) {
+          ShmChannel::notify(ring_->command_fd());
+        }
+      }
+      return ring_wait(cmd.id());
+    }
+
+    /// As wait_response: whoever finds the ring idle collects what arrived
+    // and parks the responses of others.
+    proto::ResponseWrapper ring_wait(int64_t id) {
+      std::unique_lock<std::mutex> guard(recv_lock_);
+      while (true) {
+        auto found = ring_arrived_.find(id);
+        if (found != ring_arrived_.end()) {
+          auto result = std::move(found->second);
+          ring_arrived_.erase(found);
+          if (result) {
+            return proto::ResponseWrapper(std::move(result));
+          }
+          guard.unlock();
+          /// too large for a slot, the guard sent it over the socket
+          return pipelined_ ? wait_response(id) : recv_response();
+        }
+        if (broken_) {
+          return proto::make_status_response(false, "ring failure");
+        }
+        if (ring_receiving_) {
+          arrival_.wait(guard);
+          continue;
+        }
+        ring_receiving_ = true;
+        guard.unlock();
+        std::vector<std::pair<int64_t, std::shared_ptr<proto::Response>>> got;
+        int ret = ring_collect(&got);
+        if (ret != 0) {
+          broken_ = true;
+          log_err("shared memory ring failure %d", ret);
+        }
+        {
+          std::lock_guard<std::mutex> ring_guard(ring_lock_);
+          ring_outstanding_ -= got.size();
+        }
+        ring_space_.notify_all();
+        guard.lock();
+        ring_receiving_ = false;
+        for (auto &response: got) {
+          ring_arrived_[response.first] = std::move(response.second);
+        }
+        arrival_.notify_all();
+      }
+    }
+
+    /// Takes every response in the ring, waiting for one if there is none.
+    // The guard usually answers checks within microseconds, so the ring is
+    // polled for a while before sleeping on the eventfd, unless polling
+    // would only take the core the guard needs.
+    int ring_collect(
+        std::vector<std::pair<int64_t, std::shared_ptr<proto::Response>>> *got) {
+      static const size_t max_polls =
+        std::thread::hardware_concurrency() > 1 ? RING_POLLS : 0;
+      auto &responses = ring_->responses();
+      size_t polls = 0;
+      while (true) {
+        const uint8_t *payload;
+        uint32_t size, flags;
+        int ready = responses.peek(&payload, &size, &flags);
+        if (ready < 0) {
+          return utils::PARSE_ERROR;
+        }
+        if (ready > 0) {
+          if (flags & ShmRing::ON_SOCKET) {
+            int64_t id;
+            if (size != sizeof(id)) {
+              return utils::PARSE_ERROR;
+            }
+            memcpy(&id, payload, sizeof(id));
+            got->emplace_back(id, nullptr);
+          } else {
+            auto result = std::make_shared<proto::Response>();
+            if (!result->ParseFromArray(payload, size)) {
+              return utils::PARSE_ERROR;
+            }
+            got->emplace_back(result->id(), std::move(result));
+          }
+          responses.pop();
+          continue;
+        }
+        if (!got->empty()) {
+          return 0;
+        }
+        if (polls++ < max_polls || !responses.sleep()) {
+          continue;
+        }
+        int ret = ShmChannel::await(ring_->response_fd(), sock_);
+        responses.wake();
+        if (ret != 0) {
+          return ret;
+        }
+      }
+    }
+
+    static constexpr size_t RING_POLLS = 1 << 14;
+
     std::string myid_;
     std::string myip_;
     std::string daemon_path_;
     int sock_; 
 
+    bool pipelined_;
+    std::mutex send_lock_;
+    std::mutex recv_lock_;
+    std::condition_variable arrival_;
+    bool receiving_;
+    std::unordered_map<int64_t, std::shared_ptr<proto::Response>> arrived_;
+    std::atomic<bool> broken_;
+    std::atomic<bool> peer_v2_;
+
+    bool ring_wanted_;
+    std::unique_ptr<ShmChannel> ring_;
+    /// serializes producers of the command ring
+    std::mutex ring_lock_;
+    std::condition_variable ring_space_;
+    size_t ring_outstanding_;
+    /// guarded by recv_lock_, as receiving_ and arrived_
+    bool ring_receiving_;
+    /// null for a response that comes over the socket
+    std::unordered_map<int64_t, std::shared_ptr<proto::Response>> ring_arrived_;
+
 };
+
+/// Daemon connections shared by all threads of a host process. Each call
+// leases a connection for its duration, dialing a new one while fewer than
+// size exist and otherwise waiting at most wait for one to come back. A
+// connection that failed is redialed before it is leased again.
+//
+// In pipelined mode connections are not leased exclusively: callers are
+// spread over them round robin and share each socket, and a failed
+// connection is replaced rather than redialed under its other users.
+class AttGuardClientPool {
+
+  public:
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(AttGuardClientPool);
+
+    static constexpr size_t DEFAULT_SIZE = 4;
+    static constexpr int DEFAULT_WAIT_MS = 5000;
+
+    class Lease {
+      public:
+        GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Lease);
+        Lease(): pool_(nullptr) {}
+        Lease(AttGuardClientPool *pool, std::shared_ptr<AttGuardClient> client):
+          pool_(pool), client_(std::move(client)) {}
+        Lease(Lease &&other): pool_(other.pool_), client_(std::move(other.client_)) {}
+        ~Lease() {
+          if (client_ && pool_) {
+            pool_->release(std::move(client_));
+          }
+        }
+        explicit operator bool() const { return (bool)client_; }
+        AttGuardClient *operator->() const { return client_.get(); }
+        AttGuardClient &operator*() const { return *client_; }
+
+      private:
+        AttGuardClientPool *pool_;
+        std::shared_ptr<AttGuardClient> client_;
+    };
+
+    /// dials the first connection right away so a bad daemon path fails here
+    AttGuardClientPool(std::string myid, std::string myip, std::string daemon_path):
+      myid_(std::move(myid)), myip_(std::move(myip)),
+      daemon_path_(std::move(daemon_path)), size_(DEFAULT_SIZE),
+      wait_(DEFAULT_WAIT_MS), pipelined_(false), shm_ring_(false), next_(0) {
+      auto client = dial(false, false);
+      all_.push_back(client);
+      idle_.push_back(std::move(client));
+    }
+
+    const std::string &myip() const { return myip_; }
+
+    void resize(size_t size, std::chrono::milliseconds wait) {
+      std::lock_guard<std::mutex> guard(lock_);
+      size_ = size > 0 ? size : 1;
+      wait_ = wait;
+      available_.notify_all();
+    }
+
+    void set_pipelined(bool pipelined) {
+      std::lock_guard<std::mutex> guard(lock_);
+      pipelined_ = pipelined;
+      for (auto &client: all_) {
+        if (client) {
+          client->set_pipelined(pipelined);
+        }
+      }
+    }
+
+    /// false if some connection got no ring, it keeps using the socket
+    bool set_shm_ring(bool enable) {
+      std::lock_guard<std::mutex> guard(lock_);
+      shm_ring_ = enable;
+      bool all = true;
+      for (auto &client: all_) {
+        if (client && !client->set_shm_ring(enable)) {
+          all = false;
+        }
+      }
+      return all;
+    }
+
+    Lease acquire() {
+      std::unique_lock<std::mutex> guard(lock_);
+      if (pipelined_) {
+        return acquire_shared(guard);
+      }
+      bool ready = available_.wait_for(guard, wait_, [this]() {
+          return !idle_.empty() || all_.size() < size_;
+      });
+      if (!ready) {
+        log_err("no connection to the attestation guard within %d ms",
+            (int)wait_.count());
+        return Lease();
+      }
+      std::shared_ptr<AttGuardClient> client;
+      if (!idle_.empty()) {
+        client = std::move(idle_.back());
+        idle_.pop_back();
+        guard.unlock();
+        if (client->broken()) {
+          try {
+            client->redial();
+          } catch (const std::runtime_error &e) {
+            log_err("redial failed: %s", e.what());
+            drop(client);
+            return Lease();
+          }
+        }
+        return Lease(this, std::move(client));
+      }
+      /// reserve the slot before dialing outside the lock
+      all_.push_back(nullptr);
+      bool pipelined = pipelined_;
+      bool shm_ring = shm_ring_;
+      guard.unlock();
+      try {
+        client = dial(pipelined, shm_ring);
+      } catch (const std::runtime_error &e) {
+        log_err("dial failed: %s", e.what());
+        drop(nullptr);
+        return Lease();
+      }
+      guard.lock();
+      *std::find(all_.begin(), all_.end(), nullptr) = client;
+      return Lease(this, std::move(client));
+    }
+
+  private:
+
+    std::shared_ptr<AttGuardClient> dial(bool pipelined, bool shm_ring) {
+      auto client = std::make_shared<AttGuardClient>(myid_, myip_, daemon_path_);
+      client->set_pipelined(pipelined);
+      if (shm_ring) {
+        client->set_shm_ring(true);
+      }
+      return client;
+    }
+
+    /// Called with lock held. Connections are shared, so dial up to size
+    // and hand them out in turn. Dialing is done outside the lock as in
+    // acquire, the slots reserved meanwhile are null and skipped.
+    Lease acquire_shared(std::unique_lock<std::mutex> &guard) {
+      for (auto i = all_.begin(); i != all_.end(); ) {
+        if (*i && (*i)->broken()) {
+          i = all_.erase(i);
+        } else {
+          ++i;
+        }
+      }
+      idle_.clear();
+      if (all_.size() < size_) {
+        all_.push_back(nullptr);
+        bool shm_ring = shm_ring_;
+        guard.unlock();
+        std::shared_ptr<AttGuardClient> client;
+        try {
+          client = dial(true, shm_ring);
+        } catch (const std::runtime_error &e) {
+          log_err("dial failed: %s", e.what());
+        }
+        guard.lock();
+        auto slot = std::find(all_.begin(), all_.end(), nullptr);
+        if (client) {
+          *slot = client;
+          return Lease(nullptr, std::move(client));
+        }
+        all_.erase(slot);
+        available_.notify_one();
+      }
+      for (size_t n = 0; n < all_.size(); ++n) {
+        auto &client = all_[next_++ % all_.size()];
+        if (client) {
+          return Lease(nullptr, client);
+        }
+      }
+      return Lease();
+    }
+
+    void release(std::shared_ptr<AttGuardClient> client) {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (std::find(all_.begin(), all_.end(), client) == all_.end()) {
+        return;
+      }
+      if (all_.size() > size_) {
+        /// pool was shrunk while this one was out
+        all_.erase(std::find(all_.begin(), all_.end(), client));
+      } else {
+        idle_.push_back(std::move(client));
+      }
+      available_.notify_one();
+    }
+
+    void drop(const std::shared_ptr<AttGuardClient> &client) {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto found = std::find(all_.begin(), all_.end(), client);
+      if (found != all_.end()) {
+        all_.erase(found);
+      }
+      available_.notify_one();
+    }
+
+    std::string myid_;
+    std::string myip_;
+    std::string daemon_path_;
+
+    std::mutex lock_;
+    std::condition_variable available_;
+    size_t size_;
+    std::chrono::milliseconds wait_;
+    bool pipelined_;
+    bool shm_ring_;
+    size_t next_;
+    std::vector<std::shared_ptr<AttGuardClient>> all_;
+    std::vector<std::shared_ptr<AttGuardClient>> idle_;
+};
+
+constexpr size_t AttGuardClientPool::DEFAULT_SIZE;
+constexpr int AttGuardClientPool::DEFAULT_WAIT_MS;
 }
 
-static std::unique_ptr<latte::AttGuardClient> latte_client; 
+static std::unique_ptr<latte::AttGuardClientPool> latte_clients;
 static std::unique_ptr<SyscallProxy> syscall_gate;
 static std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> port_usage;
+static std::mutex port_usage_lock;
 static std::string auth_speaker;
 static std::string auth_ip;
 
@@ -422,25 +1040,34 @@ int liblatte_init(const char *myid, int run_as_iaas, const char *daemon_path) {
     return -1;
   }
   if (!daemon_path || strcmp(daemon_path, "") == 0) {
-    latte_client = latte::utils::make_unique<latte::AttGuardClient>(auth_speaker, myip);
-  } else {
-    latte_client = latte::utils::make_unique<latte::AttGuardClient>(auth_speaker, myip, daemon_path);
+    daemon_path = DEFAULT_DAEMON_PATH;
   }
+  latte_clients = latte::utils::make_unique<latte::AttGuardClientPool>(
+      auth_speaker, myip, daemon_path);
 
   latte::log("liblatte core initialized for process %d, with id %s, ip: %s\n", getpid(),
       auth_speaker.c_str(), myip.c_str());
   return 0;
 }
 
+/// leases a daemon connection as latte_client until the call returns
 #define CHECK_LIB_INIT \
-  if (!latte_client) { \
+  if (!latte_clients) { \
     latte::log_err("the library is not initialized");\
     return -1; \
+  } \
+  auto latte_client = latte_clients->acquire(); \
+  if (!latte_client) { \
+    return -1; \
   }
 #define CHECK_LIB_INIT_PTR \
-  if (!latte_client) { \
+  if (!latte_clients) { \
     latte::log_err("the library is not initialized");\
     return nullptr; \
+  } \
+  auto latte_client = latte_clients->acquire(); \
+  if (!latte_client) { \
+    return nullptr; \
   }
 
 #define CHECK_NULL_PTR(ptr) \
@@ -455,9 +1082,11 @@ int liblatte_init(const char *myid, int run_as_iaas, const char *daemon_path) {
     return val; \
   }
 
-static int _create_principal_new(uint64_t uuid, const char *image, const char *config,
+static int _create_principal_new(latte::AttGuardClientPool::Lease &latte_client,
+    uint64_t uuid, const char *image, const char *config,
     const char *ip, uint32_t port_lo, uint32_t port_hi) {
-  latte::log("creating principal %llu, %s, %s, %d, %d, ip=%s\n", uuid, image, config,
+  LATTE_DEBUG("creating principal %llu, %s, %s, %d, %d, ip=%s",
+      (unsigned long long)uuid, image, config,
       port_lo, port_hi, ip);
   if (!ip || *ip == '\0') {
     return latte_client->create_principal(uuid, image, config, 
@@ -486,13 +1115,63 @@ int liblatte_create_principal_new(uint64_t uuid, const char *image, const char *
   /// protobuf does not support null, make sure things are consistent
   if (!image) image = "";
   if (!config) config = "*";
-  if (!_create_principal_new(uuid, image, config, new_ip, port_lo, port_hi)) {
+  if (!_create_principal_new(latte_client, uuid, image, config, new_ip,
+        port_lo, port_hi)) {
+    std::lock_guard<std::mutex> guard(port_usage_lock);
     port_usage[uuid] = std::make_pair(port_lo, port_hi);
     return 0;
   }
   return 1;
 }
 
+int liblatte_create_principals(int n, const uint64_t *uuids, const char **images,
+    const char **configs, const int *nports, int *results) {
+  CHECK_LIB_INIT;
+  CHECK_NULL_PTR(results);
+  if (n < 0 || (n > 0 && (!uuids || !nports))) {
+    return EINVAL;
+  }
+  /// Ports are allocated for the whole burst before the single request.
+  // There is no batched syscall, so this is still one call per child.
+  std::vector<latte::proto::Principal> principals;
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  principals.reserve(n);
+  ranges.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    int v = syscall_gate->alloc_child_ports(0, uuids[i], nports[i]);
+    if (v < 0) {
+      latte::log_err("error in allocating child ports for %llu: %s\n",
+          (unsigned long long)uuids[i], strerror(-v));
+      for (auto &range: ranges) {
+        syscall_gate->del_reserved_ports(range.first, range.second);
+      }
+      std::fill(results, results + n, -1);
+      return -1;
+    }
+    ranges.emplace_back(v, v + nports[i]);
+    const char *image = images && images[i] ? images[i] : "";
+    const char *config = configs && configs[i] ? configs[i] : "*";
+    std::stringstream ss;
+    ss << latte::LEGACY_CONFIG_KEY << "=" << config;
+    principals.push_back(latte_client->make_principal(uuids[i], image,
+          {ss.str()}, latte_client->myip(), ranges.back().first,
+          ranges.back().second, ""));
+  }
+  LATTE_DEBUG("creating %d principals", n);
+  auto created = latte_client->create_principals(principals);
+  std::lock_guard<std::mutex> guard(port_usage_lock);
+  for (int i = 0; i < n; ++i) {
+    results[i] = created[i];
+    if (created[i] == 1) {
+      port_usage[uuids[i]] = ranges[i];
+    } else {
+      /// rejected, nobody would ever release its ports
+      syscall_gate->del_reserved_ports(ranges[i].first, ranges[i].second);
+    }
+  }
+  return 0;
+}
+
 int liblatte_create_principal(uint64_t uuid, const char *image, const char *config,
     int nport) {
   return ::liblatte_create_principal_new(uuid, image, config, nport, "");
@@ -500,9 +1179,11 @@ int liblatte_create_principal(uint64_t uuid, const char *image, const char *conf
 
 int liblatte_create_principal_with_allocated_ports(uint64_t uuid, const char *image,
     const char *config, const char * ip, int port_lo, int port_hi) {
+  CHECK_LIB_INIT;
   if (!image) image = "";
   if (!config) config = "*";
-  return ::_create_principal_new(uuid, image, config, ip, port_lo, port_hi);
+  return ::_create_principal_new(latte_client, uuid, image, config, ip,
+      port_lo, port_hi);
 }
 
 
@@ -512,7 +1193,7 @@ int liblatte_create_image(const char *image_hash, const char *source_url,
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(image_hash);
   CHECK_NULL_PTR(source_url);
-  latte::log("creating image %s, %s, %s, %s\n", image_hash, source_url,
+  LATTE_DEBUG("creating image %s, %s, %s, %s", image_hash, source_url,
       source_rev, misc_conf);
   //// the semantic will only endorse the source of an image
   if (!source_rev) source_rev = "";
@@ -526,7 +1207,7 @@ int liblatte_post_object_acl(const char *obj_id, const char *requirement) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(obj_id);
   CHECK_NULL_PTR(requirement);
-  latte::log("posting obj acl: %s, %s\n", obj_id, requirement);
+  LATTE_DEBUG("posting obj acl: %s, %s", obj_id, requirement);
   return latte_client->post_acl(obj_id, requirement);
 }
 
@@ -536,7 +1217,7 @@ int liblatte_attest_principal_property(const char *ip, uint32_t port, const char
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(prop);
-  latte::log("attesting property: %s, %u, %s\n", ip, port, prop);
+  LATTE_DEBUG("attesting property: %s, %u, %s", ip, port, prop);
   return latte_client->check_property(ip, port, prop);
 }
 
@@ -544,12 +1225,13 @@ int liblatte_attest_principal_access(const char *ip, uint32_t port, const char *
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(obj);
-  latte::log("attesting access: %s, %u, %s\n", ip, port, obj);
+  LATTE_DEBUG("attesting access: %s, %u, %s", ip, port, obj);
   return latte_client->check_access(ip, port, obj);
 }
 
 int liblatte_delete_principal_without_allocated_ports(uint64_t uuid) {
-  latte::log("deleting principal: %llu\n", uuid);
+  CHECK_LIB_INIT;
+  LATTE_DEBUG("deleting principal: %llu", (unsigned long long)uuid);
   return latte_client->delete_principal(uuid);
 }
 
@@ -569,6 +1251,35 @@ void liblatte_set_log_level(int upto) {
   latte::setloglevel(upto);
 }
 
+int liblatte_set_pipelined(int enable) {
+  if (!latte_clients) {
+    latte::log_err("the library is not initialized");
+    return -1;
+  }
+  latte_clients->set_pipelined(enable != 0);
+  return 0;
+}
+
+int liblatte_set_shm_ring(int enable) {
+  if (!latte_clients) {
+    latte::log_err("the library is not initialized");
+    return -1;
+  }
+  return latte_clients->set_shm_ring(enable != 0) ? 0 : ENOTSUP;
+}
+
+int liblatte_set_connection_pool(int size, int wait_ms) {
+  if (!latte_clients) {
+    latte::log_err("the library is not initialized");
+    return -1;
+  }
+  if (size <= 0 || wait_ms < 0) {
+    return EINVAL;
+  }
+  latte_clients->resize(size, std::chrono::milliseconds(wait_ms));
+  return 0;
+}
+
 /// helper
 
 char* liblatte_get_principal(const char *ip, uint32_t lo, char **principal,
@@ -578,10 +1289,10 @@ char* liblatte_get_principal(const char *ip, uint32_t lo, char **principal,
   CHECK_NULL_PTR1(principal, nullptr);
   CHECK_NULL_PTR1(size, nullptr);
   if (*principal) {
-    latte::log("warning: config buffer not empty, possible memory leaking");
+    LATTE_WARN("config buffer not empty, possible memory leaking");
   }
 
-  latte::log("get principal: %s:%u\n", ip, lo);
+  LATTE_DEBUG("get principal: %s:%u", ip, lo);
   std::unique_ptr<latte::proto::Principal> p = 
     latte_client->get_principal(ip, lo);
   if (p) {
@@ -598,10 +1309,10 @@ char* liblatte_get_local_principal(uint64_t uuid, char **principal,
   CHECK_NULL_PTR1(principal, nullptr);
   CHECK_NULL_PTR1(size, nullptr);
   if (*principal) {
-    latte::log("warning: config buffer not empty, possible memory leaking");
+    LATTE_WARN("config buffer not empty, possible memory leaking");
   }
 
-  latte::log("get local principal: %u\n", uuid);
+  LATTE_DEBUG("get local principal: %llu", (unsigned long long)uuid);
   std::unique_ptr<latte::proto::Principal> p = 
     latte_client->get_local_principal(uuid);
   if (p) {
@@ -618,7 +1329,7 @@ int liblatte_get_metadata_config_easy(char *url, size_t *url_sz) {
   if (*url_sz > URL_MAX_ALLOWED) {
     return -EINVAL;
   }
-  latte::log("get metadata config");
+  LATTE_DEBUG("get metadata config");
   std::unique_ptr<latte::proto::MetadataConfig> config =
     latte_client->get_metadata_config();
   if (!config) return 0;
@@ -632,9 +1343,9 @@ char* liblatte_get_metadata_config(char **metadata_config, size_t *size) {
   CHECK_NULL_PTR1(metadata_config, nullptr);
   CHECK_NULL_PTR1(size, nullptr);
   if (*metadata_config) {
-    latte::log("warning: config buffer not empty, possible memory leaking");
+    LATTE_WARN("config buffer not empty, possible memory leaking");
   }
-  latte::log("get metadata config");
+  LATTE_DEBUG("get metadata config");
   std::unique_ptr<latte::proto::MetadataConfig> config =
     latte_client->get_metadata_config();
   if (!config) return nullptr;
@@ -646,7 +1357,8 @@ int liblatte_endorse_principal(const char *ip, uint32_t port, uint64_t gn, int t
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(property);
-  latte::log("endorse principal: %s:%u:%llu, with %d:%s", ip, port, gn, type, property);
+  LATTE_DEBUG("endorse principal: %s:%u:%llu, with %d:%s", ip, port,
+      (unsigned long long)gn, type, property);
   return latte_client->endorse_principal(ip, port, gn, type, property);
 }
 
@@ -660,7 +1372,7 @@ int liblatte_endorse_image(const char *id, const char *config, const char *prope
   CHECK_NULL_PTR(id);
   CHECK_NULL_PTR(property);
   if (!config) config = "*";
-  latte::log("endorse image: %s:%s, with %s", id, config, property);
+  LATTE_DEBUG("endorse image: %s:%s, with %s", id, config, property);
   return latte_client->endorse_image(id, config, latte::proto::Endorse::IMAGE, property);
 }
 
@@ -672,7 +1384,7 @@ int liblatte_endorse_source(const char *url, const char *rev, const char *config
   auto id = latte::utils::format_image_source(url, rev);
   CHECK_NULL_PTR(property);
   if (!config) config = "*";
-  latte::log("endorse source: %s:%s, with %s", id.c_str(), config, property);
+  LATTE_DEBUG("endorse source: %s:%s, with %s", id.c_str(), config, property);
   return latte_client->endorse_source(id, config, latte::proto::Endorse::SOURCE, property);
 }
 
@@ -684,7 +1396,8 @@ int liblatte_revoke(const char *, const char *, int , const char *) {
 int liblatte_endorse_membership(const char *ip, uint32_t port, uint64_t gn, const char *master) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(master);
-  latte::log("endorse membership: %s:%u:%u, with %s", ip, port, gn, master);
+  LATTE_DEBUG("endorse membership: %s:%u:%llu, with %s", ip, port,
+      (unsigned long long)gn, master);
   return latte_client->endorse_membership(ip, port, gn, master);
 }
 
@@ -692,7 +1405,7 @@ int liblatte_endorse_attester(const char *id, const char *config) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(id);
   if (!config) config = "*";
-  latte::log("endorse attester: %s:%s", id, config);
+  LATTE_DEBUG("endorse attester: %s:%s", id, config);
   return latte_client->endorse_attester(id, config);
 }
 
@@ -700,7 +1413,7 @@ int liblatte_endorse_builder(const char *id, const char *config) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(id);
   if (!config) config = "*";
-  latte::log("endorse builder: %s:%s", id, config);
+  LATTE_DEBUG("endorse builder: %s:%s", id, config);
   return latte_client->endorse_attester(id, config);
 }
 
@@ -711,7 +1424,7 @@ int liblatte_endorse_image_source(const char *id, const char * config,
   CHECK_NULL_PTR(source_url);
   CHECK_NULL_PTR(source_rev);
   if (!config) config = "*";
-  latte::log("endorse source: %s:%s with %s:%s",
+  LATTE_DEBUG("endorse source: %s:%s with %s:%s",
       id, config, source_url, source_rev);
   return latte_client->endorse_source(id, config,
       latte::utils::format_image_source(source_url, source_rev));
@@ -721,7 +1434,7 @@ int liblatte_check_property(const char *ip, uint32_t port, const char *property)
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(property);
-  latte::log("check property: if %s:%u having %s", ip, port, property);
+  LATTE_DEBUG("check property: if %s:%u having %s", ip, port, property);
   return latte_client->check_property(ip, port, property);
 }
 
@@ -729,15 +1442,51 @@ int liblatte_check_access(const char *ip, uint32_t port, const char *object) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(object);
-  latte::log("check access: if %s:%u can access %s", ip, port, object);
+  LATTE_DEBUG("check access: if %s:%u can access %s", ip, port, object);
   return latte_client->check_access(ip, port, object);
 }
 
+static int _check_batch(const char *what, const char *ip, uint32_t port,
+    const char **items, int n, int *results,
+    std::vector<int> (latte::AttGuardClient::*check)(const std::string&, uint32_t,
+      const std::vector<std::string>&)) {
+  CHECK_LIB_INIT;
+  CHECK_NULL_PTR(ip);
+  CHECK_NULL_PTR(results);
+  if (n < 0 || (n > 0 && !items)) {
+    return EINVAL;
+  }
+  std::vector<std::string> targets;
+  targets.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    CHECK_NULL_PTR(items[i]);
+    targets.emplace_back(items[i]);
+  }
+  LATTE_DEBUG("check %s: %d items for %s:%u", what, n, ip, port);
+  auto answers = ((*latte_client).*check)(ip, port, targets);
+  for (int i = 0; i < n; ++i) {
+    results[i] = answers[i];
+  }
+  return 0;
+}
+
+int liblatte_check_property_batch(const char *ip, uint32_t port,
+    const char **properties, int n, int *results) {
+  return _check_batch("property", ip, port, properties, n, results,
+      &latte::AttGuardClient::check_properties);
+}
+
+int liblatte_check_access_batch(const char *ip, uint32_t port,
+    const char **objects, int n, int *results) {
+  return _check_batch("access", ip, port, objects, n, results,
+      &latte::AttGuardClient::check_accesses);
+}
+
 int liblatte_check_worker_access(const char *ip, uint32_t port, const char *object) {
   CHECK_LIB_INIT;
   CHECK_NULL_PTR(ip);
   CHECK_NULL_PTR(object);
-  latte::log("check worker access: if %s:%u can access %s", ip, port, object);
+  LATTE_DEBUG("check worker access: if %s:%u can access %s", ip, port, object);
   return latte_client->check_worker_access(ip, port, object);
 }
 
@@ -747,7 +1496,7 @@ char* liblatte_check_attestation(const char *ip, uint32_t port, char **attestati
   CHECK_NULL_PTR1(ip, nullptr);
   CHECK_NULL_PTR1(attestation, nullptr);
   CHECK_NULL_PTR1(size, nullptr);
-  latte::log("check attestation: what %s:%u has", ip, port);
+  LATTE_DEBUG("check attestation: what %s:%u has", ip, port);
   std::unique_ptr<latte::proto::Attestation> att =
     latte_client->check_attestation(ip, port);
 
@@ -776,13 +1525,15 @@ int liblatte_authip(char *ip, int max_len) {
 
 int liblatte_check_image_property(const char *image, const char *config,
     const char *property) {
-  latte::log("check image property: %s, %s, %s", image, config, property);
+  CHECK_LIB_INIT;
+  LATTE_DEBUG("check image property: %s, %s, %s", image, config, property);
   return latte_client->check_image_property(image, config, property);
 }
 
 
 int liblatte_create_instance(uint64_t pid, const char *image, const char *ip,
     int nport, const char *store, const char **args, int n) {
+  CHECK_LIB_INIT;
   if (nport <= 0 && (ip == NULL || strlen(ip) == 0)) {
     latte::log_err("must provide at least ip or nport");
     return -1;
@@ -817,7 +1568,8 @@ int liblatte_delete_instance(uint64_t pid) {
 }
 
 int liblatte_endorse(const char *id, const char *prop, const char *val) {
-  latte::log("endorse: %s %s %s", id, prop, val);
+  CHECK_LIB_INIT;
+  LATTE_DEBUG("endorse: %s %s %s", id, prop, val);
   if (!id || !prop || !val) {
     latte::log_err("endorse value can't be null %p %p %p", id, prop, val);
     return -1;
@@ -826,15 +1578,17 @@ int liblatte_endorse(const char *id, const char *prop, const char *val) {
 }
 
 int liblatte_link_image(const char *host, const char *image) {
+  CHECK_LIB_INIT;
   if (!host) host = "";
   if (!image) image = "";
-  latte::log("link image: %s %s", host, image);
+  LATTE_DEBUG("link image: %s %s", host, image);
   return latte_client->link_image(host, image);
 }
 
 
 int liblatte_free_call(const char *cmd, const char **args, int n) {
-  latte::log("free call: %s", cmd);
+  CHECK_LIB_INIT;
+  LATTE_DEBUG("free call: %s", cmd);
   std::vector<std::string> nargs;
   nargs.reserve(n);
   for (int i = 0; i < n; i++) {
@@ -845,8 +1599,9 @@ int liblatte_free_call(const char *cmd, const char **args, int n) {
 
 int liblatte_guard_call(const char *cmd, const char *ip,
     int port, const char **args, int n) {
+  CHECK_LIB_INIT;
 
-  latte::log("guard call: %s, %s, %d", cmd, ip, port);
+  LATTE_DEBUG("guard call: %s, %s, %d", cmd, ip, port);
   std::vector<std::string> nargs;
   nargs.reserve(n + 1);
   std::stringstream ss;
@@ -10,6 +10,24 @@ namespace config {
 
 ConfigItems config_cache_;
 
+static uint32_t read_uint(jutils::config::SimpleConfig &conf,
+    const char *key, uint32_t default_value) {
+  const std::string *v = conf.get(key);
+  if (!v) {
+    return default_value;
+  }
+  return atoi(v->c_str());
+}
+
+static bool read_bool(jutils::config::SimpleConfig &conf,
+    const char *key, bool default_value) {
+  const std::string *v = conf.get(key);
+  if (!v) {
+    return default_value;
+  }
+  return v->compare("1") == 0 || v->compare("true") == 0;
+}
+
 void load_config(const char *path) {
   auto &conf = jutils::config::SimpleConfig::create_config(path);
 
@@ -20,6 +38,7 @@ void load_config(const char *path) {
   } else {
     latte::setloglevel(LOG_INFO);
   }
+  latte::setlograte(read_uint(conf, LOG_RATE, LOG_DEFAULT_RATE));
 
   const std::string *myid = conf.get(MY_ID);
   if (!myid) {
@@ -66,6 +85,34 @@ void load_config(const char *path) {
   config_cache_.myip = std::string(*myip);
   config_cache_.run_as_iaas = (run_as_iaas->compare("1") == 0 ||
       run_as_iaas->compare("true") == 0);
+
+  config_cache_.decision_cache_ttl = read_uint(conf, DECISION_CACHE_TTL,
+      DECISION_CACHE_DEFAULT_TTL);
+  config_cache_.decision_cache_negative_ttl = read_uint(conf,
+      DECISION_CACHE_NEGATIVE_TTL, DECISION_CACHE_DEFAULT_NEGATIVE_TTL);
+  config_cache_.decision_cache_size = read_uint(conf, DECISION_CACHE_SIZE,
+      DECISION_CACHE_DEFAULT_SIZE);
+  config_cache_.io_threads = read_uint(conf, IO_THREADS, IO_DEFAULT_THREADS);
+  config_cache_.http_threads = read_uint(conf, HTTP_THREADS,
+      HTTP_DEFAULT_THREADS);
+  config_cache_.metadata_timeout = read_uint(conf, METADATA_TIMEOUT,
+      METADATA_DEFAULT_TIMEOUT);
+  config_cache_.metadata_keep_alive = read_bool(conf, METADATA_KEEP_ALIVE, true);
+  config_cache_.metadata_max_connections = read_uint(conf,
+      METADATA_MAX_CONNECTIONS, METADATA_DEFAULT_MAX_CONNECTIONS);
+  const std::string *metrics_endpoint = conf.get(METRICS_ENDPOINT);
+  if (metrics_endpoint) {
+    config_cache_.metrics_endpoint = *metrics_endpoint;
+  }
+  config_cache_.trace_slow_ms = read_uint(conf, TRACE_SLOW_MS, 0);
+  const std::string *trace_file = conf.get(TRACE_FILE);
+  if (trace_file) {
+    config_cache_.trace_file = *trace_file;
+  }
+  const std::string *state_dir = conf.get(STATE_DIR);
+  config_cache_.state_dir = state_dir ? *state_dir : STATE_DEFAULT_DIR;
+  config_cache_.journal_compact_records = read_uint(conf,
+      JOURNAL_COMPACT_RECORDS, JOURNAL_DEFAULT_COMPACT_RECORDS);
 }
 }
 
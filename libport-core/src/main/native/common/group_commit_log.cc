@@ -0,0 +1,79 @@
+#include "group_commit_log.h"
+#include "utils.h"
+#include <unistd.h>
+
+namespace latte {
+
+GroupCommitLog::GroupCommitLog(int fd): fd_(fd), appended_(0), committed_(0),
+  failed_(0), stop_(false), groups_(0), committer_(&GroupCommitLog::run, this) {}
+
+GroupCommitLog::~GroupCommitLog() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stop_ = true;
+  }
+  queued_cv_.notify_one();
+  committer_.join();
+  ::close(fd_);
+}
+
+void GroupCommitLog::append(std::string record, Done done) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (failed_ == 0) {
+      queued_.append(record);
+    }
+    waiting_.push_back(std::move(done));
+    ++appended_;
+  }
+  queued_cv_.notify_one();
+}
+
+void GroupCommitLog::flush() {
+  std::unique_lock<std::mutex> guard(lock_);
+  auto target = appended_;
+  committed_cv_.wait(guard, [this, target]() { return committed_ >= target; });
+}
+
+/// The group is taken as a whole and the buffers are swapped back
+// afterwards, so their memory is reused by the next groups.
+//
+// A failed write may have left part of the group in the file. Nothing is
+// written after it: recovery stops at the torn record, and whatever comes
+// later would be acknowledged and then lost.
+void GroupCommitLog::run() {
+  std::string group;
+  std::vector<Done> done;
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    queued_cv_.wait(guard, [this]() { return stop_ || !waiting_.empty(); });
+    if (waiting_.empty()) {
+      return;
+    }
+    group.swap(queued_);
+    done.swap(waiting_);
+    auto upto = appended_;
+    int err = failed_;
+    guard.unlock();
+
+    if (err == 0) {
+      err = utils::reliable_write(fd_, group.data(), group.size());
+      if (err == 0 && ::fdatasync(fd_) != 0) {
+        err = errno;
+      }
+      groups_.fetch_add(1, std::memory_order_relaxed);
+    }
+    for (auto &d: done) {
+      d(err);
+    }
+    group.clear();
+    done.clear();
+
+    guard.lock();
+    failed_ = err;
+    committed_ = upto;
+    committed_cv_.notify_all();
+  }
+}
+
+}
@@ -1,91 +1,291 @@
-
 #include "log.h"
+#include "log_ring.h"
 #include <syslog.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <stdexcept>
 
 namespace latte {
-int current_level = LOG_NOTICE;
+std::atomic<int> current_level(LOG_NOTICE);
 
 bool is_debug() {
-  return current_level <= LOG_DEBUG;
+  return current_level.load(std::memory_order_relaxed) >= LOG_DEBUG;
 }
 
 int loglevel() {
-   return current_level;
+   return current_level.load(std::memory_order_relaxed);
 }
 
 void setloglevel(int upto) {
-  current_level = upto;
+  current_level.store(upto, std::memory_order_relaxed);
 }
 
-static std::once_flag probe_debug_flag;
-static bool write_to_file = false;
-static FILE* fdebug = NULL;
+namespace {
+
+constexpr const char *DEBUG_LOG_DIR = "/var/run/libport-debug";
+constexpr const char *DEBUG_LOG_PATH = "/var/run/libport-debug/log";
+constexpr size_t LOG_RING_LINES = 1024;
+/// how long the flusher sleeps once the ring is empty, unless a burst of
+// LOG_WAKE_LINES lines wakes it up earlier
+constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+constexpr size_t LOG_WAKE_LINES = LOG_RING_LINES / 4;
+
+/// Lines are formatted by the caller into a LogRing and written out by a
+// flusher thread, either to the debug log file, which stays open, or to
+// syslog. The flusher is started by the first line and stopped at exit,
+// after writing what is left.
+class LogBackend {
+
+  public:
+    LogBackend(): ring_(LOG_RING_LINES), limiter_(LOG_DEFAULT_RATE),
+      started_(false), stop_(false), pushed_(0), fd_(-1) {}
+
+    void write(int priority, const char *msg, va_list args) {
+      if (!admit(priority)) {
+        return;
+      }
+      ring_.push(priority, [msg, &args](char *buf, size_t size) {
+          va_list copy;
+          va_copy(copy, args);
+          int len = ::vsnprintf(buf, size, msg, copy);
+          va_end(copy);
+          return len < 0 ? size_t(0) : size_t(len);
+      });
+      pushed();
+    }
+
+    void write_line(int priority, const char *line, size_t len) {
+      if (!admit(priority)) {
+        return;
+      }
+      ring_.push_line(priority, line, len);
+      pushed();
+    }
+
+    void set_rate(uint32_t lines_per_sec) {
+      limiter_.set_limit(lines_per_sec);
+    }
+
+    /// writes out every line queued so far, for exit and the child of fork
+    void stop() {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (!flusher_) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> sleeping(sleep_lock_);
+        stop_.store(true, std::memory_order_release);
+      }
+      wake_.notify_one();
+      flusher_->join();
+      flusher_.reset();
+      started_.store(false, std::memory_order_release);
+    }
+
+  private:
+    /// the flusher mostly sleeps, but not through a burst
+    inline void pushed() {
+      if (pushed_.fetch_add(1, std::memory_order_relaxed) % LOG_WAKE_LINES
+          == LOG_WAKE_LINES - 1) {
+        wake_.notify_one();
+      }
+    }
+
+    /// errors are never rate limited
+    inline bool admit(int priority) {
+      if (!started_.load(std::memory_order_acquire)) {
+        start();
+      }
+      if (priority <= LOG_ERR) {
+        return true;
+      }
+      auto now = std::chrono::steady_clock::now().time_since_epoch();
+      return limiter_.admit(
+          std::chrono::duration_cast<std::chrono::seconds>(now).count());
+    }
+
+    void start() {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (started_.load(std::memory_order_relaxed)) {
+        return;
+      }
+      static std::once_flag once;
+      std::call_once(once, [this]() {
+          struct stat sb;
+          if (::stat(DEBUG_LOG_DIR, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            fd_ = ::open(DEBUG_LOG_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                0644);
+          }
+          pthread_atfork(&LogBackend::before_fork, &LogBackend::after_fork_parent,
+              &LogBackend::after_fork_child);
+          atexit(&LogBackend::at_exit);
+      });
+      stop_.store(false, std::memory_order_relaxed);
+      try {
+        flusher_.reset(new std::thread(&LogBackend::run, this));
+      } catch (std::system_error &) {
+        /// no thread, lines stay queued until the ring is full
+        return;
+      }
+      started_.store(true, std::memory_order_release);
+    }
+
+    void run() {
+      while (!stop_.load(std::memory_order_acquire)) {
+        if (flush() == 0) {
+          std::unique_lock<std::mutex> sleeping(sleep_lock_);
+          if (!stop_.load(std::memory_order_acquire)) {
+            wake_.wait_for(sleeping, FLUSH_INTERVAL);
+          }
+        }
+      }
+      flush();
+    }
+
+    size_t flush() {
+      size_t n = ring_.drain([this](int priority, const char *line, size_t len) {
+          emit(priority, line, len);
+      });
+      uint64_t lost = ring_.take_dropped() + limiter_.take_suppressed();
+      if (lost) {
+        std::array<char, 64> note;
+        int len = snprintf(&note[0], note.size(), "%llu log lines dropped",
+            (unsigned long long)lost);
+        emit(LOG_WARNING, &note[0], len);
+      }
+      if (fd_ >= 0 && !batch_.empty()) {
+        const char *p = batch_.data();
+        size_t left = batch_.size();
+        while (left > 0) {
+          ssize_t sent = ::write(fd_, p, left);
+          if (sent < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            break;
+          }
+          p += sent;
+          left -= sent;
+        }
+        batch_.clear();
+      }
+      return n;
+    }
 
-void probe_debug_log() {
-  struct stat sb;
-  if (::stat("/var/run/libport-debug", &sb) == 0) {
-    if (S_ISDIR(sb.st_mode)) {
-      write_to_file = true;
+    /// lines for the file are batched into one write per flush
+    void emit(int priority, const char *line, size_t len) {
+      if (fd_ >= 0) {
+        batch_.append(line, len);
+        batch_.push_back('\n');
+      } else {
+        ::syslog(priority, "%.*s", (int)len, line);
+      }
     }
-  }
+
+    static void at_exit();
+    static void before_fork();
+    static void after_fork_parent();
+    static void after_fork_child();
+
+    LogRing ring_;
+    LogRateLimiter limiter_;
+    std::mutex lock_;
+    std::atomic<bool> started_;
+    std::atomic<bool> stop_;
+    std::unique_ptr<std::thread> flusher_;
+    std::mutex sleep_lock_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pushed_;
+    int fd_;
+    std::string batch_;
+};
+
+/// never destroyed, other static destructors may still log
+LogBackend &backend() {
+  static LogBackend *instance = new LogBackend();
+  return *instance;
+}
+
+void LogBackend::at_exit() {
+  backend().stop();
+}
+
+void LogBackend::before_fork() {
+  backend().lock_.lock();
+}
+
+void LogBackend::after_fork_parent() {
+  backend().lock_.unlock();
+}
+
+/// The flusher did not survive the fork and a line may have been half
+// written, so the child starts from an empty ring and a new flusher. The
+// parent writes out what was queued before the fork.
+void LogBackend::after_fork_child() {
+  auto &b = backend();
+  b.flusher_.release();
+  b.ring_.reset();
+  b.limiter_.take_suppressed();
+  b.batch_.clear();
+  b.started_.store(false, std::memory_order_relaxed);
+  b.lock_.unlock();
 }
 
+}
+
+void setlograte(uint32_t lines_per_sec) {
+  backend().set_rate(lines_per_sec);
+}
+
+void flushlog() {
+  backend().stop();
+}
+
+void log_at(int priority, const char *msg, ...) {
+  va_list args;
+  va_start(args, msg);
+  backend().write(priority, msg, args);
+  va_end(args);
+}
+
+/// Always written, at the current level as it has been. Use the LATTE_*
+// macros for lines that can be filtered out.
 void log(const char* msg, ...) {
   va_list args;
-  std::call_once(probe_debug_flag, probe_debug_log);
   va_start(args, msg);
-  if (write_to_file) {
-    fdebug = fopen("/var/run/libport-debug/log", "a");
-    if (fdebug) {
-      ::vfprintf(fdebug, msg, args);
-      fprintf(fdebug, "\n");
-      fclose(fdebug);
-    }
-  } else {
-    vsyslog(current_level, msg, args);
-  }
+  backend().write(loglevel(), msg, args);
   va_end(args);
 }
 
+/// Errors are written whatever the level, as they have always been
 void log_err(const char *msg, ...) {
   va_list args;
-  std::call_once(probe_debug_flag, probe_debug_log);
   va_start(args, msg);
-  if (write_to_file) {
-    fdebug = fopen("/var/run/libport-debug/log", "a");
-    if (fdebug) {
-      ::vfprintf(fdebug, msg, args);
-      fprintf(fdebug, "\n");
-      fclose(fdebug);
-    }
-  } else {
-    vsyslog(LOG_ERR, msg, args);
-  }
+  backend().write(LOG_ERR, msg, args);
   va_end(args);
 }
 
 void log_err_throw(const char *msg, ...) {
   va_list args;
-  std::call_once(probe_debug_flag, probe_debug_log);
   std::array<char, LOG_BUF_SIZE> buf;
 
   va_start(args, msg);
-  size_t sz = ::vsnprintf(&buf[0], LOG_BUF_SIZE, msg, args);
-  if (write_to_file) {
-    fdebug = fopen("/var/run/libport-debug/log", "a");
-    if (fdebug) {
-      fwrite(&buf[0], 1, sz, fdebug);
-      fprintf(fdebug, "\n");
-      fclose(fdebug);
-    }
-  } else {
-    syslog(LOG_ERR, "%s", &buf[0]);
-  }
+  int sz = ::vsnprintf(&buf[0], LOG_BUF_SIZE, msg, args);
   va_end(args);
-  throw std::runtime_error(std::string(buf.begin(), buf.begin() + sz));
+  size_t len = sz < 0 ? 0 : std::min<size_t>(sz, LOG_BUF_SIZE - 1);
+  backend().write_line(LOG_ERR, &buf[0], len);
+  throw std::runtime_error(std::string(buf.begin(), buf.begin() + len));
 }
 
 }
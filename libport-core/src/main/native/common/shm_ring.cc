@@ -0,0 +1,134 @@
+#include "shm_ring.h"
+#include "log.h"
+#include "utils.h"
+
+#include <new>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace latte {
+
+namespace {
+
+constexpr uint32_t CHANNEL_MAGIC = 0x6c736872;
+
+}
+
+constexpr uint32_t ShmRing::NSLOT;
+constexpr uint32_t ShmRing::SLOT_SZ;
+constexpr uint32_t ShmRing::MAX_PAYLOAD;
+constexpr size_t ShmChannel::NFD;
+
+struct ShmChannel::Layout {
+  uint32_t magic;
+  uint32_t nslot;
+  uint32_t slot_sz;
+  ShmRing::Layout commands;
+  ShmRing::Layout responses;
+};
+
+std::unique_ptr<ShmChannel> ShmChannel::create() {
+  int fds[NFD] = {-1, -1, -1};
+  fds[0] = ::memfd_create("attguard-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  fds[1] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  fds[2] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  void *base = MAP_FAILED;
+  if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+      ::ftruncate(fds[0], sizeof(Layout)) == 0 &&
+      ::fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+        == 0) {
+    base = ::mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fds[0], 0);
+  }
+  if (base == MAP_FAILED) {
+    log_err("can not set up shared memory ring: %s", strerror(errno));
+    for (auto fd: fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+    return nullptr;
+  }
+  auto layout = new (base) Layout();
+  layout->magic = CHANNEL_MAGIC;
+  layout->nslot = ShmRing::NSLOT;
+  layout->slot_sz = ShmRing::SLOT_SZ;
+  return std::unique_ptr<ShmChannel>(new ShmChannel(layout, fds));
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::attach(int memfd, int command_fd,
+    int response_fd) {
+  int fds[NFD] = {memfd, command_fd, response_fd};
+  struct stat sb;
+  void *base = MAP_FAILED;
+  if (::fstat(memfd, &sb) == 0 && (size_t)sb.st_size == sizeof(Layout)) {
+    base = ::mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED,
+        memfd, 0);
+  }
+  auto layout = (Layout*) base;
+  if (base == MAP_FAILED || layout->magic != CHANNEL_MAGIC ||
+      layout->nslot != ShmRing::NSLOT || layout->slot_sz != ShmRing::SLOT_SZ) {
+    log_err("shared memory ring from the guard not usable");
+    if (base != MAP_FAILED) {
+      ::munmap(base, sizeof(Layout));
+    }
+    for (auto fd: fds) {
+      ::close(fd);
+    }
+    return nullptr;
+  }
+  return std::unique_ptr<ShmChannel>(new ShmChannel(layout, fds));
+}
+
+ShmChannel::ShmChannel(Layout *layout, const int *fds): layout_(layout),
+  commands_(&layout->commands), responses_(&layout->responses) {
+  for (size_t i = 0; i < NFD; ++i) {
+    fds_[i] = fds[i];
+  }
+}
+
+ShmChannel::~ShmChannel() {
+  ::munmap(layout_, sizeof(Layout));
+  for (auto fd: fds_) {
+    ::close(fd);
+  }
+}
+
+void ShmChannel::notify(int efd) {
+  uint64_t one = 1;
+  while (::write(efd, &one, sizeof(one)) < 0 && errno == EINTR) {
+  }
+}
+
+int ShmChannel::await(int efd, int sock) {
+  struct pollfd fds[2] = {{efd, POLLIN, 0}, {sock, POLLRDHUP, 0}};
+  while (true) {
+    int ret = ::poll(fds, 2, -1);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (fds[1].revents) {
+      return utils::UNEXPECTED_CLOSE;
+    }
+    if (fds[0].revents & POLLIN) {
+      uint64_t count;
+      /// the eventfd is non blocking, a wakeup taken already is fine
+      if (::read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN &&
+          errno != EINTR) {
+        return errno;
+      }
+      return 0;
+    }
+  }
+}
+
+}
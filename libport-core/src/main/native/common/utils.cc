@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <random>
 #include <string>
+#include <vector>
 #include <errno.h>
 #include <string.h>
 #include <ifaddrs.h>
@@ -173,11 +174,92 @@ int reliable_recv(int fd, char *buffer, int size) {
   return 0;
 }
 
-static std::random_device rd;
-static std::mt19937_64 gen(rd());
-static std::uniform_int_distribution<int64_t> dist(1, MAX_MSGID/2);
+int reliable_write(int fd, const char *buffer, size_t size) {
+  while (size > 0) {
+    auto ret = ::write(fd, buffer, size);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    buffer += ret;
+    size -= ret;
+  }
+  return 0;
+}
+
+ssize_t send_with_fds(int sock, const void *buffer, size_t size,
+    const int *fds, size_t nfd) {
+  struct iovec iov = {const_cast<void*>(buffer), size};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * nfd));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+  ssize_t ret;
+  do {
+    ret = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+int recv_with_fds(int sock, void *buffer, size_t size, int *fds, size_t *nfd) {
+  size_t want = *nfd;
+  *nfd = 0;
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * want));
+  char *pos = (char*) buffer;
+  while (size > 0) {
+    struct iovec iov = {pos, size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    auto ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (ret == 0) {
+      return UNEXPECTED_CLOSE;
+    }
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const char *data = (const char*) CMSG_DATA(cmsg);
+      for (size_t i = 0; i < n; ++i) {
+        int fd;
+        memcpy(&fd, data + i * sizeof(int), sizeof(int));
+        if (*nfd < want) {
+          fds[(*nfd)++] = fd;
+        } else {
+          close(fd);
+        }
+      }
+    }
+    pos += ret;
+    size -= ret;
+  }
+  return 0;
+}
 
+/// Called by every thread sharing a client, each draws from its own engine.
 uint64_t gen_rand_uint64() {
+  static thread_local std::mt19937_64 gen(std::random_device{}());
+  static thread_local std::uniform_int_distribution<int64_t> dist(1,
+      MAX_MSGID/2);
   return dist(gen);
 }
 
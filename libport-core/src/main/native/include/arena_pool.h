@@ -0,0 +1,134 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Pool of protobuf arenas for per-request messages
+   Author: Yan Zhai
+
+*/
+
+#ifndef _LIBPORT_ARENA_POOL_H
+#define _LIBPORT_ARENA_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <google/protobuf/arena.h>
+
+namespace latte {
+
+/// Hands out protobuf arenas that go back to the pool once the last
+// reference is dropped. Each arena owns an initial block that survives
+// Reset(), so a request whose messages fit in it costs no heap allocation.
+//
+// References may be dropped on any thread, e.g. when a handler finishes on
+// the cpprest pool, hence the lock. The pool outlives every arena it handed
+// out since the deleters keep it alive.
+class ArenaPool: public std::enable_shared_from_this<ArenaPool> {
+
+  public:
+    typedef google::protobuf::Arena Arena;
+
+    constexpr static size_t DEFAULT_BLOCK_SIZE = 4096;
+    constexpr static size_t DEFAULT_MAX_IDLE = 64;
+
+    ArenaPool(const ArenaPool&) = delete;
+    ArenaPool& operator =(const ArenaPool&) = delete;
+
+    static std::shared_ptr<ArenaPool> create(
+        size_t block_size = DEFAULT_BLOCK_SIZE,
+        size_t max_idle = DEFAULT_MAX_IDLE) {
+      return std::shared_ptr<ArenaPool>(new ArenaPool(block_size, max_idle));
+    }
+
+    /// Messages created on the arena live until the returned pointer and all
+    // its copies are gone. Alias it to hand out a message, e.g.
+    // std::shared_ptr<Command>(arena, Arena::CreateMessage<Command>(arena.get())).
+    inline std::shared_ptr<Arena> acquire() {
+      std::unique_ptr<Entry> entry;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!idle_.empty()) {
+          entry = std::move(idle_.back());
+          idle_.pop_back();
+        }
+      }
+      if (!entry) {
+        entry.reset(new Entry(block_size_));
+      }
+      auto arena = entry->arena.get();
+      auto self = shared_from_this();
+      return std::shared_ptr<Arena>(arena, Recycler{self, entry.release()});
+    }
+
+    inline size_t idle() const {
+      std::lock_guard<std::mutex> guard(lock_);
+      return idle_.size();
+    }
+
+  private:
+
+    struct Entry {
+      Entry(size_t block_size): block(new char[block_size]) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block.get();
+        options.initial_block_size = block_size;
+        arena.reset(new Arena(options));
+      }
+      std::unique_ptr<char[]> block;
+      std::unique_ptr<Arena> arena;
+    };
+
+    struct Recycler {
+      std::shared_ptr<ArenaPool> pool;
+      Entry *entry;
+      void operator()(Arena *) {
+        pool->recycle(std::unique_ptr<Entry>(entry));
+      }
+    };
+
+    ArenaPool(size_t block_size, size_t max_idle): block_size_(block_size),
+      max_idle_(max_idle) {}
+
+    inline void recycle(std::unique_ptr<Entry> entry) {
+      entry->arena->Reset();
+      std::lock_guard<std::mutex> guard(lock_);
+      if (idle_.size() < max_idle_) {
+        idle_.push_back(std::move(entry));
+      }
+    }
+
+    size_t block_size_;
+    size_t max_idle_;
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<Entry>> idle_;
+};
+
+}
+
+#endif
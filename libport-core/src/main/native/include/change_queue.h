@@ -0,0 +1,233 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Queue of changes waiting to be synced
+   Author: Yan Zhai
+
+*/
+
+#ifndef _LIBPORT_CHANGE_QUEUE_H
+#define _LIBPORT_CHANGE_QUEUE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+
+namespace latte {
+
+/// Changes to keyed state that still have to reach a remote copy of it.
+//
+// Every change gets a version, and only the latest change of each (type,
+// key) is kept: a key created and deleted before it was synced leaves
+// nothing to send, and repeated updates send the last value. A sync takes
+// what is pending, and those changes stay in flight until the sync is
+// reported done. Changes recorded meanwhile are pending for the next sync,
+// so a sync only ever carries what changed since the last successful one.
+// A failed sync puts its changes back under any newer change of the same
+// key.
+//
+// The number of pending keys is bounded. Recording a change of a new key
+// waits while the queue is full, and the syncer is woken early once the
+// queue is half full, so producers slow down to the pace syncs drain at
+// instead of growing the queue.
+template<typename Value>
+class ChangeQueue {
+
+  public:
+    struct Change {
+      uint64_t version;
+      std::string type;
+      std::string key;
+      /// created or updated with value, otherwise deleted
+      bool created;
+      Value value;
+    };
+
+    constexpr static size_t DEFAULT_CAPACITY = 4096;
+
+    ChangeQueue(const ChangeQueue&) = delete;
+    ChangeQueue& operator =(const ChangeQueue&) = delete;
+    explicit ChangeQueue(size_t capacity = DEFAULT_CAPACITY):
+      capacity_(std::max<size_t>(capacity, 1)), version_(0), synced_(0),
+      taken_(0), closed_(false) {}
+
+    inline void created(std::string type, std::string key, Value value) {
+      record(std::move(type), std::move(key), true, std::move(value));
+    }
+
+    inline void deleted(std::string type, std::string key) {
+      record(std::move(type), std::move(key), false, Value());
+    }
+
+    /// Waits for a sync to be worth it: until timeout passes, the queue is
+    // half full or it is closed. False once closed.
+    template<typename Rep, typename Period>
+    bool wait(const std::chrono::duration<Rep, Period> &timeout) {
+      std::unique_lock<std::mutex> guard(lock_);
+      ready_.wait_for(guard, timeout, [this]() {
+          return closed_ || pending_.size() >= (capacity_ + 1) / 2;
+      });
+      return !closed_;
+    }
+
+    /// The pending changes in the order they were made. They are in flight
+    // until done is called, and a take before that returns nothing.
+    std::vector<Change> take() {
+      std::vector<Change> changes;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!in_flight_.empty() || pending_.empty()) {
+          return changes;
+        }
+        in_flight_.swap(pending_);
+        taken_ = version_;
+        changes.reserve(in_flight_.size());
+        for (auto &entry: in_flight_) {
+          changes.push_back(entry.second.change);
+        }
+      }
+      space_.notify_all();
+      std::sort(changes.begin(), changes.end(),
+          [](const Change &a, const Change &b) { return a.version < b.version; });
+      return changes;
+    }
+
+    /// Ends the sync of the changes last taken. If it failed they are
+    // pending again, unless a newer change of their key replaced them.
+    void done(bool synced) {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (synced) {
+        synced_ = taken_;
+        in_flight_.clear();
+        return;
+      }
+      for (auto &entry: in_flight_) {
+        auto found = pending_.find(entry.first);
+        if (found == pending_.end()) {
+          pending_.emplace(entry.first, std::move(entry.second));
+          continue;
+        }
+        /// the newer change was based on the failed one having gone through
+        found->second.remote = entry.second.remote;
+        if (!found->second.change.created && !found->second.remote) {
+          pending_.erase(found);
+        }
+      }
+      in_flight_.clear();
+    }
+
+    /// every change up to this version has been synced
+    inline uint64_t synced() const {
+      std::lock_guard<std::mutex> guard(lock_);
+      return synced_;
+    }
+
+    /// keys with a change waiting for the next sync
+    inline size_t size() const {
+      std::lock_guard<std::mutex> guard(lock_);
+      return pending_.size();
+    }
+
+    /// Wakes up everything waiting, later changes are recorded without
+    // waiting for space.
+    void close() {
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        closed_ = true;
+      }
+      ready_.notify_all();
+      space_.notify_all();
+    }
+
+  private:
+    struct Entry {
+      Change change;
+      /// whether the key exists remotely before this change is synced
+      bool remote;
+    };
+
+    void record(std::string type, std::string key, bool created, Value value) {
+      std::string id;
+      id.reserve(type.size() + key.size() + 1);
+      id += type;
+      id.push_back('\0');
+      id += key;
+
+      std::unique_lock<std::mutex> guard(lock_);
+      space_.wait(guard, [this, &id]() {
+          return closed_ || pending_.size() < capacity_ || pending_.count(id);
+      });
+      auto found = pending_.find(id);
+      bool remote;
+      if (found != pending_.end()) {
+        remote = found->second.remote;
+      } else {
+        /// an in flight change is taken as done, a failure fixes this up
+        auto flying = in_flight_.find(id);
+        remote = flying != in_flight_.end() ? flying->second.change.created :
+          !created;
+      }
+      if (!created && !remote) {
+        if (found != pending_.end()) {
+          pending_.erase(found);
+        }
+        return;
+      }
+      Entry &e = found != pending_.end() ? found->second : pending_[id];
+      e.remote = remote;
+      e.change.version = ++version_;
+      e.change.type = std::move(type);
+      e.change.key = std::move(key);
+      e.change.created = created;
+      e.change.value = std::move(value);
+      if (pending_.size() >= (capacity_ + 1) / 2) {
+        ready_.notify_one();
+      }
+    }
+
+    const size_t capacity_;
+    mutable std::mutex lock_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::unordered_map<std::string, Entry> pending_;
+    std::unordered_map<std::string, Entry> in_flight_;
+    uint64_t version_;
+    uint64_t synced_;
+    /// version when the changes in flight were taken
+    uint64_t taken_;
+    bool closed_;
+};
+
+}
+
+#endif
@@ -34,10 +34,12 @@
 #ifndef _LIBPORT_PROTO_COMM_H
 #define _LIBPORT_PROTO_COMM_H
 
+#include <vector>
 #include "config.h"
 #include "google/protobuf/message.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "utils.h"
+#include "trace.h"
 #include "proto/traits.h"
 
 namespace latte {
@@ -48,20 +50,61 @@ namespace latte {
 
   static constexpr int COMM_HEADER_SZ = 8;
 
+  /// A frame is the payload size and the magic, both little endian 32 bit,
+  // followed by the serialized message. We read v2, so we say so.
+  static inline void encode_frame_header(uint32_t size, uint8_t *header) {
+    CodedOutputStream::WriteLittleEndian32ToArray(size, header);
+    CodedOutputStream::WriteLittleEndian32ToArray(PROTO_MAGIC_V2,
+        header + sizeof(uint32_t));
+  }
+
+  static inline void decode_frame_header(const uint8_t *header, uint32_t *size,
+      uint32_t *magic) {
+    CodedInputStream::ReadLittleEndian32FromArray(header, size);
+    CodedInputStream::ReadLittleEndian32FromArray(header + sizeof(uint32_t),
+        magic);
+  }
+
+  /// Payload buffer reused from frame to frame. It keeps the largest size
+  // seen so far, but gives the memory back after a frame larger than
+  // RETAINED_FRAME_SZ so one huge message does not pin it forever.
+  class FrameBuffer {
+    public:
+      FrameBuffer(const FrameBuffer&) = delete;
+      FrameBuffer& operator =(const FrameBuffer&) = delete;
+      FrameBuffer(size_t initial): buf_(initial) {}
+
+      inline uint8_t *reserve(size_t size) {
+        if (buf_.size() < size) {
+          buf_.resize(size);
+        }
+        return buf_.data();
+      }
+
+      inline void release() {
+        if (buf_.size() > RETAINED_FRAME_SZ) {
+          std::vector<uint8_t>(RECV_BUFSZ).swap(buf_);
+        }
+      }
+
+    private:
+      std::vector<uint8_t> buf_;
+  };
+
   /// Should move these to common library.
 
   static inline int proto_send_msg(int sock, const Message &cmd) {
-      utils::Buffer buffer(sizeof(uint32_t) * 2 + cmd.ByteSize());
-      CodedOutputStream::WriteLittleEndian32ToArray(cmd.ByteSize(),
-          buffer.buf());
-      CodedOutputStream::WriteLittleEndian32ToArray(0x1987,
-          buffer.buf() + sizeof(uint32_t));
-      cmd.SerializeToArray(buffer.buf() + sizeof(uint32_t) * 2, cmd.ByteSize());
+      uint32_t size = cmd.ByteSizeLong();
+      utils::Buffer buffer(COMM_HEADER_SZ + size);
+      encode_frame_header(size, buffer.buf());
+      cmd.SerializeWithCachedSizesToArray(buffer.buf() + COMM_HEADER_SZ);
       return utils::reliable_send(sock, buffer.buf(), buffer.size());
     }
 
+    /// magic, if given, is set to the magic the peer sent
     template<class ProtoMessage>
-    static int proto_recv_msg(int sock, ProtoMessage *result) {
+    static int proto_recv_msg(int sock, ProtoMessage *result,
+        uint32_t *magic_out = nullptr) {
 
       unsigned char buffer[COMM_HEADER_SZ];
       int ret = utils::reliable_recv(sock, buffer, COMM_HEADER_SZ);
@@ -69,10 +112,11 @@ namespace latte {
         return ret;
       }
       uint32_t size, magic;
-      google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(buffer, &size);
-      google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(buffer
-          +sizeof(magic), &magic);
-      log("proto header expect size: %d, %x", size, magic);
+      decode_frame_header(buffer, &size, &magic);
+      LATTE_DEBUG("proto header expect size: %u, %x", size, magic);
+      if (magic_out) {
+        *magic_out = magic;
+      }
 
       // +1 for defense
       utils::Buffer response_buf(size + 1);
@@ -86,16 +130,20 @@ namespace latte {
       return 0;
     }
 
+/// Commands are prepared in the v2 format, see proto::downgrade for guards
+// that only read v1.
 template<proto::Command::Type type>
 proto::Command prepare(
     const typename proto::statement_traits<type>::msg_type &statement,
     const char *auth = DEFAULT_SPEAKER) {
   proto::Command cmd;
   cmd.set_id(utils::gen_rand_uint64());
+  cmd.set_trace_id(utils::gen_rand_uint64());
+  cmd.set_sent_at_us(trace_now_us());
   cmd.set_type(type);
   cmd.set_auth(auth);
-  auto stmt_field = cmd.mutable_statement();
-  stmt_field->PackFrom(statement);
+  proto::body_traits<typename proto::statement_traits<type>::msg_type>::
+    mutable_get(&cmd)->CopyFrom(statement);
   return cmd;
 }
 
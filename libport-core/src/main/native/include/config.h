@@ -14,11 +14,21 @@ constexpr const char *DEFAULT_SPEAKER = "default-speaker";
 const constexpr int RECV_BUFSZ = 8192;
 const constexpr int SEND_BUFSZ = 8192;
 const constexpr int PROTO_MAGIC = 0x1987;
+/// Magic of peers reading the v2 wire format, where statements and results
+// are in a oneof rather than an Any. Frames always carry the magic of what
+// their sender reads, and a peer is sent v2 only once it announced it.
+const constexpr int PROTO_MAGIC_V2 = 0x1988;
+/// Frame buffers kept by a session shrink back after a larger frame
+const constexpr size_t RETAINED_FRAME_SZ = 1 << 16;
+/// Commands a session may have in flight before it stops reading more
+const constexpr size_t MAX_PIPELINED_COMMANDS = 128;
 
 
 namespace config {
 
 constexpr const char *LOG_LEVEL = "log";
+/// log lines per second below errors, 0 for no limit
+constexpr const char *LOG_RATE = "log_rate";
 constexpr const char *MY_ID = "speaker_id";
 constexpr const char *MY_IP = "speaker_ip";
 constexpr const char *RUN_AS_IAAS = "run_as_iaas";
@@ -28,6 +38,41 @@ constexpr const char *METADATA_SERVICE_PORT = "metadata_port";
 constexpr const uint32_t METADATA_SERVICE_DEFAULT_PORT = 7777;
 constexpr const char *DAEMON_SOCKET_PATH = "daemon_socket";
 constexpr const char *DAEMON_SOCKET_DEFAULT_PATH = "/var/run/latte/guard.sock";
+/// decision cache for CHECK_* commands, a ttl of 0 disables that side
+constexpr const char *DECISION_CACHE_TTL = "decision_cache_ttl_ms";
+constexpr const char *DECISION_CACHE_NEGATIVE_TTL = "decision_cache_negative_ttl_ms";
+constexpr const char *DECISION_CACHE_SIZE = "decision_cache_size";
+constexpr const uint32_t DECISION_CACHE_DEFAULT_TTL = 5000;
+constexpr const uint32_t DECISION_CACHE_DEFAULT_NEGATIVE_TTL = 1000;
+constexpr const uint32_t DECISION_CACHE_DEFAULT_SIZE = 65536;
+/// http client towards the metadata service, a timeout of 0 keeps the
+// cpprest default and 0 connections means no limit
+constexpr const char *METADATA_TIMEOUT = "metadata_timeout_ms";
+constexpr const uint32_t METADATA_DEFAULT_TIMEOUT = 30000;
+constexpr const char *METADATA_KEEP_ALIVE = "metadata_keep_alive";
+constexpr const char *METADATA_MAX_CONNECTIONS = "metadata_max_connections";
+constexpr const uint32_t METADATA_DEFAULT_MAX_CONNECTIONS = 16;
+/// threads running session I/O and handlers, 0 means one per core
+constexpr const char *IO_THREADS = "io_threads";
+constexpr const uint32_t IO_DEFAULT_THREADS = 0;
+/// threads of the pool serving metadata service requests
+constexpr const char *HTTP_THREADS = "http_threads";
+constexpr const uint32_t HTTP_DEFAULT_THREADS = 4;
+/// where metrics are served, a unix socket path or [host:]port, empty for
+// none
+constexpr const char *METRICS_ENDPOINT = "metrics_endpoint";
+/// commands slower than this are dumped to the trace file as Chrome trace
+// events, 0 disables tracing. The file defaults to
+// /tmp/attguard-trace<pid>.json
+constexpr const char *TRACE_SLOW_MS = "trace_slow_ms";
+constexpr const char *TRACE_FILE = "trace_file";
+/// principals are journaled in the state directory if it exists, empty for
+// none. The journal is compacted into a snapshot once it has that many
+// records, 0 for never.
+constexpr const char *STATE_DIR = "state_dir";
+constexpr const char *STATE_DEFAULT_DIR = "/var/lib/attguard";
+constexpr const char *JOURNAL_COMPACT_RECORDS = "journal_compact_records";
+constexpr const uint32_t JOURNAL_DEFAULT_COMPACT_RECORDS = 65536;
 
 
 
@@ -39,6 +84,19 @@ struct ConfigItems {
   std::string local_ep;
   uint32_t metadata_port;
   bool run_as_iaas;
+  uint32_t decision_cache_ttl;
+  uint32_t decision_cache_negative_ttl;
+  uint32_t decision_cache_size;
+  uint32_t io_threads;
+  uint32_t http_threads;
+  uint32_t metadata_timeout;
+  bool metadata_keep_alive;
+  uint32_t metadata_max_connections;
+  std::string metrics_endpoint;
+  uint32_t trace_slow_ms;
+  std::string trace_file;
+  std::string state_dir;
+  uint32_t journal_compact_records;
 } ;
 
 extern ConfigItems config_cache_;
@@ -71,6 +129,58 @@ static inline const std::string &local_daemon_path() {
   return config_cache_.local_ep;
 }
 
+static inline uint32_t decision_cache_ttl() {
+  return config_cache_.decision_cache_ttl;
+}
+
+static inline uint32_t decision_cache_negative_ttl() {
+  return config_cache_.decision_cache_negative_ttl;
+}
+
+static inline uint32_t decision_cache_size() {
+  return config_cache_.decision_cache_size;
+}
+
+static inline uint32_t io_threads() {
+  return config_cache_.io_threads;
+}
+
+static inline uint32_t http_threads() {
+  return config_cache_.http_threads;
+}
+
+static inline uint32_t metadata_timeout() {
+  return config_cache_.metadata_timeout;
+}
+
+static inline bool metadata_keep_alive() {
+  return config_cache_.metadata_keep_alive;
+}
+
+static inline uint32_t metadata_max_connections() {
+  return config_cache_.metadata_max_connections;
+}
+
+static inline const std::string &metrics_endpoint() {
+  return config_cache_.metrics_endpoint;
+}
+
+static inline uint32_t trace_slow_ms() {
+  return config_cache_.trace_slow_ms;
+}
+
+static inline const std::string &trace_file() {
+  return config_cache_.trace_file;
+}
+
+static inline const std::string &state_dir() {
+  return config_cache_.state_dir;
+}
+
+static inline uint32_t journal_compact_records() {
+  return config_cache_.journal_compact_records;
+}
+
 void load_config(const char *path);
 
 
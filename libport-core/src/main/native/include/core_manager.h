@@ -44,6 +44,7 @@
 #include "cpprest/json.h"
 #include "utils.h"
 #include "port-syscall.h"
+#include "change_queue.h"
 
 
 namespace latte {
@@ -175,8 +176,10 @@ class CoreManager {
       config_root_ = std::move(new_root);
     }
 
+    /// queue a change for the next sync, waits while sync_q_ is full
     void notify_created(std::string&& type, std::string&& key, web::json::value v);
     void notify_deleted(std::string&& type, std::string&& key);
+    /// sends what changed since the last successful sync
     void sync() noexcept ;
 
     /// access key in the config root of json
@@ -186,16 +189,20 @@ class CoreManager {
     constexpr static const int SYNC_DURATION = 30; // second
 
   private:
-    /// trying to sync with the config root about principals, images, and objects
+    typedef ChangeQueue<web::json::value> SyncQueue;
 
-    void sync_principals();
-    void sync_images();
-    void sync_objects();
+    /// apply the changes of one type taken from sync_q_ to the config root,
+    // false if the sync has to be retried
+    bool sync_principals(const std::vector<SyncQueue::Change> &changes);
+    bool sync_images(const std::vector<SyncQueue::Change> &changes);
+    bool sync_objects(const std::vector<SyncQueue::Change> &changes);
     /// Only called for destruct
     inline void terminate() {
-      std::unique_lock<std::mutex> guard(*this->write_lock_);
-      terminate_ = true;
-      sync_cond_.notify_one();
+      {
+        std::unique_lock<std::mutex> guard(*this->write_lock_);
+        terminate_ = true;
+      }
+      sync_q_.close();
     }
 
 
@@ -212,9 +219,8 @@ class CoreManager {
     //std::unordered_map<uint64_t, std::shared_ptr<Principal>> principals_;
     std::map<uint32_t, Principal*> index_principals_;
     std::unique_ptr<std::mutex> write_lock_;
-    // the queue with on the fly syncing content
-    std::vector< std::tuple<std::string, std::string, bool, web::json::value> > sync_q_;
-    std::condition_variable sync_cond_;
+    // changes not synced yet, coalesced per key and bounded
+    SyncQueue sync_q_;
     std::unique_ptr<std::thread> sync_thread_;
     web::json::value config_root_; // root of json object that does sync
     std::unique_ptr<SyscallProxy> proxy_; // Only do this for testing.
@@ -0,0 +1,271 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Local cache for attestation decisions
+   Author: Yan Zhai
+
+*/
+
+#ifndef _LIBPORT_DECISION_CACHE_H
+#define _LIBPORT_DECISION_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+namespace latte {
+
+/// Caches the outcome of CHECK_* commands so repeated checks of the same
+// (speaker, endpoint, target, config) tuple do not go to the metadata service.
+// Positive and negative results carry their own TTL. Entries are spread over
+// a fixed number of shards, each with its own lock, so concurrent lookups of
+// different keys rarely contend.
+//
+// Invalidation scans the shards. It only happens when principals, ACLs or
+// endorsements change, which already costs metadata round trips.
+class DecisionCache {
+
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum Kind {
+      PROPERTY = 0,
+      ACCESS = 1,
+      WORKER_ACCESS = 2,
+      IMAGE_PROPERTY = 3,
+    };
+
+    struct Key {
+      Kind kind;
+      std::string speaker;
+      /// ip of the checked principal, or the image for IMAGE_PROPERTY
+      std::string subject;
+      uint32_t port;
+      /// object or property being checked
+      std::string target;
+      std::string config;
+
+      std::string str() const {
+        std::string s;
+        s.reserve(speaker.size() + subject.size() + target.size() +
+            config.size() + 16);
+        s.push_back(static_cast<char>('0' + kind));
+        s.push_back('\0');
+        s += speaker;
+        s.push_back('\0');
+        s += subject;
+        s.push_back('\0');
+        s += std::to_string(port);
+        s.push_back('\0');
+        s += target;
+        s.push_back('\0');
+        s += config;
+        return s;
+      }
+    };
+
+    constexpr static size_t NSHARD = 16;
+
+    DecisionCache(const DecisionCache&) = delete;
+    DecisionCache& operator =(const DecisionCache&) = delete;
+    DecisionCache(): DecisionCache(std::chrono::milliseconds(0),
+        std::chrono::milliseconds(0), 0) {}
+    DecisionCache(std::chrono::milliseconds positive_ttl,
+        std::chrono::milliseconds negative_ttl, size_t capacity):
+      positive_ttl_(positive_ttl), negative_ttl_(negative_ttl),
+      shard_capacity_(capacity / NSHARD + 1), generation_(0) {}
+
+    inline bool enabled() const {
+      return positive_ttl_.count() > 0 || negative_ttl_.count() > 0;
+    }
+
+    /// Snapshot taken before a check is sent out. A result computed against
+    // an older generation is not cached, since an invalidation happened while
+    // it was in flight.
+    inline uint64_t generation() const {
+      return generation_.load(std::memory_order_acquire);
+    }
+
+    inline bool lookup(const Key &key, bool *allowed) {
+      if (!enabled()) {
+        return false;
+      }
+      auto k = key.str();
+      auto &shard = shard_of(k);
+      std::lock_guard<std::mutex> guard(shard.lock);
+      auto found = shard.entries.find(k);
+      if (found == shard.entries.end()) {
+        shard.misses++;
+        return false;
+      }
+      if (found->second.expire <= Clock::now()) {
+        shard.entries.erase(found);
+        shard.misses++;
+        return false;
+      }
+      shard.hits++;
+      *allowed = found->second.allowed;
+      return true;
+    }
+
+    inline void insert(const Key &key, bool allowed, uint64_t gen) {
+      auto ttl = allowed ? positive_ttl_ : negative_ttl_;
+      if (ttl.count() <= 0) {
+        return;
+      }
+      auto k = key.str();
+      auto &shard = shard_of(k);
+      std::lock_guard<std::mutex> guard(shard.lock);
+      if (gen != generation()) {
+        return;
+      }
+      auto now = Clock::now();
+      if (shard.entries.size() >= shard_capacity_) {
+        evict(shard, now);
+      }
+      Entry &e = shard.entries[k];
+      e.allowed = allowed;
+      e.expire = now + ttl;
+      e.kind = key.kind;
+      e.subject = key.subject;
+      e.port = key.port;
+      e.target = key.target;
+    }
+
+    /// A principal owning [lo, hi) on ip was created or removed.
+    inline void invalidate_principal(const std::string &ip, uint32_t lo,
+        uint32_t hi) {
+      invalidate_if([&ip, lo, hi](const Entry &e) {
+          return e.kind != IMAGE_PROPERTY && e.subject == ip &&
+            e.port >= lo && e.port < hi;
+      });
+    }
+
+    /// Drop every entry checking the given principal, image or object.
+    inline void invalidate_id(const std::string &id) {
+      invalidate_if([&id](const Entry &e) {
+          return e.subject == id || e.target == id;
+      });
+    }
+
+    /// New endorsements can only grant, so they never turn a positive
+    // decision negative; only the denials need to go.
+    inline void invalidate_negative() {
+      invalidate_if([](const Entry &e) { return !e.allowed; });
+    }
+
+    inline void clear() {
+      invalidate_if([](const Entry &) { return true; });
+    }
+
+    inline uint64_t hits() const { return sum(&Shard::hits); }
+    inline uint64_t misses() const { return sum(&Shard::misses); }
+
+    inline size_t size() const {
+      size_t total = 0;
+      for (auto &shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        total += shard.entries.size();
+      }
+      return total;
+    }
+
+  private:
+
+    struct Entry {
+      bool allowed;
+      Kind kind;
+      Clock::time_point expire;
+      std::string subject;
+      uint32_t port;
+      std::string target;
+    };
+
+    struct Shard {
+      mutable std::mutex lock;
+      std::unordered_map<std::string, Entry> entries;
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+    };
+
+    inline Shard &shard_of(const std::string &k) {
+      return shards_[std::hash<std::string>()(k) % NSHARD];
+    }
+
+    /// Called with shard lock held. Expired entries go first, and if that
+    // does not free anything an arbitrary entry is dropped.
+    inline void evict(Shard &shard, Clock::time_point now) const {
+      for (auto i = shard.entries.begin(); i != shard.entries.end(); ) {
+        if (i->second.expire <= now) {
+          i = shard.entries.erase(i);
+        } else {
+          ++i;
+        }
+      }
+      if (shard.entries.size() >= shard_capacity_) {
+        shard.entries.erase(shard.entries.begin());
+      }
+    }
+
+    inline void invalidate_if(std::function<bool(const Entry&)> pred) {
+      generation_.fetch_add(1, std::memory_order_acq_rel);
+      for (auto &shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for (auto i = shard.entries.begin(); i != shard.entries.end(); ) {
+          if (pred(i->second)) {
+            i = shard.entries.erase(i);
+          } else {
+            ++i;
+          }
+        }
+      }
+    }
+
+    inline uint64_t sum(uint64_t Shard::*field) const {
+      uint64_t total = 0;
+      for (auto &shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        total += shard.*field;
+      }
+      return total;
+    }
+
+    std::chrono::milliseconds positive_ttl_;
+    std::chrono::milliseconds negative_ttl_;
+    size_t shard_capacity_;
+    std::atomic<uint64_t> generation_;
+    std::array<Shard, NSHARD> shards_;
+};
+
+}
+#endif
@@ -0,0 +1,101 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Group committed append-only file
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_GROUP_COMMIT_LOG_H
+#define _LIBPORT_GROUP_COMMIT_LOG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+namespace latte {
+
+/// Appends records to a file and makes them durable in groups. Records
+// queued while the previous group is being synced go out together in one
+// write and one fdatasync, so a burst of appends costs a few syncs instead
+// of one each. A committer thread does the I/O, appenders only queue.
+//
+// Records are written in the order they were appended, and each one is
+// acknowledged once its group is durable. After a failed write or sync the
+// log is done: every later record fails with the same errno.
+class GroupCommitLog {
+
+  public:
+    /// err is 0 once the record is durable, otherwise the errno of the
+    // failed write or sync. Runs on the committer thread.
+    typedef std::function<void(int err)> Done;
+
+    GroupCommitLog(const GroupCommitLog&) = delete;
+    GroupCommitLog& operator =(const GroupCommitLog&) = delete;
+    /// takes the ownership of fd
+    explicit GroupCommitLog(int fd);
+    /// commits what is queued, then closes the file
+    ~GroupCommitLog();
+
+    void append(std::string record, Done done);
+
+    /// returns once every record appended so far is acknowledged
+    void flush();
+
+    inline uint64_t groups() const {
+      return groups_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void run();
+
+    int fd_;
+    std::mutex lock_;
+    std::condition_variable queued_cv_;
+    std::condition_variable committed_cv_;
+    /// the group being formed, its records back to back
+    std::string queued_;
+    std::vector<Done> waiting_;
+    uint64_t appended_;
+    uint64_t committed_;
+    /// errno of the first failed write or sync
+    int failed_;
+    bool stop_;
+    std::atomic<uint64_t> groups_;
+    std::thread committer_;
+};
+
+}
+
+#endif
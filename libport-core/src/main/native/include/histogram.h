@@ -0,0 +1,162 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Latency histograms for per-endpoint statistics
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_HISTOGRAM_H
+#define _LIBPORT_HISTOGRAM_H
+
+#include <cstdint>
+#include <string>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <functional>
+#include <algorithm>
+
+namespace latte {
+
+/// Lock free latency histogram with power of two buckets in microseconds:
+// bucket i counts samples in [2^(i-1), 2^i) us, bucket 0 counts < 1us and
+// the last one everything above. Good enough for percentiles within a
+// factor of two, which is what sizing a link needs.
+class LatencyHistogram {
+
+  public:
+    constexpr static size_t NBUCKET = 32;
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator =(const LatencyHistogram&) = delete;
+    LatencyHistogram(): count_(0), sum_us_(0), max_us_(0) {
+      for (auto &b: buckets_) {
+        b.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    inline void record(std::chrono::microseconds latency) {
+      uint64_t us = latency.count() > 0 ? latency.count() : 0;
+      buckets_[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+      count_.fetch_add(1, std::memory_order_relaxed);
+      sum_us_.fetch_add(us, std::memory_order_relaxed);
+      uint64_t seen = max_us_.load(std::memory_order_relaxed);
+      while (us > seen &&
+          !max_us_.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {
+      }
+    }
+
+    inline uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    inline uint64_t sum_us() const { return sum_us_.load(std::memory_order_relaxed); }
+    inline uint64_t max_us() const { return max_us_.load(std::memory_order_relaxed); }
+
+    inline uint64_t bucket(size_t i) const {
+      return buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    /// upper bound of bucket i in microseconds
+    static inline uint64_t bucket_bound(size_t i) {
+      return i + 1 >= NBUCKET ? UINT64_MAX : (uint64_t(1) << i);
+    }
+
+    /// upper bound of the bucket holding the q-quantile, q in [0, 1]
+    inline uint64_t percentile_us(double q) const {
+      uint64_t total = count();
+      if (total == 0) {
+        return 0;
+      }
+      uint64_t rank = static_cast<uint64_t>(q * total);
+      uint64_t seen = 0;
+      for (size_t i = 0; i < NBUCKET; ++i) {
+        seen += bucket(i);
+        if (seen > rank) {
+          return std::min(bucket_bound(i), max_us());
+        }
+      }
+      return max_us();
+    }
+
+  private:
+    static inline size_t bucket_of(uint64_t us) {
+      size_t i = 0;
+      while (us > 0 && i + 1 < NBUCKET) {
+        us >>= 1;
+        ++i;
+      }
+      return i;
+    }
+
+    std::array<std::atomic<uint64_t>, NBUCKET> buckets_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_us_;
+    std::atomic<uint64_t> max_us_;
+};
+
+/// Named histograms, created on first use and never removed, so callers may
+// keep the returned pointer.
+class LatencyHistograms {
+
+  public:
+    LatencyHistograms(const LatencyHistograms&) = delete;
+    LatencyHistograms& operator =(const LatencyHistograms&) = delete;
+    LatencyHistograms() {}
+
+    inline std::shared_ptr<LatencyHistogram> get(const std::string &name) {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto &h = histograms_[name];
+      if (!h) {
+        h = std::make_shared<LatencyHistogram>();
+      }
+      return h;
+    }
+
+    inline void for_each(
+        const std::function<void(const std::string&, const LatencyHistogram&)> &fn) const {
+      std::map<std::string, std::shared_ptr<LatencyHistogram>> copy;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        copy = histograms_;
+      }
+      for (auto &kv: copy) {
+        fn(kv.first, *kv.second);
+      }
+    }
+
+  private:
+    mutable std::mutex lock_;
+    std::map<std::string, std::shared_ptr<LatencyHistogram>> histograms_;
+};
+
+}
+
+#endif
@@ -54,6 +54,16 @@ extern "C" {
 
 // log setting
 void liblatte_set_log_level(int upto);
+/// share the daemon socket between threads, responses are matched by id.
+// Call right after init, before any other thread uses the library.
+int liblatte_set_pipelined(int enable);
+/// CHECK_* calls go through shared memory with the guard instead of the
+// socket. Call right after init, as liblatte_set_pipelined. ENOTSUP if the
+// guard offers no shared memory, calls then stay on the socket.
+int liblatte_set_shm_ring(int enable);
+/// at most size daemon connections shared by the threads of this process,
+// a call waits up to wait_ms for one to be free.
+int liblatte_set_connection_pool(int size, int wait_ms);
 
 
 int liblatte_init(const char *myid, int run_as_iaas, const char *daemon_path);
@@ -63,6 +73,10 @@ int liblatte_create_principal_new(uint64_t uuid, const char *image, const char *
     int nport, const char *new_ip);
 int liblatte_create_principal(uint64_t uuid, const char *image, const char *config,
     int nport);
+/// Create n principals with one request, principal i gets nports[i] ports.
+// results[i] is 1 if created, 0 if refused, -1 on failure.
+int liblatte_create_principals(int n, const uint64_t *uuids, const char **images,
+    const char **configs, const int *nports, int *results);
 
 int liblatte_create_principal_with_allocated_ports(uint64_t uuid, const char *image,
     const char *config, const char * ip, int port_lo, int port_hi);
@@ -116,6 +130,11 @@ int liblatte_check_property(const char *ip, uint32_t port, const char *property)
 
 int liblatte_check_access(const char *ip, uint32_t port, const char *object);
 int liblatte_check_worker_access(const char *ip, uint32_t port, const char *object);
+/// Batched checks: results[i] is 1 if granted, 0 if denied, -1 on failure.
+int liblatte_check_property_batch(const char *ip, uint32_t port,
+    const char **properties, int n, int *results);
+int liblatte_check_access_batch(const char *ip, uint32_t port,
+    const char **objects, int n, int *results);
 int liblatte_check_image_property(const char *image, const char *config, const char *property);
 
 char* liblatte_check_attestation(const char *ip, uint32_t port, char **attestation,
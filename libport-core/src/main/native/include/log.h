@@ -34,13 +34,61 @@ Copyright 1992-2017 The FreeBSD Project. All rights reserved.
 #define _LIBPORT_LOG_H
 
 #include <syslog.h>
+#include <cstdint>
+#include <atomic>
 
 #define LOG_BUF_SIZE 8192
+
+/// Most verbose priority the LATTE_* macros compile in, anything beyond is
+// gone at compile time along with its arguments. Release builds drop
+// LOG_DEBUG unless the build sets it.
+#ifndef LATTE_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LATTE_LOG_MIN_LEVEL LOG_INFO
+#else
+#define LATTE_LOG_MIN_LEVEL LOG_DEBUG
+#endif
+#endif
+
+/// Arguments are only evaluated when the priority is compiled in and
+// enabled, so a disabled line costs one branch or nothing.
+#define LATTE_LOG_ENABLED(priority) \
+  ((priority) <= LATTE_LOG_MIN_LEVEL && ::latte::log_enabled(priority))
+#define LATTE_LOG(priority, ...) \
+  do { \
+    if (LATTE_LOG_ENABLED(priority)) { \
+      ::latte::log_at((priority), __VA_ARGS__); \
+    } \
+  } while (0)
+#define LATTE_DEBUG(...) LATTE_LOG(LOG_DEBUG, __VA_ARGS__)
+#define LATTE_INFO(...) LATTE_LOG(LOG_INFO, __VA_ARGS__)
+#define LATTE_WARN(...) LATTE_LOG(LOG_WARNING, __VA_ARGS__)
+#define LATTE_ERR(...) LATTE_LOG(LOG_ERR, __VA_ARGS__)
+
 namespace latte {
+  extern std::atomic<int> current_level;
+
+  static inline bool log_enabled(int priority) {
+    return priority <= current_level.load(std::memory_order_relaxed);
+  }
+
+  /// Lines below LOG_ERR beyond this many per second are dropped
+  constexpr uint32_t LOG_DEFAULT_RATE = 10000;
+
   bool is_debug();
   int loglevel();
+  /// syslog priorities up to upto are logged by the LATTE_* macros, log()
+  // is unfiltered and written at loglevel(), errors are always written
   void setloglevel(int upto);
+  /// 0 disables rate limiting
+  void setlograte(uint32_t lines_per_sec);
+  /// Lines are queued and written by a background thread, this waits for
+  // everything queued so far to be written
+  void flushlog();
   void log(const char* msg, ...);
+  /// no level check, use the LATTE_* macros
+  void log_at(int priority, const char *msg, ...)
+    __attribute__((format(printf, 2, 3)));
   void log_err(const char* msg, ...);
   void log_err_throw(const char *msg, ...);
 }
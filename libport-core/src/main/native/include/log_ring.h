@@ -0,0 +1,214 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Lock free ring of log lines drained by a background flusher
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_LOG_RING_H
+#define _LIBPORT_LOG_RING_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+namespace latte {
+
+/// Bounded queue of formatted log lines with many producers and one
+// consumer, after Vyukov's bounded MPMC queue. A producer claims a slot,
+// formats the line right into it and publishes it; when the ring is full
+// the line is dropped and counted rather than blocking the caller. Lines
+// longer than a slot spill to the heap.
+class LogRing {
+
+  public:
+    constexpr static size_t LINE_SZ = 512;
+
+    LogRing(const LogRing&) = delete;
+    LogRing& operator =(const LogRing&) = delete;
+    /// capacity is rounded up to a power of two
+    LogRing(size_t capacity): dropped_(0) {
+      size_t n = 1;
+      while (n < capacity) {
+        n <<= 1;
+      }
+      slots_.reset(new Slot[n]);
+      mask_ = n - 1;
+      reset();
+    }
+
+    /// format(char *buf, size_t size) writes the line like vsnprintf does
+    // and returns its full length; it is called again with a larger buffer
+    // if the line did not fit.
+    template<typename Format>
+    bool push(int priority, Format &&format) {
+      size_t pos = head_.load(std::memory_order_relaxed);
+      Slot *slot;
+      while (true) {
+        slot = &slots_[pos & mask_];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        } else {
+          pos = head_.load(std::memory_order_relaxed);
+        }
+      }
+      slot->priority = priority;
+      slot->len = format(slot->text, LINE_SZ);
+      if (slot->len >= LINE_SZ) {
+        slot->overflow.resize(slot->len + 1);
+        format(&slot->overflow[0], slot->len + 1);
+        slot->overflow.resize(slot->len);
+      }
+      slot->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    inline bool push_line(int priority, const char *line, size_t len) {
+      return push(priority, [line, len](char *buf, size_t size) {
+          memcpy(buf, line, std::min(len, size));
+          return len;
+      });
+    }
+
+    /// Consumer side: calls sink(priority, line, len) for every published
+    // line in order and returns how many there were. It stops at a slot
+    // still being formatted, that line goes out with the next drain.
+    template<typename Sink>
+    size_t drain(Sink &&sink) {
+      size_t n = 0;
+      while (true) {
+        Slot &slot = slots_[tail_ & mask_];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) {
+          return n;
+        }
+        if (slot.len < LINE_SZ) {
+          sink(slot.priority, slot.text, slot.len);
+        } else {
+          sink(slot.priority, slot.overflow.data(), slot.len);
+          std::string().swap(slot.overflow);
+        }
+        slot.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+        ++n;
+      }
+    }
+
+    /// lines dropped on a full ring since the last call
+    inline uint64_t take_dropped() {
+      return dropped_.exchange(0, std::memory_order_relaxed);
+    }
+
+    /// Empties the ring, only safe without producers or consumer running,
+    // as in the child right after a fork.
+    void reset() {
+      for (size_t i = 0; i <= mask_; ++i) {
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+        std::string().swap(slots_[i].overflow);
+      }
+      head_.store(0, std::memory_order_relaxed);
+      tail_ = 0;
+      dropped_.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    struct Slot {
+      std::atomic<size_t> seq;
+      int priority;
+      size_t len;
+      char text[LINE_SZ];
+      std::string overflow;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    /// producers and the consumer on separate cache lines
+    char pad0_[64];
+    std::atomic<size_t> head_;
+    char pad1_[64];
+    size_t tail_;
+    std::atomic<uint64_t> dropped_;
+};
+
+/// Admits at most limit lines per second, 0 admits everything. The window
+// restarts racily, which may let a few extra lines through at the edge.
+class LogRateLimiter {
+
+  public:
+    LogRateLimiter(uint32_t limit): limit_(limit), window_(0), count_(0),
+      suppressed_(0) {}
+
+    inline void set_limit(uint32_t limit) {
+      limit_.store(limit, std::memory_order_relaxed);
+    }
+
+    inline bool admit(uint64_t now_sec) {
+      uint32_t limit = limit_.load(std::memory_order_relaxed);
+      if (limit == 0) {
+        return true;
+      }
+      uint64_t window = window_.load(std::memory_order_relaxed);
+      if (window != now_sec &&
+          window_.compare_exchange_strong(window, now_sec,
+            std::memory_order_relaxed)) {
+        count_.store(0, std::memory_order_relaxed);
+      }
+      if (count_.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+      }
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    /// lines refused since the last call
+    inline uint64_t take_suppressed() {
+      return suppressed_.exchange(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint32_t> limit_;
+    std::atomic<uint64_t> window_;
+    std::atomic<uint32_t> count_;
+    std::atomic<uint64_t> suppressed_;
+};
+
+}
+
+#endif
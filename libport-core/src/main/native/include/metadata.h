@@ -37,24 +37,30 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include "cpprest/http_client.h"
 #include "pplx/pplx.h"
+#include "histogram.h"
 
 namespace latte {
 
 class MetadataServiceDebugger;
+class InflightLimiter;
 
 class MetadataServiceClient {
 
   protected:
     // Test use only
-    MetadataServiceClient() {}
+    MetadataServiceClient();
 
   public:
     MetadataServiceClient(const MetadataServiceClient&) = delete;
     MetadataServiceClient& operator =(const MetadataServiceClient&) = delete;
     MetadataServiceClient(const std::string &server_url, const std::string& myid);
-    virtual ~MetadataServiceClient() {}
+    virtual ~MetadataServiceClient();
+
+    /// request latency of each metadata service endpoint
+    const LatencyHistograms &latencies() const { return latencies_; }
 
 
     /// the byte array is just 
@@ -156,6 +162,70 @@ class MetadataServiceClient {
     virtual bool endorse(const std::string &speaker, const std::string &target,
         const std::string &p, const std::string &v);
 
+    //// Asynchronous variants. The blocking calls above simply wait on these.
+    // Arguments are copied into the continuations, so the caller does not need
+    // to keep them alive until the task completes.
+    virtual pplx::task<void> post_object_acl_async(const std::string &speaker,
+        const std::string& obj_id,
+        const std::string& requirements);
+
+    virtual pplx::task<void> endorse_image_async(const std::string &speaker,
+        const std::string& image_hash,
+        const std::string& endorsement, const std::string& config);
+
+    virtual pplx::task<void> endorse_attester_async(const std::string &speaker,
+        const std::string &image_id,
+        const std::string &config);
+
+    virtual pplx::task<void> endorse_builder_async(const std::string &speaker,
+        const std::string &image_id,
+        const std::string &config);
+
+    virtual pplx::task<void> endorse_membership_async(const std::string &speaker,
+        const std::string &ip, uint32_t port,
+        uint64_t gn, const std::string &endorse, const std::string &config);
+
+    virtual pplx::task<void> endorse_attester_on_source_async(
+        const std::string &speaker,
+        const std::string &source_id,
+        const std::string &config);
+
+    virtual pplx::task<void> endorse_builder_on_source_async(
+        const std::string &speaker,
+        const std::string &source_id,
+        const std::string &config);
+
+    virtual pplx::task<bool> has_property_async(const std::string &speaker,
+        const std::string& principal_ip, uint32_t port,
+        const std::string& property, const std::string& bearer_ref);
+    virtual pplx::task<bool> can_access_async(const std::string &speaker,
+        const std::string& principal_ip, uint32_t port,
+        const std::string& access_object, const std::string& bearer_ref);
+    virtual pplx::task<std::string> attest_async(const std::string &speaker,
+        const std::string &principal_ip, uint32_t port,
+        const std::string &bearer);
+    virtual pplx::task<bool> can_worker_access_async(const std::string &speaker,
+        const std::string &ip, uint32_t port,
+        const std::string &object, const std::string &bearer);
+    virtual pplx::task<bool> image_has_property_async(const std::string &speaker,
+        const std::string &image, const std::string &config,
+        const std::string &prop);
+
+    virtual pplx::task<bool> create_instance_async(const std::string &speaker,
+        const std::string &pid, const std::string &image, const std::string &ip,
+        uint32_t lo, uint32_t hi, const std::string &image_store,
+        const std::unordered_map<std::string, std::string> &configs);
+    virtual pplx::task<bool> delete_instance_async(const std::string &speaker,
+        const std::string &pid);
+    virtual pplx::task<bool> free_call_async(const std::string &speaker,
+        const std::string &cmd, const std::vector<std::string> &otherargs);
+    virtual pplx::task<bool> guard_call_async(const std::string &speaker,
+        const std::string &cmd, const std::vector<std::string> &otherargs);
+    virtual pplx::task<bool> link_image_async(const std::string &speaker,
+        const std::string &host, const std::string &image);
+    virtual pplx::task<bool> endorse_async(const std::string &speaker,
+        const std::string &target, const std::string &p, const std::string &v);
+
 
   private:
     pplx::task<web::http::http_response> post_statement(
@@ -166,6 +236,10 @@ class MetadataServiceClient {
 
     std::unique_ptr<web::http::client::http_client> client_;
     std::string myid_;
+    /// bounds requests in flight, hence connections opened to the service
+    std::unique_ptr<InflightLimiter> limiter_;
+    bool keep_alive_ = true;
+    LatencyHistograms latencies_;
 
     /// just for test purpose
     friend class MetadataServiceDebugger;
@@ -0,0 +1,257 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Metrics of the attestation guard in the Prometheus text format
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_METRICS_H
+#define _LIBPORT_METRICS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <utility>
+#include "histogram.h"
+
+namespace latte {
+
+class MetricCounter {
+  public:
+    MetricCounter(): v_(0) {}
+    inline void inc(uint64_t n = 1) { v_.fetch_add(n, std::memory_order_relaxed); }
+    inline uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+  private:
+    std::atomic<uint64_t> v_;
+};
+
+class MetricGauge {
+  public:
+    MetricGauge(): v_(0) {}
+    inline void inc() { v_.fetch_add(1, std::memory_order_relaxed); }
+    inline void dec() { v_.fetch_sub(1, std::memory_order_relaxed); }
+    inline void set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+    inline int64_t value() const { return v_.load(std::memory_order_relaxed); }
+  private:
+    std::atomic<int64_t> v_;
+};
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+/// Formats samples in the Prometheus text exposition format. Samples of a
+// metric must be written one after the other, its TYPE line goes before
+// the first of them. Latencies are exported in seconds.
+class MetricsWriter {
+
+  public:
+    inline void counter(const std::string &name, const MetricLabels &labels,
+        uint64_t v) {
+      family(name, "counter");
+      sample(name, labels, nullptr, std::to_string(v));
+    }
+
+    inline void gauge(const std::string &name, const MetricLabels &labels,
+        double v) {
+      family(name, "gauge");
+      sample(name, labels, nullptr, number(v));
+    }
+
+    inline void histogram(const std::string &name, const MetricLabels &labels,
+        const LatencyHistogram &h) {
+      family(name, "histogram");
+      uint64_t seen = 0;
+      for (size_t i = 0; i + 1 < LatencyHistogram::NBUCKET; ++i) {
+        seen += h.bucket(i);
+        std::pair<std::string, std::string> le("le",
+            number(LatencyHistogram::bucket_bound(i) / 1e6));
+        sample(name + "_bucket", labels, &le, std::to_string(seen));
+      }
+      std::pair<std::string, std::string> inf("le", "+Inf");
+      sample(name + "_bucket", labels, &inf, std::to_string(h.count()));
+      sample(name + "_sum", labels, nullptr, number(h.sum_us() / 1e6));
+      sample(name + "_count", labels, nullptr, std::to_string(h.count()));
+    }
+
+    inline const std::string &str() const { return out_; }
+
+  private:
+    inline void family(const std::string &name, const char *type) {
+      if (name == last_) {
+        return;
+      }
+      last_ = name;
+      out_ += "# TYPE " + name + " " + type + "\n";
+    }
+
+    inline void sample(const std::string &name, const MetricLabels &labels,
+        const std::pair<std::string, std::string> *extra,
+        const std::string &value) {
+      out_ += name;
+      if (!labels.empty() || extra) {
+        out_ += "{";
+        bool first = true;
+        for (auto &l: labels) {
+          label(l, &first);
+        }
+        if (extra) {
+          label(*extra, &first);
+        }
+        out_ += "}";
+      }
+      out_ += " " + value + "\n";
+    }
+
+    inline void label(const std::pair<std::string, std::string> &l, bool *first) {
+      if (!*first) {
+        out_ += ",";
+      }
+      *first = false;
+      out_ += l.first + "=\"";
+      for (char c: l.second) {
+        switch (c) {
+          case '\\': out_ += "\\\\"; break;
+          case '"': out_ += "\\\""; break;
+          case '\n': out_ += "\\n"; break;
+          default: out_ += c;
+        }
+      }
+      out_ += "\"";
+    }
+
+    static inline std::string number(double v) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%.9g", v);
+      return buf;
+    }
+
+    std::string out_;
+    std::string last_;
+};
+
+/// Metrics of the process. Counters, gauges and histograms are created on
+// first use and never removed, so callers keep the returned pointer and
+// update it without locking. Values owned elsewhere are read at scrape
+// time by collectors, which their owner must remove before going away.
+class MetricsRegistry {
+
+  public:
+    typedef std::function<void(MetricsWriter&)> Collector;
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator =(const MetricsRegistry&) = delete;
+    MetricsRegistry(): next_collector_(0) {}
+
+    inline std::shared_ptr<MetricCounter> counter(const std::string &name,
+        const MetricLabels &labels = MetricLabels()) {
+      return get(counters_, name, labels);
+    }
+
+    inline std::shared_ptr<MetricGauge> gauge(const std::string &name,
+        const MetricLabels &labels = MetricLabels()) {
+      return get(gauges_, name, labels);
+    }
+
+    inline std::shared_ptr<LatencyHistogram> histogram(const std::string &name,
+        const MetricLabels &labels = MetricLabels()) {
+      return get(histograms_, name, labels);
+    }
+
+    inline uint64_t add_collector(Collector collector) {
+      std::lock_guard<std::mutex> guard(lock_);
+      collectors_[++next_collector_] = std::move(collector);
+      return next_collector_;
+    }
+
+    /// once it returns the collector is not running and won't run again
+    inline void remove_collector(uint64_t id) {
+      std::lock_guard<std::mutex> guard(lock_);
+      collectors_.erase(id);
+    }
+
+    std::string render() const {
+      MetricsWriter out;
+      std::lock_guard<std::mutex> guard(lock_);
+      for (auto &f: counters_) {
+        for (auto &m: f.second) {
+          out.counter(f.first, m.first, m.second->value());
+        }
+      }
+      for (auto &f: gauges_) {
+        for (auto &m: f.second) {
+          out.gauge(f.first, m.first, m.second->value());
+        }
+      }
+      for (auto &f: histograms_) {
+        for (auto &m: f.second) {
+          out.histogram(f.first, m.first, *m.second);
+        }
+      }
+      for (auto &c: collectors_) {
+        c.second(out);
+      }
+      return out.str();
+    }
+
+  private:
+    template<typename T>
+    using Families = std::map<std::string,
+          std::map<MetricLabels, std::shared_ptr<T>>>;
+
+    template<typename T>
+    inline std::shared_ptr<T> get(Families<T> &families, const std::string &name,
+        const MetricLabels &labels) {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto &m = families[name][labels];
+      if (!m) {
+        m = std::make_shared<T>();
+      }
+      return m;
+    }
+
+    mutable std::mutex lock_;
+    Families<MetricCounter> counters_;
+    Families<MetricGauge> gauges_;
+    Families<LatencyHistogram> histograms_;
+    std::map<uint64_t, Collector> collectors_;
+    uint64_t next_collector_;
+};
+
+/// the registry of the process, never destroyed
+MetricsRegistry &metrics();
+
+}
+
+#endif
@@ -0,0 +1,50 @@
+
+#ifndef _LIBPORT_METRICS_SERVER_H
+#define _LIBPORT_METRICS_SERVER_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
+#include <memory>
+#include <string>
+#include "metrics.h"
+
+namespace latte {
+
+/// Answers every HTTP request on its endpoint with the metrics of the
+// registry, enough for a Prometheus scrape or curl. The endpoint is a unix
+// socket path when it has a '/', otherwise [host:]port on TCP, host
+// defaulting to the loopback.
+class MetricsServer: public std::enable_shared_from_this<MetricsServer> {
+
+  public:
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator =(const MetricsServer&) = delete;
+
+    static std::shared_ptr<MetricsServer> create(
+        boost::asio::io_service &service, const std::string &endpoint,
+        MetricsRegistry &registry) {
+      return std::shared_ptr<MetricsServer>(
+          new MetricsServer(service, endpoint, registry));
+    }
+
+    void start();
+    void stop();
+
+  private:
+    typedef boost::asio::generic::stream_protocol::socket Socket;
+
+    MetricsServer(boost::asio::io_service &service, const std::string &endpoint,
+        MetricsRegistry &registry);
+
+    void start_accept();
+    void serve(std::shared_ptr<Socket> socket);
+
+    boost::asio::io_service &service_;
+    boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol>
+      listener_;
+    MetricsRegistry &registry_;
+};
+
+}
+
+#endif
@@ -36,42 +36,61 @@
 #include <cstdint>
 #include <utility>
 #include <map>
+#include <set>
 #include <sstream>
 #include <algorithm>
 
 namespace latte {
 
+/// Free segments are kept twice: by address for merging on deallocation,
+// and by (size, address) so a fitting segment is found in O(log n) no
+// matter how fragmented the space is.
 class PortManager {
 
   public:
     typedef std::pair<uint32_t, uint32_t> PortPair;
 
+    /// Which free segment allocate(cnt) carves from
+    enum Policy {
+      /// smallest segment that fits, lowest address among equals. Keeps
+      // large segments intact.
+      BEST_FIT = 0,
+      /// largest segment, leaves the biggest remainders
+      WORST_FIT = 1,
+      /// lowest address that fits, the legacy behaviour. Linear in the
+      // number of free segments.
+      FIRST_FIT = 2,
+    };
+
     constexpr static uint32_t BadPort = (uint32_t) -1;
     constexpr static std::pair<uint32_t, uint32_t> Bad = std::make_pair(0, 0);
 
     PortManager(const PortManager&) = delete;
     PortManager& operator =(const PortManager&) = delete;
     PortManager(): PortManager(1, 65535) {}
-    PortManager(uint32_t low, uint32_t high): low_(low), high_(high) {
-      free_map_[low] = high;
+    PortManager(uint32_t low, uint32_t high, Policy policy = BEST_FIT):
+      low_(low), high_(high), policy_(policy) {
+      insert_free(low, high);
     }
     inline uint32_t low() const { return low_; }
     inline uint32_t high() const { return high_; }
+    inline Policy policy() const { return policy_; }
+    inline void set_policy(Policy policy) { policy_ = policy; }
 
     /// Return [l,r) pair
     inline PortPair allocate(uint32_t cnt) {
-      constexpr PortPair Bad;
-      PortPair index = find_fit(cnt);
-      if (index == Bad) {
+      auto fit = find_fit(cnt);
+      if (fit == free_map_.end()) {
         throw_full();
       }
+      PortPair index = *fit;
       uint32_t available = index.second - index.first;
       uint32_t remain = available - cnt;
       if (remain >= 1) {
         /// Set in-place would usually avoid reallocating internal node
-        free_map_[index.first] = index.first + remain;
+        shrink_free(fit, index.first + remain);
       } else {
-        free_map_.erase(index.first);
+        erase_free(fit);
       }
       allocated_[index.first + remain] = index.second;
       return std::make_pair(index.first + remain, index.second);
@@ -85,17 +104,18 @@ class PortManager {
       if (is_allocated(lo, hi)) {
         throw_bad_range(lo, hi);
       }
-      PortPair p = find_fit(lo, hi);
+      auto fit = find_fit(lo, hi);
+      PortPair p = *fit;
 
       // adjust left boundary
       if (p.first < lo) {
-        free_map_[p.first] = lo;
+        shrink_free(fit, lo);
       } else {
-        free_map_.erase(p.first);
+        erase_free(fit);
       }
       // adjust right boundary
       if (p.second > hi) {
-        free_map_[hi] = p.second;
+        insert_free(hi, p.second);
       }
       // allocate the range
       allocated_[lo] = hi;
@@ -109,30 +129,24 @@ class PortManager {
       if (allocate_index == allocated_.end()) {
         throw_bad_port(p);
       }
-      auto free_index = free_map_.upper_bound(p);
-      auto value = free_index->first;
+      uint32_t lo = allocate_index->first;
+      uint32_t hi = allocate_index->second;
+      allocated_.erase(allocate_index);
       /// merge right
-      if (free_index != free_map_.end()) {
-        auto right_index = free_index;
-        if (right_index->first == allocate_index->second) {
-          allocate_index->second = right_index->second;
-          free_map_.erase(right_index);
-          /// internal structure changed, we may need to reset it!
-          free_index = free_map_.find(value);
-        }
+      auto free_index = free_map_.lower_bound(lo);
+      if (free_index != free_map_.end() && free_index->first == hi) {
+        hi = free_index->second;
+        free_index = erase_free(free_index);
       }
+      /// merge left in place
       if (free_index != free_map_.begin()) {
         auto left_index = std::prev(free_index);
-        if (left_index->second == allocate_index->first) {
-          // merge in place
-          left_index->second = allocate_index->second;
-        } else {
-          free_map_[allocate_index->first] = allocate_index->second;
+        if (left_index->second == lo) {
+          shrink_free(left_index, hi);
+          return;
         }
-      } else {
-        free_map_[allocate_index->first] = allocate_index->second;
       }
-      allocated_.erase(allocate_index);
+      insert_free(lo, hi);
     }
 
     inline bool is_allocated(uint32_t p) const {
@@ -205,20 +219,52 @@ class PortManager {
       throw std::runtime_error(err_msg.str());
     }
 
-    PortPair find_fit(uint32_t cnt) const {
-      constexpr PortPair Bad;
-      for (auto i = free_map_.cbegin(); i != free_map_.cend(); ++i) {
-        if (cnt <= i->second - i->first) {
-          return *i;
+    typedef std::map<uint32_t, uint32_t>::iterator FreeIter;
+
+    /// Every change to free_map_ goes through these to keep by_size_ in sync
+    inline void insert_free(uint32_t lo, uint32_t hi) {
+      free_map_[lo] = hi;
+      by_size_.emplace(hi - lo, lo);
+    }
+
+    inline FreeIter erase_free(FreeIter i) {
+      by_size_.erase(PortPair(i->second - i->first, i->first));
+      return free_map_.erase(i);
+    }
+
+    /// move the right edge of a free segment, its left edge stays
+    inline void shrink_free(FreeIter i, uint32_t hi) {
+      by_size_.erase(PortPair(i->second - i->first, i->first));
+      i->second = hi;
+      by_size_.emplace(hi - i->first, i->first);
+    }
+
+    FreeIter find_fit(uint32_t cnt) {
+      switch (policy_) {
+        case BEST_FIT: {
+          auto i = by_size_.lower_bound(PortPair(cnt, 0));
+          return i == by_size_.end() ? free_map_.end() : free_map_.find(i->second);
+        }
+        case WORST_FIT: {
+          if (by_size_.empty() || by_size_.rbegin()->first < cnt) {
+            return free_map_.end();
+          }
+          return free_map_.find(by_size_.rbegin()->second);
         }
+        case FIRST_FIT:
+        default:
+          for (auto i = free_map_.begin(); i != free_map_.end(); ++i) {
+            if (cnt <= i->second - i->first) {
+              return i;
+            }
+          }
+          return free_map_.end();
       }
-      return Bad;
     }
 
     /// This method is only called after !is_allocated(lo, hi) check, so
     // it is guaranteed to find a segment that fully contains [lo, hi)
-    PortPair find_fit(uint32_t lo, uint32_t hi) const {
-      constexpr PortPair Bad;
+    FreeIter find_fit(uint32_t lo, uint32_t hi) {
       auto p = free_map_.upper_bound(lo);
       /// p won't be first item because there must be a segment with left
       // edge smaller than lo
@@ -230,14 +276,17 @@ class PortManager {
       if (p->second < hi) {
         throw_bug("consistency broken: target segment must include given range");
       }
-      return *p;
+      return p;
     }
 
     /// The port range that is managed by this manager
     uint32_t low_;
     uint32_t high_;
+    Policy policy_;
     /// stores [l, r) intervals
     std::map<uint32_t, uint32_t> free_map_;
+    /// (r - l, l) of every free segment
+    std::set<PortPair> by_size_;
     std::map<uint32_t, uint32_t> allocated_;
 };
 
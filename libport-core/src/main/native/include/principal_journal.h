@@ -0,0 +1,115 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Journal and snapshots of the principals registered by the guard
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_PRINCIPAL_JOURNAL_H
+#define _LIBPORT_PRINCIPAL_JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "pplx/pplxtasks.h"
+#include "principal_registry.h"
+#include "group_commit_log.h"
+
+namespace latte {
+
+/// Keeps the principals of the guard across restarts. Creations and
+// deletions are appended to a journal, and from time to time the whole
+// registry is written as a snapshot and the journals it covers are dropped.
+// Recovery loads the snapshot and replays the journals written after it.
+//
+// Journals are numbered by epoch: rotating starts the next one, so the
+// snapshot of the state at the rotation covers every earlier epoch and is
+// written while appends go on. Records are length prefixed and checksummed;
+// replay of a journal stops at the first bad record, which after a crash is
+// one that was being written.
+//
+// Snapshots are PrincipalSnapshot files, which are mapped and read in place
+// instead of being parsed record by record.
+//
+// Records are group committed, a change is acknowledged once its record
+// is synced. Snapshots are synced before the journals they cover go away.
+//
+// Appends and rotations must be serialized by the caller, in the same
+// order as the changes to the registry they record.
+class PrincipalJournal {
+
+  public:
+    typedef PrincipalRegistry::PrincipalPtr PrincipalPtr;
+
+    PrincipalJournal(const PrincipalJournal&) = delete;
+    PrincipalJournal& operator =(const PrincipalJournal&) = delete;
+
+    /// null if dir is not a directory
+    static std::unique_ptr<PrincipalJournal> open(const std::string &dir);
+    ~PrincipalJournal();
+
+    /// Loads the saved state into registry and starts a new journal.
+    // Returns the generation number to continue from.
+    uint64_t recover(PrincipalRegistry &registry);
+
+    /// done once the record is durable
+    pplx::task<void> created(const proto::Principal &p);
+    pplx::task<void> deleted(uint64_t id);
+
+    /// records not covered by a snapshot yet
+    inline size_t pending() const { return pending_; }
+
+    /// Starts the next journal, returns the epoch of the previous one.
+    uint64_t rotate();
+
+    /// Saves state, which must be the registry as of the rotation to epoch
+    // + 1, and drops the journals up to epoch. gn is the next generation
+    // number at that point. Does not need the serialization of appends.
+    void snapshot(const std::vector<PrincipalPtr> &state, uint64_t gn,
+        uint64_t epoch);
+
+  private:
+    PrincipalJournal(const std::string &dir, int dirfd);
+
+    void open_journal();
+    pplx::task<void> append(std::string record);
+    std::vector<uint64_t> journals() const;
+
+    std::string dir_;
+    int dirfd_;
+    std::unique_ptr<GroupCommitLog> log_;
+    uint64_t epoch_;
+    size_t pending_;
+};
+
+}
+
+#endif
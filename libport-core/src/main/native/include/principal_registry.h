@@ -0,0 +1,435 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Registry of principals created through this guard
+   Author: Yan Zhai
+
+*/
+
+#ifndef _LIBPORT_PRINCIPAL_REGISTRY_H
+#define _LIBPORT_PRINCIPAL_REGISTRY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <functional>
+#include <unordered_map>
+#include "proto/statement.pb.h"
+
+namespace latte {
+
+/// Principals created through this guard, indexed by id and by the
+// [port_lo, port_hi) range they were given on their ip.
+//
+// Every id keeps all generations it was created with, and the latest one is
+// tracked directly so it never has to be searched for. Both indexes are split
+// in shards. A shard publishes an immutable table that readers pick up with
+// an atomic load, so lookups take no lock. Writers serialize on the shard
+// mutex, copy what they change and publish the copy.
+//
+// Every principal of a guard shares the host's ip, so the ranges of one ip
+// are split in buckets of 2^BUCKET_BITS ports, each an immutable map ordered
+// by port_lo. A range is indexed in every bucket it overlaps, so the owner of
+// a port is found in its bucket alone, in O(log n) as
+// PortManager::is_allocated does. A write copies the buckets the range
+// overlaps and the array of bucket pointers, not every range of the ip.
+class PrincipalRegistry {
+
+  public:
+    typedef std::shared_ptr<const proto::Principal> PrincipalPtr;
+
+    constexpr static size_t NSHARD = 64;
+    constexpr static uint32_t BUCKET_BITS = 10;
+    /// ports past the last bucket all go to it
+    constexpr static size_t NBUCKET = 65536 >> BUCKET_BITS;
+
+    PrincipalRegistry(const PrincipalRegistry&) = delete;
+    PrincipalRegistry& operator =(const PrincipalRegistry&) = delete;
+    PrincipalRegistry() {
+      for (auto &shard: ids_) {
+        shard.table = std::make_shared<const IdTable>();
+      }
+      for (auto &shard: endpoints_) {
+        shard.table = std::make_shared<const EndpointTable>();
+      }
+    }
+
+    /// Adds a generation of p->id(). It becomes the latest one unless a
+    // newer generation is already registered.
+    inline void insert(PrincipalPtr p) {
+      {
+        auto &shard = ids_[id_shard(p->id())];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto table = std::make_shared<IdTable>(*std::atomic_load(&shard.table));
+        add_generation(*table, p);
+        std::atomic_store(&shard.table,
+            std::shared_ptr<const IdTable>(std::move(table)));
+      }
+      auto &ip = p->auth().ip();
+      auto &shard = endpoints_[endpoint_shard(ip)];
+      std::lock_guard<std::mutex> guard(shard.lock);
+      auto current = std::atomic_load(&shard.table);
+      auto found = current->find(ip);
+      BucketsWriter buckets(found != current->end() ? found->second : nullptr);
+      if (!index(buckets, p)) {
+        return;
+      }
+      auto table = std::make_shared<EndpointTable>(*current);
+      (*table)[ip] = buckets.publish();
+      std::atomic_store(&shard.table,
+          std::shared_ptr<const EndpointTable>(std::move(table)));
+    }
+
+    /// Same as inserting each of ps in order, but every shard and every
+    // bucket is copied once, so loading a whole state stays linear.
+    inline void insert_all(const std::vector<PrincipalPtr> &ps) {
+      std::array<std::vector<const PrincipalPtr*>, NSHARD> by_id;
+      std::array<std::vector<const PrincipalPtr*>, NSHARD> by_ip;
+      for (auto &p: ps) {
+        by_id[id_shard(p->id())].push_back(&p);
+        by_ip[endpoint_shard(p->auth().ip())].push_back(&p);
+      }
+      for (size_t i = 0; i < NSHARD; ++i) {
+        if (by_id[i].empty()) {
+          continue;
+        }
+        auto &shard = ids_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto table = std::make_shared<IdTable>(*std::atomic_load(&shard.table));
+        table->reserve(table->size() + by_id[i].size());
+        for (auto p: by_id[i]) {
+          add_generation(*table, *p);
+        }
+        std::atomic_store(&shard.table,
+            std::shared_ptr<const IdTable>(std::move(table)));
+      }
+      for (size_t i = 0; i < NSHARD; ++i) {
+        if (by_ip[i].empty()) {
+          continue;
+        }
+        auto &shard = endpoints_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto current = std::atomic_load(&shard.table);
+        std::unordered_map<std::string, BucketsWriter> copies;
+        for (auto p: by_ip[i]) {
+          auto &ip = (*p)->auth().ip();
+          auto copy = copies.find(ip);
+          if (copy == copies.end()) {
+            auto found = current->find(ip);
+            copy = copies.emplace(ip, BucketsWriter(found != current->end() ?
+                  found->second : nullptr)).first;
+          }
+          index(copy->second, *p);
+        }
+        auto table = std::make_shared<EndpointTable>(*current);
+        for (auto &copy: copies) {
+          (*table)[copy.first] = copy.second.publish();
+        }
+        std::atomic_store(&shard.table,
+            std::shared_ptr<const EndpointTable>(std::move(table)));
+      }
+    }
+
+    /// Latest generation of id, or null.
+    inline PrincipalPtr latest(uint64_t id) const {
+      auto table = std::atomic_load(&ids_[id_shard(id)].table);
+      auto found = table->find(id);
+      if (found == table->end()) {
+        return nullptr;
+      }
+      return found->second->latest;
+    }
+
+    /// Principal most recently registered at (ip, port_lo), or null.
+    inline PrincipalPtr at(const std::string &ip, uint32_t port_lo) const {
+      auto ranges = ranges_of(ip, port_lo);
+      if (!ranges) {
+        return nullptr;
+      }
+      auto found = ranges->find(port_lo);
+      if (found == ranges->end()) {
+        return nullptr;
+      }
+      return found->second;
+    }
+
+    /// Principal whose [port_lo, port_hi) on ip contains port, or null.
+    inline PrincipalPtr owner(const std::string &ip, uint32_t port) const {
+      auto ranges = ranges_of(ip, port);
+      if (!ranges || ranges->size() == 0) {
+        return nullptr;
+      }
+      // order: port < index->first
+      auto index = ranges->upper_bound(port);
+      if (index == ranges->cbegin()) {
+        return nullptr;
+      }
+      --index;
+      if (port >= index->second->auth().port_hi()) {
+        return nullptr;
+      }
+      return index->second;
+    }
+
+    /// Drops every generation of id, unless allow() rejects the latest one.
+    // Returns the latest generation, or null if id was not registered;
+    // *removed tells whether anything was dropped.
+    inline PrincipalPtr remove(uint64_t id,
+        const std::function<bool(const proto::Principal&)> &allow,
+        bool *removed) {
+      *removed = false;
+      std::shared_ptr<const Entry> entry;
+      {
+        auto &shard = ids_[id_shard(id)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto current = std::atomic_load(&shard.table);
+        auto found = current->find(id);
+        if (found == current->end()) {
+          return nullptr;
+        }
+        entry = found->second;
+        if (!allow(*entry->latest)) {
+          return entry->latest;
+        }
+        auto table = std::make_shared<IdTable>(*current);
+        table->erase(id);
+        std::atomic_store(&shard.table,
+            std::shared_ptr<const IdTable>(std::move(table)));
+      }
+      *removed = true;
+      for (auto &p: entry->generations) {
+        unindex(*p);
+      }
+      return entry->latest;
+    }
+
+    /// Every registered generation, as of the call. Generations of an id
+    // come in the order they were inserted.
+    inline std::vector<PrincipalPtr> all() const {
+      std::vector<PrincipalPtr> result;
+      for (auto &shard: ids_) {
+        auto table = std::atomic_load(&shard.table);
+        for (auto &entry: *table) {
+          result.insert(result.end(), entry.second->generations.begin(),
+              entry.second->generations.end());
+        }
+      }
+      return result;
+    }
+
+    /// Number of registered ids.
+    inline size_t size() const {
+      size_t total = 0;
+      for (auto &shard: ids_) {
+        total += std::atomic_load(&shard.table)->size();
+      }
+      return total;
+    }
+
+  private:
+
+    struct Entry {
+      PrincipalPtr latest;
+      std::vector<PrincipalPtr> generations;
+    };
+
+    typedef std::unordered_map<uint64_t, std::shared_ptr<const Entry>> IdTable;
+    /// port_lo -> principal, for the ranges overlapping a bucket of one ip
+    typedef std::map<uint32_t, PrincipalPtr> Ranges;
+    /// empty buckets are null
+    typedef std::array<std::shared_ptr<const Ranges>, NBUCKET> Buckets;
+    typedef std::unordered_map<std::string, std::shared_ptr<const Buckets>>
+      EndpointTable;
+
+    /// A writer's view of the buckets of one ip, a bucket is copied the
+    // first time it changes.
+    class BucketsWriter {
+      public:
+        explicit BucketsWriter(std::shared_ptr<const Buckets> base):
+          base_(std::move(base)) {}
+
+        inline const Ranges *get(size_t b) const {
+          if (copies_[b]) {
+            return copies_[b].get();
+          }
+          return base_ ? (*base_)[b].get() : nullptr;
+        }
+
+        inline Ranges &mutate(size_t b) {
+          auto &copy = copies_[b];
+          if (!copy) {
+            auto ranges = get(b);
+            copy = ranges ? std::make_shared<Ranges>(*ranges) :
+              std::make_shared<Ranges>();
+          }
+          return *copy;
+        }
+
+        /// the new buckets, null once they are all empty
+        inline std::shared_ptr<const Buckets> publish() const {
+          auto buckets = base_ ? std::make_shared<Buckets>(*base_) :
+            std::make_shared<Buckets>();
+          bool empty = true;
+          for (size_t b = 0; b < NBUCKET; ++b) {
+            if (copies_[b]) {
+              (*buckets)[b] = copies_[b]->empty() ? nullptr : copies_[b];
+            }
+            empty = empty && !(*buckets)[b];
+          }
+          if (empty) {
+            return nullptr;
+          }
+          return buckets;
+        }
+
+      private:
+        std::shared_ptr<const Buckets> base_;
+        std::array<std::shared_ptr<Ranges>, NBUCKET> copies_;
+    };
+
+    template <typename Table>
+    struct Shard {
+      std::mutex lock;
+      std::shared_ptr<const Table> table;
+    };
+
+    static inline size_t id_shard(uint64_t id) {
+      return std::hash<uint64_t>()(id) % NSHARD;
+    }
+
+    static inline size_t endpoint_shard(const std::string &ip) {
+      return std::hash<std::string>()(ip) % NSHARD;
+    }
+
+    static inline void add_generation(IdTable &table, const PrincipalPtr &p) {
+      auto &slot = table[p->id()];
+      auto entry = slot ? std::make_shared<Entry>(*slot) :
+        std::make_shared<Entry>();
+      if (!entry->latest || entry->latest->gn() <= p->gn()) {
+        entry->latest = p;
+      }
+      entry->generations.push_back(p);
+      slot = std::move(entry);
+    }
+
+    static inline size_t bucket_of(uint32_t port) {
+      return std::min<size_t>(port >> BUCKET_BITS, NBUCKET - 1);
+    }
+
+    /// buckets [*first, *last] overlap the range of p
+    static inline void bucket_span(const proto::Principal &p, size_t *first,
+        size_t *last) {
+      auto lo = p.auth().port_lo();
+      auto hi = p.auth().port_hi();
+      *first = bucket_of(lo);
+      *last = hi > lo ? bucket_of(hi - 1) : *first;
+    }
+
+    /// Indexes the range of p, false if it is stale: an older generation
+    // does not take the range back from a newer one.
+    static inline bool index(BucketsWriter &buckets, const PrincipalPtr &p) {
+      auto lo = p->auth().port_lo();
+      auto ranges = buckets.get(bucket_of(lo));
+      if (ranges) {
+        auto owner = ranges->find(lo);
+        if (owner != ranges->end() && owner->second->id() == p->id() &&
+            owner->second->gn() > p->gn()) {
+          return false;
+        }
+      }
+      size_t first, last;
+      bucket_span(*p, &first, &last);
+      for (size_t b = first; b <= last; ++b) {
+        buckets.mutate(b)[lo] = p;
+      }
+      return true;
+    }
+
+    inline std::shared_ptr<const Ranges> ranges_of(const std::string &ip,
+        uint32_t port) const {
+      auto table = std::atomic_load(&endpoints_[endpoint_shard(ip)].table);
+      auto found = table->find(ip);
+      if (found == table->end()) {
+        return nullptr;
+      }
+      return (*found->second)[bucket_of(port)];
+    }
+
+    /// Port ranges are handed out exclusively by the port manager, so a
+    // range only ever belongs to one id at a time.
+    inline void unindex(const proto::Principal &p) {
+      auto &ip = p.auth().ip();
+      auto &shard = endpoints_[endpoint_shard(ip)];
+      std::lock_guard<std::mutex> guard(shard.lock);
+      auto current = std::atomic_load(&shard.table);
+      auto found = current->find(ip);
+      if (found == current->end()) {
+        return;
+      }
+      auto lo = p.auth().port_lo();
+      BucketsWriter buckets(found->second);
+      size_t first, last;
+      bucket_span(p, &first, &last);
+      bool changed = false;
+      for (size_t b = first; b <= last; ++b) {
+        auto ranges = buckets.get(b);
+        if (!ranges) {
+          continue;
+        }
+        auto owner = ranges->find(lo);
+        if (owner != ranges->end() && owner->second->id() == p.id()) {
+          buckets.mutate(b).erase(lo);
+          changed = true;
+        }
+      }
+      if (!changed) {
+        return;
+      }
+      auto table = std::make_shared<EndpointTable>(*current);
+      auto published = buckets.publish();
+      if (published) {
+        (*table)[ip] = std::move(published);
+      } else {
+        table->erase(ip);
+      }
+      std::atomic_store(&shard.table,
+          std::shared_ptr<const EndpointTable>(std::move(table)));
+    }
+
+    std::array<Shard<IdTable>, NSHARD> ids_;
+    std::array<Shard<EndpointTable>, NSHARD> endpoints_;
+};
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Principal snapshots read in place from a mapping
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_PRINCIPAL_SNAPSHOT_H
+#define _LIBPORT_PRINCIPAL_SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "principal_registry.h"
+
+namespace latte {
+
+/// A snapshot of principals laid out to be used where it is mapped.
+//
+// The file is a header, the records sorted by id and generation, the config
+// pairs the records point into, and a string table. Records and pairs have a
+// fixed size and refer to strings by offset and size, so a principal is found
+// with a binary search over the mapping and nothing has to be parsed. Equal
+// strings, like the ip every principal of a host has, are stored once.
+//
+// The body is checksummed as a whole and every reference is bounds checked
+// when the file is opened, the accessors trust the mapping after that.
+// Fields are in host byte order, a snapshot written on a host of the other
+// order fails the magic check.
+class PrincipalSnapshot {
+
+  public:
+    typedef PrincipalRegistry::PrincipalPtr PrincipalPtr;
+
+    struct StringRef {
+      uint32_t offset;
+      uint32_t size;
+    };
+
+    struct Pair {
+      StringRef key;
+      StringRef value;
+    };
+
+    enum Flags: uint32_t {
+      HAS_AUTH = 1,
+      HAS_CODE = 2,
+      WILDCARD = 4,
+    };
+
+    struct Record {
+      uint64_t id;
+      uint64_t gn;
+      uint64_t speaker;
+      uint64_t misc;
+      uint32_t port_lo;
+      uint32_t port_hi;
+      StringRef ip;
+      StringRef safe_id;
+      StringRef image;
+      StringRef image_store;
+      /// config pairs are [pairs, pairs + npair) of the pair array
+      uint32_t pairs;
+      uint32_t npair;
+      uint32_t flags;
+      uint32_t reserved;
+    };
+
+    struct Header {
+      uint32_t magic;
+      /// of everything after the header
+      uint32_t checksum;
+      /// last journal epoch covered
+      uint64_t epoch;
+      /// next generation number
+      uint64_t gn;
+      uint64_t nrecord;
+      uint64_t npair;
+      /// size of the string table
+      uint64_t strings;
+    };
+
+    static_assert(sizeof(Header) % 8 == 0 && sizeof(Record) % 8 == 0 &&
+        sizeof(Pair) % 8 == 0, "snapshot sections must stay 8 byte aligned");
+
+    PrincipalSnapshot(const PrincipalSnapshot&) = delete;
+    PrincipalSnapshot& operator =(const PrincipalSnapshot&) = delete;
+
+    /// The file content for state, with gn and epoch as
+    // PrincipalJournal::snapshot takes them.
+    static std::string build(const std::vector<PrincipalPtr> &state,
+        uint64_t gn, uint64_t epoch);
+
+    /// Maps name in dirfd. Null if there is no such file, throws if it is
+    // not a whole snapshot.
+    static std::unique_ptr<PrincipalSnapshot> open(int dirfd,
+        const std::string &name);
+    ~PrincipalSnapshot();
+
+    inline uint64_t epoch() const { return header_->epoch; }
+    inline uint64_t gn() const { return header_->gn; }
+    inline size_t size() const { return header_->nrecord; }
+    inline const Record& operator [](size_t i) const { return records_[i]; }
+
+    /// the latest generation of id in the snapshot, null if there is none
+    const Record* find(uint64_t id) const;
+
+    inline std::string str(const StringRef &s) const {
+      return std::string(strings_ + s.offset, s.size);
+    }
+    inline const Pair* pairs(const Record &r) const {
+      return pairs_ + r.pairs;
+    }
+
+    /// a copy of r that outlives the snapshot
+    PrincipalPtr principal(const Record &r) const;
+
+  private:
+    PrincipalSnapshot(void *base, size_t size);
+
+    /// false unless size bytes at base are a whole snapshot and every
+    // reference in it points into its section
+    static bool valid(const char *base, size_t size);
+
+    void *base_;
+    size_t size_;
+    const Header *header_;
+    const Record *records_;
+    const Pair *pairs_;
+    const char *strings_;
+};
+
+}
+
+#endif
@@ -7,32 +7,53 @@
 #include <boost/asio.hpp>
 #include "utils.h"
 #include "manager.h"
-#include <pplx/threadpool.h>
+#include "metrics.h"
+#include <thread>
+#include <vector>
 
 namespace latte {
 class Session;
+class MetricsServer;
 
 /// Just an implementation.
+//
+/// The server owns its io_service and runs it on nthreads threads, each
+// session serializes its own handlers on a strand. Metadata service
+// requests run on the cpprest pool, sized separately.
 class Server {
   public:
     GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Server);
-    Server(std::string ep):
+    Server(std::string ep, size_t nthreads):
       ep_(std::move(ep)),
-      executor_(crossplat::threadpool::shared_instance()),
-      service_(executor_.service()),
-      listener_{service_, boost::asio::local::stream_protocol::endpoint(ep_)} {
+      nthreads_(nthreads > 0 ? nthreads : default_threads()),
+      listener_{service_, boost::asio::local::stream_protocol::endpoint(ep_)},
+      sessions_(metrics().counter("attguard_sessions_total")) {
       }
 
+    /// serve metrics on endpoint too, see MetricsServer
+    void serve_metrics(const std::string &endpoint);
+
+    /// run the io_service on all threads, returns when it is stopped
     void start();
+    void stop();
   private:
     void new_session(std::shared_ptr<Session> session,
         const boost::system::error_code &ec);
     void start_accept();
+
+    static size_t default_threads() {
+      size_t n = std::thread::hardware_concurrency();
+      return n > 0 ? n : 1;
+    }
+
     std::string ep_;
-    crossplat::threadpool &executor_;
-    boost::asio::io_service &service_;
+    size_t nthreads_;
+    boost::asio::io_service service_;
     boost::asio::local::stream_protocol::acceptor listener_;
+    std::vector<std::thread> workers_;
     std::shared_ptr<LatteDispatcher> manager_;
+    std::shared_ptr<MetricsServer> metrics_;
+    std::shared_ptr<MetricCounter> sessions_;
 };
 
 
@@ -5,12 +5,18 @@
 #include <boost/asio/io_service.hpp>
 #include <boost/asio.hpp>
 #include <memory>
+#include <deque>
 #include "proto/statement.pb.h"
 #include "config.h"
 #include "log.h"
 #include "utils.h"
 #include "comm.h"
 #include "manager.h"
+#include "arena_pool.h"
+#include "metrics.h"
+#include "trace.h"
+#include "shm_ring.h"
+#include "proto/utils.h"
 
 using namespace boost::asio;
 using google::protobuf::io::CodedInputStream;
@@ -28,20 +34,28 @@ class Session: public std::enable_shared_from_this<Session> {
     }
 
     ~Session() {
-      log("session %u destoryed", sid_);
+      LATTE_DEBUG("session %llu destroyed", (unsigned long long)sid_);
+      if (authenticated_) {
+        active_->dec();
+      }
     }
 
     void start() {
       if (!authenticate()) {
         s_.close();
       } else {
-        proto_start();
+        authenticated_ = true;
+        active_->inc();
+        strand_.post(std::bind(&Session::proto_start, shared_from_this()));
       }
 
     }
 
     void stop() {
       s_.close();
+      if (ring_wakeup_) {
+        ring_wakeup_->close();
+      }
     }
     Session(io_service &service, std::shared_ptr<LatteDispatcher> dispatcher);
 
@@ -52,32 +66,80 @@ class Session: public std::enable_shared_from_this<Session> {
     bool authenticate();
     void proto_start();
     void header_received(const boost::system::error_code &ec, size_t len);
-    void command_received(const boost::system::error_code &ec, size_t len, uint8_t *data);
-    void write_response(std::shared_ptr<proto::Response> resp);
+    void command_received(const boost::system::error_code &ec, size_t len);
+    /// false if the command is malformed, rcv_at_us is when it arrived
+    bool dispatch_command(const uint8_t *data, size_t len, bool v2, bool ring,
+        int64_t rcv_at_us);
+    /// a response on its way out, with the trace of its command if traced
+    struct Outgoing {
+      std::shared_ptr<proto::Response> resp;
+      std::shared_ptr<RequestTrace> trace;
+      int64_t ready_us;
+      int64_t sending_us;
+      /// its command came through the shared memory ring
+      bool ring;
+      /// answers OPEN_RING, the fds of ring_ go along
+      bool pass_ring;
+    };
+
+    std::shared_ptr<RequestTrace> begin_trace(const proto::Command &cmd,
+        int64_t rcv_at_us);
+    void write_response(std::shared_ptr<proto::Response> resp,
+        std::shared_ptr<RequestTrace> trace, bool ring);
+    void enqueue_response(Outgoing out);
+    void send_next();
+    bool send_to_ring(uint32_t size);
+    void send_with_ring(size_t size);
     void response_sent(const boost::system::error_code &ec, size_t len);
 
-    void clear_large_rcv_buffer() {
-        decltype(large_rcv_buf_)().swap(large_rcv_buf_);
-    }
-
-    void clear_large_snd_buffer() {
-        decltype(large_snd_buf_)().swap(large_snd_buf_);
-    }
-
+    /// Shared memory transport. Commands are taken from the ring while the
+    // pipeline has room, and the session sleeps on the command eventfd only
+    // once the ring is empty.
+    void open_ring(int64_t id, bool v2);
+    void ring_start();
+    void ring_notified(const boost::system::error_code &ec);
 
+    io_service &service_;
+    /// handlers of a session run one at a time even with many io threads
+    io_service::strand strand_;
     local::stream_protocol::socket s_;
     //// IDs of this session
     uint64_t sid_;
     uint64_t pid_;
     uint64_t uid_;
     uint64_t gid_;
-    /// buffer for the small object, need larger buffer for big
-    //request.
-    std::array<uint8_t, RECV_BUFSZ> rcv_buf_;
-    std::vector<uint8_t> large_rcv_buf_;
-    std::array<uint8_t, SEND_BUFSZ> snd_buf_;
-    std::vector<uint8_t> large_snd_buf_;
+    /// Frames are read and written in place: headers have their own
+    // buffers, payloads go to buffers reused by every frame, and a response
+    // goes out as header plus payload in one gathered write.
+    std::array<uint8_t, COMM_HEADER_SZ> rcv_hdr_;
+    /// magic of the frame being read, it tells the format to answer in
+    uint32_t rcv_magic_;
+    /// when its header arrived, for tracing socket commands
+    int64_t rcv_at_us_;
+    FrameBuffer rcv_buf_;
+    std::array<uint8_t, COMM_HEADER_SZ> snd_hdr_;
+    FrameBuffer snd_buf_;
+    /// each command is parsed into its own arena, recycled once the
+    // command and everything holding it are gone
+    std::shared_ptr<ArenaPool> arenas_;
     std::shared_ptr<LatteDispatcher> dispatcher_;
+    /// Commands are pipelined: the session keeps reading while earlier ones
+    // are being handled, and responses go out in completion order, matched
+    // to their command by id. Only touched on the strand.
+    std::deque<Outgoing> outq_;
+    bool writing_;
+    bool reading_;
+    size_t inflight_;
+    /// sessions past authentication are counted as active
+    bool authenticated_;
+    std::shared_ptr<MetricGauge> active_;
+    std::unique_ptr<ShmChannel> ring_;
+    /// the command eventfd of ring_, waited on through the io service
+    std::unique_ptr<posix::stream_descriptor> ring_wakeup_;
+    uint64_t ring_count_;
+    /// commands are copied out of the ring, the client can still write there
+    std::array<uint8_t, ShmRing::MAX_PAYLOAD> ring_buf_;
+    bool ring_reading_;
 };
 }
 
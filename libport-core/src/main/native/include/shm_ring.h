@@ -0,0 +1,216 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Shared memory channel between liblatte and the guard
+   Author: Yan Zhai
+
+*/
+
+#ifndef _LIBPORT_SHM_RING_H
+#define _LIBPORT_SHM_RING_H
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+namespace latte {
+
+/// One direction of a ShmChannel: a ring of fixed size slots with a single
+// producer and a single consumer, which may be in different processes.
+//
+// The producer fills the slot at head and publishes it by moving head, the
+// consumer reads the slot at tail and frees it by moving tail. Each index is
+// written by one side only and sits on its own cache line, so a message
+// costs a few cache line transfers and no syscall. A consumer that found
+// the ring empty says it goes to sleep before blocking on its eventfd, and
+// a producer only writes that eventfd when it publishes to a sleeping
+// consumer.
+//
+// The guard reads rings a client can scribble on. Indexes and sizes coming
+// from the other side are checked, and peek fails on anything impossible.
+class ShmRing {
+
+  public:
+    constexpr static uint32_t NSLOT = 256;
+    constexpr static uint32_t SLOT_SZ = 512;
+    constexpr static uint32_t MAX_PAYLOAD = SLOT_SZ - 2 * sizeof(uint32_t);
+
+    enum SlotFlags: uint32_t {
+      /// the response was too large for a slot and goes over the socket, the
+      // payload is the id of its command
+      ON_SOCKET = 1,
+    };
+
+    struct Slot {
+      uint32_t size;
+      uint32_t flags;
+      uint8_t payload[MAX_PAYLOAD];
+    };
+
+    struct Layout {
+      alignas(64) std::atomic<uint32_t> head;
+      alignas(64) std::atomic<uint32_t> tail;
+      alignas(64) std::atomic<uint32_t> sleeping;
+      alignas(64) Slot slots[NSLOT];
+    };
+
+    explicit ShmRing(Layout *layout): l_(layout) {}
+
+    inline bool empty() const {
+      return l_->head.load(std::memory_order_acquire) ==
+        l_->tail.load(std::memory_order_relaxed);
+    }
+
+    /// producer: no slot free, the consumer is that far behind
+    inline bool full() const {
+      return l_->head.load(std::memory_order_relaxed) -
+        l_->tail.load(std::memory_order_acquire) >= NSLOT;
+    }
+
+    /// producer: where the next message is written, MAX_PAYLOAD at most
+    inline uint8_t *next() {
+      return slot(l_->head.load(std::memory_order_relaxed)).payload;
+    }
+
+    /// Producer: publishes the message written at next(). True if the
+    // consumer sleeps and has to be woken up.
+    inline bool publish(uint32_t size, uint32_t flags = 0) {
+      auto head = l_->head.load(std::memory_order_relaxed);
+      Slot &s = slot(head);
+      s.size = size;
+      s.flags = flags;
+      l_->head.store(head + 1, std::memory_order_release);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return l_->sleeping.load(std::memory_order_relaxed) != 0;
+    }
+
+    /// Consumer: the oldest message, 0 if there is none and -1 if the ring
+    // is corrupted. It stays in its slot until pop.
+    inline int peek(const uint8_t **payload, uint32_t *size,
+        uint32_t *flags) const {
+      auto tail = l_->tail.load(std::memory_order_relaxed);
+      auto head = l_->head.load(std::memory_order_acquire);
+      if (head == tail) {
+        return 0;
+      }
+      if (head - tail > NSLOT) {
+        return -1;
+      }
+      const Slot &s = slot(tail);
+      *size = s.size;
+      *flags = s.flags;
+      if (*size > MAX_PAYLOAD) {
+        return -1;
+      }
+      *payload = s.payload;
+      return 1;
+    }
+
+    inline void pop() {
+      l_->tail.store(l_->tail.load(std::memory_order_relaxed) + 1,
+          std::memory_order_release);
+    }
+
+    /// Consumer: about to block on the eventfd. False if a message came in
+    // meanwhile, it must not block then.
+    inline bool sleep() {
+      l_->sleeping.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (l_->head.load(std::memory_order_relaxed) !=
+          l_->tail.load(std::memory_order_relaxed)) {
+        l_->sleeping.store(0, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+
+    inline void wake() {
+      l_->sleeping.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    inline Slot &slot(uint32_t index) const {
+      return l_->slots[index % NSLOT];
+    }
+
+    Layout *l_;
+};
+
+/// Shared memory set up by the guard for one session: a ring of commands
+// from the client, a ring of responses back, and an eventfd to wake up the
+// consumer of each. The guard creates it and passes the memfd and the
+// eventfds over the session socket, which stays open: peer credentials are
+// still checked there once, and either side closing it ends the channel.
+//
+// The memfd is sealed at its size, a client can not shrink it under the
+// guard.
+class ShmChannel {
+
+  public:
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator =(const ShmChannel&) = delete;
+
+    /// the guard's end, null if the system does not support it
+    static std::unique_ptr<ShmChannel> create();
+    /// The client's end, from the fds the guard passed, which it takes
+    // over. Null if they are not a channel.
+    static std::unique_ptr<ShmChannel> attach(int memfd, int command_fd,
+        int response_fd);
+    ~ShmChannel();
+
+    inline ShmRing &commands() { return commands_; }
+    inline ShmRing &responses() { return responses_; }
+
+    /// memfd, command eventfd and response eventfd, in the order attach
+    // takes them
+    constexpr static size_t NFD = 3;
+    inline const int *fds() const { return fds_; }
+    inline int command_fd() const { return fds_[1]; }
+    inline int response_fd() const { return fds_[2]; }
+
+    /// wakes up the consumer sleeping on efd
+    static void notify(int efd);
+
+    /// Blocks until efd is notified, or sock is closed by the other side.
+    // 0, or the error that ended the wait.
+    static int await(int efd, int sock);
+
+  private:
+    struct Layout;
+
+    ShmChannel(Layout *layout, const int *fds);
+
+    Layout *layout_;
+    int fds_[NFD];
+    ShmRing commands_;
+    ShmRing responses_;
+};
+
+}
+
+#endif
@@ -13,7 +13,16 @@ class StoreManager {
     virtual bool add(const google::protobuf::Message &msg) = 0;
     virtual bool remove(const google::protobuf::Message &msg) = 0;
     virtual std::vector<std::shared_ptr<google::protobuf::Message>> load() = 0;
+    virtual ~StoreManager() {}
 };
 
+/// Messages kept in an append-only log, in /var/lib/attguard unless dir is
+// given. prototype tells the type of the stored messages to load, it must
+// outlive the store.
+std::unique_ptr<StoreManager> open_file_store(
+    const google::protobuf::Message &prototype);
+std::unique_ptr<StoreManager> open_file_store(
+    const google::protobuf::Message &prototype, const std::string &dir);
+
 
 #endif
@@ -0,0 +1,171 @@
+/*
+   The FreeBSD Copyright
+
+   Copyright 1992-2017 The FreeBSD Project. All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.  Redistributions in binary
+   form must reproduce the above copyright notice, this list of conditions and
+   the following disclaimer in the documentation and/or other materials
+   provided with the distribution.  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND
+   CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+   NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are
+   those of the authors and should not be interpreted as representing official
+   policies, either expressed or implied, of the FreeBSD Project.
+
+   Request tracing and the dump of slow requests
+   Author: Yan Zhai
+
+*/
+
+
+#ifndef _LIBPORT_TRACE_H
+#define _LIBPORT_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <memory>
+
+namespace latte {
+
+/// Trace stamps are microseconds on the monotonic clock, which all
+// processes of a host share, so stamps taken by liblatte line up with the
+// guard's.
+static inline int64_t trace_us(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      t.time_since_epoch()).count();
+}
+
+static inline int64_t trace_now_us() {
+  return trace_us(std::chrono::steady_clock::now());
+}
+
+struct TraceSpan {
+  std::string name;
+  int64_t start_us;
+  int64_t end_us;
+};
+
+/// Stages of one command, from liblatte sending it to the guard writing its
+// response. Stages are recorded by whichever thread ran them.
+class RequestTrace {
+
+  public:
+    RequestTrace(const RequestTrace&) = delete;
+    RequestTrace& operator =(const RequestTrace&) = delete;
+    RequestTrace(uint64_t trace_id, std::string name, int64_t start_us):
+      trace_id_(trace_id), name_(std::move(name)), start_us_(start_us) {}
+
+    inline void span(std::string name, int64_t start_us, int64_t end_us) {
+      std::lock_guard<std::mutex> guard(lock_);
+      spans_.push_back(TraceSpan{std::move(name), start_us, end_us});
+    }
+
+    inline uint64_t trace_id() const { return trace_id_; }
+    inline const std::string &name() const { return name_; }
+    inline int64_t start_us() const { return start_us_; }
+
+    inline std::vector<TraceSpan> spans() const {
+      std::lock_guard<std::mutex> guard(lock_);
+      return spans_;
+    }
+
+    /// the trace of the command this thread is handling, if it is traced
+    static inline std::shared_ptr<RequestTrace> current() {
+      return current_ref();
+    }
+
+  private:
+    friend class TraceScope;
+
+    static inline std::shared_ptr<RequestTrace> &current_ref() {
+      static thread_local std::shared_ptr<RequestTrace> trace;
+      return trace;
+    }
+
+    const uint64_t trace_id_;
+    const std::string name_;
+    const int64_t start_us_;
+    mutable std::mutex lock_;
+    std::vector<TraceSpan> spans_;
+};
+
+/// Makes a trace current while the handler of its command runs on this
+// thread. Work continued on other threads must carry the trace itself.
+class TraceScope {
+
+  public:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator =(const TraceScope&) = delete;
+    explicit TraceScope(std::shared_ptr<RequestTrace> trace):
+      saved_(std::move(RequestTrace::current_ref())) {
+      RequestTrace::current_ref() = std::move(trace);
+    }
+
+    ~TraceScope() {
+      RequestTrace::current_ref() = std::move(saved_);
+    }
+
+  private:
+    std::shared_ptr<RequestTrace> saved_;
+};
+
+/// Requests slower than a threshold are appended to a file as Chrome trace
+// events, which chrome://tracing and Perfetto load as they are: the array
+// is opened once and never closed. Each request gets its own row, the
+// command spanning it and its stages nested below.
+class SlowTraceLog {
+
+  public:
+    SlowTraceLog(const SlowTraceLog&) = delete;
+    SlowTraceLog& operator =(const SlowTraceLog&) = delete;
+    /// a threshold of 0 disables tracing
+    SlowTraceLog(const std::string &path, uint32_t threshold_ms);
+    ~SlowTraceLog();
+
+    inline bool enabled() const { return file_ != nullptr; }
+
+    /// a new trace, or nothing when tracing is disabled
+    inline std::shared_ptr<RequestTrace> begin(uint64_t trace_id,
+        std::string name, int64_t start_us) const {
+      if (!enabled()) {
+        return nullptr;
+      }
+      return std::make_shared<RequestTrace>(trace_id, std::move(name), start_us);
+    }
+
+    /// dumps the trace if it took longer than the threshold
+    void finish(const RequestTrace &trace, int64_t end_us);
+
+    static std::string format(const RequestTrace &trace, int64_t end_us,
+        int pid);
+
+  private:
+    std::mutex lock_;
+    FILE *file_;
+    int64_t threshold_us_;
+};
+
+/// the slow request log of the guard, set up from the configuration
+SlowTraceLog &slow_traces();
+
+}
+
+#endif
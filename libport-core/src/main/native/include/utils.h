@@ -107,6 +107,16 @@ int reliable_recv(int fd, char *buffer, int size) ;
 static inline int reliable_recv(int fd, unsigned char *buffer, int size) {
   return reliable_recv(fd, (char*) buffer, size);
 }
+/// for files, 0 or the errno of the failure
+int reliable_write(int fd, const char *buffer, size_t size);
+/// Sends size bytes of buffer with fds attached, without waiting on a non
+// blocking socket. Returns the bytes sent or -1 with errno set, the fds go
+// with the first byte.
+ssize_t send_with_fds(int sock, const void *buffer, size_t size,
+    const int *fds, size_t nfd);
+/// Receives size bytes as reliable_recv does. The fds sent along, at most
+// *nfd of them, are stored in fds and *nfd is set to how many came.
+int recv_with_fds(int sock, void *buffer, size_t size, int *fds, size_t *nfd);
 
 
 /// A dynamic buffer that can be used and ensured to deleted
@@ -22,11 +22,13 @@ template<> struct statement_traits<TYPE> { \
 
 
 DECL_STMT_TRAITS(Command::CREATE_PRINCIPAL, Principal, Status);
+DECL_STMT_TRAITS(Command::CREATE_PRINCIPALS, PrincipalList, StatusList);
 DECL_STMT_TRAITS(Command::DELETE_PRINCIPAL, Principal, Status);
 DECL_STMT_TRAITS(Command::GET_PRINCIPAL, Principal, Principal);
 DECL_STMT_TRAITS(Command::GET_LOCAL_PRINCIPAL, Principal, Principal);
 DECL_STMT_TRAITS(Command::ENDORSE_PRINCIPAL, EndorsePrincipal, Status);
 DECL_STMT_TRAITS(Command::GET_METADATA_CONFIG, Empty, MetadataConfig);
+DECL_STMT_TRAITS(Command::OPEN_RING, Empty, Status);
 /// Revoke is exact reverse of endorse, so just reuse it
 DECL_STMT_TRAITS(Command::REVOKE_PRINCIPAL_ENDORSEMENT, EndorsePrincipal, Status);
 DECL_STMT_TRAITS(Command::ENDORSE, Endorse, Status);
@@ -48,6 +50,40 @@ DECL_STMT_TRAITS(Command::FREE_CALL, FreeCall, Status);
 DECL_STMT_TRAITS(Command::GUARD_CALL, GuardCall, Status);
 DECL_STMT_TRAITS(Command::LINK_IMAGE, LinkImage, Status);
 
+/// Field of the v2 oneof carrying each message type, in Command::body and
+// Response::payload respectively.
+template<typename T> struct body_traits;
+template<typename T> struct payload_traits;
+
+#define DECL_ONEOF_TRAITS(TRAITS, MSG, MSG_T, FIELD) \
+template<> struct TRAITS<MSG_T> { \
+  static inline bool has(const MSG &m) { return m.has_##FIELD(); } \
+  static inline const MSG_T &get(const MSG &m) { return m.FIELD(); } \
+  static inline MSG_T *mutable_get(MSG *m) { return m->mutable_##FIELD(); } \
+};
+
+DECL_ONEOF_TRAITS(body_traits, Command, Principal, principal);
+DECL_ONEOF_TRAITS(body_traits, Command, CheckAccess, check_access);
+DECL_ONEOF_TRAITS(body_traits, Command, CheckProperty, check_property);
+DECL_ONEOF_TRAITS(body_traits, Command, CheckImage, check_image);
+DECL_ONEOF_TRAITS(body_traits, Command, CheckAttestation, check_attestation);
+DECL_ONEOF_TRAITS(body_traits, Command, PrincipalList, principal_list);
+DECL_ONEOF_TRAITS(body_traits, Command, EndorsePrincipal, endorse_principal);
+DECL_ONEOF_TRAITS(body_traits, Command, Endorse, endorse);
+DECL_ONEOF_TRAITS(body_traits, Command, PostACL, post_acl);
+DECL_ONEOF_TRAITS(body_traits, Command, FreeCall, free_call);
+DECL_ONEOF_TRAITS(body_traits, Command, GuardCall, guard_call);
+DECL_ONEOF_TRAITS(body_traits, Command, LinkImage, link_image);
+DECL_ONEOF_TRAITS(body_traits, Command, Empty, empty);
+
+DECL_ONEOF_TRAITS(payload_traits, Response, Status, status);
+DECL_ONEOF_TRAITS(payload_traits, Response, StatusList, status_list);
+DECL_ONEOF_TRAITS(payload_traits, Response, Principal, principal);
+DECL_ONEOF_TRAITS(payload_traits, Response, Attestation, attestation);
+DECL_ONEOF_TRAITS(payload_traits, Response, MetadataConfig, metadata);
+
+#undef DECL_ONEOF_TRAITS
+
 
 /* Over complicated
 template<typename V, typename V::Type value>
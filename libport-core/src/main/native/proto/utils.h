@@ -35,20 +35,72 @@
 #define _LIBPORT_PROTO_UTILS_H
 
 
+#include <memory>
 #include "proto/statement.pb.h"
+#include "proto/traits.h"
 
 namespace latte {
 namespace proto{
 
+/// Messages answering a command are created on the command's arena when
+// it was parsed into one. The returned pointer then shares ownership with
+// the command, so the arena outlives every message built on it. Without an
+// arena, or an owner, the message is on the heap.
+template<typename T>
+static inline std::shared_ptr<T> make_owned(const std::shared_ptr<Command> &owner) {
+  auto arena = owner ? owner->GetArena() : nullptr;
+  T *msg = google::protobuf::Arena::CreateMessage<T>(arena);
+  if (arena) {
+    return std::shared_ptr<T>(owner, msg);
+  }
+  return std::shared_ptr<T>(msg);
+}
+
+/// Responses are built in the v2 format, the session downgrades them for
+// peers that only read v1.
+template<typename T>
+static inline void fill_response(Response *resp, Response::Type type,
+    const T &result) {
+  resp->set_type(type);
+  payload_traits<T>::mutable_get(resp)->CopyFrom(result);
+}
+
+/// Moves the statement held by the only oneof of msg into an Any.
+static inline void pack_oneof(google::protobuf::Message *msg,
+    google::protobuf::Any *any) {
+  auto reflection = msg->GetReflection();
+  auto oneof = msg->GetDescriptor()->oneof_decl(0);
+  auto field = reflection->GetOneofFieldDescriptor(*msg, oneof);
+  any->PackFrom(reflection->GetMessage(*msg, field));
+  reflection->ClearOneof(msg, oneof);
+}
+
+/// Turn a v2 message into the v1 format for peers without PROTO_MAGIC_V2.
+// Messages already in the v1 format are left alone.
+static inline void downgrade(Command *cmd) {
+  if (cmd->body_case() != Command::BODY_NOT_SET) {
+    pack_oneof(cmd, cmd->mutable_statement());
+  }
+}
+
+static inline void downgrade(Response *resp) {
+  if (resp->payload_case() != Response::PAYLOAD_NOT_SET) {
+    pack_oneof(resp, resp->mutable_result());
+  }
+}
+
+static inline void fill_status_response(Response *resp, bool success,
+    const std::string &msg) {
+  Status status;
+  status.set_success(success);
+  status.set_info(msg);
+  fill_response(resp, Response::STATUS, status);
+}
+
 static inline Response* make_status_response(bool success,
     const std::string &msg) {
     Response* resp = Response::default_instance().New();
-    resp->set_type(Response::STATUS);
-    Status status;
-    status.set_success(success);
-    status.set_info(msg);
-    auto result = resp->mutable_result();
-    result->PackFrom(status);
+    fill_status_response(resp, success, msg);
     return resp;
 }
 
@@ -57,11 +109,34 @@ static inline std::shared_ptr<Response> make_shared_status_response(
   return std::shared_ptr<Response>(make_status_response(success, msg));
 }
 
+static inline std::shared_ptr<Response> make_shared_status_response(
+    const std::shared_ptr<Command> &owner, bool success, const std::string &msg) {
+  auto resp = make_owned<Response>(owner);
+  fill_status_response(resp.get(), success, msg);
+  return resp;
+}
+
+static inline Response* make_status_list_response(const StatusList &l) {
+    Response* resp = Response::default_instance().New();
+    fill_response(resp, Response::STATUS_LIST, l);
+    return resp;
+}
+
+static inline std::shared_ptr<Response> make_shared_status_list_response(
+    const StatusList &l) {
+  return std::shared_ptr<Response>(make_status_list_response(l));
+}
+
+static inline std::shared_ptr<Response> make_shared_status_list_response(
+    const std::shared_ptr<Command> &owner, const StatusList &l) {
+  auto resp = make_owned<Response>(owner);
+  fill_response(resp.get(), Response::STATUS_LIST, l);
+  return resp;
+}
+
 static inline Response* make_principal_response(const Principal &p) {
     Response* resp = Response::default_instance().New();
-    resp->set_type(Response::PRINCIPAL);
-    auto result = resp->mutable_result();
-    result->PackFrom(p);
+    fill_response(resp, Response::PRINCIPAL, p);
     return resp;
 }
 
@@ -70,11 +145,16 @@ static inline std::shared_ptr<Response> make_shared_principal_response(
   return std::shared_ptr<Response>(make_principal_response(p));
 }
 
+static inline std::shared_ptr<Response> make_shared_principal_response(
+    const std::shared_ptr<Command> &owner, const Principal &p) {
+  auto resp = make_owned<Response>(owner);
+  fill_response(resp.get(), Response::PRINCIPAL, p);
+  return resp;
+}
+
 static inline Response* make_metadata_config_response(const MetadataConfig &m) {
     Response* resp = Response::default_instance().New();
-    resp->set_type(Response::METADATA);
-    auto result = resp->mutable_result();
-    result->PackFrom(m);
+    fill_response(resp, Response::METADATA, m);
     return resp;
 }
 
@@ -85,9 +165,7 @@ static inline std::shared_ptr<Response> make_shared_metadata_config_response(
 
 static inline Response* make_attestation_response(const Attestation &a) {
     Response* resp = Response::default_instance().New();
-    resp->set_type(Response::ATTESTATION);
-    auto result = resp->mutable_result();
-    result->PackFrom(a);
+    fill_response(resp, Response::ATTESTATION, a);
     return resp;
 }
 
@@ -120,169 +198,131 @@ class ResponseWrapper {
     }
 
     inline int status_int() const {
-      Status state;
-      if (!r_->result().UnpackTo(&state)) {
+      Status scratch;
+      auto state = view(&scratch);
+      if (!state) {
         return -1;
       }
-      return (int)state.success();
+      return (int)state->success();
     }
 
     inline std::pair<int, std::string> status() const {
-      Status state;
-      if (!r_->result().UnpackTo(&state)) {
+      Status scratch;
+      auto state = view(&scratch);
+      if (!state) {
         return std::make_pair(-1, "");
       }
-      return std::make_pair((int)state.success(),
-          std::move(*state.mutable_info()));
+      return std::make_pair((int)state->success(), state->info());
+    }
+
+    inline std::unique_ptr<StatusList> extract_status_list() const {
+      return extract<StatusList>();
     }
 
     inline std::unique_ptr<Principal> extract_principal() const {
-      Principal* p = Principal::default_instance().New();
-      if (!r_->result().UnpackTo(p)) {
-        return nullptr;
-      }
-      return std::unique_ptr<Principal>(p);
+      return extract<Principal>();
     }
 
     inline std::unique_ptr<MetadataConfig> extract_metadata_config() const {
-      MetadataConfig *m = MetadataConfig::default_instance().New();
-      if (!r_->result().UnpackTo(m)) {
+      return extract<MetadataConfig>();
+    }
+
+    inline std::unique_ptr<Attestation> extract_attestation() const {
+      return extract<Attestation>();
+    }
+
+  private:
+    /// the result in place if it came in v2, otherwise unpacked to scratch
+    template<typename T>
+    inline const T *view(T *scratch) const {
+      if (payload_traits<T>::has(*r_)) {
+        return &payload_traits<T>::get(*r_);
+      }
+      if (!r_->result().UnpackTo(scratch)) {
         return nullptr;
       }
-      return std::unique_ptr<MetadataConfig>(m);
+      return scratch;
     }
 
-    inline std::unique_ptr<Attestation> extract_attestation() const {
-      Attestation *a = Attestation::default_instance().New();
-      if (!r_->result().UnpackTo(a)) {
+    template<typename T>
+    inline std::unique_ptr<T> extract() const {
+      std::unique_ptr<T> result(T::default_instance().New());
+      auto found = view(result.get());
+      if (!found) {
         return nullptr;
       }
-      return std::unique_ptr<Attestation>(a);
+      if (found != result.get()) {
+        result->CopyFrom(*found);
+      }
+      return result;
     }
 
-  private:
     std::shared_ptr<Response> r_;
 
 
 };
 
+/// extract_xxx(const Command&) copies the statement onto the heap.
+// extract_xxx(shared_ptr<Command>) hands out a v2 statement in place and
+// unpacks a v1 one onto the command's arena, and the result keeps the
+// command alive; don't store such a statement beyond the request or it
+// pins the whole arena.
+#define DECL_EXTRACT(name, T) \
+    static inline std::shared_ptr<T> extract_##name(const Command &cmd) { \
+      return unpack<T>(cmd, std::make_shared<T>()); \
+    } \
+    static inline std::shared_ptr<T> extract_##name( \
+        const std::shared_ptr<Command> &cmd) { \
+      if (body_traits<T>::has(*cmd)) { \
+        return std::shared_ptr<T>(cmd, body_traits<T>::mutable_get(cmd.get())); \
+      } \
+      return unpack<T>(*cmd, make_owned<T>(cmd)); \
+    }
+
 class CommandWrapper {
   public:
     GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(CommandWrapper);
     CommandWrapper(std::shared_ptr<Command> cmd): cmd_(cmd) {}
     CommandWrapper() = delete;
     CommandWrapper(Command *cmd) = delete;
-    static inline std::shared_ptr<Principal> extract_principal(const Command &cmd) {
-      auto result = std::make_shared<Principal>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-        return nullptr;
-      }
-      return result;
-    }
-    static inline std::shared_ptr<PostACL> extract_post_acl(const Command &cmd) {
-      auto result = std::make_shared<PostACL>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-        return nullptr;
-      }
-      return result;
-    }
-
-    static inline std::shared_ptr<Endorse> extract_endorse(const Command &cmd) {
-      auto result = std::make_shared<Endorse>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-        return nullptr;
-      }
-      return result;
-    }
-
-    static inline std::shared_ptr<EndorsePrincipal> extract_endorse_principal(
-        const Command &cmd) {
-      auto result = std::make_shared<EndorsePrincipal>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-          return nullptr;
-      }
-      return result;
-    }
-    
-    static inline std::shared_ptr<CheckAccess> extract_check_access(
-        const Command &cmd) {
-      auto result = std::make_shared<CheckAccess>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-          return nullptr;
-      }
-      return result;
-    }
-
-    static inline std::shared_ptr<CheckProperty> extract_check_property(
-        const Command &cmd) {
-      auto result = std::make_shared<CheckProperty>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-          return nullptr;
-      }
-      return result;
-    }
 
-    static inline std::shared_ptr<CheckAttestation> extract_check_attestation(
-        const Command &cmd) {
-      auto result = std::make_shared<CheckAttestation>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-          return nullptr;
-      }
-      return result;
-    }
+    DECL_EXTRACT(principal, Principal)
+    DECL_EXTRACT(post_acl, PostACL)
+    DECL_EXTRACT(endorse, Endorse)
+    DECL_EXTRACT(endorse_principal, EndorsePrincipal)
+    DECL_EXTRACT(check_access, CheckAccess)
+    DECL_EXTRACT(check_property, CheckProperty)
+    DECL_EXTRACT(check_attestation, CheckAttestation)
+    DECL_EXTRACT(check_image, CheckImage)
+    DECL_EXTRACT(free_call, FreeCall)
+    DECL_EXTRACT(guard_call, GuardCall)
+    DECL_EXTRACT(principal_list, PrincipalList)
+    DECL_EXTRACT(link_image, LinkImage)
 
-    static inline std::shared_ptr<CheckImage> extract_check_image(const Command &cmd) {
-      auto result = std::make_shared<CheckImage>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-          return nullptr;
-      }
-      return result;
+    std::shared_ptr<Principal> extract_principal() {
+      return extract_principal(cmd_);
     }
 
-    static inline std::shared_ptr<FreeCall> extract_free_call(const Command &cmd) {
-      auto result = std::make_shared<FreeCall>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-        return nullptr;
-      }
-      return result;
-    }
 
-    static inline std::shared_ptr<GuardCall> extract_guard_call(const Command &cmd) {
-      auto result = std::make_shared<GuardCall>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
-        return nullptr;
+  private:
+    template<typename T>
+    static inline std::shared_ptr<T> unpack(const Command &cmd,
+        std::shared_ptr<T> result) {
+      if (body_traits<T>::has(cmd)) {
+        result->CopyFrom(body_traits<T>::get(cmd));
+        return result;
       }
-      return result;
-    }
-
-    static inline std::shared_ptr<LinkImage> extract_link_image(const Command &cmd) {
-      auto result = std::make_shared<LinkImage>();
-      auto stmt = cmd.statement();
-      if (!stmt.UnpackTo(result.get())) {
+      if (!cmd.statement().UnpackTo(result.get())) {
         return nullptr;
       }
       return result;
     }
 
-    std::shared_ptr<Principal> extract_principal() {
-      return extract_principal(*cmd_);
-    }
-
-
-  private:
     std::shared_ptr<Command> cmd_;
 };
 
+#undef DECL_EXTRACT
+
 
 template<typename V, typename I>
 static inline void set_type(V& v, I type) {
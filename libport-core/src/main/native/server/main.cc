@@ -4,6 +4,7 @@
 #include "server.h"
 #include "config.h"
 #include "jutils/fs.h"
+#include <pplx/threadpool.h>
 
 int main(int argc, char **argv) {
   const char *config = "/etc/attguard/config.txt";
@@ -11,6 +12,9 @@ int main(int argc, char **argv) {
     config = argv[1];
   }
   latte::config::load_config(config);
+  /// must happen before anything touches the cpprest pool
+  crossplat::threadpool::initialize_with_threads(
+      latte::config::http_threads());
 
   auto url = latte::config::metadata_service_url();
   latte::init_manager(url);
@@ -22,7 +26,12 @@ int main(int argc, char **argv) {
     }
   }
   latte::log("attguard starting on %s", daemon.c_str());
-  auto server = latte::Server(latte::config::local_daemon_path());
+  latte::Server server(latte::config::local_daemon_path(),
+      latte::config::io_threads());
+  auto &metrics_endpoint = latte::config::metrics_endpoint();
+  if (!metrics_endpoint.empty()) {
+    server.serve_metrics(metrics_endpoint);
+  }
   /// no returns
   server.start();
   return 0;
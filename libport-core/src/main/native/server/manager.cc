@@ -1,6 +1,7 @@
 
 
 #include <unordered_map>
+#include <atomic>
 #include "proto/config.h"
 #include "proto/statement.pb.h"
 #include "proto/utils.h"
@@ -9,6 +10,11 @@
 #include "pplx/threadpool.h"
 #include "pplx/pplxtasks.h"
 #include "metadata.h"
+#include "decision_cache.h"
+#include "principal_registry.h"
+#include "principal_journal.h"
+#include "metrics.h"
+#include "trace.h"
 #include "utils.h"
 #include <jutils/config/simple.h>
 #include "config.h"
@@ -22,15 +28,16 @@ using proto::Command;
 class LatteAttestationManager: public LatteDispatcher {
 
   public:
-    typedef std::unordered_multimap<uint64_t, std::shared_ptr<proto::Principal>> PrincipalMap;
-
     LatteAttestationManager(const std::string &metadata_server):
       LatteAttestationManager(metadata_server,crossplat::threadpool::shared_instance() ) {
     }
     LatteAttestationManager(const std::string &metadata_server,
       crossplat::threadpool &pool): executor_(pool),
       metadata_service_(utils::make_unique<MetadataServiceClient>(
-            metadata_server, latte::config::myid())) {
+            metadata_server, latte::config::myid())),
+      cache_(std::chrono::milliseconds(config::decision_cache_ttl()),
+          std::chrono::milliseconds(config::decision_cache_negative_ttl()),
+          config::decision_cache_size()) {
           init();
     }
     LatteAttestationManager(MetadataServiceClient* service):
@@ -39,36 +46,56 @@ class LatteAttestationManager: public LatteDispatcher {
 
     LatteAttestationManager(MetadataServiceClient* service,
         crossplat::threadpool &pool): executor_(pool),
-        metadata_service_(service) {
+        metadata_service_(service),
+        cache_(std::chrono::milliseconds(config::decision_cache_ttl()),
+            std::chrono::milliseconds(config::decision_cache_negative_ttl()),
+            config::decision_cache_size()) {
           init();
     }
 
+    ~LatteAttestationManager() {
+      metrics().remove_collector(collector_);
+      compaction_.wait();
+    }
+
     bool dispatch(std::shared_ptr<proto::Command> cmd, Writer w) override {
-      auto handler = find_handler(cmd->type());
-      std::shared_ptr<Response> result;
-      if (handler) {
-        try {
-          //// TODO: validate the speaker field if needed
-          result = handler(cmd);
-        } catch (const std::runtime_error &e) {
-          std::string errmsg = "runtime error " + std::string(e.what());
-          log_err(errmsg.c_str());
-          result = proto::make_shared_status_response(false, errmsg);
-        } catch (const web::json::json_exception &e) {
-          std::string errmsg = "json error " + std::string(e.what());
-          log_err(errmsg.c_str());
-          result = proto::make_shared_status_response(false, errmsg);
-        } catch(const web::http::http_exception &e) {
-          std::string errmsg = "http error " + std::string(e.what());
-          log_err(errmsg.c_str());
-          result = proto::make_shared_status_response(false, errmsg);
-        }
-      } else {
+      auto route = find_route(cmd->type());
+      if (!route) {
         std::string typedesc = proto::Command::Type_Name(cmd->type());
-        result = proto::make_shared_status_response(false,
-              "not handler found for type " + typedesc);
+        w(proto::make_shared_status_response(false,
+              "not handler found for type " + typedesc));
+        return true;
+      }
+      /// histograms live as long as the registry, no need to hold them
+      auto latency = route->latency.get();
+      auto trace = RequestTrace::current();
+      auto start = std::chrono::steady_clock::now();
+      Writer done = [w, latency, trace, start](std::shared_ptr<Response> resp) {
+        auto end = std::chrono::steady_clock::now();
+        latency->record(std::chrono::duration_cast<std::chrono::microseconds>(
+              end - start));
+        if (trace) {
+          trace->span("handler", trace_us(start), trace_us(end));
+        }
+        w(std::move(resp));
+      };
+      ResponseTask pending;
+      try {
+        //// TODO: validate the speaker field if needed
+        pending = route->handler(cmd);
+      } catch (...) {
+        done(error_response(std::current_exception()));
+        return true;
       }
-      w(result);
+      /// Handlers answering from local state are already done, no need to
+      // bounce them through the scheduler.
+      if (pending.is_done()) {
+        done(complete(pending));
+        return true;
+      }
+      pending.then([done](ResponseTask t) {
+          done(complete(t));
+      });
       return true;
     }
 
@@ -77,27 +104,203 @@ class LatteAttestationManager: public LatteDispatcher {
     // is cleaner. But I have no time for that kind of shit.
   private:
 
-    typedef std::shared_ptr<Response> (LatteAttestationManager::*RawHandler)
+    typedef pplx::task<std::shared_ptr<Response>> ResponseTask;
+    typedef std::function<ResponseTask(std::shared_ptr<Command>)> AsyncHandler;
+    typedef ResponseTask (LatteAttestationManager::*RawHandler)
       (std::shared_ptr<Command>);
 
+    struct Route {
+      AsyncHandler handler;
+      std::shared_ptr<LatencyHistogram> latency;
+    };
+
+    static std::shared_ptr<Response> error_response(std::exception_ptr eptr) {
+      std::string errmsg;
+      try {
+        std::rethrow_exception(eptr);
+      } catch (const std::runtime_error &e) {
+        errmsg = "runtime error " + std::string(e.what());
+      } catch (const web::json::json_exception &e) {
+        errmsg = "json error " + std::string(e.what());
+      } catch(const web::http::http_exception &e) {
+        errmsg = "http error " + std::string(e.what());
+      } catch(const std::exception &e) {
+        errmsg = "error " + std::string(e.what());
+      }
+      log_err("%s", errmsg.c_str());
+      static auto errors = metrics().counter("attguard_command_errors_total");
+      errors->inc();
+      return proto::make_shared_status_response(false, errmsg);
+    }
+
+    static std::shared_ptr<Response> complete(const ResponseTask &t) {
+      try {
+        return t.get();
+      } catch (...) {
+        return error_response(std::current_exception());
+      }
+    }
+
+    static inline ResponseTask ready(std::shared_ptr<Response> resp) {
+      return pplx::task_from_result(std::move(resp));
+    }
+
+    static inline ResponseTask status_of(pplx::task<bool> t) {
+      return t.then([](bool res) {
+          return proto::make_shared_status_response(res, "");
+      });
+    }
+
+    static inline ResponseTask status_of(pplx::task<void> t) {
+      return t.then([]() {
+          return proto::make_shared_status_response(true, "");
+      });
+    }
+
+    /// Answer a CHECK_* command from the decision cache, or run the check
+    // and remember its outcome.
+    ResponseTask cached_check(const std::shared_ptr<Command> &cmd,
+        DecisionCache::Key key, std::function<pplx::task<bool>()> check) {
+      bool allowed;
+      if (cache_.lookup(key, &allowed)) {
+        return ready(proto::make_shared_status_response(cmd, allowed, ""));
+      }
+      return decide(std::move(key), check).then([cmd](bool res) {
+          return proto::make_shared_status_response(cmd, res, "");
+      });
+    }
+
+    /// Run a check that missed the cache and remember its outcome.
+    pplx::task<bool> decide(DecisionCache::Key key,
+        const std::function<pplx::task<bool>()> &check) {
+      auto gen = cache_.generation();
+      return check().then([this, key, gen](bool res) {
+          cache_.insert(key, res, gen);
+          return res;
+      });
+    }
+
+    /// Batched CHECK_*: every target is checked concurrently and answered in
+    // a STATUS_LIST of the same order. A failing item is reported in its own
+    // status instead of failing the whole batch.
+    ResponseTask check_all(const std::shared_ptr<Command> &cmd,
+        DecisionCache::Kind kind, const std::string &auth,
+        const std::string &ip, uint32_t port,
+        const google::protobuf::RepeatedPtrField<std::string> &targets,
+        std::function<pplx::task<bool>(const std::string&)> check) {
+      std::vector<pplx::task<proto::Status>> pending;
+      pending.reserve(targets.size());
+      for (auto &target: targets) {
+        DecisionCache::Key key{kind, auth, ip, port, target, ""};
+        bool allowed;
+        pplx::task<bool> decision;
+        if (cache_.lookup(key, &allowed)) {
+          decision = pplx::task_from_result(allowed);
+        } else {
+          try {
+            decision = decide(std::move(key), [&check, &target]() {
+                return check(target);
+            });
+          } catch (...) {
+            decision = pplx::task_from_exception<bool>(std::current_exception());
+          }
+        }
+        pending.push_back(item_status(decision));
+      }
+      return status_list(pending, cmd);
+    }
+
+    static inline bool succeeded(pplx::task<bool> &t) { return t.get(); }
+    static inline bool succeeded(pplx::task<void> &t) { t.get(); return true; }
+
+    /// Outcome of one item of a batch, a failure is reported as an error,
+    // not thrown, so liblatte can tell it from a denial.
+    template<typename T>
+    static pplx::task<proto::Status> item_status(pplx::task<T> t) {
+      return t.then([](pplx::task<T> r) {
+          proto::Status status;
+          try {
+            status.set_success(succeeded(r));
+          } catch (const std::exception &e) {
+            status.set_success(false);
+            status.set_error(true);
+            status.set_info(e.what());
+          }
+          return status;
+      });
+    }
+
+    static ResponseTask status_list(std::vector<pplx::task<proto::Status>> &pending,
+        std::shared_ptr<Command> owner = nullptr) {
+      if (pending.empty()) {
+        return ready(proto::make_shared_status_list_response(owner,
+              proto::StatusList()));
+      }
+      return pplx::when_all(pending.begin(), pending.end())
+        .then([owner](std::vector<proto::Status> results) {
+            proto::StatusList list;
+            for (auto &status: results) {
+              list.add_results()->Swap(&status);
+            }
+            return proto::make_shared_status_list_response(owner, list);
+        });
+    }
+
+    /// Endorsements only add facts, so previous denials may be stale.
+    template<typename T>
+    pplx::task<T> granting(pplx::task<T> t) {
+      return t.then([this](pplx::task<T> r) {
+          cache_.invalidate_negative();
+          return r.get();
+      });
+    }
+
     void register_handler(proto::Command::Type type, RawHandler h) {
-      dispatch_table_[static_cast<uint32_t>(type)] = std::bind(h,
-          this, std::placeholders::_1);
+      auto &route = dispatch_table_[static_cast<uint32_t>(type)];
+      route.handler = std::bind(h, this, std::placeholders::_1);
+      route.latency = metrics().histogram("attguard_command_duration_seconds",
+          {{"type", proto::Command::Type_Name(type)}});
     }
 
-    Handler find_handler(proto::Command::Type type) const {
+    const Route *find_route(proto::Command::Type type) const {
       auto res = dispatch_table_.find(static_cast<uint32_t>(type));
       if (res == dispatch_table_.end()) {
         return nullptr;
       }
-      return res->second;
+      return &res->second;
+    }
+
+    /// state owned by the manager, read at scrape time
+    void collect(MetricsWriter &out) const {
+      out.counter("attguard_decision_cache_hits_total", {}, cache_.hits());
+      out.counter("attguard_decision_cache_misses_total", {}, cache_.misses());
+      out.gauge("attguard_decision_cache_entries", {}, cache_.size());
+      out.gauge("attguard_principals", {}, principals_.size());
+      metadata_service_->latencies().for_each(
+          [&out](const std::string &endpoint, const LatencyHistogram &h) {
+            out.histogram("attguard_metadata_request_duration_seconds",
+                {{"endpoint", endpoint}}, h);
+          });
     }
 
 
     void init(uint64_t init_gn = 0) {
       gn_ = init_gn;
+      compacting_ = false;
+      compaction_ = pplx::task_from_result();
+      if (!config::state_dir().empty()) {
+        journal_ = PrincipalJournal::open(config::state_dir());
+      }
+      if (journal_) {
+        gn_ = std::max(init_gn, journal_->recover(principals_));
+      }
+      collector_ = metrics().add_collector(
+          std::bind(&LatteAttestationManager::collect, this,
+            std::placeholders::_1));
       register_handler(proto::Command::CREATE_PRINCIPAL, 
           &LatteAttestationManager::create_principal);
+      register_handler(proto::Command::CREATE_PRINCIPALS,
+          &LatteAttestationManager::create_principals);
       register_handler(proto::Command::DELETE_PRINCIPAL, 
           &LatteAttestationManager::delete_principal);
       register_handler(proto::Command::GET_PRINCIPAL, 
@@ -150,45 +353,77 @@ class LatteAttestationManager: public LatteDispatcher {
     }
 
 
-    std::shared_ptr<Response> free_call(std::shared_ptr<Command> cmd) {
-      auto freecall = proto::CommandWrapper::extract_free_call(*cmd);
+    ResponseTask free_call(std::shared_ptr<Command> cmd) {
+      auto freecall = proto::CommandWrapper::extract_free_call(cmd);
       auto proto_values = freecall->othervalues();
       std::vector<std::string> other_values(proto_values.begin(), proto_values.end());
-      auto res = metadata_service_->free_call(cmd->auth(),
-          freecall->cmd(), other_values);
-      return proto::make_shared_status_response(res, "");
-    }
-    std::shared_ptr<Response> guard_call(std::shared_ptr<Command> cmd) {
-      auto guardcall = proto::CommandWrapper::extract_guard_call(*cmd);
+      /// free calls may post anything, nothing cached can be trusted after
+      return status_of(metadata_service_->free_call_async(cmd->auth(),
+          freecall->cmd(), other_values).then([this](pplx::task<bool> r) {
+            cache_.clear();
+            return r.get();
+          }));
+    }
+    ResponseTask guard_call(std::shared_ptr<Command> cmd) {
+      auto guardcall = proto::CommandWrapper::extract_guard_call(cmd);
       auto proto_values = guardcall->othervalues();
       std::vector<std::string> other_values(proto_values.begin(), proto_values.end());
-      auto res = metadata_service_->guard_call(cmd->auth(),
-          guardcall->cmd(), other_values);
-      return proto::make_shared_status_response(res, "");
+      return status_of(metadata_service_->guard_call_async(cmd->auth(),
+          guardcall->cmd(), other_values));
     }
 
-    std::shared_ptr<Response> link_image(std::shared_ptr<Command> cmd) {
-      auto linkimage = proto::CommandWrapper::extract_link_image(*cmd);
+    ResponseTask link_image(std::shared_ptr<Command> cmd) {
+      auto linkimage = proto::CommandWrapper::extract_link_image(cmd);
       auto host = linkimage->host();
       if (host.size() == 0) {
         host = cmd->auth();
       }
       auto &image = linkimage->image();
-      auto res = metadata_service_->link_image(cmd->auth(), host, image);
-      return proto::make_shared_status_response(res, "");
+      return status_of(granting(metadata_service_->link_image_async(cmd->auth(),
+              host, image)));
     }
 
 
-    std::shared_ptr<Response> create_principal(std::shared_ptr<Command> cmd) {
+    ResponseTask create_principal(std::shared_ptr<Command> cmd) {
+      /// kept by the registry, so not on the request arena
       auto p = proto::CommandWrapper::extract_principal(*cmd);
       if (!p) {
-        return proto::make_shared_status_response(false,
-              "principal not found or mal-formed");
+        return ready(proto::make_shared_status_response(false,
+              "principal not found or mal-formed"));
+      }
+      return status_of(register_principal(cmd->auth(), cmd->pid(), p));
+    }
+
+    /// Burst creation: the principals are posted to the metadata service
+    // concurrently and each gets its own status.
+    ResponseTask create_principals(std::shared_ptr<Command> cmd) {
+      auto list = proto::CommandWrapper::extract_principal_list(cmd);
+      if (!list) {
+        return ready(proto::make_shared_status_response(false,
+              "principal list not found or mal-formed"));
       }
+      std::vector<pplx::task<proto::Status>> pending;
+      pending.reserve(list->principals_size());
+      for (auto &item: *list->mutable_principals()) {
+        auto p = std::make_shared<proto::Principal>();
+        p->Swap(&item);
+        pplx::task<void> created;
+        try {
+          created = register_principal(cmd->auth(), cmd->pid(), p);
+        } catch (...) {
+          created = pplx::task_from_exception<void>(std::current_exception());
+        }
+        pending.push_back(item_status(created));
+      }
+      return status_list(pending, cmd);
+    }
+
+    pplx::task<void> register_principal(const std::string &auth,
+        uint64_t speaker, std::shared_ptr<proto::Principal> p) {
       p->set_gn(gn());
       auto image_store = p->code().image_store();
       if (image_store.size() == 0) {
-        image_store = cmd->auth();
+        image_store = auth;
       }
       //auto res = metadata_service_->post_new_principal(cmd->auth(), principal_name(*p),
       //    ip, p->auth().port_lo(), p->auth().port_hi(),
@@ -196,288 +431,383 @@ class LatteAttestationManager: public LatteDispatcher {
       auto &confmap = p->code().config();
       /// copy the stuff to make the interface clean from any protobuf dependency
       std::unordered_map<std::string, std::string> configs(confmap.begin(), confmap.end());
-      metadata_service_ -> create_instance(cmd->auth(), principal_name(*p),
+      p->set_speaker(speaker);
+      /// only register the principal once the metadata service accepted it
+      return metadata_service_->create_instance_async(auth, principal_name(*p),
           p->code().image(), p->auth().ip(), p->auth().port_lo(), p->auth().port_hi(),
-          image_store, configs);
-
-      p->set_speaker(cmd->pid());
-      add_principal(p->id(), p);
-      return proto::make_shared_status_response(true, "");
+          image_store, configs).then([this, p](bool) {
+            auto durable = remember(p);
+            cache_.invalidate_principal(p->auth().ip(), p->auth().port_lo(),
+                p->auth().port_hi());
+            return durable;
+          });
     }
 
 
-    std::shared_ptr<Response> delete_principal(std::shared_ptr<Command> cmd) {
-      auto p = proto::CommandWrapper::extract_principal(*cmd);
+    ResponseTask delete_principal(std::shared_ptr<Command> cmd) {
+      auto p = proto::CommandWrapper::extract_principal(cmd);
       if (!p) {
-        return proto::make_shared_status_response(false,
-              "principal not found or mal-formed");
-      }
-      log("entering delete principal");
-
-      uint64_t maxgn = 0;
-      std::shared_ptr<proto::Principal> latest = nullptr;
-      plock_.lock();
-      auto matched = principals_.equal_range(p->id());
-      for (auto i = matched.first; i != matched.second; ++i) {
-        log("find gn %d", i->second->gn());
-        if (maxgn <= i->second->gn()) {
-          maxgn = i->second->gn();
-          latest = i->second;
-        }
+        return ready(proto::make_shared_status_response(false,
+              "principal not found or mal-formed"));
       }
-      log("looking for latest principal, found: %d", maxgn);
-      if (latest) {
-        auto speaker = latest->speaker();
-        if ((speaker != cmd->pid() && cmd->uid() != 0)) {
-          plock_.unlock();
-          return proto::make_shared_status_response(false,
-              "privilege not matching");
-        }
+      LATTE_DEBUG("entering delete principal");
+
+      auto uid = cmd->uid();
+      auto pid = cmd->pid();
+      bool removed = false;
+      pplx::task<void> durable;
+      auto latest = forget(p->id(),
+          [uid, pid](const proto::Principal &latest) {
+            return latest.speaker() == pid || uid == 0;
+          }, &removed, &durable);
+      if (!latest) {
+        LATTE_INFO("deleting %llu, %llu, latest principal not found",
+            (unsigned long long)p->id(), (unsigned long long)p->gn());
+        return ready(proto::make_shared_status_response(false,
+              "latest principal not found"));
+      }
+      if (!removed) {
+        return ready(proto::make_shared_status_response(false,
+            "privilege not matching"));
       }
-      principals_.erase(matched.first, matched.second);
-      //// authenticate if deletion is allowed!
 
       /// deleting latest principal
-      log("after erase the range");
-      if (latest) {
-        //auto speaker = latest->speaker();
-        auto name = principal_name(*latest);
-        //auto ip = latest->auth().ip();
-        //auto plo = latest->auth().port_lo();
-        //auto phi = latest->auth().port_hi();
-        //auto image = latest->code().image();
-        //auto config = latest->code().config().at(LEGACY_CONFIG_KEY);
-        //log("deleting principal: id = %u, maxgn = %u, latest = %p, speaker = %u, pid = %u, uid = %u",
-        //    p->id(), maxgn, latest.get(), speaker, cmd->pid(), cmd->uid());
-        log("deleting principal %s", name.c_str());
-
-        plock_.unlock();
-        metadata_service_->delete_instance(cmd->auth(), name);
-        //metadata_service_->remove_principal(cmd->auth(),name, ip, plo, phi, image, config);
-        return proto::make_shared_status_response(true, "");
-      } else {
-        plock_.unlock();
-        log("deleting %u, %u, latest principal not found", p->id(), p->gn());
-        return proto::make_shared_status_response(false,
-              "latest principal not found");
+      auto name = principal_name(*latest);
+      LATTE_INFO("deleting principal %s", name.c_str());
+      auto ip = latest->auth().ip();
+      auto lo = latest->auth().port_lo();
+      auto hi = latest->auth().port_hi();
+      return metadata_service_->delete_instance_async(cmd->auth(), name)
+        .then([this, ip, lo, hi, durable](pplx::task<bool> r) {
+          /// the local record is gone whether or not the service agreed
+          cache_.invalidate_principal(ip, lo, hi);
+          r.get();
+          return durable;
+        }).then([]() {
+          return proto::make_shared_status_response(true, "");
+        });
+    }
+
+    /// Resolves the principal owning a peer's (ip, port) from the local
+    // index. Principals created elsewhere are not found here, their
+    // attestation is what CHECK_ATTESTATION asks the metadata service for.
+    ResponseTask get_principal(std::shared_ptr<Command> cmd) {
+      auto p = proto::CommandWrapper::extract_principal(cmd);
+      if (!p) {
+        return ready(proto::make_shared_status_response(false,
+              "principal not found or mal-formed"));
       }
-
-    }
-
-    std::shared_ptr<Response> get_principal(std::shared_ptr<Command> ) {
-      /// not implemented yet
-      return proto::not_implemented();
+      auto owner = principals_.owner(p->auth().ip(), p->auth().port_lo());
+      if (!owner) {
+        return ready(proto::make_shared_status_response(false, "not found"));
+      }
+      return ready(proto::make_shared_principal_response(cmd, *owner));
     }
 
-    std::shared_ptr<Response> endorse_principal(std::shared_ptr<Command> ) {
+    ResponseTask endorse_principal(std::shared_ptr<Command> ) {
       /// not implemented yet
-      return proto::not_implemented();
+      return ready(proto::not_implemented());
     }
 
-    std::shared_ptr<Response> revoke_principal(std::shared_ptr<Command> ) {
+    ResponseTask revoke_principal(std::shared_ptr<Command> ) {
       /// not implemented yet
-      return proto::not_implemented();
+      return ready(proto::not_implemented());
     }
 
-    std::shared_ptr<Response> endorse(std::shared_ptr<Command> cmd) {
-      auto endorse = proto::CommandWrapper::extract_endorse(*cmd);
+    ResponseTask endorse(std::shared_ptr<Command> cmd) {
+      auto endorse = proto::CommandWrapper::extract_endorse(cmd);
       if (endorse->endorsements_size() == 0) {
-        return proto::make_shared_status_response(false,
-            "must provide at least one property");
+        return ready(proto::make_shared_status_response(false,
+            "must provide at least one property"));
       }
       auto &image = endorse->id();
       auto &property = endorse->endorsements(0).property();
       auto &value = endorse->endorsements(0).value();
       //auto &config = endorse->config().at(LEGACY_CONFIG_KEY);
-      metadata_service_->endorse(cmd->auth(), image, property, value);
-      return proto::make_shared_status_response(true, "");
+      return metadata_service_->endorse_async(cmd->auth(), image, property, value)
+        .then([this, image](pplx::task<bool> r) {
+          /// an endorsement may overwrite a previous value of the property
+          cache_.invalidate_id(image);
+          cache_.invalidate_negative();
+          r.get();
+          return proto::make_shared_status_response(true, "");
+        });
     }
 
-    std::shared_ptr<Response> revoke(std::shared_ptr<Command> ) {
-      return proto::not_implemented();
+    ResponseTask revoke(std::shared_ptr<Command> ) {
+      return ready(proto::not_implemented());
     }
 
-    std::shared_ptr<Response> get_local_principal(std::shared_ptr<Command> cmd) {
-      auto p = proto::CommandWrapper::extract_principal(*cmd);
+    ResponseTask get_local_principal(std::shared_ptr<Command> cmd) {
+      auto p = proto::CommandWrapper::extract_principal(cmd);
       if (!p) {
-        return proto::make_shared_status_response(false,
-              "principal not found or mal-formed");
-      }
-
-      uint64_t maxgn = 0;
-      std::shared_ptr<proto::Principal> latest = nullptr;
-      std::lock_guard<std::mutex> guard(plock_);
-      auto matched = principals_.equal_range(p->id());
-      for (auto i = matched.first; i != matched.second; ++i) {
-        if (maxgn <= i->second->gn()) {
-          maxgn = i->second->gn();
-          latest = i->second;
-        }
+        return ready(proto::make_shared_status_response(false,
+              "principal not found or mal-formed"));
       }
+
+      auto latest = principals_.latest(p->id());
       if (latest) {
-        return proto::make_shared_principal_response(*latest);
+        return ready(proto::make_shared_principal_response(cmd, *latest));
       } else {
-        return proto::make_shared_status_response(false, "not found");
+        return ready(proto::make_shared_status_response(false, "not found"));
       }
     }
 
-    std::shared_ptr<Response> get_metadata_config(std::shared_ptr<Command>) {
+    ResponseTask get_metadata_config(std::shared_ptr<Command>) {
       proto::MetadataConfig config;
       config.set_ip(config::metadata_service_ip());
       config.set_port(config::metadata_service_port());
-      return proto::make_shared_metadata_config_response(config);
+      return ready(proto::make_shared_metadata_config_response(config));
     }
 
     ////////////////////Legacy APIs
-    std::shared_ptr<Response> post_acl(std::shared_ptr<Command> cmd) {
-      auto acl = proto::CommandWrapper::extract_post_acl(*cmd);
+    ResponseTask post_acl(std::shared_ptr<Command> cmd) {
+      auto acl = proto::CommandWrapper::extract_post_acl(cmd);
       /// we only use the first name
       if (acl->policies_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one policy");
+        return ready(proto::make_shared_status_response(false, "must provide one policy"));
       }
-      metadata_service_->post_object_acl(cmd->auth(), acl->name(), acl->policies(0));
-      return proto::make_shared_status_response(true, "");
-    }
-
-    std::shared_ptr<Response> endorse_membership(std::shared_ptr<Command> cmd) {
-      auto endorse_p = proto::CommandWrapper::extract_endorse_principal(*cmd);
+      auto name = acl->name();
+      auto scoped = cmd->auth() + ":" + name;
+      return status_of(metadata_service_->post_object_acl_async(cmd->auth(),
+            name, acl->policies(0)).then([this, name, scoped](pplx::task<void> r) {
+              /// the service may scope the object under the speaker
+              cache_.invalidate_id(name);
+              cache_.invalidate_id(scoped);
+              r.get();
+            }));
+    }
+
+    ResponseTask endorse_membership(std::shared_ptr<Command> cmd) {
+      auto endorse_p = proto::CommandWrapper::extract_endorse_principal(cmd);
       if (endorse_p->endorsements_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one endorsement");
+        return ready(proto::make_shared_status_response(false, "must provide one endorsement"));
       }
       auto gn = endorse_p->principal().gn();
       auto &target_ip = endorse_p->principal().auth().ip();
       auto target_port = endorse_p->principal().auth().port_lo();
       auto &target_config = endorse_p->principal().code().config().at(LEGACY_CONFIG_KEY);
       auto &statement = endorse_p->endorsements(0);
-      metadata_service_->endorse_membership(cmd->auth(), target_ip, target_port, gn, statement.property(),
-          target_config);
-      return proto::make_shared_status_response(true, "");
+      return status_of(granting(metadata_service_->endorse_membership_async(
+              cmd->auth(), target_ip, target_port, gn, statement.property(),
+              target_config)));
     }
 
-    std::shared_ptr<Response> endorse_attester(std::shared_ptr<Command> cmd) {
-      auto endorse = proto::CommandWrapper::extract_endorse(*cmd);
+    ResponseTask endorse_attester(std::shared_ptr<Command> cmd) {
+      auto endorse = proto::CommandWrapper::extract_endorse(cmd);
       auto id = endorse->id();
       auto &config = endorse->config().at(LEGACY_CONFIG_KEY);
       if (endorse->type() == proto::Endorse::SOURCE) {
         /// metadata_service_->endorse_source(id, statement);
-        metadata_service_->endorse_attester_on_source(cmd->auth(),id, config);
+        return status_of(granting(metadata_service_->endorse_attester_on_source_async(
+              cmd->auth(),id, config)));
       } else {
         //// Need add a type
-        metadata_service_->endorse_attester(cmd->auth(),id, config);
+        return status_of(granting(metadata_service_->endorse_attester_async(
+              cmd->auth(),id, config)));
       }
-      return proto::make_shared_status_response(true, "");
     }
 
-    std::shared_ptr<Response> endorse_builder(std::shared_ptr<Command> cmd) {
-      auto endorse = proto::CommandWrapper::extract_endorse(*cmd);
+    ResponseTask endorse_builder(std::shared_ptr<Command> cmd) {
+      auto endorse = proto::CommandWrapper::extract_endorse(cmd);
       auto id = endorse->id();
       if (endorse->endorsements_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one endorsement");
+        return ready(proto::make_shared_status_response(false, "must provide one endorsement"));
       }
       auto &config = endorse->config().at(LEGACY_CONFIG_KEY);
       if (endorse->type() == proto::Endorse::SOURCE) {
         /// metadata_service_->endorse_source(id, statement);
-        metadata_service_->endorse_builder_on_source(cmd->auth(),id, config);
+        return status_of(granting(metadata_service_->endorse_builder_on_source_async(
+              cmd->auth(),id, config)));
       } else {
         //// Need add a type
-        metadata_service_->endorse_builder(cmd->auth(),id, config);
+        return status_of(granting(metadata_service_->endorse_builder_async(
+              cmd->auth(),id, config)));
       }
-      return proto::make_shared_status_response(true, "");
     }
 
-    std::shared_ptr<Response> endorse_source(std::shared_ptr<Command> cmd) {
-      auto endorse = proto::CommandWrapper::extract_endorse(*cmd);
+    ResponseTask endorse_source(std::shared_ptr<Command> cmd) {
+      auto endorse = proto::CommandWrapper::extract_endorse(cmd);
       auto id = endorse->id();
       if (endorse->endorsements_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one endorsement");
+        return ready(proto::make_shared_status_response(false, "must provide one endorsement"));
       }
       auto &statement = endorse->endorsements(0);
       auto &config = endorse->config().at(LEGACY_CONFIG_KEY);
       if (endorse->type() == proto::Endorse::SOURCE) {
         /// metadata_service_->endorse_source(id, statement);
-        return proto::make_shared_status_response(false, "source endorse this is image only");
+        return ready(proto::make_shared_status_response(false,
+              "source endorse this is image only"));
       } else {
         //// Need add a type
-        metadata_service_->endorse_image(cmd->auth(), id, statement.property(), config);
+        return status_of(granting(metadata_service_->endorse_image_async(
+              cmd->auth(), id, statement.property(), config)));
       }
-      return proto::make_shared_status_response(true, "");
     }
 
-    std::shared_ptr<Response> check_property(std::shared_ptr<Command> cmd) {
-      auto check = proto::CommandWrapper::extract_check_property(*cmd);
+    ResponseTask check_property(std::shared_ptr<Command> cmd) {
+      auto check = proto::CommandWrapper::extract_check_property(cmd);
       auto &ip = check->principal().auth().ip();
       auto port = check->principal().auth().port_lo();
+      auto auth = cmd->auth();
+      if (check->batch()) {
+        return check_all(cmd, DecisionCache::PROPERTY, auth, ip, port,
+            check->properties(), [this, auth, ip, port](const std::string &prop) {
+              return metadata_service_->has_property_async(auth, ip, port, prop, "");
+            });
+      }
       if (check->properties_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one property");
+        return ready(proto::make_shared_status_response(false, "must provide one property"));
       }
       auto &prop = check->properties(0);
-      return proto::make_shared_status_response(
-          metadata_service_->has_property(cmd->auth(), ip, port, prop, ""), "");
+      return cached_check(cmd, {DecisionCache::PROPERTY, auth, ip, port, prop, ""},
+          [this, auth, ip, port, prop]() {
+            return metadata_service_->has_property_async(auth, ip, port, prop, "");
+          });
     }
 
-    std::shared_ptr<Response> check_attestation(std::shared_ptr<Command> cmd) {
-      auto attest = proto::CommandWrapper::extract_check_attestation(*cmd);
+    ResponseTask check_attestation(std::shared_ptr<Command> cmd) {
+      auto attest = proto::CommandWrapper::extract_check_attestation(cmd);
       auto &ip = attest->principal().auth().ip();
       auto port = attest->principal().auth().port_lo();
-      proto::Attestation a;
-      a.set_content(metadata_service_->attest(cmd->auth(), ip, port, ""));
-      return proto::make_shared_attestation_response(a);
+      return metadata_service_->attest_async(cmd->auth(), ip, port, "")
+        .then([](std::string content) {
+          proto::Attestation a;
+          a.set_content(std::move(content));
+          return proto::make_shared_attestation_response(a);
+        });
     }
 
-    std::shared_ptr<Response> check_access(std::shared_ptr<Command> cmd) {
-      auto check = proto::CommandWrapper::extract_check_access(*cmd);
+    ResponseTask check_access(std::shared_ptr<Command> cmd) {
+      auto check = proto::CommandWrapper::extract_check_access(cmd);
       auto &ip = check->principal().auth().ip();
       auto port = check->principal().auth().port_lo();
+      auto auth = cmd->auth();
+      if (check->batch()) {
+        return check_all(cmd, DecisionCache::ACCESS, auth, ip, port, check->objects(),
+            [this, auth, ip, port](const std::string &object) {
+              return metadata_service_->can_access_async(auth, ip, port, object, "");
+            });
+      }
       if (check->objects_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one object");
+        return ready(proto::make_shared_status_response(false, "must provide one object"));
       }
       auto &object = check->objects(0);
-      return proto::make_shared_status_response(
-          metadata_service_->can_access(cmd->auth(),ip, port, object, ""), "");
+      return cached_check(cmd, {DecisionCache::ACCESS, auth, ip, port, object, ""},
+          [this, auth, ip, port, object]() {
+            return metadata_service_->can_access_async(auth, ip, port, object, "");
+          });
     }
 
-    std::shared_ptr<Response> check_worker_access(std::shared_ptr<Command> cmd) {
-      auto check = proto::CommandWrapper::extract_check_access(*cmd);
+    ResponseTask check_worker_access(std::shared_ptr<Command> cmd) {
+      auto check = proto::CommandWrapper::extract_check_access(cmd);
       auto &ip = check->principal().auth().ip();
       auto port = check->principal().auth().port_lo();
+      auto auth = cmd->auth();
+      if (check->batch()) {
+        return check_all(cmd, DecisionCache::WORKER_ACCESS, auth, ip, port,
+            check->objects(), [this, auth, ip, port](const std::string &object) {
+              return metadata_service_->can_worker_access_async(auth, ip, port,
+                  object, "");
+            });
+      }
       if (check->objects_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one object");
+        return ready(proto::make_shared_status_response(false, "must provide one object"));
       }
       auto &object = check->objects(0);
-      return proto::make_shared_status_response(
-          metadata_service_->can_worker_access(cmd->auth(),ip, port, object, ""), "");
+      return cached_check(cmd, {DecisionCache::WORKER_ACCESS, auth, ip, port, object, ""},
+          [this, auth, ip, port, object]() {
+            return metadata_service_->can_worker_access_async(auth, ip, port,
+                object, "");
+          });
     }
 
-    std::shared_ptr<Response> check_image_property(std::shared_ptr<Command> cmd) {
-      auto check = proto::CommandWrapper::extract_check_image(*cmd);
+    ResponseTask check_image_property(std::shared_ptr<Command> cmd) {
+      auto check = proto::CommandWrapper::extract_check_image(cmd);
       auto &image = check->image();
       auto &confmap = check->config();
       if (check->property_size() == 0) {
-        return proto::make_shared_status_response(false, "must provide one property");
+        return ready(proto::make_shared_status_response(false, "must provide one property"));
       }
       auto &config = confmap.at(LEGACY_CONFIG_KEY);
       auto &property = check->property(0);
-      return proto::make_shared_status_response(
-          metadata_service_->image_has_property(cmd->auth(), image, config,
-            property), "");
-    }
-
-    void add_principal(uint64_t id, std::shared_ptr<proto::Principal> p) {
-      std::lock_guard<std::mutex> guard(plock_);
-      principals_.insert(std::make_pair(id, std::move(p)));
+      auto auth = cmd->auth();
+      return cached_check(cmd, {DecisionCache::IMAGE_PROPERTY, auth, image, 0, property,
+          config}, [this, auth, image, config, property]() {
+            return metadata_service_->image_has_property_async(auth, image,
+                config, property);
+          });
     }
 
     uint64_t gn() {
       return gn_++;
     }
 
-    std::unordered_map<uint32_t, Handler> dispatch_table_;
+    /// Changes to the registry are journaled in the order they are made,
+    // and acknowledged once their record is durable.
+    pplx::task<void> remember(PrincipalRegistry::PrincipalPtr p) {
+      if (!journal_) {
+        principals_.insert(std::move(p));
+        return pplx::task_from_result();
+      }
+      std::lock_guard<std::mutex> guard(journal_lock_);
+      principals_.insert(p);
+      auto durable = journal_->created(*p);
+      compact();
+      return durable;
+    }
+
+    PrincipalRegistry::PrincipalPtr forget(uint64_t id,
+        const std::function<bool(const proto::Principal&)> &allow,
+        bool *removed, pplx::task<void> *durable) {
+      *durable = pplx::task_from_result();
+      if (!journal_) {
+        return principals_.remove(id, allow, removed);
+      }
+      std::lock_guard<std::mutex> guard(journal_lock_);
+      auto latest = principals_.remove(id, allow, removed);
+      if (*removed) {
+        *durable = journal_->deleted(id);
+        compact();
+      }
+      return latest;
+    }
+
+    /// Once the journal is long enough, appends move on to the next one and
+    // the registry as of now is saved in the background. Runs under
+    // journal_lock_.
+    void compact() {
+      auto limit = config::journal_compact_records();
+      if (limit == 0 || journal_->pending() < limit || compacting_) {
+        return;
+      }
+      compacting_ = true;
+      auto state = principals_.all();
+      uint64_t next_gn = gn_;
+      auto epoch = journal_->rotate();
+      compaction_ = pplx::create_task([this, state, next_gn, epoch]() {
+          try {
+            journal_->snapshot(state, next_gn, epoch);
+          } catch (const std::exception &e) {
+            log_err("compacting the journal failed: %s", e.what());
+          }
+          compacting_ = false;
+      });
+    }
+
+    std::unordered_map<uint32_t, Route> dispatch_table_;
     crossplat::threadpool & executor_;
     std::unique_ptr<MetadataServiceClient> metadata_service_;
-
-    std::mutex plock_;
-    PrincipalMap principals_;
-    uint64_t gn_;
+    DecisionCache cache_;
+
+    PrincipalRegistry principals_;
+    std::atomic<uint64_t> gn_;
+    /// null when principals are not kept across restarts
+    std::unique_ptr<PrincipalJournal> journal_;
+    std::mutex journal_lock_;
+    std::atomic<bool> compacting_;
+    pplx::task<void> compaction_;
+    uint64_t collector_;
     /// maybe we could use image but not now I think.
 
 };
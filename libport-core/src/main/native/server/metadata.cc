@@ -39,8 +39,12 @@
 #include "cpprest/json.h"
 #include "utils.h"
 #include "safe.h"
+#include "config.h"
+#include "trace.h"
 #include <iostream>
 #include <stdio.h>
+#include <deque>
+#include <chrono>
 
 
 namespace {
@@ -87,9 +91,7 @@ namespace {
   typedef std::function<pplx::task<web::http::http_response>(web::http::http_response res)> DebugTask;
   DebugTask debug_task() {
     return [](web::http::http_response res) {
-      if (latte::is_debug()) {
-        latte::log("response body: \n%s", res.to_string().c_str());
-      }
+      LATTE_DEBUG("response body: \n%s", res.to_string().c_str());
       return pplx::task_from_result(res);
     };
   }
@@ -124,27 +126,73 @@ namespace {
 
 namespace latte {
 
+/// Counting semaphore for requests. A request waiting for a slot does not
+// hold a thread, it is resumed by the one releasing the slot.
+class InflightLimiter {
+  public:
+    InflightLimiter(size_t max): max_(max), inflight_(0) {}
+
+    pplx::task<void> acquire() {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (inflight_ < max_) {
+        inflight_++;
+        return pplx::task_from_result();
+      }
+      pplx::task_completion_event<void> ready;
+      waiters_.push_back(ready);
+      return pplx::create_task(ready);
+    }
+
+    void release() {
+      pplx::task_completion_event<void> next;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (waiters_.empty()) {
+          inflight_--;
+          return;
+        }
+        /// the slot passes to the next waiter directly
+        next = waiters_.front();
+        waiters_.pop_front();
+      }
+      next.set();
+    }
+
+  private:
+    std::mutex lock_;
+    size_t max_;
+    size_t inflight_;
+    std::deque<pplx::task_completion_event<void>> waiters_;
+};
+
+static web::http::client::http_client_config make_http_config() {
+  web::http::client::http_client_config conf;
+  if (config::metadata_timeout() > 0) {
+    conf.set_timeout(std::chrono::milliseconds(config::metadata_timeout()));
+  }
+  return conf;
+}
+
 static std::once_flag trace_once;
 static FILE* ftrace = NULL;
 pplx::task<web::http::http_response> MetadataServiceClient::post_statement(
     const std::string& api_path, const std::string& speaker,
     const std::vector<std::string>& statements, const std::string& bearer_ref) {
-  if (is_debug()) {
-    log("");
-    log("new metadata action: %s, target %s, ref: %s", api_path.c_str(), speaker.c_str(),
+  if (LATTE_LOG_ENABLED(LOG_DEBUG)) {
+    log_at(LOG_DEBUG, "new metadata action: %s, target %s, ref: %s", api_path.c_str(), speaker.c_str(),
         bearer_ref.c_str());
-    log("---start of statement---");
-    for (auto s : statements) {
-      log("%s;", s.c_str());
+    log_at(LOG_DEBUG, "---start of statement---");
+    for (auto &s : statements) {
+      log_at(LOG_DEBUG, "%s;", s.c_str());
     }
-    log("---end of statement ----");
+    log_at(LOG_DEBUG, "---end of statement ----");
   }
 
   web::http::http_request new_request(web::http::methods::POST);
   new_request.set_request_uri(api_path);
   new_request.headers().set_content_type("application/json");
   new_request.set_body(format_request(speaker, statements, bearer_ref));
-  if (is_debug()) {
+  if (LATTE_LOG_ENABLED(LOG_DEBUG)) {
     static int counter = 0;
     std::call_once(trace_once, []() {
           pid_t pid = getpid();
@@ -162,20 +210,69 @@ pplx::task<web::http::http_response> MetadataServiceClient::post_statement(
         full_uri.push_back('/');
         full_uri += api_path;
       }
-      fprintf(ftrace, "#%d \ncurl %s -XPOST -d '%s'\n\n", counter++, full_uri.c_str(),
+      /// the trace id matches the request in the slow request dump
+      auto current = RequestTrace::current();
+      fprintf(ftrace, "#%d trace %#llx\ncurl %s -XPOST -d '%s'\n\n", counter++,
+          current ? (unsigned long long)current->trace_id() : 0ull,
+          full_uri.c_str(),
           format_request(speaker, statements, bearer_ref).serialize().c_str());
       fflush(ftrace);
     }
   }
-  return this->client_->request(new_request);
+  if (!keep_alive_) {
+    new_request.headers().add("Connection", "close");
+  }
+  auto latency = latencies_.get(api_path);
+  /// only requests issued while the handler runs see its trace, those
+  // chained after an earlier response show up in the handler's span
+  auto trace = RequestTrace::current();
+  auto issued = trace ? trace_now_us() : 0;
+  auto send = [this, new_request, latency, trace, issued, api_path]() {
+    auto start = std::chrono::steady_clock::now();
+    if (trace && limiter_) {
+      trace->span("metadata wait", issued, trace_us(start));
+    }
+    return this->client_->request(new_request).then(
+        [latency, start, trace, api_path](
+          pplx::task<web::http::http_response> res) {
+          auto end = std::chrono::steady_clock::now();
+          latency->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                end - start));
+          if (trace) {
+            trace->span("metadata " + api_path, trace_us(start), trace_us(end));
+          }
+          return res;
+        });
+  };
+  if (!limiter_) {
+    return send();
+  }
+  auto limiter = limiter_.get();
+  return limiter->acquire().then(send).then(
+      [limiter](pplx::task<web::http::http_response> res) {
+        limiter->release();
+        return res;
+      });
 }
 
+/// cpprest keeps connections to a host alive and reuses them on its own,
+// there is no knob for the pool size. Bounding the requests in flight
+// bounds the connections it opens.
 MetadataServiceClient::MetadataServiceClient(const std::string &server_url,
     const std::string& myid):
-  client_(utils::make_unique<web::http::client::http_client>(server_url)),
-  myid_(myid) {
+  client_(utils::make_unique<web::http::client::http_client>(server_url,
+        make_http_config())),
+  myid_(myid), keep_alive_(config::metadata_keep_alive()) {
+    if (config::metadata_max_connections() > 0) {
+      limiter_ = utils::make_unique<InflightLimiter>(
+          config::metadata_max_connections());
+    }
   }
 
+MetadataServiceClient::MetadataServiceClient() {}
+
+MetadataServiceClient::~MetadataServiceClient() {}
+
 std::string MetadataServiceClient::post_new_principal(const std::string &speaker,
     const std::string& principal_name,
     const std::string& principal_ip, int port_min, int port_max,
@@ -228,23 +325,38 @@ void MetadataServiceClient::post_new_image(const std::string &speaker,
 void MetadataServiceClient::post_object_acl(const std::string &speaker,
     const std::string& object_id,
     const std::string& requirement) {
+  post_object_acl_async(speaker, object_id, requirement).wait();
+}
+
+pplx::task<void> MetadataServiceClient::post_object_acl_async(
+    const std::string &speaker,
+    const std::string& object_id,
+    const std::string& requirement) {
   // FIXME: this is a problem with SAFE. we temporarily use alice for object
   // acl setting...
   std::string actual_id = object_id;
   if (object_id.find(":") == std::string::npos) {
     actual_id = speaker + ":" + object_id;
   }
-  this->post_statement("/postObjectAcl", speaker, {actual_id, requirement})
+  return this->post_statement("/postObjectAcl", speaker, {actual_id, requirement})
     .then(debug_task())
-    .then(sink_task("posting acl")).wait();
+    .then(sink_task("posting acl"));
 }
 
 void MetadataServiceClient::endorse_image(const std::string &speaker,
     const std::string& image_hash,
     const std::string& endorsement, const std::string& config) {
-  this->post_statement("/postImageProperty", speaker, {image_hash, config, endorsement})
+  endorse_image_async(speaker, image_hash, endorsement, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_image_async(
+    const std::string &speaker,
+    const std::string& image_hash,
+    const std::string& endorsement, const std::string& config) {
+  return this->post_statement("/postImageProperty", speaker,
+      {image_hash, config, endorsement})
     .then(debug_task())
-    .then(sink_task("endorsing image")).wait();
+    .then(sink_task("endorsing image"));
 }
 
 void MetadataServiceClient::endorse_membership(const std::string &speaker,
@@ -272,60 +384,83 @@ void MetadataServiceClient::endorse_membership(const std::string &speaker,
 void MetadataServiceClient::endorse_membership(const std::string &speaker,
     const std::string &ip,
     uint32_t port, uint64_t gn, const std::string &property, const std::string &config) {
-  std::string identity;
-  this->post_statement("/postWorkerSet", speaker, {property,
+  endorse_membership_async(speaker, ip, port, gn, property, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_membership_async(
+    const std::string &speaker,
+    const std::string &ip,
+    uint32_t port, uint64_t gn, const std::string &property, const std::string &config) {
+  return this->post_statement("/postWorkerSet", speaker, {property,
       utils::format_netaddr(ip, port),
       //utils::itoa(gn),
       config})
     .then(debug_task())
-    /*
-    .then(json_task("endorsing membership"))
-    .then([&](pplx::task<web::json::value> v) -> pplx::task<web::http::http_response> {
-        try {
-          auto key = extract_safe_identity(v.get());
-          identity = key;
-          return this->post_statement("/updateSubjectSet", utils::format_netaddr(ip, port), {key});
-        } catch(std::runtime_error &e) {
-          return pplx::task_from_exception<web::http::http_response>(
-            std::runtime_error(std::move(e)));
-        }})
-    */
-    .then(sink_task("updating membership")).wait();
+    .then(sink_task("updating membership"));
 }
 
 void MetadataServiceClient::endorse_builder_on_source(const std::string &speaker,
     const std::string &source_id,
     const std::string &config) {
-  this->post_statement("/postSourceImage", speaker, 
+  endorse_builder_on_source_async(speaker, source_id, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_builder_on_source_async(
+    const std::string &speaker,
+    const std::string &source_id,
+    const std::string &config) {
+  return this->post_statement("/postSourceImage", speaker, 
       {source_id, config})
     .then(debug_task())
-    .then(sink_task("endorsing builder")).wait();
+    .then(sink_task("endorsing builder"));
 }
 
 void MetadataServiceClient::endorse_builder(const std::string &speaker,
     const std::string &image_id,
     const std::string &config) {
-  this->post_statement("/postBuilderImage", IAAS_IDENTITY, 
+  endorse_builder_async(speaker, image_id, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_builder_async(
+    const std::string &,
+    const std::string &image_id,
+    const std::string &config) {
+  return this->post_statement("/postBuilderImage", IAAS_IDENTITY, 
       {image_id, config})
     .then(debug_task())
-    .then(sink_task("endorsing builder")).wait();
+    .then(sink_task("endorsing builder"));
 }
+
 void MetadataServiceClient::endorse_attester_on_source(const std::string &speaker,
     const std::string &source_id,
     const std::string &config) {
-  this->post_statement("/postAttesterSource", IAAS_IDENTITY, 
+  endorse_attester_on_source_async(speaker, source_id, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_attester_on_source_async(
+    const std::string &,
+    const std::string &source_id,
+    const std::string &config) {
+  return this->post_statement("/postAttesterSource", IAAS_IDENTITY, 
       {source_id, config})
     .then(debug_task())
-    .then(sink_task("endorsing attester")).wait();
+    .then(sink_task("endorsing attester"));
 }
 
 void MetadataServiceClient::endorse_attester(const std::string &speaker,
     const std::string &image_id,
     const std::string &config) {
-  this->post_statement("/postAttesterImage", IAAS_IDENTITY, 
+  endorse_attester_async(speaker, image_id, config).wait();
+}
+
+pplx::task<void> MetadataServiceClient::endorse_attester_async(
+    const std::string &,
+    const std::string &image_id,
+    const std::string &config) {
+  return this->post_statement("/postAttesterImage", IAAS_IDENTITY, 
       {image_id, config})
     .then(debug_task())
-    .then(sink_task("endorsing attester")).wait();
+    .then(sink_task("endorsing attester"));
 }
 
 void MetadataServiceClient::endorse_source(const std::string &speaker,
@@ -337,7 +472,13 @@ void MetadataServiceClient::endorse_source(const std::string &speaker,
     .then(sink_task("endorsing source")).wait();
 }
 
-bool MetadataServiceClient::has_property(const std::string &,
+bool MetadataServiceClient::has_property(const std::string &speaker,
+    const std::string& principal_ip,
+    uint32_t port, const std::string& property, const std::string& bearer) {
+  return has_property_async(speaker, principal_ip, port, property, bearer).get();
+}
+
+pplx::task<bool> MetadataServiceClient::has_property_async(const std::string &,
     const std::string& principal_ip,
     uint32_t port, const std::string& property, const std::string& bearer) {
   return this->post_statement("/attestAppProperty", ATTEST_IDENTITY, {
@@ -356,10 +497,16 @@ bool MetadataServiceClient::has_property(const std::string &,
         /// we alreay caught it, no need to do again
         return false;
       }
-    }).get();
+    });
+}
+
+bool MetadataServiceClient::can_access(const std::string &speaker,
+    const std::string& principal_ip, uint32_t port,
+    const std::string& access_object, const std::string& bearer) {
+  return can_access_async(speaker, principal_ip, port, access_object, bearer).get();
 }
 
-bool MetadataServiceClient::can_access(const std::string &,
+pplx::task<bool> MetadataServiceClient::can_access_async(const std::string &,
     const std::string& principal_ip, uint32_t port,
     const std::string& access_object, const std::string& bearer) {
   return this->post_statement("/appAccessesObject", ATTEST_IDENTITY, {
@@ -378,10 +525,17 @@ bool MetadataServiceClient::can_access(const std::string &,
         /// we alreay caught it, no need to do again
         return false;
       }
-    }).get();
+    });
+}
+
+bool MetadataServiceClient::can_worker_access(const std::string &speaker,
+    const std::string& principal_ip, uint32_t port,
+    const std::string& access_object, const std::string& bearer) {
+  return can_worker_access_async(speaker, principal_ip, port, access_object,
+      bearer).get();
 }
 
-bool MetadataServiceClient::can_worker_access(const std::string &,
+pplx::task<bool> MetadataServiceClient::can_worker_access_async(const std::string &,
     const std::string& principal_ip, uint32_t port,
     const std::string& access_object, const std::string& bearer) {
   return this->post_statement("/workerAccessesObject", ATTEST_IDENTITY, {
@@ -400,7 +554,7 @@ bool MetadataServiceClient::can_worker_access(const std::string &,
         /// we alreay caught it, no need to do again
         return false;
       }
-    }).get();
+    });
 }
 
 
@@ -408,6 +562,13 @@ bool MetadataServiceClient::can_worker_access(const std::string &,
 std::string MetadataServiceClient::attest(const std::string &speaker,
     const std::string &ip,
     uint32_t port, const std::string &bearer) {
+  return attest_async(speaker, ip, port, bearer).get();
+}
+
+pplx::task<std::string> MetadataServiceClient::attest_async(
+    const std::string &speaker,
+    const std::string &ip,
+    uint32_t port, const std::string &bearer) {
   return this->post_statement("/attestInstance", speaker, {
       utils::format_netaddr(ip, port)}, bearer)
     .then(debug_task())
@@ -419,7 +580,7 @@ std::string MetadataServiceClient::attest(const std::string &speaker,
         /// we alreay caught it, no need to do again
         return "";
       }
-    }).get();
+    });
 }
 
 void MetadataServiceClient::remove_principal(
@@ -441,6 +602,14 @@ bool MetadataServiceClient::image_has_property(
     const std::string &image,
     const std::string &config,
     const std::string &property) {
+  return image_has_property_async(speaker, image, config, property).get();
+}
+
+pplx::task<bool> MetadataServiceClient::image_has_property_async(
+    const std::string &,
+    const std::string &image,
+    const std::string &config,
+    const std::string &property) {
   return this->post_statement("/checkImgProperty", ATTEST_IDENTITY, {
       image, config, property})
     .then(debug_task())
@@ -457,7 +626,7 @@ bool MetadataServiceClient::image_has_property(
         /// we alreay caught it, no need to do again
         return false;
       }
-    }).get();
+    });
 }
 
 
@@ -467,68 +636,97 @@ bool MetadataServiceClient::create_instance(const std::string &speaker,
         const std::string &ip, uint32_t lo, uint32_t hi,
         const std::string &image_store,
         const std::unordered_map<std::string, std::string> &configs) {
+  return create_instance_async(speaker, pid, image, ip, lo, hi, image_store,
+      configs).get();
+}
+
+pplx::task<bool> MetadataServiceClient::create_instance_async(
+        const std::string &speaker,
+        const std::string &pid, const std::string &image,
+        const std::string &ip, uint32_t lo, uint32_t hi,
+        const std::string &image_store,
+        const std::unordered_map<std::string, std::string> &configs) {
+
+  /// The config statements do not depend on the first response, so build
+  // them now and move them into the continuation.
+  std::vector<std::string> statements;
+  statements.reserve(configs.size() * 2 + 1);
+  statements.push_back(pid);
+  for (auto &i: configs) {
+    statements.push_back(i.first);
+    statements.push_back(i.second);
+  }
 
   /// Create instance first 
-  this->post_statement("/postInstance", speaker,
+  return this->post_statement("/postInstance", speaker,
       {pid, image, utils::format_id(ip, lo, hi), image_store})
     .then(debug_task())
     .then(json_task("creating instance new"))
-    .then([&](pplx::task<web::json::value> v) -> pplx::task<web::http::http_response> {
+    .then([this, speaker, statements](pplx::task<web::json::value> v)
+        -> pplx::task<web::http::http_response> {
         try {
           auto key = extract_safe_identity(v.get());
-          std::vector<std::string> statements;
-          statements.reserve(configs.size() + 1);
-          statements.push_back(pid);
-          for (auto &i: configs) {
-            statements.push_back(i.first);
-            statements.push_back(i.second);
-          }
           return this->post_statement("/postInstanceConfig", speaker,
-              std::move(statements));
+              statements);
         } catch(std::runtime_error &e) {
           return pplx::task_from_exception<web::http::http_response>(
             std::runtime_error(std::move(e)));
         }
-    }).then(sink_task("posting configs")).wait();
-  return true;
+    }).then(sink_task("posting configs"))
+    .then([]() { return true; });
 }
 
 bool MetadataServiceClient::delete_instance(const std::string &speaker,
     const std::string &pid) {
-  this->post_statement("/lazyDeleteInstance", speaker, {pid})
+  return delete_instance_async(speaker, pid).get();
+}
+
+pplx::task<bool> MetadataServiceClient::delete_instance_async(
+    const std::string &speaker, const std::string &pid) {
+  return this->post_statement("/lazyDeleteInstance", speaker, {pid})
     .then(debug_task())
-    .then(json_task("deleting instance")).wait();
-  return true;
+    .then(json_task("deleting instance"))
+    .then([](web::json::value) { return true; });
+}
+
+static inline std::string format_call_url(const std::string &cmd) {
+  if (cmd[0] == '/') {
+    return cmd;
+  }
+  return "/" + cmd;
 }
 
 bool MetadataServiceClient::free_call(const std::string &speaker,
     const std::string &cmd, const std::vector<std::string> &othervalues) {
+  return free_call_async(speaker, cmd, othervalues).get();
+}
+
+pplx::task<bool> MetadataServiceClient::free_call_async(const std::string &speaker,
+    const std::string &cmd, const std::vector<std::string> &othervalues) {
 
-  std::string url;
-  if (cmd[0] == '/') {
-    url = cmd;
-  } else {
-    url = "/" + cmd;
-  }
-  this->post_statement(url, speaker, othervalues)
+  std::string url = format_call_url(cmd);
+  /// json_task only keeps the pointer, the message must outlive the task
+  auto msg = std::make_shared<std::string>(url);
+  return this->post_statement(url, speaker, othervalues)
     .then(debug_task())
-    .then(json_task(url.c_str())).wait();
-  return true;
+    .then(json_task(msg->c_str()))
+    .then([msg](web::json::value) { return true; });
 }
 
 bool MetadataServiceClient::guard_call(const std::string &speaker,
     const std::string &cmd, const std::vector<std::string> &othervalues) {
+  return guard_call_async(speaker, cmd, othervalues).get();
+}
 
-  std::string url;
-  if (cmd[0] == '/') {
-    url = cmd;
-  } else {
-    url = "/" + cmd;
-  }
+pplx::task<bool> MetadataServiceClient::guard_call_async(const std::string &speaker,
+    const std::string &cmd, const std::vector<std::string> &othervalues) {
+
+  std::string url = format_call_url(cmd);
+  auto msg = std::make_shared<std::string>(url);
   return this->post_statement(url, speaker, othervalues)
     .then(debug_task())
-    .then(json_task(url.c_str()))
-    .then([](pplx::task<web::json::value> v) -> bool {
+    .then(json_task(msg->c_str()))
+    .then([msg](pplx::task<web::json::value> v) -> bool {
       try {
         auto msg = v.get()["message"].as_string();
         if (msg.find("Exception") == std::string::npos) {
@@ -541,32 +739,37 @@ bool MetadataServiceClient::guard_call(const std::string &speaker,
         /// we alreay caught it, no need to do again
         return false;
       }
-    }).get();
+    });
 
 }
 
 bool MetadataServiceClient::link_image(const std::string &speaker,
     const std::string &host, const std::string &image) {
-  this->post_statement("/postLinkImageOwner", speaker, {host, image})
+  return link_image_async(speaker, host, image).get();
+}
+
+pplx::task<bool> MetadataServiceClient::link_image_async(const std::string &speaker,
+    const std::string &host, const std::string &image) {
+  return this->post_statement("/postLinkImageOwner", speaker, {host, image})
     .then(debug_task())
-    .then(json_task("New Endorsements")).wait();
-  return true;
+    .then(json_task("New Endorsements"))
+    .then([](web::json::value) { return true; });
 }
 
 bool MetadataServiceClient::endorse(const std::string &speaker,
     const std::string &target, const std::string &prop,
     const std::string &val) {
-  this->post_statement("/postEndorsement", speaker, {target, prop, val})
-    .then(debug_task())
-    .then(json_task("New Endorsements")).wait();
-  return true;
+  return endorse_async(speaker, target, prop, val).get();
 }
 
-
+pplx::task<bool> MetadataServiceClient::endorse_async(const std::string &speaker,
+    const std::string &target, const std::string &prop,
+    const std::string &val) {
+  return this->post_statement("/postEndorsement", speaker, {target, prop, val})
+    .then(debug_task())
+    .then(json_task("New Endorsements"))
+    .then([](web::json::value) { return true; });
 }
 
 
-
-
-
-
+}
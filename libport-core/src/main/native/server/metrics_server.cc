@@ -0,0 +1,91 @@
+#include "metrics_server.h"
+#include "log.h"
+#include <unistd.h>
+
+namespace latte {
+
+using boost::asio::generic::stream_protocol;
+
+/// requests longer than this are not HTTP we care about
+static constexpr size_t MAX_SCRAPE_REQUEST = 8192;
+
+MetricsRegistry &metrics() {
+  static MetricsRegistry *registry = new MetricsRegistry();
+  return *registry;
+}
+
+static stream_protocol::endpoint parse_endpoint(const std::string &ep) {
+  if (ep.find('/') != std::string::npos) {
+    /// a socket left by an earlier run
+    ::unlink(ep.c_str());
+    return boost::asio::local::stream_protocol::endpoint(ep);
+  }
+  std::string host = "127.0.0.1";
+  std::string port = ep;
+  auto colon = ep.rfind(':');
+  if (colon != std::string::npos) {
+    host = ep.substr(0, colon);
+    port = ep.substr(colon + 1);
+  }
+  return boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address::from_string(host), std::stoi(port));
+}
+
+MetricsServer::MetricsServer(boost::asio::io_service &service,
+    const std::string &endpoint, MetricsRegistry &registry):
+  service_(service), listener_(service, parse_endpoint(endpoint)),
+  registry_(registry) {
+}
+
+void MetricsServer::start() {
+  start_accept();
+}
+
+void MetricsServer::stop() {
+  boost::system::error_code ec;
+  listener_.close(ec);
+}
+
+void MetricsServer::start_accept() {
+  auto socket = std::make_shared<Socket>(service_);
+  auto self = shared_from_this();
+  listener_.async_accept(*socket,
+      [self, socket](const boost::system::error_code &ec) {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+        if (!ec) {
+          self->serve(socket);
+        } else {
+          log_err("metrics accept: %s", ec.message().c_str());
+        }
+        self->start_accept();
+      });
+}
+
+/// one response per connection, like HTTP/1.0
+void MetricsServer::serve(std::shared_ptr<Socket> socket) {
+  auto request = std::make_shared<boost::asio::streambuf>(MAX_SCRAPE_REQUEST);
+  auto self = shared_from_this();
+  boost::asio::async_read_until(*socket, *request, "\r\n\r\n",
+      [self, socket, request](const boost::system::error_code &ec, size_t) {
+        if (ec) {
+          LATTE_DEBUG("metrics request: %s", ec.message().c_str());
+          return;
+        }
+        auto body = self->registry_.render();
+        auto response = std::make_shared<std::string>(
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n");
+        *response += body;
+        boost::asio::async_write(*socket, boost::asio::buffer(*response),
+            [socket, response](const boost::system::error_code &, size_t) {
+              boost::system::error_code ignored;
+              socket->shutdown(Socket::shutdown_both, ignored);
+            });
+      });
+}
+
+}
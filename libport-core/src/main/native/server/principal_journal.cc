@@ -0,0 +1,364 @@
+#include "principal_journal.h"
+#include "principal_snapshot.h"
+#include "log.h"
+#include "utils.h"
+#include "google/protobuf/io/coded_stream.h"
+
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace latte {
+
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::CodedInputStream;
+
+namespace {
+
+constexpr uint32_t JOURNAL_MAGIC = 0x6c6a6e6c;
+constexpr const char *SNAPSHOT_NAME = "principals.snapshot";
+constexpr const char *SNAPSHOT_TMP_NAME = "principals.snapshot.tmp";
+constexpr const char *JOURNAL_PREFIX = "principals.journal.";
+/// length of type and payload, then their checksum
+constexpr size_t RECORD_HEADER_SZ = 8;
+
+enum RecordType: uint8_t {
+  CREATE = 1,
+  DELETE = 2,
+};
+
+inline void put32(std::string &out, uint32_t v) {
+  uint8_t buf[sizeof(v)];
+  CodedOutputStream::WriteLittleEndian32ToArray(v, buf);
+  out.append((const char*)buf, sizeof(buf));
+}
+
+inline void put64(std::string &out, uint64_t v) {
+  uint8_t buf[sizeof(v)];
+  CodedOutputStream::WriteLittleEndian64ToArray(v, buf);
+  out.append((const char*)buf, sizeof(buf));
+}
+
+inline uint32_t get32(const char *p) {
+  uint32_t v;
+  CodedInputStream::ReadLittleEndian32FromArray((const uint8_t*)p, &v);
+  return v;
+}
+
+inline uint64_t get64(const char *p) {
+  uint64_t v;
+  CodedInputStream::ReadLittleEndian64FromArray((const uint8_t*)p, &v);
+  return v;
+}
+
+inline uint32_t checksum(const char *data, size_t len) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, len);
+  return crc.checksum();
+}
+
+/// Starts a record at the end of out, its type and payload are appended
+// by the caller and seal fills in the header.
+inline size_t begin_record(std::string &out, uint8_t type) {
+  size_t start = out.size();
+  out.append(RECORD_HEADER_SZ, '\0');
+  out.push_back((char)type);
+  return start;
+}
+
+inline void seal(std::string &out, size_t start) {
+  const char *body = &out[start + RECORD_HEADER_SZ];
+  size_t len = out.size() - start - RECORD_HEADER_SZ;
+  uint32_t crc = checksum(body, len);
+  CodedOutputStream::WriteLittleEndian32ToArray(len, (uint8_t*)&out[start]);
+  CodedOutputStream::WriteLittleEndian32ToArray(crc, (uint8_t*)&out[start + 4]);
+}
+
+class RecordReader {
+  public:
+    RecordReader(const std::string &data, size_t offset):
+      data_(data), offset_(offset) {}
+
+    /// false at the end, or at a record that is cut short or damaged
+    bool next(uint8_t *type, const char **payload, size_t *len) {
+      if (data_.size() - offset_ < RECORD_HEADER_SZ) {
+        return false;
+      }
+      const char *header = &data_[offset_];
+      uint32_t body_len = get32(header);
+      if (body_len == 0 ||
+          data_.size() - offset_ - RECORD_HEADER_SZ < body_len) {
+        return false;
+      }
+      const char *body = header + RECORD_HEADER_SZ;
+      if (checksum(body, body_len) != get32(header + 4)) {
+        return false;
+      }
+      *type = (uint8_t)body[0];
+      *payload = body + 1;
+      *len = body_len - 1;
+      offset_ += RECORD_HEADER_SZ + body_len;
+      return true;
+    }
+
+    inline size_t offset() const { return offset_; }
+
+  private:
+    const std::string &data_;
+    size_t offset_;
+};
+
+/// false if there is no such file
+bool read_file(int dirfd, const std::string &name, std::string *out) {
+  int fd = ::openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    log_err_throw("can not open %s: %s", name.c_str(), strerror(errno));
+  }
+  struct stat sb;
+  if (::fstat(fd, &sb) != 0) {
+    ::close(fd);
+    log_err_throw("can not stat %s: %s", name.c_str(), strerror(errno));
+  }
+  out->resize(sb.st_size);
+  size_t done = 0;
+  while (done < out->size()) {
+    ssize_t n = ::read(fd, &(*out)[done], out->size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  ::close(fd);
+  out->resize(done);
+  return true;
+}
+
+inline std::string journal_name(uint64_t epoch) {
+  return JOURNAL_PREFIX + utils::itoa(epoch);
+}
+
+}
+
+std::unique_ptr<PrincipalJournal> PrincipalJournal::open(const std::string &dir) {
+  int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0) {
+    log_err("state directory %s not usable: %s, principals are not kept "
+        "across restarts", dir.c_str(), strerror(errno));
+    return nullptr;
+  }
+  return std::unique_ptr<PrincipalJournal>(new PrincipalJournal(dir, dirfd));
+}
+
+PrincipalJournal::PrincipalJournal(const std::string &dir, int dirfd):
+  dir_(dir), dirfd_(dirfd), epoch_(0), pending_(0) {}
+
+PrincipalJournal::~PrincipalJournal() {
+  log_.reset();
+  ::close(dirfd_);
+}
+
+uint64_t PrincipalJournal::recover(PrincipalRegistry &registry) {
+  auto start = std::chrono::steady_clock::now();
+  /// generations of each id, in the order they were created
+  std::unordered_map<uint64_t, std::vector<PrincipalPtr>> state;
+  uint64_t gn = 0;
+  auto apply = [&state, &gn](uint8_t type, const char *payload, size_t len) {
+    if (type == CREATE) {
+      auto p = std::make_shared<proto::Principal>();
+      if (!p->ParseFromArray(payload, len)) {
+        return false;
+      }
+      gn = std::max(gn, p->gn() + 1);
+      state[p->id()].push_back(std::move(p));
+      return true;
+    }
+    if (type == DELETE && len == sizeof(uint64_t)) {
+      state.erase(get64(payload));
+      return true;
+    }
+    return false;
+  };
+
+  uint64_t covered = 0;
+  if (auto snapshot = PrincipalSnapshot::open(dirfd_, SNAPSHOT_NAME)) {
+    covered = snapshot->epoch();
+    gn = snapshot->gn();
+    state.reserve(snapshot->size());
+    for (size_t i = 0; i < snapshot->size(); ++i) {
+      auto p = snapshot->principal((*snapshot)[i]);
+      state[p->id()].push_back(std::move(p));
+    }
+  }
+
+  std::string data;
+  uint8_t type;
+  const char *payload;
+  size_t len;
+  epoch_ = covered;
+  pending_ = 0;
+  for (auto epoch: journals()) {
+    auto name = journal_name(epoch);
+    if (epoch <= covered) {
+      ::unlinkat(dirfd_, name.c_str(), 0);
+      continue;
+    }
+    epoch_ = epoch;
+    if (!read_file(dirfd_, name, &data)) {
+      continue;
+    }
+    if (data.size() < sizeof(uint32_t) || get32(&data[0]) != JOURNAL_MAGIC) {
+      log_err("malformed journal %s in %s, skipped", name.c_str(), dir_.c_str());
+      continue;
+    }
+    RecordReader records(data, sizeof(uint32_t));
+    while (records.next(&type, &payload, &len) && apply(type, payload, len)) {
+      ++pending_;
+    }
+    if (records.offset() != data.size()) {
+      log_err("journal %s in %s: %zu bytes after the last good record dropped",
+          name.c_str(), dir_.c_str(), data.size() - records.offset());
+    }
+  }
+
+  std::vector<PrincipalPtr> all;
+  for (auto &generations: state) {
+    all.insert(all.end(), generations.second.begin(), generations.second.end());
+  }
+  registry.insert_all(all);
+  ++epoch_;
+  open_journal();
+  LATTE_INFO("recovered %zu principals from %s in %lld us", state.size(),
+      dir_.c_str(), (long long)std::chrono::duration_cast<
+        std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+      .count());
+  return gn;
+}
+
+pplx::task<void> PrincipalJournal::created(const proto::Principal &p) {
+  std::string record;
+  auto start = begin_record(record, CREATE);
+  p.AppendToString(&record);
+  seal(record, start);
+  return append(std::move(record));
+}
+
+pplx::task<void> PrincipalJournal::deleted(uint64_t id) {
+  std::string record;
+  auto start = begin_record(record, DELETE);
+  put64(record, id);
+  seal(record, start);
+  return append(std::move(record));
+}
+
+pplx::task<void> PrincipalJournal::append(std::string record) {
+  ++pending_;
+  pplx::task_completion_event<void> durable;
+  log_->append(std::move(record), [this, durable](int err) {
+      if (err == 0) {
+        durable.set();
+        return;
+      }
+      log_err("can not journal in %s: %s", dir_.c_str(), strerror(err));
+      durable.set_exception(std::runtime_error(
+            "principal journal failed: " + std::string(strerror(err))));
+  });
+  return pplx::create_task(durable);
+}
+
+/// the group committer of the previous journal drains before it goes
+uint64_t PrincipalJournal::rotate() {
+  log_.reset();
+  ++epoch_;
+  open_journal();
+  pending_ = 0;
+  return epoch_ - 1;
+}
+
+void PrincipalJournal::snapshot(const std::vector<PrincipalPtr> &state,
+    uint64_t gn, uint64_t epoch) {
+  std::string out = PrincipalSnapshot::build(state, gn, epoch);
+  int fd = ::openat(dirfd_, SNAPSHOT_TMP_NAME,
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool written = fd >= 0 &&
+    utils::reliable_write(fd, out.data(), out.size()) == 0 &&
+    ::fdatasync(fd) == 0;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (!written ||
+      ::renameat(dirfd_, SNAPSHOT_TMP_NAME, dirfd_, SNAPSHOT_NAME) != 0) {
+    log_err("can not write snapshot in %s: %s", dir_.c_str(), strerror(errno));
+    return;
+  }
+  ::fsync(dirfd_);
+  for (auto e: journals()) {
+    if (e <= epoch) {
+      ::unlinkat(dirfd_, journal_name(e).c_str(), 0);
+    }
+  }
+}
+
+/// the journal itself has to be durable before any record in it
+void PrincipalJournal::open_journal() {
+  auto name = journal_name(epoch_);
+  int fd = ::openat(dirfd_, name.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    log_err_throw("can not open journal %s in %s: %s", name.c_str(),
+        dir_.c_str(), strerror(errno));
+  }
+  std::string magic;
+  put32(magic, JOURNAL_MAGIC);
+  int err = utils::reliable_write(fd, magic.data(), magic.size());
+  if (err == 0 && (::fdatasync(fd) != 0 || ::fsync(dirfd_) != 0)) {
+    err = errno;
+  }
+  if (err != 0) {
+    ::close(fd);
+    log_err_throw("can not write journal %s in %s: %s", name.c_str(),
+        dir_.c_str(), strerror(err));
+  }
+  log_ = utils::make_unique<GroupCommitLog>(fd);
+}
+
+/// epochs of the journals in the directory, in order
+std::vector<uint64_t> PrincipalJournal::journals() const {
+  std::vector<uint64_t> epochs;
+  int fd = ::openat(dirfd_, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = fd < 0 ? nullptr : ::fdopendir(fd);
+  if (!dir) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    log_err_throw("can not list %s: %s", dir_.c_str(), strerror(errno));
+  }
+  size_t prefix = strlen(JOURNAL_PREFIX);
+  while (struct dirent *entry = ::readdir(dir)) {
+    if (strncmp(entry->d_name, JOURNAL_PREFIX, prefix) != 0) {
+      continue;
+    }
+    char *end;
+    uint64_t epoch = strtoull(entry->d_name + prefix, &end, 10);
+    if (end != entry->d_name + prefix && *end == '\0') {
+      epochs.push_back(epoch);
+    }
+  }
+  ::closedir(dir);
+  std::sort(epochs.begin(), epochs.end());
+  return epochs;
+}
+
+}
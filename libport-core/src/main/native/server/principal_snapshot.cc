@@ -0,0 +1,229 @@
+#include "principal_snapshot.h"
+#include "log.h"
+
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace latte {
+
+namespace {
+
+constexpr uint32_t SNAPSHOT_MAGIC = 0x6c736e32;
+
+inline uint32_t checksum(const char *data, size_t len) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, len);
+  return crc.checksum();
+}
+
+/// Collects the string table, every distinct string is kept once.
+class StringTable {
+  public:
+    PrincipalSnapshot::StringRef add(const std::string &s) {
+      if (s.empty()) {
+        return {0, 0};
+      }
+      auto found = index_.find(s);
+      if (found != index_.end()) {
+        return found->second;
+      }
+      PrincipalSnapshot::StringRef ref {(uint32_t)data_.size(), (uint32_t)s.size()};
+      data_ += s;
+      index_.emplace(s, ref);
+      return ref;
+    }
+
+    inline const std::string& data() const { return data_; }
+
+  private:
+    std::string data_;
+    std::unordered_map<std::string, PrincipalSnapshot::StringRef> index_;
+};
+
+template<typename T>
+inline void append(std::string &out, const T *items, size_t n) {
+  out.append((const char*)items, sizeof(T) * n);
+}
+
+}
+
+std::string PrincipalSnapshot::build(const std::vector<PrincipalPtr> &state,
+    uint64_t gn, uint64_t epoch) {
+  std::vector<PrincipalPtr> sorted(state);
+  std::sort(sorted.begin(), sorted.end(),
+      [](const PrincipalPtr &a, const PrincipalPtr &b) {
+        return a->id() < b->id() || (a->id() == b->id() && a->gn() < b->gn());
+      });
+
+  StringTable strings;
+  std::vector<Record> records(sorted.size());
+  std::vector<Pair> pairs;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    const proto::Principal &p = *sorted[i];
+    Record &r = records[i];
+    memset(&r, 0, sizeof(r));
+    r.id = p.id();
+    r.gn = p.gn();
+    r.speaker = p.speaker();
+    if (p.has_auth()) {
+      r.flags |= HAS_AUTH;
+      r.misc = p.auth().misc();
+      r.port_lo = p.auth().port_lo();
+      r.port_hi = p.auth().port_hi();
+      r.ip = strings.add(p.auth().ip());
+      r.safe_id = strings.add(p.auth().safe_id());
+    }
+    if (p.has_code()) {
+      r.flags |= HAS_CODE | (p.code().wildcard() ? WILDCARD : 0);
+      r.image = strings.add(p.code().image());
+      r.image_store = strings.add(p.code().image_store());
+      r.pairs = pairs.size();
+      /// map order is unspecified, sort to write the same file every time
+      std::vector<std::pair<std::string, std::string>> config(
+          p.code().config().begin(), p.code().config().end());
+      std::sort(config.begin(), config.end());
+      for (auto &kv: config) {
+        pairs.push_back(Pair{strings.add(kv.first), strings.add(kv.second)});
+      }
+      r.npair = pairs.size() - r.pairs;
+    }
+  }
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.epoch = epoch;
+  header.gn = gn;
+  header.nrecord = records.size();
+  header.npair = pairs.size();
+  header.strings = strings.data().size();
+
+  std::string out;
+  out.reserve(sizeof(header) + sizeof(Record) * records.size() +
+      sizeof(Pair) * pairs.size() + strings.data().size());
+  append(out, &header, 1);
+  append(out, records.data(), records.size());
+  append(out, pairs.data(), pairs.size());
+  out += strings.data();
+  uint32_t crc = checksum(&out[sizeof(header)], out.size() - sizeof(header));
+  memcpy(&out[offsetof(Header, checksum)], &crc, sizeof(crc));
+  return out;
+}
+
+std::unique_ptr<PrincipalSnapshot> PrincipalSnapshot::open(int dirfd,
+    const std::string &name) {
+  int fd = ::openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return nullptr;
+    }
+    log_err_throw("can not open %s: %s", name.c_str(), strerror(errno));
+  }
+  struct stat sb;
+  if (::fstat(fd, &sb) != 0) {
+    ::close(fd);
+    log_err_throw("can not stat %s: %s", name.c_str(), strerror(errno));
+  }
+  size_t size = sb.st_size;
+  if (size < sizeof(Header)) {
+    ::close(fd);
+    log_err_throw("snapshot %s is cut short", name.c_str());
+  }
+  void *base = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    log_err_throw("can not map %s: %s", name.c_str(), strerror(errno));
+  }
+  if (!valid((const char*)base, size)) {
+    ::munmap(base, size);
+    log_err_throw("snapshot %s damaged", name.c_str());
+  }
+  return std::unique_ptr<PrincipalSnapshot>(new PrincipalSnapshot(base, size));
+}
+
+PrincipalSnapshot::PrincipalSnapshot(void *base, size_t size):
+  base_(base), size_(size), header_((const Header*)base),
+  records_((const Record*)(header_ + 1)),
+  pairs_((const Pair*)(records_ + header_->nrecord)),
+  strings_((const char*)(pairs_ + header_->npair)) {}
+
+PrincipalSnapshot::~PrincipalSnapshot() {
+  ::munmap(base_, size_);
+}
+
+bool PrincipalSnapshot::valid(const char *base, size_t size) {
+  const Header &h = *(const Header*)base;
+  size_t body = size - sizeof(Header);
+  /// each section is checked on its own first so the sums can not overflow
+  if (h.magic != SNAPSHOT_MAGIC || h.nrecord > body / sizeof(Record) ||
+      h.npair > body / sizeof(Pair) || h.strings > body ||
+      h.nrecord * sizeof(Record) + h.npair * sizeof(Pair) + h.strings != body ||
+      checksum(base + sizeof(Header), body) != h.checksum) {
+    return false;
+  }
+  auto records = (const Record*)(base + sizeof(Header));
+  auto pairs = (const Pair*)(records + h.nrecord);
+  auto in_table = [&h](const StringRef &s) {
+    return (uint64_t)s.offset + s.size <= h.strings;
+  };
+  for (size_t i = 0; i < h.nrecord; ++i) {
+    const Record &r = records[i];
+    if (!in_table(r.ip) || !in_table(r.safe_id) || !in_table(r.image) ||
+        !in_table(r.image_store) || (uint64_t)r.pairs + r.npair > h.npair) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < h.npair; ++i) {
+    if (!in_table(pairs[i].key) || !in_table(pairs[i].value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const PrincipalSnapshot::Record* PrincipalSnapshot::find(uint64_t id) const {
+  auto end = records_ + header_->nrecord;
+  auto found = std::upper_bound(records_, end, id,
+      [](uint64_t id, const Record &r) { return id < r.id; });
+  if (found == records_ || (found - 1)->id != id) {
+    return nullptr;
+  }
+  return found - 1;
+}
+
+PrincipalSnapshot::PrincipalPtr PrincipalSnapshot::principal(
+    const Record &r) const {
+  auto p = std::make_shared<proto::Principal>();
+  p->set_id(r.id);
+  p->set_gn(r.gn);
+  p->set_speaker(r.speaker);
+  if (r.flags & HAS_AUTH) {
+    auto auth = p->mutable_auth();
+    auth->set_ip(strings_ + r.ip.offset, r.ip.size);
+    auth->set_port_lo(r.port_lo);
+    auth->set_port_hi(r.port_hi);
+    auth->set_misc(r.misc);
+    auth->set_safe_id(strings_ + r.safe_id.offset, r.safe_id.size);
+  }
+  if (r.flags & HAS_CODE) {
+    auto code = p->mutable_code();
+    code->set_image(strings_ + r.image.offset, r.image.size);
+    code->set_image_store(strings_ + r.image_store.offset, r.image_store.size);
+    code->set_wildcard((r.flags & WILDCARD) != 0);
+    auto config = code->mutable_config();
+    for (auto kv = pairs(r), end = kv + r.npair; kv != end; ++kv) {
+      (*config)[str(kv->key)] = str(kv->value);
+    }
+  }
+  return p;
+}
+
+}
@@ -4,6 +4,7 @@
 #include "server.h"
 #include "session.h"
 #include "manager.h"
+#include "metrics_server.h"
 
 
 namespace latte {
@@ -11,12 +12,30 @@ namespace latte {
 void Server::start() {
   manager_ = get_manager();
   start_accept();
+  log("server running on %zu threads", nthreads_);
+  for (size_t i = 1; i < nthreads_; ++i) {
+    workers_.emplace_back([this]() { service_.run(); });
+  }
   service_.run();
+  for (auto &worker: workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+void Server::stop() {
+  service_.stop();
+}
+
+void Server::serve_metrics(const std::string &endpoint) {
+  metrics_ = MetricsServer::create(service_, endpoint, metrics());
+  metrics_->start();
+  log("metrics served on %s", endpoint.c_str());
 }
 
 void Server::start_accept() {
   auto session = Session::create(service_, manager_);
-  log("waiting for new session");
+  LATTE_DEBUG("waiting for new session");
   listener_.async_accept(session->socket(),
       std::bind(&Server::new_session, this, session, std::placeholders::_1));
 }
@@ -24,7 +43,8 @@ void Server::start_accept() {
 void Server::new_session(std::shared_ptr<Session> session,
     const boost::system::error_code &ec) {
   if (!ec) {
-    log("starting new session");
+    LATTE_DEBUG("starting new session");
+    sessions_->inc();
     session->start();
   }
   start_accept();
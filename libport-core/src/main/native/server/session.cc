@@ -1,14 +1,23 @@
 
 #include "session.h"
 #include <boost/asio.hpp>
+#include <string.h>
+#include <unistd.h>
 
 
 
 namespace latte {
 Session::Session(io_service &service, std::shared_ptr<LatteDispatcher> dispatcher): 
-  s_(service), dispatcher_(dispatcher) {
+  service_(service), strand_(service), s_(service), rcv_magic_(PROTO_MAGIC),
+  rcv_at_us_(0),
+  rcv_buf_(RECV_BUFSZ),
+  snd_buf_(SEND_BUFSZ),
+  arenas_(ArenaPool::create()), dispatcher_(dispatcher), writing_(false),
+  reading_(false), inflight_(0), authenticated_(false),
+  active_(metrics().gauge("attguard_sessions_active")), ring_count_(0),
+  ring_reading_(false) {
     sid_ = utils::gen_rand_uint64();
-    log("session %u created", sid_);
+    LATTE_DEBUG("session %llu created", (unsigned long long)sid_);
   }
 
 
@@ -18,7 +27,8 @@ bool Session::authenticate() {
   pid_ = std::get<0>(ids);
   uid_ = std::get<1>(ids);
   gid_ = std::get<2>(ids);
-  log("session authentication: %u %u %u", pid_, uid_, gid_);
+  LATTE_DEBUG("session authentication: %llu %llu %llu", (unsigned long long)pid_,
+      (unsigned long long)uid_, (unsigned long long)gid_);
   /// pid can't be 0
   if (pid_ == 0) {
     return false;
@@ -27,129 +37,329 @@ bool Session::authenticate() {
 }
 
 void Session::proto_start() {
-  log("session %u proto starts\n", sid_);
-  async_read(s_, buffer(rcv_buf_, COMM_HEADER_SZ),
-      std::bind(&Session::header_received, shared_from_this(),
-        std::placeholders::_1, std::placeholders::_2));
+  if (reading_ || inflight_ >= MAX_PIPELINED_COMMANDS || !s_.is_open()) {
+    return;
+  }
+  LATTE_DEBUG("session %llu waits for command, %zu in flight",
+      (unsigned long long)sid_, inflight_);
+  reading_ = true;
+  async_read(s_, buffer(rcv_hdr_),
+      strand_.wrap(std::bind(&Session::header_received, shared_from_this(),
+        std::placeholders::_1, std::placeholders::_2)));
 }
 
 void Session::header_received(const boost::system::error_code &ec, size_t len) {
+  reading_ = false;
   if (ec) {
     log("error in receving header: %s", ec.message().c_str());
     stop();
     return ;
   }
   if (len < COMM_HEADER_SZ) {
-    log("received %d for header, expect %d, abort", len, COMM_HEADER_SZ);
+    LATTE_WARN("received %zu for header, expect %d, abort", len, COMM_HEADER_SZ);
     stop();
     return;
   }
 
   uint32_t size, magic;
-  CodedInputStream::ReadLittleEndian32FromArray(&rcv_buf_[0], &size);
-  CodedInputStream::ReadLittleEndian32FromArray(
-      &rcv_buf_[sizeof(size)], &magic);
-  if (magic != PROTO_MAGIC) {
-    log("warning: magic differs: %x, expect %x", magic, PROTO_MAGIC);
-  }
-  if (size > RECV_BUFSZ) {
-    //// should have a maximum bound for the size or alternative
-    //receive mechanism for super large thing. And should have a timer.
-    large_rcv_buf_ = std::vector<uint8_t>(size, 0);
-    async_read(s_, buffer(large_rcv_buf_, size),
-        std::bind(&Session::command_received, shared_from_this(),
-          std::placeholders::_1, size, &large_rcv_buf_[0]));
-  } else {
-    async_read(s_, buffer(rcv_buf_, size),
-        std::bind(&Session::command_received, shared_from_this(),
-          std::placeholders::_1, size, &rcv_buf_[0]));
+  decode_frame_header(&rcv_hdr_[0], &size, &magic);
+  if (magic != PROTO_MAGIC && magic != PROTO_MAGIC_V2) {
+    LATTE_WARN("magic differs: %x, expect %x", magic, PROTO_MAGIC_V2);
   }
+  rcv_magic_ = magic;
+  rcv_at_us_ = trace_now_us();
+  reading_ = true;
+  //// should have a maximum bound for the size or alternative
+  //receive mechanism for super large thing. And should have a timer.
+  async_read(s_, buffer(rcv_buf_.reserve(size), size),
+      strand_.wrap(std::bind(&Session::command_received, shared_from_this(),
+        std::placeholders::_1, size)));
 }
 
-void Session::command_received(const boost::system::error_code &ec, size_t len, uint8_t *data) {
-  utils::Guards<void(void)>([this, len]() { 
-      if (len > RECV_BUFSZ) {
-      clear_large_rcv_buffer(); 
-      }
-    });
+void Session::command_received(const boost::system::error_code &ec, size_t len) {
+  reading_ = false;
   if (ec) {
     log("error in receving command: %s", ec.message().c_str());
     stop();
     return ;
   }
-  auto result = std::make_shared<proto::Command>();
-  if (!result->ParseFromArray(data, len)) {
+  /// answer in the format the peer reads
+  bool parsed = dispatch_command(rcv_buf_.reserve(len), len,
+      rcv_magic_ == PROTO_MAGIC_V2, false, rcv_at_us_);
+  rcv_buf_.release();
+  if (!parsed) {
     log("error parsing received command");
     stop();
     return ;
   }
+  /// the receive buffer is free again, read the next command right away
+  proto_start();
+}
+
+bool Session::dispatch_command(const uint8_t *data, size_t len, bool v2,
+    bool ring, int64_t rcv_at_us) {
+  auto arena = arenas_->acquire();
+  std::shared_ptr<proto::Command> result(arena,
+      google::protobuf::Arena::CreateMessage<proto::Command>(arena.get()));
+  if (!result->ParseFromArray(data, len)) {
+    return false;
+  }
   /// process should be async processing in fact.
   /// Response resp = process_cmd(command)
   result->set_pid(pid_);
   result->set_uid(uid_);
   result->set_gid(gid_);
-  log("command received, auth %s, type %s", result->auth().c_str(),
+  LATTE_DEBUG("command received, auth %s, type %s", result->auth().c_str(),
       result->Type_Name(result->type()).c_str());
-  dispatcher_->dispatch(result, std::bind(&Session::write_response,
-        shared_from_this(), std::placeholders::_1));
+  auto id = result->id();
+  if (result->type() == proto::Command::OPEN_RING && !ring) {
+    open_ring(id, v2);
+    return true;
+  }
+  auto self = shared_from_this();
+  auto trace = begin_trace(*result, rcv_at_us);
+  inflight_++;
+  {
+    TraceScope scope(trace);
+    dispatcher_->dispatch(result, [self, id, v2, trace, ring](
+          std::shared_ptr<proto::Response> resp) {
+        resp->set_id(id);
+        if (!v2) {
+          proto::downgrade(resp.get());
+        }
+        self->write_response(std::move(resp), trace, ring);
+    });
+  }
+  return true;
+}
+
+/// A traced command starts when liblatte sent it, or when it arrived if
+// the client did not stamp it.
+std::shared_ptr<RequestTrace> Session::begin_trace(const proto::Command &cmd,
+    int64_t rcv_at_us) {
+  auto &traces = slow_traces();
+  if (!traces.enabled()) {
+    return nullptr;
+  }
+  bool stamped = cmd.sent_at_us() > 0 && cmd.sent_at_us() <= rcv_at_us;
+  auto trace = traces.begin(cmd.trace_id() ? cmd.trace_id() : cmd.id(),
+      cmd.Type_Name(cmd.type()), stamped ? cmd.sent_at_us() : rcv_at_us);
+  if (stamped) {
+    trace->span("socket", cmd.sent_at_us(), rcv_at_us);
+  }
+  trace->span("read", rcv_at_us, trace_now_us());
+  return trace;
 }
 
-static inline void serialize_msg(const proto::Response &resp,
-    unsigned char *ptr) {
-  uint32_t sz = resp.ByteSize();
-  CodedOutputStream::WriteLittleEndian32ToArray(sz, ptr);
-  CodedOutputStream::WriteLittleEndian32ToArray(PROTO_MAGIC,
-      ptr + sizeof(uint32_t));
-  resp.SerializeToArray(ptr + COMM_HEADER_SZ, sz);
+/// callback for dispatcher, may run on any thread
+void Session::write_response(std::shared_ptr<proto::Response> resp,
+    std::shared_ptr<RequestTrace> trace, bool ring) {
+  int64_t ready_us = trace ? trace_now_us() : 0;
+  strand_.post(std::bind(&Session::enqueue_response, shared_from_this(),
+        Outgoing{std::move(resp), std::move(trace), ready_us, 0, ring, false}));
 }
 
-/// callback for dispatcher
-void Session::write_response(std::shared_ptr<proto::Response> resp) {
-  size_t msgsz = resp->ByteSize() + COMM_HEADER_SZ;
-  log("response: %u bytes, result type %s", msgsz, 
+void Session::enqueue_response(Outgoing out) {
+  outq_.push_back(std::move(out));
+  if (!writing_) {
+    send_next();
+  }
+}
+
+void Session::send_next() {
+  auto &out = outq_.front();
+  auto &resp = out.resp;
+  if (out.trace) {
+    out.sending_us = trace_now_us();
+    out.trace->span("queued", out.ready_us, out.sending_us);
+  }
+  /// sizes are computed once and cached in the message for serializing
+  uint32_t size = resp->ByteSizeLong();
+  LATTE_DEBUG("response %lld: %u bytes, result type %s", (long long)resp->id(), size,
       resp->Type_Name(resp->type()).c_str());
-  if (msgsz > SEND_BUFSZ) {
-    large_snd_buf_ = decltype(large_snd_buf_)(msgsz, 0);
-    serialize_msg(*resp, &large_snd_buf_[0]);
-    async_write(s_, buffer(large_snd_buf_, msgsz),
-        std::bind(&Session::response_sent, shared_from_this(),
-          std::placeholders::_1, std::placeholders::_2));
-  } else {
-    serialize_msg(*resp, &snd_buf_[0]);
-    async_write(s_, buffer(snd_buf_, msgsz),
-        std::bind(&Session::response_sent, shared_from_this(),
-          std::placeholders::_1, msgsz));
+  writing_ = true;
+  if (out.ring && send_to_ring(size)) {
+    return;
   }
+  encode_frame_header(size, &snd_hdr_[0]);
+  auto payload = snd_buf_.reserve(size);
+  resp->SerializeWithCachedSizesToArray(payload);
+  if (out.pass_ring) {
+    send_with_ring(size);
+    return;
+  }
+  std::array<const_buffer, 2> frame = {{
+    buffer(snd_hdr_), buffer(payload, size)
+  }};
+  async_write(s_, frame,
+      strand_.wrap(std::bind(&Session::response_sent, shared_from_this(),
+        std::placeholders::_1, size + COMM_HEADER_SZ)));
 }
 
-void Session::response_sent(const boost::system::error_code &ec, size_t len) {
-  utils::Guards<void(void)>([this, len] () {
-      if (len > SEND_BUFSZ) {
-      clear_large_snd_buffer();
-      }
-      });
+void Session::response_sent(const boost::system::error_code &ec, size_t) {
+  snd_buf_.release();
+  writing_ = false;
+  auto &out = outq_.front();
+  if (out.trace) {
+    auto now = trace_now_us();
+    out.trace->span("write", out.sending_us, now);
+    slow_traces().finish(*out.trace, now);
+  }
+  outq_.pop_front();
+  inflight_--;
   if (ec) {
     log_err("error in sending response: %s", ec.message().c_str());
     stop();
     return;
   }
+  if (!outq_.empty()) {
+    send_next();
+  }
+  /// resume reading if the pipeline was full
   proto_start();
+  ring_start();
 }
 
+/// Responses that fit a slot never touch the socket and are done right
+// away, so a run of them recurses through response_sent at most as deep as
+// the pipeline. A larger one leaves a marker in the ring and is written to
+// the socket, false is returned for that.
+bool Session::send_to_ring(uint32_t size) {
+  auto &out = outq_.front();
+  auto &responses = ring_->responses();
+  if (responses.full()) {
+    /// the client has more commands out than the ring has slots
+    LATTE_WARN("session %llu: response ring overrun", (unsigned long long)sid_);
+    response_sent(boost::asio::error::no_buffer_space, 0);
+    return true;
+  }
+  bool wake;
+  bool fits = size <= ShmRing::MAX_PAYLOAD;
+  if (fits) {
+    out.resp->SerializeWithCachedSizesToArray(responses.next());
+    wake = responses.publish(size);
+  } else {
+    int64_t id = out.resp->id();
+    memcpy(responses.next(), &id, sizeof(id));
+    wake = responses.publish(sizeof(id), ShmRing::ON_SOCKET);
+  }
+  if (wake) {
+    ShmChannel::notify(ring_->response_fd());
+  }
+  if (fits) {
+    response_sent(boost::system::error_code(), size);
+  }
+  return fits;
 }
 
+/// The fds go with the first byte of the frame, the socket is non blocking
+// so the send is retried once it is writable.
+void Session::send_with_ring(size_t size) {
+  std::vector<uint8_t> frame(snd_hdr_.begin(), snd_hdr_.end());
+  auto payload = snd_buf_.reserve(size);
+  frame.insert(frame.end(), payload, payload + size);
+  auto self = shared_from_this();
+  ssize_t sent = utils::send_with_fds(s_.native_handle(), frame.data(),
+      frame.size(), ring_->fds(), ShmChannel::NFD);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    s_.async_wait(local::stream_protocol::socket::wait_write,
+        strand_.wrap([self, size](const boost::system::error_code &ec) {
+          if (ec) {
+            self->response_sent(ec, 0);
+          } else {
+            self->send_with_ring(size);
+          }
+        }));
+    return;
+  }
+  if (sent < 0) {
+    response_sent(boost::system::error_code(errno,
+          boost::system::system_category()), 0);
+    return;
+  }
+  auto rest = std::make_shared<std::vector<uint8_t>>(frame.begin() + sent,
+      frame.end());
+  async_write(s_, buffer(*rest),
+      strand_.wrap([self, rest](const boost::system::error_code &ec,
+          size_t len) {
+        self->response_sent(ec, len);
+      }));
+}
 
+/// One channel per session, liblatte asks right after connecting.
+void Session::open_ring(int64_t id, bool v2) {
+  std::shared_ptr<proto::Response> resp;
+  bool opened = false;
+  if (ring_) {
+    resp = proto::make_shared_status_response(false, "ring already open");
+  } else if (!(ring_ = ShmChannel::create())) {
+    resp = proto::make_shared_status_response(false, "no shared memory ring");
+  } else {
+    resp = proto::make_shared_status_response(true, "");
+    opened = true;
+  }
+  resp->set_id(id);
+  if (!v2) {
+    proto::downgrade(resp.get());
+  }
+  inflight_++;
+  enqueue_response(Outgoing{std::move(resp), nullptr, 0, 0, false, opened});
+  if (opened) {
+    ring_wakeup_ = utils::make_unique<posix::stream_descriptor>(
+        service_, ::dup(ring_->command_fd()));
+    LATTE_DEBUG("session %llu opened a shared memory ring",
+        (unsigned long long)sid_);
+    ring_start();
+  }
+}
 
+void Session::ring_start() {
+  if (!ring_wakeup_ || ring_reading_ || !s_.is_open()) {
+    return;
+  }
+  auto &commands = ring_->commands();
+  while (inflight_ < MAX_PIPELINED_COMMANDS) {
+    const uint8_t *payload;
+    uint32_t size, flags;
+    int ready = commands.peek(&payload, &size, &flags);
+    if (ready < 0) {
+      LATTE_WARN("session %llu: corrupted command ring", (unsigned long long)sid_);
+      stop();
+      return;
+    }
+    if (ready == 0) {
+      if (!commands.sleep()) {
+        continue;
+      }
+      ring_reading_ = true;
+      ring_wakeup_->async_read_some(buffer(&ring_count_, sizeof(ring_count_)),
+          strand_.wrap(std::bind(&Session::ring_notified, shared_from_this(),
+              std::placeholders::_1)));
+      return;
+    }
+    memcpy(ring_buf_.data(), payload, size);
+    commands.pop();
+    /// rcv_at_us_ belongs to a socket frame that may be half read
+    if (!dispatch_command(ring_buf_.data(), size, true, true,
+          trace_now_us())) {
+      log("error parsing command from the ring");
+      stop();
+      return;
+    }
+  }
+}
 
+void Session::ring_notified(const boost::system::error_code &ec) {
+  ring_reading_ = false;
+  if (ec) {
+    if (ec != boost::asio::error::operation_aborted) {
+      log_err("error in waiting on the ring: %s", ec.message().c_str());
+    }
+    stop();
+    return;
+  }
+  ring_->commands().wake();
+  ring_start();
+}
 
-
-
-
-
-
-
-
-
-
-
-
+}
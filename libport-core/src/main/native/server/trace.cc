@@ -0,0 +1,91 @@
+#include "trace.h"
+#include "config.h"
+#include "log.h"
+#include "utils.h"
+#include <unistd.h>
+
+namespace latte {
+
+static void append_escaped(std::string &out, const std::string &s) {
+  for (char c: s) {
+    switch (c) {
+      case '\\': out += "\\\\"; break;
+      case '"': out += "\\\""; break;
+      case '\n': out += "\\n"; break;
+      default: out += c;
+    }
+  }
+}
+
+static void append_event(std::string &out, const std::string &name,
+    int64_t start_us, int64_t end_us, int pid, uint32_t tid,
+    const std::string &args) {
+  char buf[128];
+  out += "{\"name\":\"";
+  append_escaped(out, name);
+  snprintf(buf, sizeof(buf),
+      "\",\"cat\":\"attguard\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+      "\"pid\":%d,\"tid\":%u", (long long)start_us,
+      (long long)(end_us > start_us ? end_us - start_us : 0), pid, tid);
+  out += buf;
+  if (!args.empty()) {
+    out += ",\"args\":{" + args + "}";
+  }
+  out += "},\n";
+}
+
+SlowTraceLog::SlowTraceLog(const std::string &path, uint32_t threshold_ms):
+  file_(nullptr), threshold_us_(int64_t(threshold_ms) * 1000) {
+  if (threshold_ms == 0) {
+    return;
+  }
+  file_ = std::fopen(path.c_str(), "w");
+  if (!file_) {
+    log_err("can not open trace file %s, tracing disabled", path.c_str());
+    return;
+  }
+  std::fputs("[\n", file_);
+  std::fflush(file_);
+}
+
+SlowTraceLog::~SlowTraceLog() {
+  if (file_) {
+    std::fclose(file_);
+  }
+}
+
+/// Chrome wants an integer row, the trace id goes in the arguments
+std::string SlowTraceLog::format(const RequestTrace &trace, int64_t end_us,
+    int pid) {
+  uint32_t tid = static_cast<uint32_t>(trace.trace_id() & 0x7fffffff);
+  std::string out;
+  append_event(out, trace.name(), trace.start_us(), end_us, pid, tid,
+      "\"trace_id\":\"" + utils::itoa<uint64_t, utils::HexType>(
+        trace.trace_id()) + "\"");
+  for (auto &span: trace.spans()) {
+    append_event(out, span.name, span.start_us, span.end_us, pid, tid, "");
+  }
+  return out;
+}
+
+void SlowTraceLog::finish(const RequestTrace &trace, int64_t end_us) {
+  if (!file_ || end_us - trace.start_us() < threshold_us_) {
+    return;
+  }
+  auto events = format(trace, end_us, ::getpid());
+  std::lock_guard<std::mutex> guard(lock_);
+  std::fputs(events.c_str(), file_);
+  std::fflush(file_);
+}
+
+/// never destroyed, sessions may finish traces during exit
+SlowTraceLog &slow_traces() {
+  static SlowTraceLog *instance = new SlowTraceLog(
+      config::trace_file().empty() ?
+        "/tmp/attguard-trace" + utils::itoa(::getpid()) + ".json" :
+        config::trace_file(),
+      config::trace_slow_ms());
+  return *instance;
+}
+
+}
@@ -1,10 +1,17 @@
-
 #include "store.h"
 #include "utils.h"
-
-#include <crypto++/sha.h>
-#include <crypto++/hex.h>
-#include <mutex>
+#include "log.h"
+#include "group_commit_log.h"
+#include "google/protobuf/io/coded_stream.h"
+
+#include <boost/crc.hpp>
+#include <openssl/sha.h>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -14,109 +21,187 @@
 
 
 /// A simple implementation for persistency
+//
+// Messages are kept in an append-only log, known by their SHA-256. Adds and
+// removals are group committed: concurrent callers share one write and one
+// fdatasync, and each returns once its own record is durable. Digests are
+// computed by the callers, so nothing is serialized before the commit.
+//
+// Records are framed as in the principal journal, with their length and a
+// crc32 of the body. A record cut short by a crash is dropped when the store
+// is opened, so later records never follow a damaged one.
 
 class FileStore : public StoreManager{
 
   public:
-    static constexpr int MAX_DIGEST_SZ = 2048;
     static constexpr const char *SYNC_DIR = "/var/lib/attguard";
+    static constexpr const char *LOG_NAME = "store.log";
 
     GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(FileStore);
 
-    FileStore(): FileStore(latte::utils::make_unique<CryptoPP::SHA256>()) {}
-
-    FileStore(std::unique_ptr<CryptoPP::HashTransformation> hasher):
-          StoreManager(), hasher_(std::move(hasher)) {
-        if (hasher_->DigestSize() > MAX_DIGEST_SZ) {
-          throw std::runtime_error("hash digest size larger than expected");
+    /// prototype tells the type of the stored messages to load
+    FileStore(const google::protobuf::Message &prototype,
+        const std::string &dir = SYNC_DIR):
+          StoreManager(), prototype_(prototype), path_(dir + "/" + LOG_NAME) {
+        std::string data = read_log();
+        size_t good = scan(data, nullptr);
+        if (good < data.size()) {
+          latte::log_err("store %s: %zu bytes after the last good record "
+              "dropped", path_.c_str(), data.size() - good);
+          if (::truncate(path_.c_str(), good) != 0) {
+            latte::log_err_throw("can not truncate store %s: %s",
+                path_.c_str(), strerror(errno));
+          }
         }
+        int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+        if (fd < 0) {
+          latte::log_err_throw("can not open store %s: %s", path_.c_str(),
+              strerror(errno));
+        }
+        log_ = latte::utils::make_unique<latte::GroupCommitLog>(fd);
       }
 
-    ~FileStore() {
-      if (dirfd_ > 0) {
-        close(dirfd_);
-      }
-    }
-
     bool add(const google::protobuf::Message &msg) override {
-
-      /// copied twice, not elegant, we may use some other approach
       std::string s = msg.SerializeAsString();
-      std::array<uint8_t, MAX_DIGEST_SZ> local_digest;
-      {
-        std::lock_guard<std::mutex> g(sync_lock_);
-        hasher_->CalculateDigest(&digest_buffer_[0], (uint8_t*) s.c_str(),
-            s.size());
-        local_digest.swap(digest_buffer_);
-      }
-      std::string fname = digest_to_hex(&local_digest[0],
-          hasher_->DigestSize());
-
-      return sync_file(fname, std::move(s));
+      return commit(ADD, digest(s), s);
     }
 
     bool remove(const google::protobuf::Message &msg) override {
       std::string s = msg.SerializeAsString();
-      std::array<uint8_t, MAX_DIGEST_SZ> local_digest;
-      {
-        std::lock_guard<std::mutex> g(sync_lock_);
-        hasher_->CalculateDigest(&digest_buffer_[0], (uint8_t*) s.c_str(),
-            s.size());
-        local_digest.swap(digest_buffer_);
+      return commit(REMOVE, digest(s), "");
+    }
+
+    /// messages added and not removed since, in the order they were added
+    std::vector<std::shared_ptr<google::protobuf::Message>> load() override {
+      log_->flush();
+      std::vector<std::pair<std::string, std::string>> added;
+      scan(read_log(), &added);
+
+      std::vector<std::shared_ptr<google::protobuf::Message>> result;
+      for (auto &entry: added) {
+        if (entry.first.empty()) {
+          continue;
+        }
+        std::shared_ptr<google::protobuf::Message> msg(prototype_.New());
+        if (msg->ParseFromString(entry.second)) {
+          result.push_back(std::move(msg));
+        }
       }
-      std::string fname = digest_to_hex(&local_digest[0],
-          hasher_->DigestSize());
-      unlinkat(dirfd_, fname.c_str(), 0);
-      return true;
+      return result;
     }
 
 
   private:
+    enum RecordType: uint8_t {
+      ADD = 1,
+      REMOVE = 2,
+    };
+    /// length of what follows the header and its checksum
+    static constexpr size_t HEADER_SZ = 2 * sizeof(uint32_t);
+    /// type and digest size
+    static constexpr size_t PREFIX_SZ = 2;
+
+    static std::string digest(const std::string &data) {
+      std::string result(SHA256_DIGEST_LENGTH, '\0');
+      SHA256((const uint8_t*) data.data(), data.size(), (uint8_t*) &result[0]);
+      return result;
+    }
 
-    void init() {
-      dirfd_ = open(SYNC_DIR, O_DIRECTORY);
-      if (dirfd_ < 0) {
-        latte::log_err_throw("can not open sync directory ",
-            SYNC_DIR, strerror(errno));
-      }
+    static uint32_t checksum(const char *data, size_t len) {
+      boost::crc_32_type crc;
+      crc.process_bytes(data, len);
+      return crc.checksum();
     }
 
-    std::string digest_to_hex(uint8_t *data, size_t sz) {
-      CryptoPP::HexEncoder encoder;
-      encoder.Put(data, sz);
-      encoder.MessageEnd();
-      std::string result(encoder.MaxRetrievable(), 0);
-      encoder.Get((uint8_t*) &result[0], result.size());
-      return result;
+    std::string read_log() const {
+      std::ifstream in(path_, std::ios::binary);
+      return std::string((std::istreambuf_iterator<char>(in)),
+          std::istreambuf_iterator<char>());
     }
 
-    bool sync_file(const std::string &fname, std::string data) {
-      struct stat fmeta;
-      if (fstatat(dirfd_, fname.c_str(), &fmeta, 0) == 0) {
-        latte::log_err("file %s already existed", fname.c_str());
-        return false;
+    /// Replays the records of data into added, removed entries keep an
+    // empty key. Returns where the last good record ends.
+    static size_t scan(const std::string &data,
+        std::vector<std::pair<std::string, std::string>> *added) {
+      std::unordered_map<std::string, size_t> index;
+      size_t offset = 0;
+      while (data.size() - offset >= HEADER_SZ) {
+        uint32_t len, crc;
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+            (const uint8_t*)&data[offset], &len);
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+            (const uint8_t*)&data[offset + sizeof(uint32_t)], &crc);
+        const char *body = &data[offset + HEADER_SZ];
+        if (len < PREFIX_SZ || data.size() - offset - HEADER_SZ < len ||
+            checksum(body, len) != crc ||
+            (uint8_t)body[1] > len - PREFIX_SZ) {
+          break;
+        }
+        offset += HEADER_SZ + len;
+        if (!added) {
+          continue;
+        }
+        std::string key(body + PREFIX_SZ, (uint8_t)body[1]);
+        if (body[0] == ADD) {
+          index[key] = added->size();
+          added->emplace_back(std::move(key),
+              std::string(body + PREFIX_SZ + (uint8_t)body[1],
+                len - PREFIX_SZ - (uint8_t)body[1]));
+        } else {
+          auto found = index.find(key);
+          if (found != index.end()) {
+            (*added)[found->second].first.clear();
+            index.erase(found);
+          }
+        }
       }
+      return offset;
+    }
 
-      int fd = openat(dirfd_, fname.c_str(),
-          O_CREAT | O_TRUNC | O_WRONLY, 0644);
-      FILE* f = fdopen(fd, "r");
-      if (fwrite(data.c_str(), 1, data.size(), f) != data.size()) {
-        if (ferror(f)) {
-          latte::log_err("error in writing file %s\n", fname.c_str());
-          return false;
-        }
-        latte::log("partial data written to file %s\n");
+    bool commit(RecordType type, const std::string &key,
+        const std::string &payload) {
+      std::string record(HEADER_SZ, '\0');
+      record.push_back((char)type);
+      record.push_back((char)key.size());
+      record += key;
+      record += payload;
+      size_t len = record.size() - HEADER_SZ;
+      google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+          len, (uint8_t*) &record[0]);
+      google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+          checksum(&record[HEADER_SZ], len),
+          (uint8_t*) &record[sizeof(uint32_t)]);
+
+      std::promise<int> durable;
+      auto result = durable.get_future();
+      log_->append(std::move(record), [&durable](int err) {
+          durable.set_value(err);
+      });
+      int err = result.get();
+      if (err != 0) {
+        latte::log_err("error in writing store %s: %s", path_.c_str(),
+            strerror(err));
+        return false;
       }
-      fclose(f);
       return true;
     }
 
 
-    std::unique_ptr<CryptoPP::HashTransformation> hasher_;
-    std::array<uint8_t, MAX_DIGEST_SZ> digest_buffer_;
-    std::mutex sync_lock_;
-    int dirfd_;
+    const google::protobuf::Message &prototype_;
+    std::string path_;
+    std::unique_ptr<latte::GroupCommitLog> log_;
 
 
 };
 
+std::unique_ptr<StoreManager> open_file_store(
+    const google::protobuf::Message &prototype) {
+  return latte::utils::make_unique<FileStore>(prototype);
+}
+
+std::unique_ptr<StoreManager> open_file_store(
+    const google::protobuf::Message &prototype, const std::string &dir) {
+  return latte::utils::make_unique<FileStore>(prototype, dir);
+}
+
@@ -102,5 +102,85 @@ class MockMetadataClient: public MetadataServiceClient {
         uint32_t, port, const std::string&, object,
         const std::string&, bearer, override)
 
+    //// The manager drives the asynchronous interface, route it back to the
+    // mocked blocking calls so call counts and arguments are recorded.
+    pplx::task<void> post_object_acl_async(const std::string &speaker,
+        const std::string &obj_id, const std::string &requirements) override {
+      post_object_acl(speaker, obj_id, requirements);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<void> endorse_image_async(const std::string &speaker,
+        const std::string &image_hash, const std::string &endorsement,
+        const std::string &config) override {
+      endorse_image(speaker, image_hash, endorsement, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<bool> has_property_async(const std::string &speaker,
+        const std::string &principal_ip, uint32_t port,
+        const std::string &property, const std::string &bearer) override {
+      return pplx::task_from_result(has_property(speaker, principal_ip, port,
+            property, bearer));
+    }
+
+    pplx::task<bool> can_access_async(const std::string &speaker,
+        const std::string &principal_ip, uint32_t port,
+        const std::string &access_object, const std::string &bearer) override {
+      return pplx::task_from_result(can_access(speaker, principal_ip, port,
+            access_object, bearer));
+    }
+
+    pplx::task<bool> image_has_property_async(const std::string &speaker,
+        const std::string &image, const std::string &config,
+        const std::string &property) override {
+      return pplx::task_from_result(image_has_property(speaker, image, config,
+            property));
+    }
+
+    pplx::task<void> endorse_attester_async(const std::string &speaker,
+        const std::string &image_id, const std::string &config) override {
+      endorse_attester(speaker, image_id, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<void> endorse_builder_async(const std::string &speaker,
+        const std::string &image_id, const std::string &config) override {
+      endorse_builder(speaker, image_id, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<void> endorse_membership_async(const std::string &speaker,
+        const std::string &ip, uint32_t port, uint64_t gn,
+        const std::string &endorse, const std::string &config) override {
+      endorse_membership(speaker, ip, port, gn, endorse, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<void> endorse_attester_on_source_async(const std::string &speaker,
+        const std::string &source_id, const std::string &config) override {
+      endorse_attester_on_source(speaker, source_id, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<void> endorse_builder_on_source_async(const std::string &speaker,
+        const std::string &source_id, const std::string &config) override {
+      endorse_builder_on_source(speaker, source_id, config);
+      return pplx::task_from_result();
+    }
+
+    pplx::task<std::string> attest_async(const std::string &speaker,
+        const std::string &ip, uint32_t port,
+        const std::string &bearer) override {
+      return pplx::task_from_result(attest(speaker, ip, port, bearer));
+    }
+
+    pplx::task<bool> can_worker_access_async(const std::string &speaker,
+        const std::string &ip, uint32_t port, const std::string &object,
+        const std::string &bearer) override {
+      return pplx::task_from_result(can_worker_access(speaker, ip, port,
+            object, bearer));
+    }
+
 };
 }
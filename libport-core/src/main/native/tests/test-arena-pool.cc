@@ -0,0 +1,84 @@
+#include "arena_pool.h"
+#include "proto/statement.pb.h"
+#include "proto/utils.h"
+
+#include <thread>
+
+#define BOOST_TEST_MODULE TestArenaPool
+#include <boost/test/unit_test.hpp>
+
+using latte::ArenaPool;
+using google::protobuf::Arena;
+
+BOOST_AUTO_TEST_CASE(test_recycle) {
+  auto pool = ArenaPool::create();
+  Arena *first;
+  {
+    auto arena = pool->acquire();
+    first = arena.get();
+    std::shared_ptr<latte::proto::Command> cmd(arena,
+        Arena::CreateMessage<latte::proto::Command>(arena.get()));
+    cmd->set_auth(std::string(100, 'a'));
+    BOOST_CHECK_EQUAL(cmd->GetArena(), first);
+    arena.reset();
+    /// the command still holds the arena
+    BOOST_CHECK_EQUAL(pool->idle(), 0);
+    BOOST_CHECK_EQUAL(cmd->auth().size(), 100);
+  }
+  BOOST_CHECK_EQUAL(pool->idle(), 1);
+  auto again = pool->acquire();
+  BOOST_CHECK_EQUAL(again.get(), first);
+  BOOST_CHECK_EQUAL(pool->idle(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_max_idle) {
+  auto pool = ArenaPool::create(1024, 2);
+  {
+    std::vector<std::shared_ptr<Arena>> held;
+    for (int i = 0; i < 5; ++i) {
+      held.push_back(pool->acquire());
+    }
+  }
+  BOOST_CHECK_EQUAL(pool->idle(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_outlive_pool) {
+  auto pool = ArenaPool::create();
+  auto arena = pool->acquire();
+  std::weak_ptr<ArenaPool> watch(pool);
+  pool.reset();
+  /// the arena keeps its pool alive until it is returned
+  BOOST_CHECK(!watch.expired());
+  std::thread releaser([&arena]() { arena.reset(); });
+  releaser.join();
+  BOOST_CHECK(watch.expired());
+}
+
+BOOST_AUTO_TEST_CASE(test_request_owned) {
+  auto pool = ArenaPool::create();
+  Arena *arena;
+  std::shared_ptr<latte::proto::Principal> p;
+  std::shared_ptr<latte::proto::Response> resp;
+  {
+    auto a = pool->acquire();
+    arena = a.get();
+    std::shared_ptr<latte::proto::Command> cmd(a,
+        Arena::CreateMessage<latte::proto::Command>(arena));
+    latte::proto::Principal principal;
+    principal.set_id(1);
+    cmd->mutable_statement()->PackFrom(principal);
+    p = latte::proto::CommandWrapper::extract_principal(cmd);
+    resp = latte::proto::make_shared_principal_response(cmd, *p);
+    /// the heap overload still copies out of the arena
+    auto heap = latte::proto::CommandWrapper::extract_principal(*cmd);
+    BOOST_CHECK(heap->GetArena() == nullptr);
+  }
+  BOOST_REQUIRE(p);
+  BOOST_CHECK_EQUAL(p->GetArena(), arena);
+  BOOST_CHECK_EQUAL(resp->GetArena(), arena);
+  BOOST_CHECK_EQUAL(p->id(), 1u);
+  BOOST_CHECK_EQUAL(pool->idle(), 0);
+  p.reset();
+  resp.reset();
+  BOOST_CHECK_EQUAL(pool->idle(), 1);
+}
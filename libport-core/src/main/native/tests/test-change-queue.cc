@@ -0,0 +1,95 @@
+#include "change_queue.h"
+
+#include <thread>
+#include <atomic>
+
+#define BOOST_TEST_MODULE TestChangeQueue
+#include <boost/test/unit_test.hpp>
+
+typedef latte::ChangeQueue<std::string> Queue;
+
+BOOST_AUTO_TEST_CASE(test_coalesce) {
+  Queue q;
+  q.created("principals", "1", "a");
+  q.created("images", "1", "image");
+  q.created("principals", "1", "b");
+  /// never synced, so nothing to send
+  q.created("principals", "2", "c");
+  q.deleted("principals", "2");
+  q.deleted("accessors", "x");
+  BOOST_CHECK_EQUAL(q.size(), 3);
+
+  auto changes = q.take();
+  BOOST_REQUIRE_EQUAL(changes.size(), 3);
+  BOOST_CHECK_EQUAL(changes[0].type, "images");
+  BOOST_CHECK_EQUAL(changes[1].key, "1");
+  BOOST_CHECK_EQUAL(changes[1].value, "b");
+  BOOST_CHECK(!changes[2].created);
+  BOOST_CHECK(changes[0].version < changes[1].version &&
+      changes[1].version < changes[2].version);
+  q.done(true);
+  BOOST_CHECK_EQUAL(q.synced(), changes[2].version);
+  BOOST_CHECK(q.take().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_delta_during_sync) {
+  Queue q;
+  q.created("principals", "1", "a");
+  auto changes = q.take();
+  BOOST_REQUIRE_EQUAL(changes.size(), 1);
+  /// the creation in flight will be there remotely, its deletion has to go
+  q.deleted("principals", "1");
+  q.created("principals", "2", "b");
+  BOOST_CHECK(q.take().empty());
+  q.done(true);
+
+  changes = q.take();
+  BOOST_REQUIRE_EQUAL(changes.size(), 2);
+  BOOST_CHECK(!changes[0].created);
+  BOOST_CHECK_EQUAL(changes[1].key, "2");
+  q.done(true);
+  BOOST_CHECK_EQUAL(q.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_failed_sync) {
+  Queue q;
+  q.created("principals", "1", "a");
+  q.created("principals", "2", "b");
+  auto first = q.take();
+  q.deleted("principals", "1");
+  q.created("principals", "2", "c");
+  q.done(false);
+
+  /// the creation of 1 never went out, so its deletion cancels it
+  auto changes = q.take();
+  BOOST_REQUIRE_EQUAL(changes.size(), 1);
+  BOOST_CHECK_EQUAL(changes[0].key, "2");
+  BOOST_CHECK_EQUAL(changes[0].value, "c");
+  BOOST_CHECK(changes[0].version > first[1].version);
+  BOOST_CHECK_EQUAL(q.synced(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_back_pressure) {
+  Queue q(4);
+  for (int i = 0; i < 4; ++i) {
+    q.created("principals", std::to_string(i), "");
+  }
+  /// a key already queued is coalesced, not held back
+  q.created("principals", "0", "again");
+  std::atomic<bool> recorded(false);
+  std::thread producer([&q, &recorded]() {
+      q.created("principals", "4", "");
+      recorded = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK(!recorded);
+  /// half full wakes the syncer before the timeout
+  BOOST_CHECK(q.wait(std::chrono::seconds(30)));
+  BOOST_CHECK_EQUAL(q.take().size(), 4);
+  producer.join();
+  BOOST_CHECK(recorded);
+  BOOST_CHECK_EQUAL(q.size(), 1);
+
+  q.close();
+  BOOST_CHECK(!q.wait(std::chrono::seconds(30)));
+}
@@ -0,0 +1,105 @@
+#include "decision_cache.h"
+
+#include <thread>
+
+#define BOOST_TEST_MODULE TestDecisionCache
+#include <boost/test/unit_test.hpp>
+
+using latte::DecisionCache;
+using std::chrono::milliseconds;
+
+static DecisionCache::Key access_key(const std::string &ip, uint32_t port,
+    const std::string &object) {
+  return DecisionCache::Key{DecisionCache::ACCESS, "speaker", ip, port, object, ""};
+}
+
+BOOST_AUTO_TEST_CASE(test_disabled) {
+  DecisionCache cache;
+  bool allowed = false;
+  cache.insert(access_key("1.1.1.1", 100, "obj"), true, cache.generation());
+  BOOST_CHECK(!cache.enabled());
+  BOOST_CHECK(!cache.lookup(access_key("1.1.1.1", 100, "obj"), &allowed));
+  BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_hit_and_miss) {
+  DecisionCache cache(milliseconds(10000), milliseconds(10000), 1024);
+  bool allowed = false;
+  auto key = access_key("1.1.1.1", 100, "obj");
+  BOOST_CHECK(!cache.lookup(key, &allowed));
+  cache.insert(key, true, cache.generation());
+  BOOST_CHECK(cache.lookup(key, &allowed));
+  BOOST_CHECK(allowed);
+  /// kinds do not alias each other
+  auto prop = key;
+  prop.kind = DecisionCache::PROPERTY;
+  BOOST_CHECK(!cache.lookup(prop, &allowed));
+  BOOST_CHECK_EQUAL(cache.hits(), 1);
+  BOOST_CHECK_EQUAL(cache.misses(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_expire) {
+  DecisionCache cache(milliseconds(10000), milliseconds(1), 1024);
+  bool allowed = true;
+  auto denied = access_key("1.1.1.1", 100, "secret");
+  auto granted = access_key("1.1.1.1", 100, "obj");
+  cache.insert(denied, false, cache.generation());
+  cache.insert(granted, true, cache.generation());
+  std::this_thread::sleep_for(milliseconds(5));
+  BOOST_CHECK(!cache.lookup(denied, &allowed));
+  BOOST_CHECK(cache.lookup(granted, &allowed));
+  BOOST_CHECK(allowed);
+}
+
+BOOST_AUTO_TEST_CASE(test_negative_disabled) {
+  DecisionCache cache(milliseconds(10000), milliseconds(0), 1024);
+  bool allowed = true;
+  auto key = access_key("1.1.1.1", 100, "secret");
+  cache.insert(key, false, cache.generation());
+  BOOST_CHECK(!cache.lookup(key, &allowed));
+}
+
+BOOST_AUTO_TEST_CASE(test_invalidate_principal) {
+  DecisionCache cache(milliseconds(10000), milliseconds(10000), 1024);
+  bool allowed;
+  cache.insert(access_key("1.1.1.1", 100, "obj"), true, cache.generation());
+  cache.insert(access_key("1.1.1.1", 200, "obj"), true, cache.generation());
+  cache.insert(access_key("2.2.2.2", 100, "obj"), true, cache.generation());
+  cache.invalidate_principal("1.1.1.1", 100, 200);
+  BOOST_CHECK(!cache.lookup(access_key("1.1.1.1", 100, "obj"), &allowed));
+  BOOST_CHECK(cache.lookup(access_key("1.1.1.1", 200, "obj"), &allowed));
+  BOOST_CHECK(cache.lookup(access_key("2.2.2.2", 100, "obj"), &allowed));
+}
+
+BOOST_AUTO_TEST_CASE(test_invalidate_id_and_negative) {
+  DecisionCache cache(milliseconds(10000), milliseconds(10000), 1024);
+  bool allowed;
+  cache.insert(access_key("1.1.1.1", 100, "obj"), true, cache.generation());
+  cache.insert(access_key("1.1.1.1", 100, "other"), true, cache.generation());
+  cache.insert(access_key("1.1.1.1", 100, "secret"), false, cache.generation());
+  cache.invalidate_id("obj");
+  BOOST_CHECK(!cache.lookup(access_key("1.1.1.1", 100, "obj"), &allowed));
+  BOOST_CHECK(cache.lookup(access_key("1.1.1.1", 100, "other"), &allowed));
+  cache.invalidate_negative();
+  BOOST_CHECK(!cache.lookup(access_key("1.1.1.1", 100, "secret"), &allowed));
+  BOOST_CHECK(cache.lookup(access_key("1.1.1.1", 100, "other"), &allowed));
+}
+
+BOOST_AUTO_TEST_CASE(test_stale_insert) {
+  DecisionCache cache(milliseconds(10000), milliseconds(10000), 1024);
+  bool allowed;
+  auto key = access_key("1.1.1.1", 100, "obj");
+  auto gen = cache.generation();
+  /// an invalidation racing with the check must win
+  cache.invalidate_id("obj");
+  cache.insert(key, true, gen);
+  BOOST_CHECK(!cache.lookup(key, &allowed));
+}
+
+BOOST_AUTO_TEST_CASE(test_capacity) {
+  DecisionCache cache(milliseconds(10000), milliseconds(10000), 0);
+  for (uint32_t port = 0; port < 1000; ++port) {
+    cache.insert(access_key("1.1.1.1", port, "obj"), true, cache.generation());
+  }
+  BOOST_CHECK(cache.size() <= DecisionCache::NSHARD);
+}
@@ -0,0 +1,116 @@
+#include "group_commit_log.h"
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE TestGroupCommitLog
+#include <boost/test/unit_test.hpp>
+
+using latte::GroupCommitLog;
+
+static std::string temp_path(const char *name) {
+  return std::string("/tmp/") + name + std::to_string(::getpid());
+}
+
+static int open_log(const std::string &path) {
+  return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+}
+
+static std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(in)),
+      std::istreambuf_iterator<char>());
+}
+
+BOOST_AUTO_TEST_CASE(test_order) {
+  auto path = temp_path("test-group-commit-order");
+  std::vector<int> acked;
+  {
+    GroupCommitLog log(open_log(path));
+    for (int i = 0; i < 10; ++i) {
+      log.append(std::to_string(i), [i, &acked](int err) {
+          BOOST_CHECK_EQUAL(err, 0);
+          acked.push_back(i);
+      });
+    }
+    log.flush();
+    BOOST_CHECK_EQUAL(acked.size(), 10);
+    BOOST_CHECK_EQUAL(read_file(path), "0123456789");
+    log.append("x", [](int) {});
+  }
+  /// whatever is queued is committed before the log goes away
+  BOOST_CHECK_EQUAL(read_file(path), "0123456789x");
+  for (int i = 0; i < 10; ++i) {
+    BOOST_CHECK_EQUAL(acked[i], i);
+  }
+  ::unlink(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_grouped) {
+  constexpr int NTHREAD = 8;
+  constexpr int NRECORD = 200;
+  auto path = temp_path("test-group-commit-grouped");
+  GroupCommitLog log(open_log(path));
+  std::vector<std::thread> writers;
+  for (int t = 0; t < NTHREAD; ++t) {
+    writers.emplace_back([&log, t]() {
+        for (int i = 0; i < NRECORD; ++i) {
+          /// each writer waits for its record to be durable
+          std::promise<int> durable;
+          auto result = durable.get_future();
+          log.append(std::string(1, 'a' + t), [&durable](int err) {
+              durable.set_value(err);
+          });
+          BOOST_CHECK_EQUAL(result.get(), 0);
+        }
+    });
+  }
+  for (auto &w: writers) {
+    w.join();
+  }
+  auto content = read_file(path);
+  BOOST_CHECK_EQUAL(content.size(), NTHREAD * NRECORD);
+  for (int t = 0; t < NTHREAD; ++t) {
+    BOOST_CHECK_EQUAL(std::count(content.begin(), content.end(), 'a' + t),
+        NRECORD);
+  }
+  /// writers waiting together share syncs
+  BOOST_CHECK_LT(log.groups(), NTHREAD * NRECORD);
+  ::unlink(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_failure) {
+  /// not opened for writing
+  GroupCommitLog log(::open("/dev/null", O_RDONLY));
+  int result = 0;
+  log.append("x", [&result](int err) { result = err; });
+  log.flush();
+  BOOST_CHECK_EQUAL(result, EBADF);
+}
+
+BOOST_AUTO_TEST_CASE(test_failure_sticky) {
+  auto path = temp_path("test-group-commit-sticky");
+  int fd = ::open("/dev/full", O_WRONLY);
+  BOOST_REQUIRE(fd >= 0);
+  GroupCommitLog log(fd);
+  int first = 0;
+  log.append("x", [&first](int err) { first = err; });
+  log.flush();
+  BOOST_CHECK_EQUAL(first, ENOSPC);
+  /// the disk has room again, still nothing goes after the failed record
+  int file = open_log(path);
+  BOOST_REQUIRE_EQUAL(::dup2(file, fd), fd);
+  ::close(file);
+  int later = 0;
+  log.append("y", [&later](int err) { later = err; });
+  log.flush();
+  BOOST_CHECK_EQUAL(later, ENOSPC);
+  BOOST_CHECK_EQUAL(read_file(path), "");
+  ::unlink(path.c_str());
+}
@@ -0,0 +1,43 @@
+#include "histogram.h"
+
+#define BOOST_TEST_MODULE TestHistogram
+#include <boost/test/unit_test.hpp>
+
+using latte::LatencyHistogram;
+using std::chrono::microseconds;
+
+BOOST_AUTO_TEST_CASE(test_empty) {
+  LatencyHistogram h;
+  BOOST_CHECK_EQUAL(h.count(), 0);
+  BOOST_CHECK_EQUAL(h.percentile_us(0.99), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_record) {
+  LatencyHistogram h;
+  for (int i = 0; i < 90; ++i) {
+    h.record(microseconds(100));
+  }
+  for (int i = 0; i < 10; ++i) {
+    h.record(microseconds(5000));
+  }
+  BOOST_CHECK_EQUAL(h.count(), 100);
+  BOOST_CHECK_EQUAL(h.sum_us(), 90 * 100 + 10 * 5000);
+  BOOST_CHECK_EQUAL(h.max_us(), 5000);
+  /// within a factor of two of the real value
+  BOOST_CHECK(h.percentile_us(0.5) >= 100 && h.percentile_us(0.5) < 200);
+  BOOST_CHECK(h.percentile_us(0.95) >= 5000 && h.percentile_us(0.95) < 10000);
+  BOOST_CHECK_EQUAL(h.percentile_us(1.0), 5000);
+}
+
+BOOST_AUTO_TEST_CASE(test_registry) {
+  latte::LatencyHistograms all;
+  all.get("/a")->record(microseconds(1));
+  all.get("/b")->record(microseconds(2));
+  all.get("/a")->record(microseconds(3));
+  size_t n = 0;
+  all.for_each([&n](const std::string &name, const LatencyHistogram &h) {
+      BOOST_CHECK_EQUAL(h.count(), name == "/a" ? 2 : 1);
+      n++;
+  });
+  BOOST_CHECK_EQUAL(n, 2);
+}
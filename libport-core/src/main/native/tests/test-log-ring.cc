@@ -0,0 +1,142 @@
+#include "log_ring.h"
+#include "log.h"
+
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <syslog.h>
+
+#define BOOST_TEST_MODULE TestLogRing
+#include <boost/test/unit_test.hpp>
+
+using latte::LogRing;
+using latte::LogRateLimiter;
+
+static std::vector<std::string> drain_all(LogRing &ring) {
+  std::vector<std::string> lines;
+  ring.drain([&lines](int, const char *line, size_t len) {
+      lines.emplace_back(line, len);
+  });
+  return lines;
+}
+
+BOOST_AUTO_TEST_CASE(test_order) {
+  LogRing ring(4);
+  BOOST_CHECK(ring.push_line(LOG_INFO, "a", 1));
+  BOOST_CHECK(ring.push_line(LOG_ERR, "bc", 2));
+  int priority = -1;
+  size_t n = ring.drain([&priority](int p, const char *line, size_t len) {
+      if (std::string(line, len) == "bc") {
+        priority = p;
+      }
+  });
+  BOOST_CHECK_EQUAL(n, 2);
+  BOOST_CHECK_EQUAL(priority, LOG_ERR);
+  BOOST_CHECK_EQUAL(ring.drain([](int, const char*, size_t) {}), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_full) {
+  LogRing ring(3);
+  /// rounded up to 4
+  for (int i = 0; i < 6; ++i) {
+    ring.push_line(LOG_INFO, "x", 1);
+  }
+  BOOST_CHECK_EQUAL(ring.take_dropped(), 2);
+  BOOST_CHECK_EQUAL(ring.take_dropped(), 0);
+  BOOST_CHECK_EQUAL(drain_all(ring).size(), 4);
+  /// slots are reusable after a drain, around the ring several times
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < 4; ++i) {
+      BOOST_CHECK(ring.push_line(LOG_INFO, "y", 1));
+    }
+    BOOST_CHECK_EQUAL(drain_all(ring).size(), 4);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_long_line) {
+  LogRing ring(2);
+  std::string line(LogRing::LINE_SZ * 3, 'z');
+  line.back() = '!';
+  ring.push(LOG_INFO, [&line](char *buf, size_t size) {
+      return (size_t)snprintf(buf, size, "%s", line.c_str());
+  });
+  auto lines = drain_all(ring);
+  BOOST_REQUIRE_EQUAL(lines.size(), 1);
+  BOOST_CHECK(lines[0] == line);
+}
+
+BOOST_AUTO_TEST_CASE(test_producers) {
+  constexpr int NTHREAD = 4;
+  constexpr int NLINE = 20000;
+  LogRing ring(256);
+  std::atomic<int> running(NTHREAD);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < NTHREAD; ++t) {
+    producers.emplace_back([&ring, &running, t]() {
+        for (int i = 0; i < NLINE; ++i) {
+          ring.push(LOG_INFO, [t, i](char *buf, size_t size) {
+              return (size_t)snprintf(buf, size, "%d %d", t, i);
+          });
+        }
+        running--;
+    });
+  }
+  /// lines of one producer come out in order, none lost or doubled
+  std::vector<int> next(NTHREAD, 0);
+  size_t received = 0, bad = 0;
+  auto sink = [&](int, const char *line, size_t len) {
+    int t, i;
+    if (sscanf(std::string(line, len).c_str(), "%d %d", &t, &i) != 2 ||
+        t < 0 || t >= NTHREAD || i < next[t]) {
+      bad++;
+      return;
+    }
+    next[t] = i + 1;
+    received++;
+  };
+  while (running > 0) {
+    ring.drain(sink);
+  }
+  for (auto &p: producers) {
+    p.join();
+  }
+  ring.drain(sink);
+  BOOST_CHECK_EQUAL(bad, 0);
+  BOOST_CHECK_EQUAL(received + ring.take_dropped(), size_t(NTHREAD * NLINE));
+}
+
+BOOST_AUTO_TEST_CASE(test_rate_limiter) {
+  LogRateLimiter limiter(3);
+  int admitted = 0;
+  for (int i = 0; i < 10; ++i) {
+    admitted += limiter.admit(100);
+  }
+  BOOST_CHECK_EQUAL(admitted, 3);
+  BOOST_CHECK_EQUAL(limiter.take_suppressed(), 7);
+  /// a new second opens a new window
+  BOOST_CHECK(limiter.admit(101));
+  limiter.set_limit(0);
+  for (int i = 0; i < 10; ++i) {
+    BOOST_CHECK(limiter.admit(101));
+  }
+  BOOST_CHECK_EQUAL(limiter.take_suppressed(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_lazy_macros) {
+  int evaluated = 0;
+  auto arg = [&evaluated]() {
+    evaluated++;
+    return "arg";
+  };
+  latte::setloglevel(LOG_INFO);
+  LATTE_DEBUG("%s", arg());
+  BOOST_CHECK_EQUAL(evaluated, 0);
+  LATTE_INFO("%s", arg());
+  BOOST_CHECK_EQUAL(evaluated, 1);
+  latte::setloglevel(LOG_DEBUG);
+  LATTE_DEBUG("%s", arg());
+  BOOST_CHECK_EQUAL(evaluated, LATTE_LOG_MIN_LEVEL >= LOG_DEBUG ? 2 : 1);
+  latte::setloglevel(LOG_NOTICE);
+  latte::flushlog();
+}
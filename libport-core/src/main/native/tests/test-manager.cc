@@ -8,6 +8,7 @@
 #include "proto/statement.pb.h"
 #include "proto/utils.h"
 #include "test-include/mock-metadata-client.h"
+#include <future>
 
 
 #define BOOST_TEST_MODULE TestManager
@@ -41,6 +42,21 @@ void resp_attestation(std::shared_ptr<latte::proto::Response> resp) {
   BOOST_CHECK(wrapper.extract_attestation());
 }
 
+/// Handlers complete asynchronously, block until the writer has been called
+// so the checks below observe the response.
+static void dispatch_wait(std::shared_ptr<latte::LatteDispatcher> &manager,
+    std::shared_ptr<latte::proto::Command> cmd,
+    void (*checker)(std::shared_ptr<latte::proto::Response>)) {
+  auto done = std::make_shared<std::promise<void>>();
+  auto finished = done->get_future();
+  manager->dispatch(std::move(cmd),
+      [checker, done](std::shared_ptr<latte::proto::Response> resp) {
+        checker(std::move(resp));
+        done->set_value();
+      });
+  finished.wait();
+}
+
 static inline latte::proto::Principal _P(int index) {
   latte::proto::Principal p;
   p.set_id(index);
@@ -67,21 +83,21 @@ BOOST_AUTO_TEST_CASE(test_create_principal) {
   auto cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p1 = _P(1);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p1);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p2 = _P(0);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p2);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
   BOOST_CHECK_EQUAL(mclient->post_new_principal_call_count, 3);
 
@@ -116,7 +132,7 @@ BOOST_AUTO_TEST_CASE(test_create_principal_fail) {
   latte::proto::CheckAccess invalid;
 
   auto cmd = latte::prepare<proto::Command::CHECK_ACCESS>(invalid);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   BOOST_CHECK_EQUAL(mclient->post_new_principal_call_count, 0);
@@ -134,28 +150,28 @@ BOOST_AUTO_TEST_CASE(test_remove_principal_no_gc) {
   auto cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p1 = _P(1);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p1);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p2 = _P(2);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p2);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p);
   BOOST_TEST_MESSAGE("remove first principal fail\n");
   cmd.set_uid(2);
   cmd.set_pid(101);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
 
@@ -163,28 +179,28 @@ BOOST_AUTO_TEST_CASE(test_remove_principal_no_gc) {
   BOOST_TEST_MESSAGE("remove first principal\n");
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p1);
   BOOST_TEST_MESSAGE("remove second principal\n");
   cmd.set_uid(0);
   cmd.set_pid(101);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p2);
   BOOST_TEST_MESSAGE("remove third principal\n");
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p);
   BOOST_TEST_MESSAGE("remove duplicated principal\n");
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
   BOOST_CHECK_EQUAL(mclient->remove_principal_call_count, 3);
 }
@@ -198,54 +214,54 @@ BOOST_AUTO_TEST_CASE(test_remove_principal_gc) {
   auto cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p1 = _P(1);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p1);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   latte::proto::Principal p2 = _P(0);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p2);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
   latte::proto::Principal p3 = _P(0);
   cmd = latte::prepare<proto::Command::CREATE_PRINCIPAL>(p3);
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p);
   cmd.set_uid(1);
   cmd.set_pid(100);
   BOOST_TEST_MESSAGE("remove first principal\n");
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p1);
   cmd.set_uid(1);
   cmd.set_pid(100);
   BOOST_TEST_MESSAGE("remove second principal\n");
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p2);
   cmd.set_uid(1);
   cmd.set_pid(100);
   BOOST_TEST_MESSAGE("remove first principal\n");
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
   cmd = latte::prepare<proto::Command::DELETE_PRINCIPAL>(p3);
   cmd.set_uid(1);
   cmd.set_pid(100);
   BOOST_TEST_MESSAGE("remove first principal\n");
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
   BOOST_CHECK_EQUAL(mclient->remove_principal_call_count, 2);
 }
@@ -261,7 +277,7 @@ BOOST_AUTO_TEST_CASE(test_post_object_acl) {
   auto cmd = latte::prepare<proto::Command::POST_ACL>(std::move(failed_post));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   latte::proto::PostACL post;
@@ -271,7 +287,7 @@ BOOST_AUTO_TEST_CASE(test_post_object_acl) {
   cmd = latte::prepare<proto::Command::POST_ACL>(std::move(post));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
   BOOST_REQUIRE_EQUAL(mclient->post_object_acl_call_count, 1);
   auto &callarg = *mclient->post_object_acl_call_args.begin();
@@ -293,7 +309,7 @@ BOOST_AUTO_TEST_CASE(test_endorse_image) {
   auto cmd = latte::prepare<proto::Command::ENDORSE>(std::move(failed_endorse1));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   latte::proto::Endorse failed_endorse2;
@@ -303,7 +319,7 @@ BOOST_AUTO_TEST_CASE(test_endorse_image) {
   cmd = latte::prepare<proto::Command::ENDORSE>(std::move(failed_endorse2));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   latte::proto::Endorse endorse;
@@ -317,7 +333,7 @@ BOOST_AUTO_TEST_CASE(test_endorse_image) {
   cmd = latte::prepare<proto::Command::ENDORSE>(std::move(endorse));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
   BOOST_REQUIRE_EQUAL(mclient->endorse_image_call_count, 1);
 
@@ -341,7 +357,7 @@ BOOST_AUTO_TEST_CASE(test_has_property) {
   auto cmd = latte::prepare<proto::Command::CHECK_PROPERTY>(std::move(failed_check));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   latte::proto::CheckProperty check;
@@ -355,7 +371,7 @@ BOOST_AUTO_TEST_CASE(test_has_property) {
   cmd.set_uid(1);
   cmd.set_pid(100);
   mclient->has_property_return_value = true;
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   BOOST_REQUIRE_EQUAL(mclient->has_property_call_count, 1);
@@ -380,7 +396,7 @@ BOOST_AUTO_TEST_CASE(test_can_access) {
   auto cmd = latte::prepare<proto::Command::CHECK_ACCESS>(std::move(failed_check));
   cmd.set_uid(1);
   cmd.set_pid(100);
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
 
   latte::proto::CheckAccess check;
@@ -394,7 +410,7 @@ BOOST_AUTO_TEST_CASE(test_can_access) {
   cmd.set_uid(1);
   cmd.set_pid(100);
   mclient->can_access_return_value = true;
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 
   BOOST_REQUIRE_EQUAL(mclient->can_access_call_count, 1);
@@ -405,6 +421,89 @@ BOOST_AUTO_TEST_CASE(test_can_access) {
   BOOST_CHECK_EQUAL(std::get<3>(callarg), "ooo");
 }
 
+BOOST_AUTO_TEST_CASE(test_can_access_batch) {
+  latte::MockMetadataClient *mclient = new latte::MockMetadataClient();
+  latte::init_manager(mclient);
+  auto manager = latte::get_manager();
+
+  latte::proto::CheckAccess check;
+  auto p = check.mutable_principal();
+  auto auth = p->mutable_auth();
+  auth->set_ip("1.1.1.1");
+  auth->set_port_lo(100);
+  check.add_objects("o1");
+  check.add_objects("o2");
+  check.add_objects("o3");
+  check.set_batch(true);
+
+  auto cmd = latte::prepare<proto::Command::CHECK_ACCESS>(std::move(check));
+  cmd.set_uid(1);
+  cmd.set_pid(100);
+  mclient->can_access_return_value = true;
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
+      [](std::shared_ptr<proto::Response> resp) {
+        BOOST_REQUIRE_EQUAL(resp->type(), proto::Response::STATUS_LIST);
+        proto::ResponseWrapper wrapper(resp);
+        auto list = wrapper.extract_status_list();
+        BOOST_REQUIRE(list);
+        BOOST_REQUIRE_EQUAL(list->results_size(), 3);
+        for (auto &status: list->results()) {
+          BOOST_CHECK(status.success());
+        }
+      });
+
+  BOOST_REQUIRE_EQUAL(mclient->can_access_call_count, 3);
+  auto callarg = mclient->can_access_call_args.begin();
+  BOOST_CHECK_EQUAL(std::get<3>(*callarg++), "o1");
+  BOOST_CHECK_EQUAL(std::get<3>(*callarg++), "o2");
+  BOOST_CHECK_EQUAL(std::get<3>(*callarg++), "o3");
+}
+
+/// The metadata service is down for one object and denies another.
+class FlakyMetadataClient: public latte::MockMetadataClient {
+  public:
+    pplx::task<bool> can_access_async(const std::string &speaker,
+        const std::string &principal_ip, uint32_t port,
+        const std::string &access_object, const std::string &bearer) override {
+      if (access_object == "down") {
+        return pplx::task_from_exception<bool>(
+            std::runtime_error("metadata service unavailable"));
+      }
+      return pplx::task_from_result(access_object != "denied");
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_can_access_batch_error) {
+  latte::init_manager(new FlakyMetadataClient());
+  auto manager = latte::get_manager();
+
+  latte::proto::CheckAccess check;
+  auto auth = check.mutable_principal()->mutable_auth();
+  auth->set_ip("1.1.1.1");
+  auth->set_port_lo(100);
+  check.add_objects("granted");
+  check.add_objects("denied");
+  check.add_objects("down");
+  check.set_batch(true);
+
+  auto cmd = latte::prepare<proto::Command::CHECK_ACCESS>(std::move(check));
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
+      [](std::shared_ptr<proto::Response> resp) {
+        proto::ResponseWrapper wrapper(resp);
+        auto list = wrapper.extract_status_list();
+        BOOST_REQUIRE(list);
+        BOOST_REQUIRE_EQUAL(list->results_size(), 3);
+        BOOST_CHECK(list->results(0).success());
+        BOOST_CHECK(!list->results(0).error());
+        /// a denial is not an error
+        BOOST_CHECK(!list->results(1).success());
+        BOOST_CHECK(!list->results(1).error());
+        BOOST_CHECK(!list->results(2).success());
+        BOOST_CHECK(list->results(2).error());
+        BOOST_CHECK_EQUAL(list->results(2).info(), "metadata service unavailable");
+      });
+}
+
 static void _test_endorse_attester(std::shared_ptr<latte::LatteDispatcher> &manager,
     latte::proto::Endorse::Type t) {
   latte::proto::Endorse endorse;
@@ -414,7 +513,7 @@ static void _test_endorse_attester(std::shared_ptr<latte::LatteDispatcher> &mana
   confmap[latte::LEGACY_CONFIG_KEY] = "*";
     auto cmd = latte::prepare<latte::proto::Command::ENDORSE_ATTESTER_IMAGE>(
         std::move(endorse));
-    manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+    dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
 }
 
@@ -455,12 +554,12 @@ static void _test_endorse_membership(std::shared_ptr<latte::LatteDispatcher> &ma
     e->set_property("membership");
     auto cmd = latte::prepare<latte::proto::Command::ENDORSE_MEMBERSHIP>(
         std::move(endorse));
-    manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+    dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
         resp_ok);
   } else {
     auto cmd = latte::prepare<latte::proto::Command::ENDORSE_MEMBERSHIP>(
         std::move(endorse));
-    manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+    dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
         resp_fail);
   }
 }
@@ -492,7 +591,7 @@ BOOST_AUTO_TEST_CASE(test_attest) {
   auth->set_port_lo(100);
   auto cmd = latte::prepare<latte::proto::Command::CHECK_ATTESTATION>(
       std::move(check));
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_attestation);
   BOOST_REQUIRE_EQUAL(mclient->attest_call_count, 1);
   auto &callarg = mclient->attest_call_args.front();
@@ -500,6 +599,22 @@ BOOST_AUTO_TEST_CASE(test_attest) {
   BOOST_CHECK_EQUAL(std::get<2>(callarg), 100);
 }
 
+BOOST_AUTO_TEST_CASE(test_get_principal_remote) {
+  latte::MockMetadataClient *mclient = new latte::MockMetadataClient();
+  latte::init_manager(mclient);
+  auto manager = latte::get_manager();
+  latte::proto::Principal lookup;
+  auto auth = lookup.mutable_auth();
+  auth->set_ip("1.1.1.1");
+  auth->set_port_lo(100);
+  /// not created through this guard, whatever the metadata service knows
+  mclient->attest_return_value = "attested";
+  auto cmd = latte::prepare<latte::proto::Command::GET_PRINCIPAL>(lookup);
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
+      resp_fail);
+  BOOST_CHECK_EQUAL(mclient->attest_call_count, 0);
+}
+
 BOOST_AUTO_TEST_CASE(test_can_worker_access) {
   latte::MockMetadataClient *mclient = new latte::MockMetadataClient();
   latte::init_manager(mclient);
@@ -512,7 +627,7 @@ BOOST_AUTO_TEST_CASE(test_can_worker_access) {
   auth->set_port_lo(100);
   auto cmd = latte::prepare<latte::proto::Command::CHECK_WORKER_ACCESS>(
       std::move(check_fail));
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_fail);
   BOOST_REQUIRE_EQUAL(mclient->can_worker_access_call_count, 0);
 
@@ -526,7 +641,7 @@ BOOST_AUTO_TEST_CASE(test_can_worker_access) {
   check.add_objects("obj");
   cmd = latte::prepare<latte::proto::Command::CHECK_WORKER_ACCESS>(
       std::move(check));
-  manager->dispatch(std::make_shared<proto::Command>(std::move(cmd)),
+  dispatch_wait(manager, std::make_shared<proto::Command>(std::move(cmd)),
       resp_ok);
   BOOST_REQUIRE_EQUAL(mclient->can_worker_access_call_count, 1);
   auto &callarg = mclient->can_worker_access_call_args.front();
@@ -0,0 +1,101 @@
+#include "metrics.h"
+#include "metrics_server.h"
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE TestMetrics
+#include <boost/test/unit_test.hpp>
+
+using latte::LatencyHistogram;
+using latte::MetricsRegistry;
+using latte::MetricsServer;
+using latte::MetricsWriter;
+
+static bool contains(const std::string &text, const std::string &line) {
+  return text.find(line) != std::string::npos;
+}
+
+BOOST_AUTO_TEST_CASE(test_writer) {
+  MetricsWriter out;
+  out.counter("requests_total", {{"type", "a"}}, 3);
+  out.counter("requests_total", {{"type", "b\"c"}}, 4);
+  out.gauge("entries", {}, 7);
+  auto &text = out.str();
+  BOOST_CHECK(contains(text, "# TYPE requests_total counter\n"));
+  BOOST_CHECK(contains(text, "requests_total{type=\"a\"} 3\n"));
+  BOOST_CHECK(contains(text, "requests_total{type=\"b\\\"c\"} 4\n"));
+  BOOST_CHECK(contains(text, "# TYPE entries gauge\nentries 7\n"));
+  /// one TYPE line per family
+  BOOST_CHECK_EQUAL(text.find("# TYPE requests_total"),
+      text.rfind("# TYPE requests_total"));
+}
+
+BOOST_AUTO_TEST_CASE(test_histogram) {
+  LatencyHistogram h;
+  h.record(std::chrono::microseconds(1));
+  h.record(std::chrono::microseconds(1000000));
+  MetricsWriter out;
+  out.histogram("latency_seconds", {{"op", "x"}}, h);
+  auto &text = out.str();
+  BOOST_CHECK(contains(text, "# TYPE latency_seconds histogram\n"));
+  BOOST_CHECK(contains(text, "latency_seconds_bucket{op=\"x\",le=\"+Inf\"} 2\n"));
+  BOOST_CHECK(contains(text, "latency_seconds_count{op=\"x\"} 2\n"));
+  BOOST_CHECK(contains(text, "latency_seconds_sum{op=\"x\"} 1.000001\n"));
+}
+
+BOOST_AUTO_TEST_CASE(test_registry) {
+  MetricsRegistry registry;
+  auto c = registry.counter("hits_total");
+  BOOST_CHECK(c == registry.counter("hits_total"));
+  c->inc(2);
+  registry.gauge("active")->inc();
+  BOOST_CHECK(contains(registry.render(), "hits_total 2\n"));
+  BOOST_CHECK(contains(registry.render(), "active 1\n"));
+}
+
+BOOST_AUTO_TEST_CASE(test_collector) {
+  MetricsRegistry registry;
+  int value = 5;
+  auto id = registry.add_collector([&value](MetricsWriter &out) {
+      out.gauge("owned", {}, value);
+  });
+  BOOST_CHECK(contains(registry.render(), "owned 5\n"));
+  value = 6;
+  BOOST_CHECK(contains(registry.render(), "owned 6\n"));
+  registry.remove_collector(id);
+  BOOST_CHECK(!contains(registry.render(), "owned"));
+}
+
+BOOST_AUTO_TEST_CASE(test_scrape) {
+  std::string path = "/tmp/test-metrics-" + std::to_string(::getpid());
+  MetricsRegistry registry;
+  registry.counter("scraped_total")->inc();
+  boost::asio::io_service service;
+  auto server = MetricsServer::create(service, path, registry);
+  server->start();
+  std::thread runner([&service]() { service.run(); });
+
+  boost::asio::local::stream_protocol::socket sock(service);
+  sock.connect(boost::asio::local::stream_protocol::endpoint(path));
+  std::string req = "GET /metrics HTTP/1.0\r\n\r\n";
+  boost::asio::write(sock, boost::asio::buffer(req));
+  std::string reply;
+  boost::system::error_code ec;
+  char buf[1024];
+  size_t n;
+  while ((n = sock.read_some(boost::asio::buffer(buf), ec)) > 0 && !ec) {
+    reply.append(buf, n);
+  }
+  BOOST_CHECK(reply.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+  BOOST_CHECK(contains(reply, "\r\n\r\n# TYPE scraped_total counter\n"));
+  BOOST_CHECK(contains(reply, "scraped_total 1\n"));
+
+  server->stop();
+  service.stop();
+  runner.join();
+  ::unlink(path.c_str());
+}
@@ -0,0 +1,86 @@
+#include "port_manager.h"
+
+#include <random>
+#include <vector>
+
+#define BOOST_TEST_MODULE TestPortManager
+#include <boost/test/unit_test.hpp>
+
+using latte::PortManager;
+
+BOOST_AUTO_TEST_CASE(test_best_fit) {
+  PortManager m(1, 2001);
+  auto a = m.allocate(1, 101);
+  auto b = m.allocate(101, 111);
+  m.allocate(111, 2001);
+  m.deallocate(a.first);
+  m.deallocate(b.first);
+  /// [1, 111) merged into one segment
+  auto c = m.allocate(110);
+  BOOST_CHECK_EQUAL(c.second - c.first, 110);
+  m.deallocate(c.first);
+
+  m.allocate(50, 60);
+  /// free: [1,50) and [60,111), best fit for 20 is the smaller one
+  auto d = m.allocate(20);
+  BOOST_CHECK(d.second <= 50);
+}
+
+BOOST_AUTO_TEST_CASE(test_worst_and_first_fit) {
+  PortManager m(1, 2001, PortManager::WORST_FIT);
+  m.allocate(50, 60);
+  auto p = m.allocate(10);
+  BOOST_CHECK(p.first >= 60);
+
+  PortManager f(1, 2001, PortManager::FIRST_FIT);
+  f.allocate(50, 60);
+  auto q = f.allocate(10);
+  BOOST_CHECK(q.second <= 50);
+}
+
+/// random churn against a bitmap of the port space
+BOOST_AUTO_TEST_CASE(test_churn) {
+  const uint32_t lo = 1, hi = 4001;
+  for (auto policy: {PortManager::BEST_FIT, PortManager::WORST_FIT,
+      PortManager::FIRST_FIT}) {
+    PortManager m(lo, hi, policy);
+    std::vector<bool> used(hi, false);
+    std::vector<PortManager::PortPair> live;
+    std::mt19937 rng(42);
+    for (int round = 0; round < 5000; ++round) {
+      if (live.empty() || rng() % 3 != 0) {
+        uint32_t cnt = 1 + rng() % 64;
+        try {
+          auto p = m.allocate(cnt);
+          BOOST_REQUIRE_EQUAL(p.second - p.first, cnt);
+          for (auto i = p.first; i < p.second; ++i) {
+            BOOST_REQUIRE(!used[i]);
+            used[i] = true;
+          }
+          live.push_back(p);
+        } catch (const std::runtime_error &) {
+          uint32_t run = 0, longest = 0;
+          for (auto i = lo; i < hi; ++i) {
+            run = used[i] ? 0 : run + 1;
+            longest = std::max(longest, run);
+          }
+          BOOST_REQUIRE(longest < cnt);
+        }
+      } else {
+        auto i = rng() % live.size();
+        auto p = live[i];
+        live[i] = live.back();
+        live.pop_back();
+        m.deallocate(p.first);
+        for (auto j = p.first; j < p.second; ++j) {
+          used[j] = false;
+        }
+      }
+    }
+    for (auto &p: live) {
+      BOOST_CHECK(m.is_allocated(p.first, p.second));
+      m.deallocate(p.first);
+    }
+    BOOST_CHECK_EQUAL(m.report_fragment(hi), 1);
+  }
+}
@@ -0,0 +1,161 @@
+#include "principal_journal.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BOOST_TEST_MODULE TestPrincipalJournal
+#include <boost/test/unit_test.hpp>
+
+using latte::PrincipalJournal;
+using latte::PrincipalRegistry;
+using latte::proto::Principal;
+
+static PrincipalRegistry::PrincipalPtr make_principal(uint64_t id, uint64_t gn,
+    uint32_t lo) {
+  auto p = std::make_shared<Principal>();
+  p->set_id(id);
+  p->set_gn(gn);
+  p->mutable_auth()->set_ip("1.1.1.1");
+  p->mutable_auth()->set_port_lo(lo);
+  p->mutable_auth()->set_port_hi(lo + 100);
+  return p;
+}
+
+/// A fresh state directory, removed with everything in it at the end.
+struct StateDir {
+  StateDir() {
+    char tmpl[] = "/tmp/test-journal-XXXXXX";
+    path = ::mkdtemp(tmpl);
+  }
+  ~StateDir() {
+    std::string cmd = "rm -rf " + path;
+    BOOST_CHECK_EQUAL(std::system(cmd.c_str()), 0);
+  }
+  std::string path;
+};
+
+static bool exists(const std::string &path) {
+  struct stat sb;
+  return ::stat(path.c_str(), &sb) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_no_directory) {
+  BOOST_CHECK(!PrincipalJournal::open("/nonexistent/state"));
+}
+
+BOOST_AUTO_TEST_CASE(test_replay) {
+  StateDir dir;
+  {
+    auto journal = PrincipalJournal::open(dir.path);
+    PrincipalRegistry registry;
+    BOOST_CHECK_EQUAL(journal->recover(registry), 0);
+    BOOST_CHECK_EQUAL(registry.size(), 0);
+    journal->created(*make_principal(1, 0, 100));
+    journal->created(*make_principal(2, 1, 200));
+    journal->created(*make_principal(1, 2, 300));
+    journal->deleted(2);
+    journal->created(*make_principal(3, 3, 400));
+    BOOST_CHECK_EQUAL(journal->pending(), 5);
+  }
+  auto journal = PrincipalJournal::open(dir.path);
+  PrincipalRegistry registry;
+  BOOST_CHECK_EQUAL(journal->recover(registry), 4);
+  BOOST_CHECK_EQUAL(registry.size(), 2);
+  BOOST_CHECK_EQUAL(registry.latest(1)->gn(), 2);
+  BOOST_CHECK(!registry.latest(2));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 150)->id(), 1);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 250));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 450)->id(), 3);
+  /// replayed records still wait for a snapshot
+  BOOST_CHECK_EQUAL(journal->pending(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(test_torn_tail) {
+  StateDir dir;
+  {
+    auto journal = PrincipalJournal::open(dir.path);
+    PrincipalRegistry registry;
+    journal->recover(registry);
+    journal->created(*make_principal(1, 0, 100));
+    journal->created(*make_principal(2, 1, 200));
+  }
+  /// the last record was being written when the guard died
+  auto name = dir.path + "/principals.journal.1";
+  struct stat sb;
+  BOOST_REQUIRE_EQUAL(::stat(name.c_str(), &sb), 0);
+  BOOST_REQUIRE_EQUAL(::truncate(name.c_str(), sb.st_size - 3), 0);
+
+  auto journal = PrincipalJournal::open(dir.path);
+  PrincipalRegistry registry;
+  BOOST_CHECK_EQUAL(journal->recover(registry), 1);
+  BOOST_CHECK(registry.latest(1));
+  BOOST_CHECK(!registry.latest(2));
+  /// later records go to a new journal, not after the damaged one
+  journal->created(*make_principal(3, 5, 300));
+  journal.reset();
+  journal = PrincipalJournal::open(dir.path);
+  PrincipalRegistry again;
+  BOOST_CHECK_EQUAL(journal->recover(again), 6);
+  BOOST_CHECK(again.latest(1));
+  BOOST_CHECK(again.latest(3));
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot) {
+  StateDir dir;
+  {
+    auto journal = PrincipalJournal::open(dir.path);
+    PrincipalRegistry registry;
+    journal->recover(registry);
+    for (uint64_t id = 1; id <= 10; ++id) {
+      auto p = make_principal(id, id, id * 100);
+      registry.insert(p);
+      journal->created(*p);
+    }
+    bool removed;
+    registry.remove(4, [](const Principal&) { return true; }, &removed);
+    journal->deleted(4);
+
+    auto state = registry.all();
+    auto epoch = journal->rotate();
+    BOOST_CHECK_EQUAL(journal->pending(), 0);
+    /// appends go on while the snapshot is written
+    auto late = make_principal(11, 11, 1100);
+    journal->created(*late);
+    journal->deleted(5);
+    journal->snapshot(state, 12, epoch);
+    BOOST_CHECK(!exists(dir.path + "/principals.journal.1"));
+    BOOST_CHECK(exists(dir.path + "/principals.snapshot"));
+  }
+  auto journal = PrincipalJournal::open(dir.path);
+  PrincipalRegistry registry;
+  BOOST_CHECK_EQUAL(journal->recover(registry), 12);
+  BOOST_CHECK_EQUAL(registry.size(), 9);
+  BOOST_CHECK(!registry.latest(4));
+  BOOST_CHECK(!registry.latest(5));
+  BOOST_CHECK(registry.latest(11));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 1050)->id(), 10);
+  BOOST_CHECK_EQUAL(journal->pending(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_damaged_snapshot) {
+  StateDir dir;
+  {
+    auto journal = PrincipalJournal::open(dir.path);
+    PrincipalRegistry registry;
+    journal->recover(registry);
+    journal->snapshot({make_principal(1, 1, 100), make_principal(2, 2, 200)},
+        3, journal->rotate());
+  }
+  std::fstream f(dir.path + "/principals.snapshot",
+      std::ios::in | std::ios::out | std::ios::binary);
+  f.seekp(-2, std::ios::end);
+  f.put('\xff');
+  f.close();
+  /// losing principals silently is worse than not starting
+  auto journal = PrincipalJournal::open(dir.path);
+  PrincipalRegistry registry;
+  BOOST_CHECK_THROW(journal->recover(registry), std::runtime_error);
+}
@@ -0,0 +1,175 @@
+#include "principal_registry.h"
+
+#include <thread>
+#include <atomic>
+
+#define BOOST_TEST_MODULE TestPrincipalRegistry
+#include <boost/test/unit_test.hpp>
+
+using latte::PrincipalRegistry;
+using latte::proto::Principal;
+
+static PrincipalRegistry::PrincipalPtr make_principal(uint64_t id, uint64_t gn,
+    const std::string &ip, uint32_t lo, uint64_t speaker = 0) {
+  auto p = std::make_shared<Principal>();
+  p->set_id(id);
+  p->set_gn(gn);
+  p->set_speaker(speaker);
+  p->mutable_auth()->set_ip(ip);
+  p->mutable_auth()->set_port_lo(lo);
+  p->mutable_auth()->set_port_hi(lo + 100);
+  return p;
+}
+
+static bool always(const Principal&) { return true; }
+
+BOOST_AUTO_TEST_CASE(test_latest_generation) {
+  PrincipalRegistry registry;
+  BOOST_CHECK(!registry.latest(1));
+  registry.insert(make_principal(1, 3, "1.1.1.1", 100));
+  registry.insert(make_principal(1, 7, "1.1.1.1", 200));
+  /// an older generation showing up late does not win
+  registry.insert(make_principal(1, 5, "1.1.1.1", 300));
+  BOOST_REQUIRE(registry.latest(1));
+  BOOST_CHECK_EQUAL(registry.latest(1)->gn(), 7);
+  BOOST_CHECK_EQUAL(registry.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_endpoint_index) {
+  PrincipalRegistry registry;
+  registry.insert(make_principal(1, 1, "1.1.1.1", 100));
+  registry.insert(make_principal(2, 2, "1.1.1.1", 200));
+  registry.insert(make_principal(3, 3, "2.2.2.2", 100));
+  BOOST_REQUIRE(registry.at("1.1.1.1", 200));
+  BOOST_CHECK_EQUAL(registry.at("1.1.1.1", 200)->id(), 2);
+  BOOST_CHECK_EQUAL(registry.at("2.2.2.2", 100)->id(), 3);
+  BOOST_CHECK(!registry.at("1.1.1.1", 150));
+  BOOST_CHECK(!registry.at("3.3.3.3", 100));
+}
+
+BOOST_AUTO_TEST_CASE(test_owner) {
+  PrincipalRegistry registry;
+  /// ranges are [lo, lo + 100)
+  registry.insert(make_principal(1, 1, "1.1.1.1", 100));
+  registry.insert(make_principal(2, 2, "1.1.1.1", 300));
+  registry.insert(make_principal(3, 3, "2.2.2.2", 200));
+  BOOST_CHECK(!registry.owner("1.1.1.1", 99));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 100)->id(), 1);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 199)->id(), 1);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 200));
+  BOOST_CHECK(!registry.owner("1.1.1.1", 250));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 350)->id(), 2);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 400));
+  BOOST_CHECK_EQUAL(registry.owner("2.2.2.2", 250)->id(), 3);
+  BOOST_CHECK(!registry.owner("3.3.3.3", 250));
+  bool removed;
+  registry.remove(2, always, &removed);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 350));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 150)->id(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_owner_across_buckets) {
+  PrincipalRegistry registry;
+  auto wide = std::make_shared<Principal>(*make_principal(1, 1, "1.1.1.1", 1000));
+  /// [1000, 3100) spans three buckets
+  wide->mutable_auth()->set_port_hi(3100);
+  registry.insert(wide);
+  registry.insert(make_principal(2, 2, "1.1.1.1", 3100));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 1023)->id(), 1);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 2048)->id(), 1);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 3099)->id(), 1);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 3100)->id(), 2);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 3200));
+  BOOST_CHECK(!registry.owner("1.1.1.1", 999));
+  /// ports beyond 16 bits share the last bucket
+  registry.insert(make_principal(3, 3, "1.1.1.1", 70000));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 70050)->id(), 3);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 65000));
+  bool removed;
+  registry.remove(1, always, &removed);
+  BOOST_CHECK(removed);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 1023));
+  BOOST_CHECK(!registry.owner("1.1.1.1", 2048));
+  BOOST_CHECK(!registry.at("1.1.1.1", 1000));
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 3150)->id(), 2);
+  registry.remove(2, always, &removed);
+  registry.remove(3, always, &removed);
+  BOOST_CHECK(!registry.owner("1.1.1.1", 70050));
+  BOOST_CHECK_EQUAL(registry.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_remove) {
+  PrincipalRegistry registry;
+  registry.insert(make_principal(1, 1, "1.1.1.1", 100, 42));
+  registry.insert(make_principal(1, 2, "1.1.1.1", 200, 42));
+  registry.insert(make_principal(2, 3, "1.1.1.1", 300, 42));
+  bool removed = true;
+  BOOST_CHECK(!registry.remove(9, always, &removed));
+  BOOST_CHECK(!removed);
+
+  /// refused removal leaves everything in place
+  auto latest = registry.remove(1, [](const Principal &p) {
+        return p.speaker() == 7;
+      }, &removed);
+  BOOST_REQUIRE(latest);
+  BOOST_CHECK(!removed);
+  BOOST_CHECK(registry.latest(1));
+
+  latest = registry.remove(1, always, &removed);
+  BOOST_REQUIRE(latest);
+  BOOST_CHECK(removed);
+  BOOST_CHECK_EQUAL(latest->gn(), 2);
+  BOOST_CHECK(!registry.latest(1));
+  /// every generation leaves the endpoint index
+  BOOST_CHECK(!registry.at("1.1.1.1", 100));
+  BOOST_CHECK(!registry.at("1.1.1.1", 200));
+  BOOST_CHECK(registry.at("1.1.1.1", 300));
+  BOOST_CHECK_EQUAL(registry.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_insert_all) {
+  PrincipalRegistry registry;
+  registry.insert(make_principal(1, 1, "1.1.1.1", 100));
+  registry.insert_all({
+      make_principal(2, 2, "1.1.1.1", 200),
+      make_principal(3, 4, "2.2.2.2", 100),
+      make_principal(3, 3, "2.2.2.2", 100),
+      make_principal(4, 5, "1.1.1.1", 300)});
+  BOOST_CHECK_EQUAL(registry.size(), 4);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 150)->id(), 1);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 250)->id(), 2);
+  BOOST_CHECK_EQUAL(registry.owner("1.1.1.1", 350)->id(), 4);
+  /// same as one by one, the older generation loses
+  BOOST_CHECK_EQUAL(registry.latest(3)->gn(), 4);
+  BOOST_CHECK_EQUAL(registry.at("2.2.2.2", 100)->gn(), 4);
+  BOOST_CHECK_EQUAL(registry.all().size(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_readers) {
+  PrincipalRegistry registry;
+  const uint64_t n = 2000;
+  std::thread writer([&registry, n]() {
+    for (uint64_t id = 0; id < n; ++id) {
+      registry.insert(make_principal(id, id, "1.1.1.1", id * 100));
+    }
+  });
+  std::atomic<int> mismatched(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; ++r) {
+    readers.emplace_back([&registry, &mismatched, n]() {
+      for (uint64_t id = 0; id < n; ++id) {
+        auto p = registry.latest(id);
+        if (p && p->id() != id) {
+          mismatched++;
+        }
+      }
+    });
+  }
+  writer.join();
+  for (auto &reader: readers) {
+    reader.join();
+  }
+  BOOST_CHECK_EQUAL(mismatched.load(), 0);
+  BOOST_CHECK_EQUAL(registry.size(), n);
+  BOOST_CHECK_EQUAL(registry.at("1.1.1.1", 1500 * 100)->id(), 1500);
+}
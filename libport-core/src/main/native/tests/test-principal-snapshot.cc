@@ -0,0 +1,134 @@
+#include "principal_snapshot.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE TestPrincipalSnapshot
+#include <boost/test/unit_test.hpp>
+
+using latte::PrincipalSnapshot;
+using latte::proto::Principal;
+
+static PrincipalSnapshot::PrincipalPtr make_principal(uint64_t id, uint64_t gn,
+    const std::string &ip, uint32_t lo) {
+  auto p = std::make_shared<Principal>();
+  p->set_id(id);
+  p->set_gn(gn);
+  p->mutable_auth()->set_ip(ip);
+  p->mutable_auth()->set_port_lo(lo);
+  p->mutable_auth()->set_port_hi(lo + 100);
+  return p;
+}
+
+/// A fresh directory, removed with everything in it at the end.
+struct SnapshotDir {
+  SnapshotDir() {
+    char tmpl[] = "/tmp/test-snapshot-XXXXXX";
+    path = ::mkdtemp(tmpl);
+    fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+  }
+  ~SnapshotDir() {
+    ::close(fd);
+    std::string cmd = "rm -rf " + path;
+    BOOST_CHECK_EQUAL(std::system(cmd.c_str()), 0);
+  }
+  void write(const std::string &content) {
+    std::ofstream out(path + "/snapshot", std::ios::binary);
+    out << content;
+  }
+  std::string path;
+  int fd;
+};
+
+BOOST_AUTO_TEST_CASE(test_missing) {
+  SnapshotDir dir;
+  BOOST_CHECK(!PrincipalSnapshot::open(dir.fd, "snapshot"));
+}
+
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+  auto full = std::make_shared<Principal>();
+  full->set_id(7);
+  full->set_gn(3);
+  full->set_speaker(42);
+  full->mutable_auth()->set_ip("10.0.0.1");
+  full->mutable_auth()->set_port_lo(1000);
+  full->mutable_auth()->set_port_hi(2000);
+  full->mutable_auth()->set_misc(9);
+  full->mutable_auth()->set_safe_id("safe");
+  full->mutable_code()->set_image("image");
+  full->mutable_code()->set_image_store("store");
+  full->mutable_code()->set_wildcard(true);
+  (*full->mutable_code()->mutable_config())["k1"] = "v1";
+  (*full->mutable_code()->mutable_config())["k2"] = "";
+  auto bare = std::make_shared<Principal>();
+  bare->set_id(1);
+
+  SnapshotDir dir;
+  dir.write(PrincipalSnapshot::build({full, bare}, 11, 5));
+  auto snapshot = PrincipalSnapshot::open(dir.fd, "snapshot");
+  BOOST_REQUIRE(snapshot);
+  BOOST_CHECK_EQUAL(snapshot->epoch(), 5);
+  BOOST_CHECK_EQUAL(snapshot->gn(), 11);
+  BOOST_REQUIRE_EQUAL(snapshot->size(), 2);
+  /// records come sorted by id
+  BOOST_CHECK_EQUAL((*snapshot)[0].id, 1);
+
+  auto r = snapshot->find(7);
+  BOOST_REQUIRE(r);
+  BOOST_CHECK_EQUAL(snapshot->str(r->ip), "10.0.0.1");
+  BOOST_CHECK_EQUAL(r->port_lo, 1000);
+  BOOST_CHECK_EQUAL(r->npair, 2);
+  BOOST_CHECK_EQUAL(snapshot->str(snapshot->pairs(*r)[0].key), "k1");
+  auto copy = snapshot->principal(*r);
+  snapshot.reset();
+  BOOST_CHECK_EQUAL(copy->speaker(), 42);
+  BOOST_CHECK_EQUAL(copy->auth().port_hi(), 2000);
+  BOOST_CHECK_EQUAL(copy->auth().misc(), 9);
+  BOOST_CHECK_EQUAL(copy->auth().safe_id(), "safe");
+  BOOST_CHECK_EQUAL(copy->code().image_store(), "store");
+  BOOST_CHECK(copy->code().wildcard());
+  BOOST_CHECK_EQUAL(copy->code().config().size(), 2);
+  BOOST_CHECK_EQUAL(copy->code().config().at("k1"), "v1");
+  BOOST_CHECK_EQUAL(copy->code().config().at("k2"), "");
+  /// fields that were never set stay unset
+  snapshot = PrincipalSnapshot::open(dir.fd, "snapshot");
+  auto empty = snapshot->principal(*snapshot->find(1));
+  BOOST_CHECK(!empty->has_auth());
+  BOOST_CHECK(!empty->has_code());
+}
+
+BOOST_AUTO_TEST_CASE(test_find_latest) {
+  SnapshotDir dir;
+  dir.write(PrincipalSnapshot::build({
+        make_principal(2, 5, "1.1.1.1", 100),
+        make_principal(1, 1, "1.1.1.1", 200),
+        make_principal(2, 3, "1.1.1.1", 300),
+        make_principal(4, 4, "1.1.1.1", 400)}, 6, 1));
+  auto snapshot = PrincipalSnapshot::open(dir.fd, "snapshot");
+  BOOST_REQUIRE(snapshot);
+  BOOST_CHECK_EQUAL(snapshot->find(2)->gn, 5);
+  BOOST_CHECK_EQUAL(snapshot->find(4)->port_lo, 400);
+  BOOST_CHECK(!snapshot->find(0));
+  BOOST_CHECK(!snapshot->find(3));
+  BOOST_CHECK(!snapshot->find(5));
+  /// the ip shared by every principal is stored once
+  BOOST_CHECK_EQUAL(snapshot->find(1)->ip.offset, snapshot->find(4)->ip.offset);
+}
+
+BOOST_AUTO_TEST_CASE(test_damaged) {
+  auto content = PrincipalSnapshot::build({make_principal(1, 1, "1.1.1.1", 100)},
+      2, 1);
+  SnapshotDir dir;
+  dir.write(content.substr(0, content.size() - 1));
+  BOOST_CHECK_THROW(PrincipalSnapshot::open(dir.fd, "snapshot"),
+      std::runtime_error);
+  content[sizeof(PrincipalSnapshot::Header)] ^= 1;
+  dir.write(content);
+  BOOST_CHECK_THROW(PrincipalSnapshot::open(dir.fd, "snapshot"),
+      std::runtime_error);
+  dir.write("");
+  BOOST_CHECK_THROW(PrincipalSnapshot::open(dir.fd, "snapshot"),
+      std::runtime_error);
+}
@@ -0,0 +1,83 @@
+#include "comm.h"
+#include "proto/utils.h"
+
+#define BOOST_TEST_MODULE TestProtoUtils
+#include <boost/test/unit_test.hpp>
+
+using namespace latte;
+
+static proto::CheckAccess check_access() {
+  proto::CheckAccess statement;
+  statement.add_objects("obj");
+  statement.mutable_principal()->mutable_auth()->set_ip("10.0.0.1");
+  return statement;
+}
+
+BOOST_AUTO_TEST_CASE(test_extract_v2) {
+  auto cmd = std::make_shared<proto::Command>(
+      prepare<proto::Command::CHECK_ACCESS>(check_access()));
+  BOOST_CHECK(cmd->has_check_access());
+  BOOST_CHECK(!cmd->has_statement());
+  /// handed out in place
+  auto stmt = proto::CommandWrapper::extract_check_access(cmd);
+  BOOST_REQUIRE(stmt);
+  BOOST_CHECK_EQUAL(stmt.get(), cmd->mutable_check_access());
+  BOOST_CHECK_EQUAL(stmt->objects(0), "obj");
+  auto copy = proto::CommandWrapper::extract_check_access(*cmd);
+  BOOST_REQUIRE(copy);
+  BOOST_CHECK_EQUAL(copy->principal().auth().ip(), "10.0.0.1");
+  /// the wrong type is refused either way
+  BOOST_CHECK(!proto::CommandWrapper::extract_principal(cmd));
+  BOOST_CHECK(!proto::CommandWrapper::extract_principal(*cmd));
+}
+
+BOOST_AUTO_TEST_CASE(test_extract_v1) {
+  auto cmd = std::make_shared<proto::Command>(
+      prepare<proto::Command::CHECK_ACCESS>(check_access()));
+  proto::downgrade(cmd.get());
+  BOOST_CHECK_EQUAL(cmd->body_case(), proto::Command::BODY_NOT_SET);
+  BOOST_CHECK(cmd->has_statement());
+  auto stmt = proto::CommandWrapper::extract_check_access(cmd);
+  BOOST_REQUIRE(stmt);
+  BOOST_CHECK_EQUAL(stmt->objects(0), "obj");
+  BOOST_CHECK(!proto::CommandWrapper::extract_principal(cmd));
+  /// v1 already, nothing to do
+  proto::downgrade(cmd.get());
+  BOOST_CHECK(proto::CommandWrapper::extract_check_access(*cmd));
+}
+
+BOOST_AUTO_TEST_CASE(test_v2_smaller) {
+  auto cmd = prepare<proto::Command::CHECK_ACCESS>(check_access());
+  auto v2 = cmd.ByteSizeLong();
+  proto::downgrade(&cmd);
+  BOOST_CHECK_LT(v2, cmd.ByteSizeLong());
+}
+
+BOOST_AUTO_TEST_CASE(test_response_wrapper) {
+  proto::Principal p;
+  p.set_id(7);
+  for (bool v1: {false, true}) {
+    auto resp = proto::make_shared_principal_response(p);
+    if (v1) {
+      proto::downgrade(resp.get());
+      BOOST_CHECK(resp->has_result());
+    } else {
+      BOOST_CHECK(resp->has_principal());
+    }
+    proto::ResponseWrapper wrapper(resp);
+    auto extracted = wrapper.extract_principal();
+    BOOST_REQUIRE(extracted);
+    BOOST_CHECK_EQUAL(extracted->id(), 7);
+    BOOST_CHECK(!wrapper.extract_attestation());
+    BOOST_CHECK_EQUAL(wrapper.status_int(), -1);
+  }
+  for (bool v1: {false, true}) {
+    auto resp = proto::make_shared_status_response(true, "fine");
+    if (v1) {
+      proto::downgrade(resp.get());
+    }
+    proto::ResponseWrapper wrapper(resp);
+    BOOST_CHECK_EQUAL(wrapper.status_int(), 1);
+    BOOST_CHECK_EQUAL(wrapper.status().second, "fine");
+  }
+}
@@ -1,11 +1,140 @@
-
-
 #include "session.h"
+#include "proto/utils.h"
+
+#include <thread>
+#include <sys/socket.h>
 
 
 #define BOOST_TEST_MODULE TestSession
 #include <boost/test/unit_test.hpp>
 
+using namespace latte;
+
+/// Holds every command until n of them arrived, then answers in reverse.
+class ReverseDispatcher: public LatteDispatcher {
+  public:
+    ReverseDispatcher(size_t n): n_(n) {}
+
+    bool dispatch(std::shared_ptr<proto::Command> cmd, Writer w) override {
+      held_.push_back(w);
+      if (held_.size() == n_) {
+        for (auto i = held_.rbegin(); i != held_.rend(); ++i) {
+          (*i)(proto::make_shared_status_response(true, ""));
+        }
+        held_.clear();
+      }
+      return true;
+    }
+
+  private:
+    size_t n_;
+    std::vector<Writer> held_;
+};
+
 BOOST_AUTO_TEST_CASE(test_session_create) {
-  
+
+}
+
+BOOST_AUTO_TEST_CASE(test_session_pipelined) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  io_service service;
+  auto session = Session::create(service,
+      std::make_shared<ReverseDispatcher>(3));
+  session->socket().assign(local::stream_protocol(), fds[0]);
+  session->start();
+  /// several io threads, the strand keeps the session consistent
+  std::vector<std::thread> runners;
+  for (int i = 0; i < 4; ++i) {
+    runners.emplace_back([&service]() { service.run(); });
+  }
+
+  proto::Empty placeholder;
+  for (int64_t id = 1; id <= 3; ++id) {
+    auto cmd = prepare<proto::Command::GET_METADATA_CONFIG>(placeholder);
+    cmd.set_id(id);
+    BOOST_REQUIRE_EQUAL(proto_send_msg(fds[1], cmd), 0);
+  }
+  for (int64_t id = 3; id >= 1; --id) {
+    proto::Response resp;
+    BOOST_REQUIRE_EQUAL(proto_recv_msg(fds[1], &resp), 0);
+    BOOST_CHECK_EQUAL(resp.id(), id);
+  }
+
+  close(fds[1]);
+  for (auto &runner: runners) {
+    runner.join();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_session_large_frame) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  io_service service;
+  auto session = Session::create(service,
+      std::make_shared<ReverseDispatcher>(1));
+  session->socket().assign(local::stream_protocol(), fds[0]);
+  session->start();
+  std::thread runner([&service]() { service.run(); });
+
+  /// frames beyond the retained size in between small ones
+  proto::Empty placeholder;
+  for (size_t sz: {size_t(16), RETAINED_FRAME_SZ * 2, size_t(16)}) {
+    auto cmd = prepare<proto::Command::GET_METADATA_CONFIG>(placeholder,
+        std::string(sz, 'a').c_str());
+    cmd.set_id(sz);
+    BOOST_REQUIRE_EQUAL(proto_send_msg(fds[1], cmd), 0);
+    proto::Response resp;
+    BOOST_REQUIRE_EQUAL(proto_recv_msg(fds[1], &resp), 0);
+    BOOST_CHECK_EQUAL(resp.id(), sz);
+  }
+
+  close(fds[1]);
+  runner.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_session_wire_version) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  io_service service;
+  auto session = Session::create(service,
+      std::make_shared<ReverseDispatcher>(1));
+  session->socket().assign(local::stream_protocol(), fds[0]);
+  session->start();
+  std::thread runner([&service]() { service.run(); });
+
+  /// an older peer sends PROTO_MAGIC and an Any, and gets an Any back
+  proto::Empty placeholder;
+  auto cmd = prepare<proto::Command::GET_METADATA_CONFIG>(placeholder);
+  proto::downgrade(&cmd);
+  BOOST_CHECK(cmd.has_statement());
+  std::string frame(COMM_HEADER_SZ, '\0');
+  CodedOutputStream::WriteLittleEndian32ToArray(cmd.ByteSizeLong(),
+      (uint8_t*)&frame[0]);
+  CodedOutputStream::WriteLittleEndian32ToArray(PROTO_MAGIC,
+      (uint8_t*)&frame[sizeof(uint32_t)]);
+  frame += cmd.SerializeAsString();
+  BOOST_REQUIRE_EQUAL(utils::reliable_send(fds[1], frame.data(), frame.size()), 0);
+  proto::Response resp;
+  uint32_t magic;
+  BOOST_REQUIRE_EQUAL(proto_recv_msg(fds[1], &resp, &magic), 0);
+  BOOST_CHECK_EQUAL(magic, PROTO_MAGIC_V2);
+  BOOST_CHECK(resp.has_result());
+  BOOST_CHECK_EQUAL(resp.payload_case(), proto::Response::PAYLOAD_NOT_SET);
+  BOOST_CHECK_EQUAL(proto::ResponseWrapper(new proto::Response(resp)).status_int(), 1);
+
+  /// a v2 peer gets the oneof
+  cmd = prepare<proto::Command::GET_METADATA_CONFIG>(placeholder);
+  BOOST_REQUIRE_EQUAL(proto_send_msg(fds[1], cmd), 0);
+  resp.Clear();
+  BOOST_REQUIRE_EQUAL(proto_recv_msg(fds[1], &resp), 0);
+  BOOST_CHECK(!resp.has_result());
+  BOOST_CHECK(resp.has_status());
+  BOOST_CHECK(resp.status().success());
+
+  close(fds[1]);
+  runner.join();
 }
@@ -0,0 +1,224 @@
+#include "shm_ring.h"
+#include "session.h"
+#include "utils.h"
+#include "proto/utils.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE TestShmRing
+#include <boost/test/unit_test.hpp>
+
+using namespace latte;
+
+/// Answers right away, with a response too large for a slot on command 2.
+class EchoDispatcher: public LatteDispatcher {
+  public:
+    bool dispatch(std::shared_ptr<proto::Command> cmd, Writer w) override {
+      std::string info(cmd->id() == 2 ? 2 * ShmRing::MAX_PAYLOAD : 0, 'x');
+      w(proto::make_shared_status_response(true, info));
+      return true;
+    }
+};
+
+/// Layout is cache line aligned, which new does not promise before C++17.
+struct AlignedLayout {
+  AlignedLayout() {
+    void *memory = nullptr;
+    BOOST_REQUIRE_EQUAL(::posix_memalign(&memory, alignof(ShmRing::Layout),
+          sizeof(ShmRing::Layout)), 0);
+    layout = new (memory) ShmRing::Layout();
+  }
+  ~AlignedLayout() {
+    layout->~Layout();
+    ::free(layout);
+  }
+  ShmRing::Layout *operator ->() { return layout; }
+  ShmRing::Layout *layout;
+};
+
+static void push(ShmRing &ring, uint32_t value) {
+  memcpy(ring.next(), &value, sizeof(value));
+  ring.publish(sizeof(value));
+}
+
+static uint32_t pop(ShmRing &ring) {
+  const uint8_t *payload;
+  uint32_t size, flags, value = 0;
+  BOOST_REQUIRE_EQUAL(ring.peek(&payload, &size, &flags), 1);
+  BOOST_REQUIRE_EQUAL(size, sizeof(value));
+  memcpy(&value, payload, sizeof(value));
+  ring.pop();
+  return value;
+}
+
+BOOST_AUTO_TEST_CASE(test_ring_wrap) {
+  AlignedLayout layout;
+  ShmRing ring(layout.layout);
+  BOOST_CHECK(ring.empty());
+  const uint8_t *payload;
+  uint32_t size, flags;
+  BOOST_CHECK_EQUAL(ring.peek(&payload, &size, &flags), 0);
+
+  /// several times around, never more than half of the slots in use
+  uint32_t produced = 0, consumed = 0;
+  while (produced < 3 * ShmRing::NSLOT) {
+    for (int i = 0; i < 100; ++i) {
+      push(ring, produced++);
+    }
+    while (consumed + 30 < produced) {
+      BOOST_REQUIRE_EQUAL(pop(ring), consumed++);
+    }
+  }
+  while (!ring.empty()) {
+    BOOST_REQUIRE_EQUAL(pop(ring), consumed++);
+  }
+  BOOST_CHECK_EQUAL(consumed, produced);
+}
+
+BOOST_AUTO_TEST_CASE(test_ring_full) {
+  AlignedLayout layout;
+  ShmRing ring(layout.layout);
+  for (uint32_t i = 0; i < ShmRing::NSLOT; ++i) {
+    BOOST_REQUIRE(!ring.full());
+    push(ring, i);
+  }
+  BOOST_CHECK(ring.full());
+  BOOST_CHECK_EQUAL(pop(ring), 0);
+  BOOST_CHECK(!ring.full());
+}
+
+BOOST_AUTO_TEST_CASE(test_ring_sleep) {
+  AlignedLayout layout;
+  ShmRing ring(layout.layout);
+  /// nobody sleeps, nobody to wake
+  BOOST_CHECK(!ring.publish(0));
+  /// a message is there, the consumer must not block
+  BOOST_CHECK(!ring.sleep());
+  ring.pop();
+  BOOST_CHECK(ring.sleep());
+  BOOST_CHECK(ring.publish(0));
+  ring.wake();
+  BOOST_CHECK(!ring.publish(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_ring_corrupted) {
+  AlignedLayout layout;
+  ShmRing ring(layout.layout);
+  const uint8_t *payload;
+  uint32_t size, flags;
+  /// the other side claims a size larger than a slot
+  ring.publish(ShmRing::MAX_PAYLOAD + 1);
+  BOOST_CHECK_EQUAL(ring.peek(&payload, &size, &flags), -1);
+  /// or a head further than the ring goes
+  layout->head.store(ShmRing::NSLOT + 1);
+  layout->slots[0].size = 0;
+  BOOST_CHECK_EQUAL(ring.peek(&payload, &size, &flags), -1);
+}
+
+BOOST_AUTO_TEST_CASE(test_channel_attach) {
+  auto guard = ShmChannel::create();
+  BOOST_REQUIRE(guard);
+  int fds[ShmChannel::NFD];
+  for (size_t i = 0; i < ShmChannel::NFD; ++i) {
+    fds[i] = ::dup(guard->fds()[i]);
+  }
+  auto client = ShmChannel::attach(fds[0], fds[1], fds[2]);
+  BOOST_REQUIRE(client);
+  /// both ends see the same memory
+  push(client->commands(), 42);
+  BOOST_CHECK_EQUAL(pop(guard->commands()), 42);
+  push(guard->responses(), 7);
+  BOOST_CHECK_EQUAL(pop(client->responses()), 7);
+
+  int socks[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, socks), 0);
+  ShmChannel::notify(guard->response_fd());
+  BOOST_CHECK_EQUAL(ShmChannel::await(client->response_fd(), socks[0]), 0);
+  /// the guard going away ends the wait too
+  close(socks[1]);
+  BOOST_CHECK(ShmChannel::await(client->response_fd(), socks[0]) != 0);
+  close(socks[0]);
+
+  /// anything but a channel is refused
+  int bogus[ShmChannel::NFD] = {::dup(guard->command_fd()),
+    ::dup(guard->command_fd()), ::dup(guard->response_fd())};
+  BOOST_CHECK(!ShmChannel::attach(bogus[0], bogus[1], bogus[2]));
+}
+
+BOOST_AUTO_TEST_CASE(test_session_ring) {
+  int socks[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, socks), 0);
+  io_service service;
+  auto session = Session::create(service, std::make_shared<EchoDispatcher>());
+  session->socket().assign(local::stream_protocol(), socks[0]);
+  session->start();
+  std::thread runner([&service]() { service.run(); });
+
+  proto::Empty placeholder;
+  auto open = prepare<proto::Command::OPEN_RING>(placeholder);
+  open.set_id(1);
+  BOOST_REQUIRE_EQUAL(proto_send_msg(socks[1], open), 0);
+  uint8_t header[COMM_HEADER_SZ];
+  int fds[ShmChannel::NFD];
+  size_t nfd = ShmChannel::NFD;
+  BOOST_REQUIRE_EQUAL(utils::recv_with_fds(socks[1], header, sizeof(header),
+        fds, &nfd), 0);
+  BOOST_REQUIRE_EQUAL(nfd, ShmChannel::NFD);
+  uint32_t size, magic;
+  decode_frame_header(header, &size, &magic);
+  std::vector<uint8_t> payload(size);
+  BOOST_REQUIRE_EQUAL(utils::reliable_recv(socks[1], payload.data(), size), 0);
+  proto::Response opened;
+  BOOST_REQUIRE(opened.ParseFromArray(payload.data(), size));
+  BOOST_CHECK_EQUAL(opened.id(), 1);
+  auto ring = ShmChannel::attach(fds[0], fds[1], fds[2]);
+  BOOST_REQUIRE(ring);
+
+  /// a small response comes back in the ring, a large one over the socket
+  proto::CheckAccess check;
+  check.add_objects("object");
+  for (int64_t id = 2; id <= 3; ++id) {
+    auto cmd = prepare<proto::Command::CHECK_ACCESS>(check);
+    cmd.set_id(id);
+    auto &commands = ring->commands();
+    BOOST_REQUIRE(cmd.ByteSizeLong() <= ShmRing::MAX_PAYLOAD);
+    cmd.SerializeToArray(commands.next(), ShmRing::MAX_PAYLOAD);
+    if (commands.publish(cmd.ByteSizeLong())) {
+      ShmChannel::notify(ring->command_fd());
+    }
+  }
+  auto &responses = ring->responses();
+  for (int64_t id = 2; id <= 3; ++id) {
+    while (responses.empty()) {
+      if (responses.sleep()) {
+        BOOST_REQUIRE_EQUAL(ShmChannel::await(ring->response_fd(), socks[1]), 0);
+      }
+      responses.wake();
+    }
+    const uint8_t *slot;
+    uint32_t flags;
+    BOOST_REQUIRE_EQUAL(responses.peek(&slot, &size, &flags), 1);
+    proto::Response resp;
+    if (id == 2) {
+      int64_t marked;
+      BOOST_REQUIRE_EQUAL(flags, ShmRing::ON_SOCKET);
+      BOOST_REQUIRE_EQUAL(size, sizeof(marked));
+      memcpy(&marked, slot, sizeof(marked));
+      BOOST_CHECK_EQUAL(marked, id);
+      BOOST_REQUIRE_EQUAL(proto_recv_msg(socks[1], &resp), 0);
+    } else {
+      BOOST_REQUIRE_EQUAL(flags, 0);
+      BOOST_REQUIRE(resp.ParseFromArray(slot, size));
+    }
+    responses.pop();
+    BOOST_CHECK_EQUAL(resp.id(), id);
+  }
+
+  close(socks[1]);
+  runner.join();
+}
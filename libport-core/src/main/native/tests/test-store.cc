@@ -0,0 +1,99 @@
+#include "store.h"
+#include "proto/statement.pb.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BOOST_TEST_MODULE TestStore
+#include <boost/test/unit_test.hpp>
+
+using latte::proto::Principal;
+
+static Principal make_principal(uint64_t id) {
+  Principal p;
+  p.set_id(id);
+  p.mutable_auth()->set_ip("1.1.1.1");
+  p.mutable_auth()->set_port_lo(id * 100);
+  return p;
+}
+
+/// A fresh store directory, removed with everything in it at the end.
+struct StoreDir {
+  StoreDir() {
+    char tmpl[] = "/tmp/test-store-XXXXXX";
+    path = ::mkdtemp(tmpl);
+  }
+  ~StoreDir() {
+    std::string cmd = "rm -rf " + path;
+    BOOST_CHECK_EQUAL(std::system(cmd.c_str()), 0);
+  }
+  std::string log() const { return path + "/store.log"; }
+  std::string path;
+};
+
+static std::vector<uint64_t> ids(StoreManager &store) {
+  std::vector<uint64_t> result;
+  for (auto &msg: store.load()) {
+    result.push_back(static_cast<Principal&>(*msg).id());
+  }
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_add_remove) {
+  StoreDir dir;
+  Principal prototype;
+  {
+    auto store = open_file_store(prototype, dir.path);
+    BOOST_CHECK(store->load().empty());
+    BOOST_CHECK(store->add(make_principal(1)));
+    BOOST_CHECK(store->add(make_principal(2)));
+    BOOST_CHECK(store->add(make_principal(3)));
+    BOOST_CHECK(store->remove(make_principal(2)));
+    /// removing what is not there changes nothing
+    BOOST_CHECK(store->remove(make_principal(9)));
+    BOOST_CHECK((ids(*store) == std::vector<uint64_t>{1, 3}));
+  }
+  auto store = open_file_store(prototype, dir.path);
+  BOOST_CHECK((ids(*store) == std::vector<uint64_t>{1, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(test_torn_tail) {
+  StoreDir dir;
+  Principal prototype;
+  {
+    auto store = open_file_store(prototype, dir.path);
+    store->add(make_principal(1));
+    store->add(make_principal(2));
+  }
+  /// the last record was being written when the guard died
+  struct stat sb;
+  BOOST_REQUIRE_EQUAL(::stat(dir.log().c_str(), &sb), 0);
+  BOOST_REQUIRE_EQUAL(::truncate(dir.log().c_str(), sb.st_size - 3), 0);
+  {
+    auto store = open_file_store(prototype, dir.path);
+    BOOST_CHECK((ids(*store) == std::vector<uint64_t>{1}));
+    /// later records are not lost behind the damaged one
+    store->add(make_principal(3));
+  }
+  auto store = open_file_store(prototype, dir.path);
+  BOOST_CHECK((ids(*store) == std::vector<uint64_t>{1, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(test_damaged_record) {
+  StoreDir dir;
+  Principal prototype;
+  {
+    auto store = open_file_store(prototype, dir.path);
+    store->add(make_principal(1));
+    store->add(make_principal(2));
+  }
+  std::fstream f(dir.log(), std::ios::in | std::ios::out | std::ios::binary);
+  f.seekp(-2, std::ios::end);
+  f.put('\xff');
+  f.close();
+  /// a checksum mismatch is not parsed as a message
+  auto store = open_file_store(prototype, dir.path);
+  BOOST_CHECK((ids(*store) == std::vector<uint64_t>{1}));
+}
@@ -0,0 +1,124 @@
+#include "trace.h"
+#include "session.h"
+#include "proto/utils.h"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE TestTrace
+#include <boost/test/unit_test.hpp>
+
+using namespace latte;
+
+static std::string read_file(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+static std::string temp_path(const char *name) {
+  return std::string("/tmp/") + name + std::to_string(::getpid()) + ".json";
+}
+
+/// Answers after a while, remembering the trace it ran under.
+class SlowDispatcher: public LatteDispatcher {
+  public:
+    bool dispatch(std::shared_ptr<proto::Command> cmd, Writer w) override {
+      seen = RequestTrace::current();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      w(proto::make_shared_status_response(true, ""));
+      return true;
+    }
+
+    std::shared_ptr<RequestTrace> seen;
+};
+
+BOOST_AUTO_TEST_CASE(test_scope) {
+  BOOST_CHECK(!RequestTrace::current());
+  auto outer = std::make_shared<RequestTrace>(1, "outer", 0);
+  auto inner = std::make_shared<RequestTrace>(2, "inner", 0);
+  {
+    TraceScope a(outer);
+    BOOST_CHECK(RequestTrace::current() == outer);
+    {
+      TraceScope b(inner);
+      BOOST_CHECK(RequestTrace::current() == inner);
+    }
+    BOOST_CHECK(RequestTrace::current() == outer);
+  }
+  BOOST_CHECK(!RequestTrace::current());
+}
+
+BOOST_AUTO_TEST_CASE(test_format) {
+  RequestTrace trace(0xabc, "CHECK_\"ACCESS", 100);
+  trace.span("handler", 110, 150);
+  auto events = SlowTraceLog::format(trace, 200, 7);
+  BOOST_CHECK(events.find("{\"name\":\"CHECK_\\\"ACCESS\",\"cat\":\"attguard\","
+        "\"ph\":\"X\",\"ts\":100,\"dur\":100,\"pid\":7,\"tid\":2748,"
+        "\"args\":{\"trace_id\":\"0xabc\"}},\n") == 0);
+  BOOST_CHECK(events.find("{\"name\":\"handler\",\"cat\":\"attguard\","
+        "\"ph\":\"X\",\"ts\":110,\"dur\":40,\"pid\":7,\"tid\":2748},\n")
+      != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_slow_only) {
+  SlowTraceLog disabled("/nonexistent/trace", 0);
+  BOOST_CHECK(!disabled.enabled());
+  BOOST_CHECK(!disabled.begin(1, "x", 0));
+
+  auto path = temp_path("test-trace-slow");
+  {
+    SlowTraceLog traces(path, 1);
+    BOOST_REQUIRE(traces.enabled());
+    auto fast = traces.begin(1, "fast", 1000);
+    traces.finish(*fast, 1500);
+    auto slow = traces.begin(2, "slow", 1000);
+    traces.finish(*slow, 3000);
+  }
+  auto content = read_file(path);
+  BOOST_CHECK(content.compare(0, 2, "[\n") == 0);
+  BOOST_CHECK(content.find("\"fast\"") == std::string::npos);
+  BOOST_CHECK(content.find("\"slow\"") != std::string::npos);
+  ::unlink(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_session_trace) {
+  auto path = temp_path("test-trace-session");
+  config::config_cache_.trace_slow_ms = 1;
+  config::config_cache_.trace_file = path;
+  BOOST_REQUIRE(slow_traces().enabled());
+
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  io_service service;
+  auto dispatcher = std::make_shared<SlowDispatcher>();
+  auto session = Session::create(service, dispatcher);
+  session->socket().assign(local::stream_protocol(), fds[0]);
+  session->start();
+  std::thread runner([&service]() { service.run(); });
+
+  proto::Empty placeholder;
+  auto cmd = prepare<proto::Command::GET_METADATA_CONFIG>(placeholder);
+  BOOST_CHECK(cmd.trace_id() != 0);
+  BOOST_REQUIRE_EQUAL(proto_send_msg(fds[1], cmd), 0);
+  proto::Response resp;
+  BOOST_REQUIRE_EQUAL(proto_recv_msg(fds[1], &resp), 0);
+  close(fds[1]);
+  runner.join();
+
+  BOOST_REQUIRE(dispatcher->seen);
+  BOOST_CHECK_EQUAL(dispatcher->seen->trace_id(), cmd.trace_id());
+  BOOST_CHECK_EQUAL(dispatcher->seen->start_us(), cmd.sent_at_us());
+  auto content = read_file(path);
+  BOOST_CHECK(content.find("\"trace_id\":\"" + utils::itoa<uint64_t,
+        utils::HexType>(cmd.trace_id()) + "\"") != std::string::npos);
+  for (auto stage: {"GET_METADATA_CONFIG", "socket", "read", "queued", "write"}) {
+    BOOST_CHECK_MESSAGE(content.find(std::string("\"") + stage + "\"")
+        != std::string::npos, stage);
+  }
+  ::unlink(path.c_str());
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Benchmark attguard against the metadata stub.
+# usage: bench.sh BUILD_DIR [attguard-bench options...]
+# Without the stub, run BUILD_DIR/bench/attguard-bench alone, which hosts
+# attguard in process with a null metadata service.
+
+if [ $# -lt 1 ]; then
+  echo "Must provide the build directory"
+  exit 1
+fi
+build=$(readlink -f $1)
+shift
+tools=$(dirname $(readlink -f $0))
+work=$(mktemp -d /tmp/attguard-bench.XXXXXX)
+stub_port=${STUB_PORT:-19851}
+
+cd $work
+go build -o metadata_stub $tools/metadata_stub.go || exit 1
+./metadata_stub :$stub_port >stub.out 2>stub.err &
+stub=$!
+
+cat > config.txt <<CONF
+speaker_id = 127.0.0.1:1-65535
+speaker_ip = 127.0.0.1
+run_as_iaas = true
+metadata_ip = 127.0.0.1
+metadata_port = $stub_port
+daemon_socket = $work/guard.sock
+log = info
+CONF
+$build/server/attguard config.txt >guard.out 2>guard.err &
+guard=$!
+sleep 1.0
+
+$build/bench/attguard-bench --daemon $work/guard.sock "$@"
+rc=$?
+
+kill -KILL $guard $stub
+echo "logs left in $work"
+exit $rc
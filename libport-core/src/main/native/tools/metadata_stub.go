@@ -9,6 +9,7 @@ import (
 	"regexp"
 	"strconv"
 	"strings"
+	"sync"
 
 	myhttp "github.com/jerryz920/utils/goutils/http"
 	log "github.com/sirupsen/logrus"
@@ -42,8 +43,18 @@ var (
 		Images:     make(map[string]Image),
 		Objects:    make(map[string]Object),
 	}
+	// handlers run concurrently, the store is not
+	storeLock sync.Mutex
 )
 
+func locked(handler http.HandlerFunc) http.HandlerFunc {
+	return func(w http.ResponseWriter, r *http.Request) {
+		storeLock.Lock()
+		defer storeLock.Unlock()
+		handler(w, r)
+	}
+}
+
 type MetadataRequest struct {
 	Principal   string
 	OtherValues []string
@@ -306,16 +317,76 @@ func retractInstanceSet(w http.ResponseWriter, r *http.Request) {
 	delete(store.Principals, m.OtherValues[0])
 }
 
+func postInstance(w http.ResponseWriter, r *http.Request) {
+	m, status := ReadRequest(r)
+	SetCommonHeader(w)
+	if status != http.StatusOK {
+		LoggedWriteHeader(w, status)
+		return
+	}
+	if len(m.OtherValues) != 4 {
+		LoggedWriteHeader(w, http.StatusBadRequest)
+		log.Infof("bad request values: %v", m.OtherValues)
+		return
+	}
+	ip, p1, p2, status := ParseIP(m.OtherValues[2])
+	if status != http.StatusOK || p1 > 65535 || p2 > 65535 || p1 > p2 || net.ParseIP(ip) == nil {
+		LoggedWriteHeader(w, status)
+		log.Infof("bad request values: %v", m.OtherValues)
+		return
+	}
+	store.Principals[m.OtherValues[0]] = Principal{
+		ImageID:    m.OtherValues[1],
+		Properties: make(map[string]string),
+		IP:         ip,
+		PortMin:    p1,
+		PortMax:    p2,
+	}
+	LoggedWrite(w, []byte(fmt.Sprintf(`{"message":"['%s']"}`, m.OtherValues[0])))
+}
+
+func postInstanceConfig(w http.ResponseWriter, r *http.Request) {
+	m, status := ReadRequest(r)
+	SetCommonHeader(w)
+	if status != http.StatusOK {
+		LoggedWriteHeader(w, status)
+		return
+	}
+	p, ok := store.Principals[m.OtherValues[0]]
+	if !ok {
+		LoggedWriteHeader(w, http.StatusNotFound)
+		return
+	}
+	for i := 1; i+1 < len(m.OtherValues); i += 2 {
+		p.Properties[m.OtherValues[i]] = m.OtherValues[i+1]
+	}
+	LoggedWriteHeader(w, http.StatusOK)
+}
+
+func lazyDeleteInstance(w http.ResponseWriter, r *http.Request) {
+	m, status := ReadRequest(r)
+	SetCommonHeader(w)
+	if status != http.StatusOK {
+		LoggedWriteHeader(w, status)
+		return
+	}
+	delete(store.Principals, m.OtherValues[0])
+	LoggedWrite(w, []byte(fmt.Sprintf(`{"message":"['%s']"}`, m.OtherValues[0])))
+}
+
 func main() {
 	server := myhttp.NewEchoServer()
-	server.AddRoute("/postInstanceSet", postInstanceSet)
-	server.AddRoute("/retractInstanceSet", retractInstanceSet)
-	server.AddRoute("/updateSubjectSet", updateSubjectSet)
-	server.AddRoute("/postAttesterImage", postAttesterImage)
-	server.AddRoute("/postImageProperty", postImageProperty)
-	server.AddRoute("/postObjectAcl", postObjectAcl)
-	server.AddRoute("/attestAppProperty", attestAppProperty)
-	server.AddRoute("/appAccessesObject", attestObjectAccess)
+	server.AddRoute("/postInstanceSet", locked(postInstanceSet))
+	server.AddRoute("/retractInstanceSet", locked(retractInstanceSet))
+	server.AddRoute("/updateSubjectSet", locked(updateSubjectSet))
+	server.AddRoute("/postAttesterImage", locked(postAttesterImage))
+	server.AddRoute("/postImageProperty", locked(postImageProperty))
+	server.AddRoute("/postObjectAcl", locked(postObjectAcl))
+	server.AddRoute("/attestAppProperty", locked(attestAppProperty))
+	server.AddRoute("/appAccessesObject", locked(attestObjectAccess))
+	server.AddRoute("/postInstance", locked(postInstance))
+	server.AddRoute("/postInstanceConfig", locked(postInstanceConfig))
+	server.AddRoute("/lazyDeleteInstance", locked(lazyDeleteInstance))
 
 	if len(os.Args) > 1 {
 		server.ListenAndServe(os.Args[1])